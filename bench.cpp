@@ -0,0 +1,574 @@
+#include <iostream>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include <boost/program_options.hpp>
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#include "connection.h"
+
+/**
+ * Load generator: many simulated clients (a thread and a UDP socket each) send a mix of
+ * HELLO / LIST / GET / ADD / DEL requests to one server as fast as it answers them.
+ * Every run (a catalog size and a file size distribution from the sweep) first uploads the catalog,
+ * then measures the mix for DURATION seconds and removes the files it added.
+ * The latency of a GET / ADD covers the whole transfer, DEL isn't answered, so only its sending is measured.
+ * The results are written as JSON.
+ */
+
+namespace po = boost::program_options;
+namespace chr = std::chrono;
+
+std::size_t CLIENTS_DEFAULT = 16;
+unsigned int DURATION_DEFAULT = 10;
+unsigned int TIMEOUT_DEFAULT = 2;
+std::size_t TIMEOUT_MAX = 300;
+
+#define NAME_PREFIX "netstore-bench-" /** of the files created by the benchmark */
+#define UPLOAD_CHUNK 65536 /** bytes written to the socket at once */
+
+/**
+ * Flags provided by the user.
+ */
+struct bench_options {
+    std::string SERVER_ADDR = ""; /** the benchmarked server (unicast) */
+    int CMD_PORT = 0;
+    unsigned int TIMEOUT = 0; /** seconds a request waits for its answer, then it's counted as an error */
+    std::size_t CLIENTS = 0; /** simulated clients, each with a request in flight */
+    unsigned int DURATION = 0; /** seconds every run is measured */
+    std::string MIX = ""; /** weights of the commands, e.g. "HELLO=1,LIST=2,GET=4,ADD=1,DEL=1" */
+    std::vector<std::size_t> CATALOG_SIZES; /** files uploaded before each run */
+    std::vector<std::string> FILE_SIZES; /** size distributions of the uploaded files */
+    std::string OUTPUT = ""; /** JSON file, empty - standard output */
+};
+
+enum class command {
+    hello, list, get, add, del
+};
+
+const char *COMMAND_NAMES[] = {"HELLO", "LIST", "GET", "ADD", "DEL"};
+constexpr std::size_t COMMAND_COUNT = sizeof COMMAND_NAMES / sizeof COMMAND_NAMES[0];
+
+/** Sizes of the uploaded files: "fixed:SIZE", "uniform:MIN:MAX" or "pareto:MIN:ALPHA" (capped at 1000 * MIN). */
+struct size_distribution {
+    std::string spec;
+    std::string kind;
+    double first = 0;
+    double second = 0;
+
+    explicit size_distribution(const std::string &spec) : spec(spec) {
+        std::vector<std::string> fields;
+        std::stringstream stream(spec);
+        for (std::string field; std::getline(stream, field, ':');) {
+            fields.push_back(field);
+        }
+        kind = fields.empty() ? "" : fields[0];
+        if (!((kind == "fixed" && fields.size() == 2) || ((kind == "uniform" || kind == "pareto") && fields.size() == 3))) {
+            throw std::invalid_argument("file-sizes");
+        }
+        first = std::stod(fields[1]);
+        second = fields.size() == 3 ? std::stod(fields[2]) : first;
+        if (first < 0 || (kind == "uniform" && second < first) || (kind == "pareto" && (first <= 0 || second <= 0))) {
+            throw std::invalid_argument("file-sizes");
+        }
+    }
+
+    uint64_t draw(std::mt19937_64 &random) const {
+        if (kind == "fixed") {
+            return (uint64_t) first;
+        }
+        if (kind == "uniform") {
+            return std::uniform_int_distribution<uint64_t>((uint64_t) first, (uint64_t) second)(random);
+        }
+        double u = std::uniform_real_distribution<double>(0, 1)(random);
+        return (uint64_t) std::min(first * 1000, first * std::pow(1 - u, -1 / second));
+    }
+};
+
+/** What one simulated client measured for one command. */
+struct command_stats {
+    std::vector<uint64_t> latencies; /** microseconds, of the successful requests */
+    uint64_t errors = 0; /** refused or unanswered requests, broken transfers */
+    uint64_t bytes = 0; /** bytes of the files moved */
+
+    void merge(const command_stats &other) {
+        latencies.insert(latencies.end(), other.latencies.begin(), other.latencies.end());
+        errors += other.errors;
+        bytes += other.bytes;
+    }
+};
+
+/** A client of the load generator, used by a single thread. */
+struct simulated_client {
+    int sock = -1; /** UDP */
+    uint64_t cmd_seq = 0;
+    std::mt19937_64 random;
+    std::vector<std::string> added; /** files added during the measured run, removed by its DELs */
+    command_stats stats[COMMAND_COUNT];
+};
+
+/** A run of the sweep. */
+struct bench_run {
+    std::size_t catalog_size = 0;
+    const size_distribution *sizes = nullptr;
+    std::string tag; /** part of the names of the files of this run */
+    std::vector<std::string> catalog; /** files uploaded before the run, fetched by the GETs */
+    double seconds = 0; /** measured */
+    command_stats stats[COMMAND_COUNT];
+};
+
+/** Splits a comma separated list. */
+std::vector<std::string> split_list(const std::string &list) {
+    std::vector<std::string> items;
+    std::stringstream stream(list);
+    for (std::string item; std::getline(stream, item, ',');) {
+        if (!item.empty()) {
+            items.push_back(item);
+        }
+    }
+    return items;
+}
+
+/**
+ * Reads command line flags supplied by the user.
+ * @param [in] argc Argument count.
+ * @param [in] argv
+ * @return Parsed options.
+ */
+bench_options read_options(int argc, char const *argv[]) {
+    po::options_description description("Allowed options");
+    bench_options options;
+    std::string catalog_sizes_option;
+    std::string file_sizes_option;
+
+    description.add_options()
+            ("help", "help message")
+            ("server,a", po::value<std::string>(&options.SERVER_ADDR), "IPv4 address of the benchmarked server")
+            ("cmd-port,p", po::value<int>(&options.CMD_PORT))
+            ("timeout,t", po::value<unsigned int>(&options.TIMEOUT)->default_value(TIMEOUT_DEFAULT),
+             "seconds a request waits for its answer before it counts as an error")
+            ("clients,c", po::value<std::size_t>(&options.CLIENTS)->default_value(CLIENTS_DEFAULT),
+             "simulated clients, each with its own socket and a request in flight")
+            ("duration,d", po::value<unsigned int>(&options.DURATION)->default_value(DURATION_DEFAULT),
+             "seconds every run of the sweep is measured")
+            ("mix,m", po::value<std::string>(&options.MIX)->default_value("HELLO=1,LIST=2,GET=4,ADD=1,DEL=1"),
+             "weights of the commands sent by the clients")
+            ("catalog-sizes,n", po::value<std::string>(&catalog_sizes_option)->default_value("100,1000"),
+             "files on the server during the runs, comma separated")
+            ("file-sizes,s", po::value<std::string>(&file_sizes_option)->default_value("fixed:4096,uniform:1024:65536"),
+             "size distributions of the files, comma separated: fixed:SIZE, uniform:MIN:MAX or pareto:MIN:ALPHA")
+            ("output,o", po::value<std::string>(&options.OUTPUT)->default_value(""),
+             "file the JSON results are written to, the standard output if empty");
+    std::string mandatory_variables[] = {"server", "cmd-port"};
+
+    po::variables_map variables;
+    po::store(po::parse_command_line(argc, argv, description), variables);
+    po::notify(variables);
+
+    if (variables.count("help")) {
+        std::cout << description << "\n";
+        exit(0);
+    }
+    for (const std::string &variable: mandatory_variables) {
+        if (!variables.count(variable)) {
+            throw std::invalid_argument(variable);
+        }
+    }
+    if (options.TIMEOUT > TIMEOUT_MAX || options.TIMEOUT == 0) {
+        throw std::invalid_argument("timeout");
+    }
+    if (options.CMD_PORT < 0) {
+        throw std::invalid_argument("port");
+    }
+    if (options.CLIENTS == 0) {
+        throw std::invalid_argument("clients");
+    }
+    if (options.DURATION == 0) {
+        throw std::invalid_argument("duration");
+    }
+    for (const std::string &size : split_list(catalog_sizes_option)) {
+        options.CATALOG_SIZES.push_back(std::stoul(size));
+    }
+    options.FILE_SIZES = split_list(file_sizes_option);
+    if (options.CATALOG_SIZES.empty() || options.FILE_SIZES.empty()) {
+        throw std::invalid_argument("sweep");
+    }
+    return options;
+}
+
+/**
+ * Reads the weights of the commands, e.g. "GET=4,ADD=1".
+ * A DEL removes a file added by the same client, so the mix can't have DELs without ADDs.
+ */
+std::vector<double> parse_mix(const std::string &mix) {
+    std::vector<double> weights(COMMAND_COUNT, 0);
+    for (const std::string &item : split_list(mix)) {
+        std::size_t equals = item.find('=');
+        std::string name = item.substr(0, equals);
+        auto it = std::find(std::begin(COMMAND_NAMES), std::end(COMMAND_NAMES), name);
+        if (equals == std::string::npos || it == std::end(COMMAND_NAMES)) {
+            throw std::invalid_argument("mix");
+        }
+        weights[it - std::begin(COMMAND_NAMES)] = std::stod(item.substr(equals + 1));
+    }
+    if (std::all_of(weights.begin(), weights.end(), [](double weight) { return weight <= 0; }) ||
+        (weights[(std::size_t) command::del] > 0 && weights[(std::size_t) command::add] <= 0)) {
+        throw std::invalid_argument("mix");
+    }
+    return weights;
+}
+
+void initialize_socket(int &sock) {
+    sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0) {
+        throw std::runtime_error("socket");
+    }
+    struct sockaddr_in local_address{};
+    local_address.sin_family = AF_INET;
+    local_address.sin_addr.s_addr = htonl(INADDR_ANY);
+    local_address.sin_port = htons(0);
+    if (bind(sock, (struct sockaddr *) &local_address, sizeof local_address) < 0) {
+        throw std::runtime_error("bind");
+    }
+}
+
+/**
+ * Waits for the answer to the request @ref cmd_seq, the late answers to the earlier requests are dropped.
+ * @param [out] cmd, param, data The answer (param only if it's a CMPLX_CMD).
+ * @return false if there was no answer within the TIMEOUT.
+ */
+bool receive_reply(simulated_client &client, const bench_options &options, uint64_t cmd_seq, std::string &cmd,
+                   uint64_t &param, std::string &data) {
+    static const char *COMPLEX_REPLIES[] = {"GOOD_DAY", "CONNECT_ME", "CAN_ADD"};
+    char buffer[BSIZE];
+    chr::steady_clock::time_point deadline = chr::steady_clock::now() + chr::seconds(options.TIMEOUT);
+    for (;;) {
+        chr::microseconds left = chr::duration_cast<chr::microseconds>(deadline - chr::steady_clock::now());
+        if (left.count() <= 0) {
+            return false;
+        }
+        set_socket_receive_timeout(client.sock, {(time_t) (left.count() / 1000000), (suseconds_t) (left.count() % 1000000)});
+        ssize_t rcv_len = recv(client.sock, buffer, sizeof buffer, 0);
+        if (rcv_len < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error("recv");
+        }
+
+        simpl_view simple;
+        if (!decode(buffer, rcv_len, simple) || simple.cmd_seq != cmd_seq) {
+            continue;
+        }
+        bool complex = std::any_of(std::begin(COMPLEX_REPLIES), std::end(COMPLEX_REPLIES),
+                                   [&](const char *name) { return command_is(simple.cmd, name); });
+        cmplx_view view;
+        if (complex && !decode(buffer, rcv_len, view)) {
+            continue;
+        }
+        cmd = std::string(base_data(simple.cmd));
+        param = complex ? view.param : 0;
+        data = std::string(complex ? view.data : simple.data);
+        return true;
+    }
+}
+
+/** Connects to the TCP port announced by the server. */
+int connect_to(const struct sockaddr_in &server, uint64_t port, const bench_options &options) {
+    int sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (sock < 0) {
+        throw std::runtime_error("socket");
+    }
+    struct sockaddr_in server_tcp{server};
+    server_tcp.sin_port = htons(port);
+    set_socket_receive_timeout(sock, {(time_t) options.TIMEOUT, 0});
+    if (connect(sock, (struct sockaddr *) &server_tcp, sizeof server_tcp) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+/** HELLO, answered with GOOD_DAY. */
+bool bench_hello(simulated_client &client, const bench_options &options, const struct sockaddr_in &server) {
+    uint64_t cmd_seq = send_simple_message(client.sock, server, "HELLO", "", client.cmd_seq++);
+    std::string cmd, data;
+    uint64_t param;
+    return receive_reply(client, options, cmd_seq, cmd, param, data) && cmd == "GOOD_DAY";
+}
+
+/** LIST of the files of the run, measured until the first MY_LIST. */
+bool bench_list(simulated_client &client, const bench_options &options, const struct sockaddr_in &server,
+                const std::string &pattern) {
+    uint64_t cmd_seq = send_simple_message(client.sock, server, "LIST", pattern, client.cmd_seq++);
+    std::string cmd, data;
+    uint64_t param;
+    return receive_reply(client, options, cmd_seq, cmd, param, data) && cmd == "MY_LIST";
+}
+
+/** GET of the whole file, until the server closes the connection. */
+bool bench_get(simulated_client &client, const bench_options &options, const struct sockaddr_in &server,
+               const std::string &name, uint64_t &bytes) {
+    uint64_t cmd_seq = send_simple_message(client.sock, server, "GET", name, client.cmd_seq++);
+    std::string cmd, data;
+    uint64_t port;
+    if (!receive_reply(client, options, cmd_seq, cmd, port, data) || cmd != "CONNECT_ME") {
+        return false;
+    }
+    int sock = connect_to(server, port, options);
+    if (sock < 0) {
+        return false;
+    }
+    char buffer[BSIZE];
+    ssize_t rcv_len;
+    while ((rcv_len = read(sock, buffer, sizeof buffer)) > 0) {
+        bytes += rcv_len;
+    }
+    close(sock);
+    return rcv_len == 0;
+}
+
+/** ADD of a file of @ref size bytes, until the server saves it and closes the connection. */
+bool bench_add(simulated_client &client, const bench_options &options, const struct sockaddr_in &server,
+               const std::string &name, uint64_t size, uint64_t &bytes) {
+    uint64_t cmd_seq = send_complex_message(client.sock, server, "ADD", name, client.cmd_seq++, size);
+    std::string cmd, data;
+    uint64_t port;
+    if (!receive_reply(client, options, cmd_seq, cmd, port, data) || cmd != "CAN_ADD") {
+        return false;
+    }
+    int sock = connect_to(server, port, options);
+    if (sock < 0) {
+        return false;
+    }
+    static const std::string chunk(UPLOAD_CHUNK, 'x');
+    bool success = true;
+    for (uint64_t left = size; success && left > 0;) {
+        ssize_t snd_len = write(sock, chunk.data(), std::min<uint64_t>(left, chunk.size()));
+        success = snd_len > 0;
+        left -= success ? snd_len : 0;
+        bytes += success ? snd_len : 0;
+    }
+    char ignored;
+    success = success && shutdown(sock, SHUT_WR) == 0 && read(sock, &ignored, 1) == 0;
+    close(sock);
+    return success;
+}
+
+/** Runs a request and files its latency (or error) under @ref which. */
+template<typename F>
+void measure(simulated_client &client, command which, F &&request) {
+    command_stats &stats = client.stats[(std::size_t) which];
+    chr::steady_clock::time_point start = chr::steady_clock::now();
+    if (!request(stats.bytes)) {
+        ++stats.errors;
+        return;
+    }
+    stats.latencies.push_back(chr::duration_cast<chr::microseconds>(chr::steady_clock::now() - start).count());
+}
+
+/** Runs @ref work for every simulated client in its own thread, waits for all of them. */
+template<typename F>
+void for_each_client(std::vector<simulated_client> &clients, F &&work) {
+    std::vector<std::thread> threads;
+    for (std::size_t i = 0; i < clients.size(); ++i) {
+        threads.emplace_back([&, i] { work(i, clients[i]); });
+    }
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+}
+
+/** Uploads the catalog of the run, the clients share the work; files that weren't added are left out. */
+void populate(std::vector<simulated_client> &clients, const bench_options &options,
+              const struct sockaddr_in &server, bench_run &run) {
+    std::vector<std::vector<std::string>> uploaded(clients.size());
+    for_each_client(clients, [&](std::size_t index, simulated_client &client) {
+        for (std::size_t i = index; i < run.catalog_size; i += clients.size()) {
+            std::string name = run.tag + "-" + std::to_string(i);
+            uint64_t ignored = 0;
+            if (bench_add(client, options, server, name, run.sizes->draw(client.random), ignored)) {
+                uploaded[index].push_back(name);
+            }
+        }
+    });
+    for (std::vector<std::string> &names : uploaded) {
+        run.catalog.insert(run.catalog.end(), names.begin(), names.end());
+    }
+}
+
+/** Sends the mix of requests for DURATION seconds, then removes the files the run added. */
+void measure_run(std::vector<simulated_client> &clients, const bench_options &options,
+                 const struct sockaddr_in &server, const std::vector<double> &weights, bench_run &run) {
+    chr::steady_clock::time_point start = chr::steady_clock::now();
+    chr::steady_clock::time_point end = start + chr::seconds(options.DURATION);
+    for_each_client(clients, [&](std::size_t index, simulated_client &client) {
+        std::discrete_distribution<std::size_t> pick(weights.begin(), weights.end());
+        uint64_t added = 0;
+        while (chr::steady_clock::now() < end) {
+            auto which = (command) pick(client.random);
+            switch (which) {
+                case command::hello:
+                    measure(client, which, [&](uint64_t &) { return bench_hello(client, options, server); });
+                    break;
+                case command::list:
+                    measure(client, which, [&](uint64_t &) { return bench_list(client, options, server, run.tag); });
+                    break;
+                case command::get: {
+                    if (run.catalog.empty()) {
+                        break;
+                    }
+                    const std::string &name = run.catalog[client.random() % run.catalog.size()];
+                    measure(client, which, [&](uint64_t &bytes) {
+                        return bench_get(client, options, server, name, bytes);
+                    });
+                    break;
+                }
+                case command::add: {
+                    std::string name = run.tag + "-c" + std::to_string(index) + "-" + std::to_string(added++);
+                    uint64_t size = run.sizes->draw(client.random);
+                    measure(client, which, [&](uint64_t &bytes) {
+                        if (!bench_add(client, options, server, name, size, bytes)) {
+                            return false;
+                        }
+                        client.added.push_back(name);
+                        return true;
+                    });
+                    break;
+                }
+                case command::del: {
+                    /* keeps the catalog at its size, nothing to remove before this client's first ADD */
+                    if (client.added.empty()) {
+                        break;
+                    }
+                    std::string name = std::move(client.added.back());
+                    client.added.pop_back();
+                    measure(client, which, [&](uint64_t &) {
+                        send_simple_message(client.sock, server, "DEL", name, client.cmd_seq++);
+                        return true;
+                    });
+                    break;
+                }
+            }
+        }
+    });
+    run.seconds = chr::duration<double>(chr::steady_clock::now() - start).count();
+
+    for (simulated_client &client : clients) {
+        for (std::size_t i = 0; i < COMMAND_COUNT; ++i) {
+            run.stats[i].merge(client.stats[i]);
+            client.stats[i] = {};
+        }
+        for (const std::string &name : client.added) {
+            send_simple_message(client.sock, server, "DEL", name, client.cmd_seq++);
+        }
+        client.added.clear();
+    }
+    for (const std::string &name : run.catalog) {
+        send_simple_message(clients[0].sock, server, "DEL", name, clients[0].cmd_seq++);
+    }
+}
+
+/** The latency below which @ref quantile of the (sorted) latencies are. */
+uint64_t percentile(const std::vector<uint64_t> &sorted, double quantile) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    std::size_t rank = (std::size_t) std::ceil(quantile * sorted.size());
+    return sorted[std::min(sorted.size(), std::max<std::size_t>(rank, 1)) - 1];
+}
+
+/** Writes the configuration and the results of all the runs as a JSON object. */
+void write_json(std::ostream &out, const bench_options &options, std::vector<bench_run> &runs) {
+    out << "{\n  \"server\": \"" << options.SERVER_ADDR << ":" << options.CMD_PORT << "\",\n"
+        << "  \"clients\": " << options.CLIENTS << ",\n"
+        << "  \"duration_s\": " << options.DURATION << ",\n"
+        << "  \"mix\": \"" << options.MIX << "\",\n"
+        << "  \"runs\": [";
+    for (std::size_t r = 0; r < runs.size(); ++r) {
+        bench_run &run = runs[r];
+        out << (r == 0 ? "" : ",") << "\n    {\n"
+            << "      \"catalog_size\": " << run.catalog_size << ",\n"
+            << "      \"catalog_uploaded\": " << run.catalog.size() << ",\n"
+            << "      \"file_sizes\": \"" << run.sizes->spec << "\",\n"
+            << "      \"seconds\": " << run.seconds << ",\n"
+            << "      \"commands\": {";
+        for (std::size_t i = 0; i < COMMAND_COUNT; ++i) {
+            command_stats &stats = run.stats[i];
+            std::sort(stats.latencies.begin(), stats.latencies.end());
+            out << (i == 0 ? "" : ",") << "\n        \"" << COMMAND_NAMES[i] << "\": {"
+                << "\"count\": " << stats.latencies.size()
+                << ", \"errors\": " << stats.errors
+                << ", \"ops_per_s\": " << stats.latencies.size() / run.seconds
+                << ", \"bytes_per_s\": " << stats.bytes / run.seconds
+                << ", \"p50_us\": " << percentile(stats.latencies, 0.5)
+                << ", \"p99_us\": " << percentile(stats.latencies, 0.99)
+                << ", \"p999_us\": " << percentile(stats.latencies, 0.999) << "}";
+        }
+        out << "\n      }\n    }";
+    }
+    out << "\n  ]\n}\n";
+}
+
+int main(int argc, char const *argv[]) {
+    bench_options options = read_options(argc, argv);
+    std::vector<double> weights = parse_mix(options.MIX);
+    std::vector<size_distribution> distributions;
+    for (const std::string &spec : options.FILE_SIZES) {
+        distributions.emplace_back(spec);
+    }
+
+    struct sockaddr_in server{};
+    server.sin_family = AF_INET;
+    server.sin_port = htons(options.CMD_PORT);
+    if (inet_aton(options.SERVER_ADDR.c_str(), &server.sin_addr) == 0) {
+        throw std::invalid_argument("server");
+    }
+
+    std::vector<simulated_client> clients(options.CLIENTS);
+    for (std::size_t i = 0; i < clients.size(); ++i) {
+        initialize_socket(clients[i].sock);
+        clients[i].random.seed(i);
+    }
+
+    /* the names of every run are unique, the leftovers of an interrupted benchmark don't get in the way */
+    std::string tag = NAME_PREFIX + std::to_string(getpid());
+    std::vector<bench_run> runs;
+    for (std::size_t catalog_size : options.CATALOG_SIZES) {
+        for (const size_distribution &sizes : distributions) {
+            bench_run &run = runs.emplace_back();
+            run.catalog_size = catalog_size;
+            run.sizes = &sizes;
+            run.tag = tag + "-" + std::to_string(runs.size());
+            std::cerr << "[BENCH] catalog " << catalog_size << ", file sizes " << sizes.spec << "\n";
+            populate(clients, options, server, run);
+            measure_run(clients, options, server, weights, run);
+        }
+    }
+
+    for (simulated_client &client : clients) {
+        close(client.sock);
+    }
+    if (options.OUTPUT.empty()) {
+        write_json(std::cout, options, runs);
+    }
+    else {
+        std::ofstream out(options.OUTPUT);
+        write_json(out, options, runs);
+        if (!out) {
+            throw std::runtime_error("write");
+        }
+    }
+    return 0;
+}
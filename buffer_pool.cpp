@@ -0,0 +1,41 @@
+#include <stdexcept>
+
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "buffer_pool.h"
+
+buffer_pool::buffer_pool(std::size_t count, std::size_t size) {
+    std::size_t page = sysconf(_SC_PAGESIZE);
+    buffer_size = (size + page - 1) / page * page;
+    if (count > 0) {
+        memory = mmap(nullptr, count * buffer_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) {
+            memory = nullptr;
+            throw std::runtime_error("mmap");
+        }
+    }
+    for (std::size_t i = 0; i < count; ++i) {
+        regions.push_back({static_cast<char *>(memory) + i * buffer_size, buffer_size});
+        free_buffers.push_back((int) (count - 1 - i)); /* the first ones are taken first */
+    }
+}
+
+buffer_pool::~buffer_pool() {
+    if (memory) {
+        munmap(memory, regions.size() * buffer_size);
+    }
+}
+
+int buffer_pool::take() {
+    if (free_buffers.empty()) {
+        return -1;
+    }
+    int index = free_buffers.back();
+    free_buffers.pop_back();
+    return index;
+}
+
+void buffer_pool::give_back(int index) {
+    free_buffers.push_back(index);
+}
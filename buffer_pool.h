@@ -0,0 +1,43 @@
+#ifndef NETSTORE_BUFFER_POOL_H
+#define NETSTORE_BUFFER_POOL_H
+
+#include <cstddef>
+#include <vector>
+
+#include <sys/uio.h>
+
+/**
+ * Buffers of a fixed size carved out of a single mapping, allocated once:
+ * every buffer starts at a page boundary, so they can be registered with io_uring as fixed buffers.
+ * Not thread safe, every transfer worker has its own.
+ */
+class buffer_pool {
+public:
+    /**
+     * @param [in] count Number of the buffers.
+     * @param [in] size Bytes of every buffer, rounded up to the page size.
+     */
+    buffer_pool(std::size_t count, std::size_t size);
+    buffer_pool(const buffer_pool &) = delete;
+    buffer_pool &operator=(const buffer_pool &) = delete;
+    ~buffer_pool();
+
+    /** Takes a free buffer. @return Its index, -1 if all of them are taken. */
+    int take();
+    void give_back(int index);
+
+    char *data(int index) { return static_cast<char *>(regions[index].iov_base); }
+    std::size_t size() const { return buffer_size; }
+    std::size_t available() const { return free_buffers.size(); }
+
+    /** All the buffers, by the index (for IORING_REGISTER_BUFFERS). */
+    const std::vector<struct iovec> &all() const { return regions; }
+
+private:
+    void *memory = nullptr;
+    std::size_t buffer_size;
+    std::vector<struct iovec> regions;
+    std::vector<int> free_buffers;
+};
+
+#endif //NETSTORE_BUFFER_POOL_H
@@ -0,0 +1,157 @@
+#include <algorithm>
+#include <cstring>
+#include <functional>
+
+#include "catalog.h"
+
+#define NAME_CHUNK_LEN (1 << 16) /** size of a single chunk of the name pool */
+#define INITIAL_SLOTS 64 /** initial size of the hash table */
+#define COMPACT_MIN_WASTE (1 << 20) /** don't compact the name pool for less than that */
+
+std::string_view name_pool::intern(std::string_view name) {
+    char *begin;
+    if (name.size() > NAME_CHUNK_LEN) {
+        /* a dedicated chunk for a long name, the current chunk is still filled */
+        chunks.emplace_back(new char[name.size()]);
+        begin = chunks.back().get();
+    }
+    else {
+        if (name.size() > chunk_free) {
+            chunks.emplace_back(new char[NAME_CHUNK_LEN]);
+            chunk_next = chunks.back().get();
+            chunk_free = NAME_CHUNK_LEN;
+        }
+        begin = chunk_next;
+        chunk_next += name.size();
+        chunk_free -= name.size();
+    }
+    if (!name.empty()) {
+        memcpy(begin, name.data(), name.size());
+    }
+    used_bytes += name.size();
+    return {begin, name.size()};
+}
+
+catalog::catalog(std::string folder) : folder_path(std::move(folder)) {}
+
+catalog::entry_id catalog::find(std::string_view name) const {
+    if (slots.empty()) {
+        return npos;
+    }
+    std::size_t hash = std::hash<std::string_view>{}(name);
+    for (std::size_t i = hash & mask();; i = (i + 1) & mask()) {
+        entry_id id = slots[i];
+        if (id == npos) {
+            return npos;
+        }
+        if (entries[id].hash == hash && entries[id].name == name) {
+            return id;
+        }
+    }
+}
+
+catalog::entry_id catalog::insert(std::string_view name, uint64_t size, std::time_t mtime) {
+    if (find(name) != npos) {
+        return npos;
+    }
+    if ((count + 1) * 10 > slots.size() * 7) {
+        /* keep the load factor under 0.7 */
+        grow();
+    }
+
+    entry_id id;
+    if (free_ids.empty()) {
+        id = entries.size();
+        entries.emplace_back();
+    }
+    else {
+        id = free_ids.back();
+        free_ids.pop_back();
+    }
+    file_entry &entry = entries[id];
+    entry.name = names.intern(name);
+    entry.size = size;
+    entry.mtime = mtime;
+    entry.hash = std::hash<std::string_view>{}(name);
+    entry.alive = true;
+
+    std::size_t i = entry.hash & mask();
+    while (slots[i] != npos) {
+        i = (i + 1) & mask();
+    }
+    slots[i] = id;
+    index.add(id, entry.name);
+    ++count;
+    ++current_version;
+    return id;
+}
+
+void catalog::erase(entry_id id) {
+    std::size_t i = entries[id].hash & mask();
+    while (slots[i] != id) {
+        i = (i + 1) & mask();
+    }
+
+    /* backward shift deletion, no tombstones needed */
+    for (std::size_t j = (i + 1) & mask(); slots[j] != npos; j = (j + 1) & mask()) {
+        std::size_t home = entries[slots[j]].hash & mask();
+        /* the entry can be moved to i only if its home slot isn't in the (i, j] range */
+        bool in_range = (i <= j) ? (i < home && home <= j) : (i < home || home <= j);
+        if (!in_range) {
+            slots[i] = slots[j];
+            i = j;
+        }
+    }
+    slots[i] = npos;
+
+    index.remove(id);
+    names.release(entries[id].name);
+    entries[id] = file_entry{};
+    free_ids.push_back(id);
+    --count;
+    ++current_version;
+    compact();
+}
+
+std::string catalog::path(entry_id id) const {
+    std::string result;
+    result.reserve(folder_path.size() + 1 + entries[id].name.size());
+    result += folder_path;
+    result += '/';
+    result += entries[id].name;
+    return result;
+}
+
+void catalog::reserve(std::size_t files) {
+    while (files * 10 > slots.size() * 7) {
+        grow();
+    }
+    entries.reserve(files);
+}
+
+void catalog::grow() {
+    std::vector<entry_id> new_slots(std::max<std::size_t>(slots.size() * 2, INITIAL_SLOTS), npos);
+    slots.swap(new_slots);
+    for (entry_id id : new_slots) {
+        if (id != npos) {
+            std::size_t i = entries[id].hash & mask();
+            while (slots[i] != npos) {
+                i = (i + 1) & mask();
+            }
+            slots[i] = id;
+        }
+    }
+}
+
+void catalog::compact() {
+    if (names.wasted() < COMPACT_MIN_WASTE || names.wasted() * 2 < names.used()) {
+        return;
+    }
+    name_pool fresh;
+    for (file_entry &entry : entries) {
+        if (entry.alive) {
+            entry.name = fresh.intern(entry.name);
+        }
+    }
+    names = std::move(fresh);
+}
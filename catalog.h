@@ -0,0 +1,134 @@
+#ifndef NETSTORE_CATALOG_H
+#define NETSTORE_CATALOG_H
+
+#include <ctime>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "search_index.h"
+
+/**
+ * Storage for the file names, every name is allocated once.
+ * The names are kept in big chunks, a removed name leaves a hole
+ * that is reclaimed by @ref catalog::compact.
+ */
+class name_pool {
+public:
+    /** Copies @ref name into the pool, the view is valid until the pool is destroyed. */
+    std::string_view intern(std::string_view name);
+    /** Marks the bytes of @ref name as unused. */
+    void release(std::string_view name) { garbage += name.size(); }
+
+    std::size_t used() const { return used_bytes; }
+    std::size_t wasted() const { return garbage; }
+
+private:
+    std::vector<std::unique_ptr<char[]>> chunks;
+    char *chunk_next = nullptr; /** first free byte of the current chunk */
+    std::size_t chunk_free = 0; /** bytes left in the current chunk */
+    std::size_t used_bytes = 0;
+    std::size_t garbage = 0;
+};
+
+/** Metadata of a file in the shared folder. */
+struct file_entry {
+    std::string_view name; /** interned in the catalog's @ref name_pool */
+    uint64_t size = 0;
+    std::time_t mtime = 0;
+    bool checksummed = false; /** if @ref checksum is known */
+    uint32_t checksum = 0; /** CRC32C of the file, computed during a transfer */
+    std::size_t hash = 0; /** hash of the name, kept to rehash without touching the names */
+    bool alive = false; /** false for a free slot in @ref catalog::entries */
+};
+
+/**
+ * Index of the files in the shared folder.
+ * An open addressing (linear probing) hash map from a file name to its metadata,
+ * lookups don't allocate. Entries have stable ids, reused after removal.
+ * The names are also kept in a @ref search_index for the substring searches.
+ */
+class catalog {
+public:
+    using entry_id = uint32_t;
+    static constexpr entry_id npos = UINT32_MAX;
+
+    catalog() = default;
+    explicit catalog(std::string folder);
+
+    /** @return id of the file named @ref name, @ref npos if there is no such file. */
+    entry_id find(std::string_view name) const;
+
+    /**
+     * Adds a file.
+     * @return id of the new entry, @ref npos if a file with such a name already exists.
+     */
+    entry_id insert(std::string_view name, uint64_t size, std::time_t mtime);
+
+    /** Removes the entry @ref id (it has to be alive). */
+    void erase(entry_id id);
+
+    /** Makes room for @ref files files, so that adding them doesn't rehash. */
+    void reserve(std::size_t files);
+
+    const file_entry &operator[](entry_id id) const { return entries[id]; }
+    file_entry &operator[](entry_id id) { return entries[id]; }
+
+    /** Full path of the file. */
+    std::string path(entry_id id) const;
+    const std::string &folder() const { return folder_path; }
+
+    std::size_t size() const { return count; }
+    /** Changes every time a file is added or removed. */
+    uint64_t version() const { return current_version; }
+    /** Upper bound of the entry ids (some of them may be free). */
+    entry_id capacity() const { return entries.size(); }
+
+    /** Calls @ref f(id, entry) for every file. */
+    template<typename F>
+    void for_each(F f) const {
+        for (entry_id id = 0; id < entries.size(); ++id) {
+            if (entries[id].alive) {
+                f(id, entries[id]);
+            }
+        }
+    }
+
+    /** Calls @ref f(id, entry) for every file whose name contains @ref query. */
+    template<typename F>
+    void search(std::string_view query, F f) const {
+        if (query.empty()) {
+            for_each(f);
+            return;
+        }
+        bool exact;
+        const std::vector<entry_id> *ids = index.candidates(query, exact);
+        if (ids == nullptr) {
+            return;
+        }
+        for (entry_id id : *ids) {
+            if (exact || entries[id].name.find(query) != std::string_view::npos) {
+                f(id, entries[id]);
+            }
+        }
+    }
+
+private:
+    std::string folder_path;
+    name_pool names;
+    std::vector<file_entry> entries;
+    std::vector<entry_id> free_ids;
+    std::vector<entry_id> slots; /** hash table, @ref npos marks an empty slot */
+    search_index index;
+    std::size_t count = 0;
+    uint64_t current_version = 0;
+
+    std::size_t mask() const { return slots.size() - 1; }
+    void grow();
+    /** Copies the live names into a fresh pool when more than half of it is wasted. */
+    void compact();
+};
+
+#endif //NETSTORE_CATALOG_H
@@ -0,0 +1,164 @@
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "catalog_snapshot.h"
+
+#define SNAPSHOT_MAGIC "NSCATLOG" /** first bytes of a snapshot */
+#define SNAPSHOT_VERSION 1
+#define FLAG_CHECKSUMMED 1 /** record flag: the checksum is known */
+
+namespace {
+
+struct snapshot_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t count;
+    int64_t folder_mtime;
+    uint64_t names_length;
+};
+
+struct snapshot_record {
+    uint64_t size;
+    int64_t mtime;
+    uint64_t name_offset;
+    uint32_t name_length;
+    uint32_t checksum;
+    uint32_t flags;
+    uint32_t reserved;
+};
+
+void write_all(int fd, const void *data, std::size_t length) {
+    const char *next = static_cast<const char *>(data);
+    while (length > 0) {
+        ssize_t written = write(fd, next, length);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error("write");
+        }
+        next += written;
+        length -= written;
+    }
+}
+
+}
+
+int64_t folder_mtime(const std::string &folder) {
+    struct stat info{};
+    if (stat(folder.c_str(), &info) < 0) {
+        throw std::runtime_error("stat");
+    }
+    return (int64_t) info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+}
+
+void save_snapshot(const catalog &files, const std::string &path) {
+    snapshot_header header{};
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof header.magic);
+    header.version = SNAPSHOT_VERSION;
+    header.record_size = sizeof(snapshot_record);
+
+    std::vector<snapshot_record> records;
+    records.reserve(files.size());
+    std::string names;
+    files.for_each([&](catalog::entry_id, const file_entry &entry) {
+        snapshot_record record{};
+        record.size = entry.size;
+        record.mtime = entry.mtime;
+        record.name_offset = names.size();
+        record.name_length = entry.name.size();
+        record.checksum = entry.checksum;
+        record.flags = entry.checksummed ? FLAG_CHECKSUMMED : 0;
+        records.push_back(record);
+        names += entry.name;
+    });
+    header.count = records.size();
+    header.names_length = names.size();
+
+    std::string temporary = path + ".tmp";
+    int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+        throw std::runtime_error("open");
+    }
+    try {
+        write_all(fd, &header, sizeof header);
+        write_all(fd, records.data(), records.size() * sizeof(snapshot_record));
+        write_all(fd, names.data(), names.size());
+        if (fdatasync(fd) < 0 || rename(temporary.c_str(), path.c_str()) < 0) {
+            throw std::runtime_error("rename");
+        }
+        /* the rename changed the folder, its mtime is only known now */
+        header.folder_mtime = folder_mtime(files.folder());
+        if (pwrite(fd, &header.folder_mtime, sizeof header.folder_mtime,
+                   offsetof(snapshot_header, folder_mtime)) != sizeof header.folder_mtime) {
+            throw std::runtime_error("pwrite");
+        }
+    } catch (...) {
+        close(fd);
+        unlink(temporary.c_str());
+        throw;
+    }
+    close(fd);
+}
+
+bool load_snapshot(const std::string &path, catalog &files, int64_t &saved_folder_mtime) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat info{};
+    if (fstat(fd, &info) < 0 || (std::size_t) info.st_size < sizeof(snapshot_header)) {
+        close(fd);
+        return false;
+    }
+    std::size_t length = info.st_size;
+    void *mapping = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        return false;
+    }
+    madvise(mapping, length, MADV_SEQUENTIAL);
+
+    const char *begin = static_cast<const char *>(mapping);
+    snapshot_header header{};
+    memcpy(&header, begin, sizeof header);
+    bool valid = memcmp(header.magic, SNAPSHOT_MAGIC, sizeof header.magic) == 0 &&
+                 header.version == SNAPSHOT_VERSION && header.record_size == sizeof(snapshot_record) &&
+                 header.count <= (length - sizeof header) / sizeof(snapshot_record);
+    std::size_t names_begin = valid ? sizeof header + header.count * sizeof(snapshot_record) : length;
+    valid = valid && header.names_length <= length - names_begin;
+
+    /* the records are checked before anything is added, a broken snapshot is ignored as a whole */
+    const char *records = begin + sizeof header;
+    for (uint64_t i = 0; valid && i < header.count; ++i) {
+        snapshot_record record{};
+        memcpy(&record, records + i * sizeof record, sizeof record);
+        valid = record.name_offset <= header.names_length &&
+                record.name_length <= header.names_length - record.name_offset;
+    }
+    if (valid) {
+        files.reserve(files.size() + header.count);
+        for (uint64_t i = 0; i < header.count; ++i) {
+            snapshot_record record{};
+            memcpy(&record, records + i * sizeof record, sizeof record);
+            std::string_view name(begin + names_begin + record.name_offset, record.name_length);
+            catalog::entry_id id = files.insert(name, record.size, record.mtime);
+            if (id != catalog::npos && (record.flags & FLAG_CHECKSUMMED)) {
+                files[id].checksummed = true;
+                files[id].checksum = record.checksum;
+            }
+        }
+        saved_folder_mtime = header.folder_mtime;
+    }
+    munmap(mapping, length);
+    return valid;
+}
@@ -0,0 +1,34 @@
+#ifndef NETSTORE_CATALOG_SNAPSHOT_H
+#define NETSTORE_CATALOG_SNAPSHOT_H
+
+#include <cstdint>
+#include <string>
+
+#include "catalog.h"
+
+/**
+ * On-disk copy of the catalog (names, sizes, mtimes, checksums), loaded with a single mmap.
+ *
+ * Layout (native byte order, the snapshot is only read by the server that wrote it):
+ * header | count records | names
+ * header: magic[8] | version (u32) | record size (u32) | count (u64) | folder mtime (i64, ns) | names length (u64)
+ * record: size (u64) | mtime (i64) | name offset (u64) | name length (u32) | checksum (u32) | flags (u32) | 0 (u32)
+ */
+
+/** Modification time of @ref folder in nanoseconds, changes when a file is created, removed or renamed in it. */
+int64_t folder_mtime(const std::string &folder);
+
+/**
+ * Writes @ref files to @ref path (through a temporary file renamed over it).
+ * The folder mtime is written last, after the rename, so that the snapshot itself doesn't make it stale.
+ */
+void save_snapshot(const catalog &files, const std::string &path);
+
+/**
+ * Adds the files from the snapshot at @ref path to @ref files.
+ * @param [out] saved_folder_mtime @ref folder_mtime of the shared folder when the snapshot was written.
+ * @return false if there is no valid snapshot (@ref files is left untouched).
+ */
+bool load_snapshot(const std::string &path, catalog &files, int64_t &saved_folder_mtime);
+
+#endif //NETSTORE_CATALOG_SNAPSHOT_H
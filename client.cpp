@@ -1,13 +1,21 @@
 #include <iostream>
 #include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <tuple>
 #include <vector>
 
 #include <boost/config.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/program_options.hpp>
 #include <boost/tokenizer.hpp>
-#include <boost/regex.hpp>
 
 #include <csignal>
 #include <netinet/in.h>
@@ -17,8 +25,17 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <fcntl.h>
+#include <fnmatch.h>
+#include <glob.h>
+#include <poll.h>
+#include <strings.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
 
 #include "connection.h"
+#include "crc32c.h"
+#include "transfer.h"
+#include "udp_batch.h"
 
 namespace po = boost::program_options;
 namespace fs = boost::filesystem;
@@ -28,9 +45,45 @@ std::size_t TIMEOUT_DEFAULT = 5;
 std::size_t TIMEOUT_MAX = 300;
 int TTL_VALUE = 4;
 int ENABLE_BROADCAST = 1;
+int RECEIVE_BUFFER = 4 << 20; /** room for a burst of replies (e.g. a long MY_LIST) while they're being read */
+std::size_t UDP_BATCH = 32; /** max number of datagrams received with one recvmmsg call */
+std::size_t MAX_SOURCES_DEFAULT = 4;
+uint64_t RANGE_MIN_LEN = 1 << 20; /** smallest part of a file downloaded from a single server */
+uint64_t RANGES_PER_SOURCE = 4; /** a file is split into that many parts per server, so the faster ones take more */
+unsigned int RESUME_ATTEMPTS = 3; /** times a broken transfer is resumed before giving up */
+std::string PARTIAL_SUFFIX = ".part"; /** a download is kept in OUT_FLDR/name.part until it's complete */
+std::size_t RTT_SAMPLES = 64; /** round trip times remembered by the adaptive wait */
+double RTT_QUANTILE = 0.99; /** the adaptive wait is based on this quantile of the round trip times */
+unsigned int WINDOW_FACTOR = 4; /** the adaptive wait lasts at least that many times the quantile */
+chr::milliseconds GRACE_MIN(10); /** least time waited after the last reply by the adaptive wait */
+unsigned int LIVE_ROUNDS = 3; /** a server that didn't answer that many HELLOs in a row isn't expected anymore */
+std::size_t UPLOAD_FANOUT_DEFAULT = 1;
+std::size_t REPLICAS_DEFAULT = 1;
+std::size_t PAGE_SIZE_DEFAULT = 0;
+unsigned int PAGE_ATTEMPTS = 3; /** times a page of a paged search is asked for before giving the server up */
 
 struct server_info;
 
+/** How the servers for an upload are chosen, the best ones are asked first. */
+enum class placement_policy {
+    most_free, /** the most free space */
+    least_loaded, /** the fewest transfers waiting (announced in GOOD_DAY), then the quickest to answer HELLO */
+    consistent_hash, /** rendezvous hashing of the file name, a file keeps going to the same servers */
+};
+
+placement_policy parse_placement_policy(const std::string &name) {
+    if (name == "most-free") {
+        return placement_policy::most_free;
+    }
+    else if (name == "least-loaded") {
+        return placement_policy::least_loaded;
+    }
+    else if (name == "consistent-hash") {
+        return placement_policy::consistent_hash;
+    }
+    throw std::invalid_argument("placement");
+}
+
 using server_infos = std::vector<server_info>;
 
 /**
@@ -41,11 +94,23 @@ struct client_options {
     int CMD_PORT = 0;
     std::string OUT_FLDR = "";
     unsigned int TIMEOUT = 0;
+    std::size_t MAX_SOURCES = 0; /** max number of servers a single file is downloaded from */
+    bool ADAPTIVE_WAIT = false; /** stop waiting for the multicast replies once the known servers answered */
+    std::size_t UPLOAD_FANOUT = 0; /** number of servers asked to accept an upload at once */
+    std::size_t REPLICAS = 0; /** number of servers an upload is sent to */
+    placement_policy PLACEMENT = placement_policy::most_free; /** order in which the servers are asked */
+    bool SESSION = false; /** fetch and upload over long-lived sessions, in the foreground */
+    bool COMPRESSION = false; /** ask for the whole file transfers to be deflated on the way */
+    bool CHECKSUMS = true; /** ask for the checksums of the fetched files */
+    bool PAGED_SEARCH = false; /** search with LIST_PAGE, every server is asked for its pages one by one */
+    std::size_t PAGE_SIZE = 0; /** max names in a page, 0 - as many as fit in a datagram */
 };
 
 struct server_info {
     uint64_t available_space = 0;
     struct sockaddr_in address{};
+    chr::system_clock::duration rtt{}; /** how long the last HELLO took to be answered */
+    uint64_t queue = 0; /** transfers waiting on the server for their turn */
 };
 
 template<typename T>
@@ -54,6 +119,73 @@ struct message {
     T command; /** SIMPL_CMD or CMPLX_CMD */
 };
 
+/**
+ * What the previous HELLO/LIST rounds taught about the servers, used by the adaptive wait.
+ * Without any history the client waits the whole TIMEOUT, as it did before.
+ */
+struct discovery_history {
+    std::map<uint64_t, unsigned int> live; /** server (@ref key) -> HELLO rounds since it last answered */
+    std::deque<chr::system_clock::duration> rtts; /** times of the first replies, the most recent first */
+
+    static uint64_t key(const struct sockaddr_in &address) {
+        return ((uint64_t) address.sin_addr.s_addr << 16) | address.sin_port;
+    }
+
+    /** @ref RTT_QUANTILE of the remembered round trip times. */
+    chr::system_clock::duration quantile() const {
+        std::vector<chr::system_clock::duration> sorted(rtts.begin(), rtts.end());
+        std::size_t index = std::min(sorted.size() - 1, (std::size_t) (RTT_QUANTILE * sorted.size()));
+        std::nth_element(sorted.begin(), sorted.begin() + index, sorted.end());
+        return sorted[index];
+    }
+
+    void add_rtt(chr::system_clock::duration rtt) {
+        rtts.push_front(rtt);
+        if (rtts.size() > RTT_SAMPLES) {
+            rtts.pop_back();
+        }
+    }
+
+    /** Updates the live servers after a HELLO round answered by @ref answered. */
+    void end_hello(const std::set<uint64_t> &answered) {
+        for (auto it = live.begin(); it != live.end();) {
+            if (!answered.count(it->first) && ++it->second >= LIVE_ROUNDS) {
+                it = live.erase(it);
+            }
+            else {
+                ++it;
+            }
+        }
+        for (uint64_t server : answered) {
+            live[server] = 0;
+        }
+    }
+};
+
+/** A TCP connection to a server carrying many transfers (see the frames in codec.h). */
+struct client_session {
+    int socket = -1;
+    struct sockaddr_in address{}; /** TCP address of the server */
+    uint64_t next_id = 0; /** id of the next request */
+    char header[FRAME_HEADER_LEN]; /** of the last reply, the command of its frame_view points into it */
+};
+
+/** Files the program created and didn't finish yet, shared by the transfers running in the background. */
+struct open_file_set {
+    std::mutex mutex;
+    std::set<std::string> names;
+
+    void insert(const std::string &name) {
+        std::lock_guard<std::mutex> lock(mutex);
+        names.insert(name);
+    }
+
+    void erase(const std::string &name) {
+        std::lock_guard<std::mutex> lock(mutex);
+        names.erase(name);
+    }
+};
+
 /**
  * Current client state.
  */
@@ -62,23 +194,86 @@ struct client_state {
     struct sockaddr_in remote_address{};
     std::vector<message<SIMPL_CMD>> previous_search; /** files from previous search */
     server_infos previous_servers; /** servers from previous search */
-    std::set<std::string> open_files; /** currently open files that the program created */
+    std::shared_ptr<open_file_set> open_files = std::make_shared<open_file_set>(); /** currently open files that the program created */
+    discovery_history history; /** servers and round trip times seen by the previous HELLO/LIST rounds */
+    std::map<uint64_t, struct client_session> sessions; /** open sessions by the server (@ref discovery_history::key) */
 };
 
 client_state current_client_state{};
 
 void clean_up(client_state &state) {
     close(state.socket);
-    for (const std::string &file : state.open_files) {
+    for (auto &session : state.sessions) {
+        close(session.second.socket);
+    }
+    std::lock_guard<std::mutex> lock(state.open_files->mutex);
+    for (const std::string &file : state.open_files->names) {
         unlink(file.c_str()); /* remove remaining files */
     }
 }
 
 uint64_t get_cmd_seq() {
-    static uint64_t cmd_seq = 0;
+    static std::atomic<uint64_t> cmd_seq{0}; /* the transfers in the background take theirs too */
     return cmd_seq++;
 }
 
+void print_error(const std::exception &e) {
+    std::cerr << "error: " << e.what();
+    if (errno != 0) {
+        std::cerr << ": " << strerror(errno);
+    }
+    std::cerr << "\n";
+}
+
+/**
+ * The transfers running in the background, each in its own thread.
+ * The interactive loop goes on meanwhile and waits for all of them before it exits.
+ */
+class task_group {
+public:
+    void run(std::function<void()> task) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ++running;
+        }
+        std::thread([this, task = std::move(task)] {
+            try {
+                task();
+            }
+            catch (const std::exception &e) {
+                print_error(e); /* only the transfer fails */
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--running == 0) {
+                finished.notify_all();
+            }
+        }).detach();
+    }
+
+    void wait() {
+        std::unique_lock<std::mutex> lock(mutex);
+        finished.wait(lock, [this] { return running == 0; });
+    }
+
+private:
+    std::mutex mutex;
+    std::condition_variable finished;
+    std::size_t running = 0;
+};
+
+task_group background_tasks;
+
+/** A copy of @ref state for a background transfer (without the search results), the open files are shared. */
+client_state task_state(const client_state &state) {
+    client_state copy;
+    copy.socket = state.socket;
+    copy.remote_address = state.remote_address;
+    copy.previous_servers = state.previous_servers;
+    copy.open_files = state.open_files;
+    copy.history = state.history;
+    return copy;
+}
+
 /**
  * Reads command line flags supplied by the user.
  * @param [in] argc Argument count.
@@ -88,13 +283,43 @@ uint64_t get_cmd_seq() {
 client_options read_options(int argc, char const *argv[]) {
     po::options_description description("Allowed options");
     client_options options;
+    std::string placement_option;
 
     description.add_options()
             ("help", "help message")
             ("mcast-addr,g", po::value<std::string>(&options.MCAST_ADDR))
             ("cmd-port,p", po::value<int>(&options.CMD_PORT))
             ("out-fldr,o", po::value<std::string>(&options.OUT_FLDR))
-            ("timeout,t", po::value<unsigned int>(&options.TIMEOUT)->default_value(TIMEOUT_DEFAULT));
+            ("timeout,t", po::value<unsigned int>(&options.TIMEOUT)->default_value(TIMEOUT_DEFAULT))
+            ("max-sources,s", po::value<std::size_t>(&options.MAX_SOURCES)->default_value(MAX_SOURCES_DEFAULT),
+             "max number of servers a file is downloaded from in parallel, 1 disables parallel downloads")
+            ("adaptive-wait,a", po::value<bool>(&options.ADAPTIVE_WAIT)->default_value(false),
+             "stop waiting for the replies to discover and search shortly after the servers known from "
+             "the previous rounds answered, instead of waiting the whole timeout")
+            ("upload-fanout,k",
+             po::value<std::size_t>(&options.UPLOAD_FANOUT)->default_value(UPLOAD_FANOUT_DEFAULT),
+             "number of servers asked to accept an upload at once, the extra acceptances are cancelled")
+            ("replicas,r", po::value<std::size_t>(&options.REPLICAS)->default_value(REPLICAS_DEFAULT),
+             "number of servers an upload is sent to, in parallel from a single read of the file")
+            ("placement", po::value<std::string>(&placement_option)->default_value("most-free"),
+             "order in which the servers are asked to accept an upload: most-free, least-loaded "
+             "or consistent-hash (least-loaded asks the servers for their queues, the servers without the "
+             "protocol extensions don't answer such a discover)")
+            ("session", po::value<bool>(&options.SESSION)->default_value(false),
+             "fetch and upload over a TCP session kept open with every server (many files of a command "
+             "in a single batch), so a transfer doesn't need its own connection; "
+             "the transfers don't run in the background then")
+            ("compression", po::value<bool>(&options.COMPRESSION)->default_value(false),
+             "ask the servers to deflate the fetched and uploaded files on the way (if they compress well), "
+             "for the slow links")
+            ("checksums", po::value<bool>(&options.CHECKSUMS)->default_value(true),
+             "ask the servers for the checksum of every fetched file and check it, "
+             "(a server without the protocol extensions doesn't answer, it's asked again without them)")
+            ("paged-search", po::value<bool>(&options.PAGED_SEARCH)->default_value(false),
+             "search page by page, every server sends its next page when asked for it, "
+             "so the long results aren't lost in a burst of datagrams")
+            ("page-size", po::value<std::size_t>(&options.PAGE_SIZE)->default_value(PAGE_SIZE_DEFAULT),
+             "max number of names in a page of a paged search, 0 - as many as fit in a datagram");
     std::string mandatory_variables[] = {"mcast-addr", "cmd-port", "out-fldr"};
 
     po::variables_map variables;
@@ -112,6 +337,16 @@ client_options read_options(int argc, char const *argv[]) {
     if (options.CMD_PORT < 0) {
         throw std::invalid_argument("port");
     }
+    if (options.MAX_SOURCES == 0) {
+        throw std::invalid_argument("max-sources");
+    }
+    if (options.UPLOAD_FANOUT == 0) {
+        throw std::invalid_argument("upload-fanout");
+    }
+    if (options.REPLICAS == 0) {
+        throw std::invalid_argument("replicas");
+    }
+    options.PLACEMENT = parse_placement_policy(placement_option);
     fs::path dir_path(options.OUT_FLDR);
 
     if (!fs::exists(dir_path) || !fs::is_directory(dir_path)) {
@@ -174,6 +409,9 @@ void initialize_socket(int &sock) {
 
     /* setting TTL */
     set_socket_option(sock, TTL_VALUE, IPPROTO_IP, IP_MULTICAST_TTL, "setsockopt multicast ttl");
+
+    /* the kernel caps it at rmem_max */
+    set_socket_option(sock, RECEIVE_BUFFER, SOL_SOCKET, SO_RCVBUF, "setsockopt receive buffer");
 }
 
 /**
@@ -193,46 +431,27 @@ uint64_t send_simple_client_message(int socket, client_state &state, const std::
     return send_simple_message(socket, state.remote_address, cmd, data, get_cmd_seq());
 }
 
-void receive_message(int sock, char *buffer, struct sockaddr_in &server_address, ssize_t &rcv_len, socklen_t &addr_len) {
-    rcv_len = recvfrom(sock, buffer, BSIZE, 0, (struct sockaddr *) &server_address, &addr_len);
-    if (rcv_len < 0) {
-        if (rcv_len != -1 ||
-            (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINPROGRESS)) {
-            /* not caused by timeout */
-            throw std::runtime_error("read");
-        }
-    }
-}
-
 /**
- * Tries to receive a message for @ref end_point - @ref current_time seconds.
+ * Receives the messages of type @ref T that arrive before @ref end_point, one poll and one recvmmsg
+ * for the whole burst waiting on the socket.
  * @tparam T - SIMPL_CMD/CMPLX_CMD
  * @param [in] socket Socket used to read.
+ * @param [in] batch Receiving buffers.
  * @param [in] end_point Point in time that limits the receiving.
- * @param [in] current_time Current point in time.
- * @param [in] wait_time Structure used to set the socket options.
- * @param [out] buffer Receiving buffer.
  * @param [out] server_messages All the information sent by the server (server address + message sent by the server).
+ * @return Number of datagrams received (including the malformed ones), 0 if the time is up.
  */
 template<typename T>
-void receive_timeouted_message(int socket, const chr::system_clock::time_point &end_point,
-                               const chr::system_clock::time_point &current_time, struct timeval &wait_time,
-                               char *buffer,
-                               std::vector<message<T>> &server_messages) {
-    struct sockaddr_in server_address{};
-    socklen_t addr_len = sizeof server_address;
-    ssize_t rcv_len;
-    chr::nanoseconds remaining_time = end_point - current_time;
-    chr::seconds sec = chr::duration_cast<chr::seconds>(remaining_time);
-    wait_time.tv_sec = sec.count();
-    wait_time.tv_usec = chr::duration_cast<chr::microseconds>(remaining_time - sec).count();
-
-    set_socket_receive_timeout(socket, wait_time);
-    receive_message(socket, buffer, server_address, rcv_len, addr_len);
-
-    if (rcv_len != -1 && !message_too_short<T>(server_address, rcv_len)) {
-        server_messages.push_back({server_address, {buffer, rcv_len}});
+std::size_t receive_messages_until(int socket, receive_batch &batch, const chr::system_clock::time_point &end_point,
+                                   std::vector<message<T>> &server_messages) {
+    batch_stats stats;
+    std::size_t count = batch.receive_within(socket, end_point - chr::system_clock::now(), stats);
+    for (std::size_t i = 0; i < count; ++i) {
+        if (!message_too_short<T>(batch.address(i), batch.length(i))) {
+            server_messages.push_back({batch.address(i), {batch.data(i), (ssize_t) batch.length(i)}});
+        }
     }
+    return count;
 }
 
 /**
@@ -247,27 +466,127 @@ template<typename T>
 void
 receive_timeouted_messages(int socket, client_options &options, std::vector<message<T>> &server_messages,
                            std::size_t limit) {
-    char buffer[BSIZE];
+    receive_batch batch(std::min(limit, UDP_BATCH));
+    chr::system_clock::time_point end_point = chr::system_clock::now() + chr::seconds(options.TIMEOUT);
+    while (server_messages.size() < limit && chr::system_clock::now() < end_point) {
+        receive_messages_until(socket, batch, end_point, server_messages);
+    }
+}
+
+/**
+ * The wait for the replies to a multicast request (sent just before), at most @ref options.TIMEOUT seconds.
+ * With @ref options.ADAPTIVE_WAIT and some history, the wait ends early: every reply extends it
+ * by a grace period derived from the round trip times, starting from a window of @ref WINDOW_FACTOR times
+ * the @ref RTT_QUANTILE. With @ref expect_live, it doesn't end before all the live servers answered.
+ */
+class reply_window {
+public:
+    reply_window(const client_options &options, const discovery_history &history, bool expect_live)
+            : start_point(chr::system_clock::now()), end_point(start_point + chr::seconds(options.TIMEOUT)),
+              last_reply(start_point), expect_live(expect_live) {
+        adaptive = options.ADAPTIVE_WAIT && !history.rtts.empty() && (!expect_live || !history.live.empty());
+        if (adaptive) {
+            chr::system_clock::duration quantile = history.quantile();
+            grace = std::max<chr::system_clock::duration>(GRACE_MIN, quantile);
+            window = std::max<chr::system_clock::duration>(grace, quantile * WINDOW_FACTOR);
+        }
+    }
+
+    /** When the wait ends, every reply may move it. */
+    chr::system_clock::time_point deadline(const discovery_history &history) const {
+        if (adaptive && (!expect_live || expected_answered == history.live.size())) {
+            return std::min(end_point, std::max(start_point + window, last_reply + grace));
+        }
+        return end_point;
+    }
+
+    /** Notes an accepted reply of @ref server. */
+    void reply(discovery_history &history, const struct sockaddr_in &server, chr::system_clock::time_point arrival) {
+        last_reply = arrival;
+        uint64_t key = discovery_history::key(server);
+        if (answered.insert(key).second) {
+            history.add_rtt(arrival - start_point);
+            expected_answered += history.live.count(key);
+        }
+    }
+
+    /** Ends the wait, the servers that didn't answer a HELLO are noted. */
+    void finish(discovery_history &history) const {
+        if (expect_live) {
+            history.end_hello(answered);
+        }
+    }
+
+private:
+    chr::system_clock::time_point start_point;
+    chr::system_clock::time_point end_point;
+    chr::system_clock::time_point last_reply;
+    bool expect_live;
+    bool adaptive;
+    chr::system_clock::duration grace{}, window{};
+    std::set<uint64_t> answered;
+    std::size_t expected_answered = 0;
+};
 
-    chr::system_clock::time_point start_point = chr::system_clock::now();
-    std::chrono::seconds timeout(options.TIMEOUT);
-    chr::system_clock::time_point end_point = start_point + timeout;
-    struct timeval wait_time{};
+/**
+ * Collects the replies to a multicast request (sent just before) within a @ref reply_window.
+ * @param [in] accept Checks a message as it arrives (and may print it), only the accepted ones are kept.
+ * @param [out] server_messages Accepted messages.
+ */
+template<typename T>
+void collect_replies(int socket, client_state &state, const client_options &options,
+                     std::vector<message<T>> &server_messages, bool expect_live,
+                     const std::function<bool(const message<T> &)> &accept) {
+    receive_batch batch(UDP_BATCH);
+    reply_window window(options, state.history, expect_live);
+    std::vector<message<T>> received;
     for (;;) {
-        chr::system_clock::time_point current_time = chr::system_clock::now();
-        if (end_point < current_time || server_messages.size() >= limit) {
-            /* time is up / already received limit messages */
+        chr::system_clock::time_point deadline = window.deadline(state.history);
+        if (deadline <= chr::system_clock::now()) {
             break;
         }
-        else {
-            receive_timeouted_message(socket, end_point, current_time, wait_time, buffer, server_messages);
+        received.clear();
+        receive_messages_until(socket, batch, deadline, received);
+        chr::system_clock::time_point arrival = chr::system_clock::now();
+        for (message<T> &info : received) {
+            if (!accept(info)) {
+                continue;
+            }
+            window.reply(state.history, info.address, arrival);
+            server_messages.push_back(std::move(info));
         }
     }
+    window.finish(state.history);
+}
+
+/**
+ * Checks a reply to the HELLO @ref cmd_seq sent at @ref sent, adds the server to @ref servers
+ * (and prints it, the servers are printed as they answer).
+ */
+bool take_good_day(const message<CMPLX_CMD> &info, uint64_t cmd_seq, chr::system_clock::time_point sent, bool print,
+                   server_infos &servers) {
+    if (!(check_data_not_empty(info.command, info.address) &&
+          check_cmd(info.command, "GOOD_DAY", info.address) &&
+          check_cmd_seq(info.command, cmd_seq, info.address))) {
+        return false;
+    }
+    server_info server{info.command.param, info.address, chr::system_clock::now() - sent};
+    std::string_view queue;
+    if (find_extension(info.command.data, "queue", queue)) {
+        server.queue = strtoull(std::string(queue).c_str(), nullptr, 10);
+    }
+    servers.push_back(server);
+    if (print) {
+        std::cout << "Found " << inet_ntoa(info.address.sin_addr) << " (" << base_data(info.command.data)
+                  << ") ";
+        std::cout << "with free space " << info.command.param << std::endl;
+    }
+    return true;
+}
 
-    /* revert socket timeout */
-    wait_time.tv_sec = 0;
-    wait_time.tv_usec = 0;
-    set_socket_receive_timeout(socket, wait_time);
+/** Data of a HELLO: the servers' queues are asked for only if the placement needs them. */
+std::string hello_data(const client_options &options) {
+    return options.PLACEMENT == placement_policy::least_loaded ? ask_extension("", "queue") : "";
 }
 
 /**
@@ -280,56 +599,264 @@ receive_timeouted_messages(int socket, client_options &options, std::vector<mess
  *                    but shouldn't print anything).
  */
 void hello(int socket, client_state &state, client_options &options, bool print) {
-    uint64_t cmd_seq = send_simple_client_message(socket, state, "HELLO", "");
+    uint64_t cmd_seq = send_simple_client_message(socket, state, "HELLO", hello_data(options));
+    chr::system_clock::time_point sent = chr::system_clock::now();
     std::vector<message<CMPLX_CMD>> server_messages;
-    receive_timeouted_messages(socket, options, server_messages, SIZE_MAX);
     state.previous_servers.clear();
+    collect_replies<CMPLX_CMD>(socket, state, options, server_messages, true,
+                               [&state, cmd_seq, print, sent](const message<CMPLX_CMD> &info) {
+        return take_good_day(info, cmd_seq, sent, print, state.previous_servers);
+    });
+}
+
+/** Names of a server received by a paged search so far. */
+struct list_pages {
+    struct sockaddr_in address{};
+    uint64_t total = 0; /** matching files on the server, as it said in the first page */
+    std::vector<std::string> names;
+    uint64_t cmd_seq = 0; /** of the request waiting for the next page */
+    std::string request; /** data of that request */
+    chr::system_clock::time_point asked;
+    unsigned int attempts = 1;
+
+    bool complete() const { return names.size() >= total; }
+};
+
+/**
+ * Handles the "search" command with LIST_PAGE: the first pages are collected like the MY_LIST replies,
+ * then every server is asked for the pages after the last name it sent, until it sent all of them.
+ * A page that doesn't come within TIMEOUT is asked for again, up to @ref PAGE_ATTEMPTS times.
+ */
+void search_paged(client_state &state, client_options &options, const std::string &argument) {
+    uint64_t cmd_seq = get_cmd_seq();
+    send_complex_message(state.socket, state.remote_address, "LIST_PAGE", argument, cmd_seq, options.PAGE_SIZE);
+    std::map<uint64_t, list_pages> servers;
+
+    /* the names are printed as they arrive, returns false if the message isn't a page the client waits for */
+    auto add_page = [&](const message<CMPLX_CMD> &info) {
+        if (!check_cmd(info.command, "MY_PAGE", info.address)) {
+            return false;
+        }
+        uint64_t key = discovery_history::key(info.address);
+        auto server = servers.find(key);
+        if (server == servers.end()) {
+            if (!check_cmd_seq(info.command, cmd_seq, info.address)) {
+                return false;
+            }
+            server = servers.emplace(key, list_pages{}).first;
+            server->second.address = info.address;
+            server->second.total = info.command.param;
+        }
+        else if (server->second.complete() || !check_cmd_seq(info.command, server->second.cmd_seq, info.address)) {
+            return false; /* a duplicate of a page already received */
+        }
+
+        list_pages &pages = server->second;
+        std::string address(inet_ntoa(info.address.sin_addr));
+        std::string_view page = info.command.data;
+        std::string name;
+        std::size_t before = pages.names.size();
+        while (!page.empty()) {
+            if (!decode_page_entry(page, name)) {
+                error_message(info.address, "Wrong info in data.");
+                break;
+            }
+            std::cout << name << " (" << address << ")" << "\n";
+            pages.names.push_back(name);
+        }
+        std::cout.flush();
+        if (pages.names.size() == before) {
+            pages.total = pages.names.size(); /* the files were removed meanwhile */
+        }
+        if (!pages.complete()) {
+            pages.request = add_extension(argument, "after", pages.names.back());
+            pages.cmd_seq = get_cmd_seq();
+            pages.asked = chr::system_clock::now();
+            pages.attempts = 1;
+            send_complex_message(state.socket, info.address, "LIST_PAGE", pages.request, pages.cmd_seq,
+                                 options.PAGE_SIZE);
+        }
+        return true;
+    };
+
+    std::vector<message<CMPLX_CMD>> server_messages;
+    collect_replies<CMPLX_CMD>(state.socket, state, options, server_messages, false, add_page);
+
+    receive_batch batch(UDP_BATCH);
+    std::vector<message<CMPLX_CMD>> received;
+    for (;;) {
+        chr::system_clock::time_point current_time = chr::system_clock::now();
+        chr::system_clock::time_point deadline = chr::system_clock::time_point::max();
+        for (auto &server : servers) {
+            list_pages &pages = server.second;
+            if (pages.complete()) {
+                continue;
+            }
+            chr::system_clock::time_point end_point = pages.asked + chr::seconds(options.TIMEOUT);
+            if (end_point <= current_time) {
+                if (pages.attempts == PAGE_ATTEMPTS) {
+                    error_message(pages.address, "No page after " + pages.names.back() + ".");
+                    pages.total = pages.names.size(); /* the names received so far are kept */
+                    continue;
+                }
+                ++pages.attempts;
+                pages.asked = current_time;
+                end_point = current_time + chr::seconds(options.TIMEOUT);
+                send_complex_message(state.socket, pages.address, "LIST_PAGE", pages.request, pages.cmd_seq,
+                                     options.PAGE_SIZE);
+            }
+            deadline = std::min(deadline, end_point);
+        }
+        if (deadline == chr::system_clock::time_point::max()) {
+            break; /* all the servers sent their pages (or were given up) */
+        }
+        received.clear();
+        receive_messages_until(state.socket, batch, deadline, received);
+        for (const message<CMPLX_CMD> &info : received) {
+            add_page(info);
+        }
+    }
 
-    for (auto &info : server_messages) {
-        if (check_data_not_empty(info.command, info.address) &&
-            check_cmd(info.command, "GOOD_DAY", info.address) &&
-            check_cmd_seq(info.command, cmd_seq, info.address)) {
-            state.previous_servers.push_back({info.command.param, info.address});
-            if (print) {
-                std::cout << "Found " << inet_ntoa(info.address.sin_addr) << " (" << info.command.data << ") ";
-                std::cout << "with free space " << info.command.param << "\n";
+    /* the names are kept like the MY_LIST replies, for fetch */
+    state.previous_search.clear();
+    for (auto &server : servers) {
+        std::string data;
+        for (const std::string &name : server.second.names) {
+            if (!data.empty()) {
+                data += '\n';
             }
+            data += name;
         }
+        state.previous_search.push_back({server.second.address, SIMPL_CMD("MY_LIST", cmd_seq, std::move(data))});
     }
 }
 
-/** Handles the "discover" command. */
-void discover(client_state &state, client_options &options) {
-    hello(state.socket, state, options, true);
+/**
+ * Checks a reply to the LIST @ref cmd_seq and prints its files, they are printed as they arrive
+ * (the servers without matching files don't answer at all).
+ */
+bool take_list(const message<SIMPL_CMD> &info, uint64_t cmd_seq) {
+    if (!(check_data_not_empty(info.command, info.address) &&
+          check_cmd(info.command, "MY_LIST", info.address) &&
+          check_cmd_seq(info.command, cmd_seq, info.address))) {
+        return false;
+    }
+    std::string address(inet_ntoa(info.address.sin_addr));
+    auto t = tokenize(info);
+    for (auto it = t.begin(); it != t.end(); ++it) {
+        std::cout << *it << " (" << address << ")" << "\n";
+    }
+    std::cout.flush();
+    return true;
+}
+
+/**
+ * A discover or search waiting for its replies in the interactive loop, while the next commands are read.
+ * The replies are told apart by their cmd_seq.
+ */
+struct pending_request {
+    reply_window window;
+    /** Decodes a reply of the request and accepts it (see @ref collect_replies). */
+    std::function<bool(const char *, std::size_t, const struct sockaddr_in &)> take;
+    /** Called once the window is over. */
+    std::function<void()> finish;
+};
+
+/** Wraps the @ref accept of a @ref collect_replies into a @ref pending_request::take. */
+template<typename T>
+std::function<bool(const char *, std::size_t, const struct sockaddr_in &)>
+take_as(std::function<bool(const message<T> &)> accept) {
+    return [accept = std::move(accept)](const char *data, std::size_t length, const struct sockaddr_in &address) {
+        return !message_too_short<T>(address, length) && accept({address, {data, (ssize_t) length}});
+    };
+}
+
+/** The requests of the interactive loop, by their cmd_seq. */
+struct pending_requests {
+    std::map<uint64_t, pending_request> requests;
+    uint64_t last_discover = 0; /** cmd_seq of the latest discover, only its servers are kept */
+    uint64_t last_search = 0; /** ...of the latest search, only its files are kept */
+};
+
+/** Handles the "discover" command, the replies are collected by the interactive loop. */
+void discover(client_state &state, client_options &options, pending_requests &pending) {
+    uint64_t cmd_seq = send_simple_client_message(state.socket, state, "HELLO", hello_data(options));
+    chr::system_clock::time_point sent = chr::system_clock::now();
+    auto servers = std::make_shared<server_infos>();
+    pending.last_discover = cmd_seq;
+    pending.requests.emplace(cmd_seq, pending_request{
+            reply_window(options, state.history, true),
+            take_as<CMPLX_CMD>([cmd_seq, sent, servers](const message<CMPLX_CMD> &info) {
+                return take_good_day(info, cmd_seq, sent, true, *servers);
+            }),
+            [&state, &pending, cmd_seq, servers] {
+                if (pending.last_discover == cmd_seq) {
+                    state.previous_servers = std::move(*servers);
+                }
+            }});
 }
 
-/** Handles the "search" command. */
-void search(client_state &state, client_options &options, const std::string &argument) {
+/** Handles the "search" command, the replies are collected by the interactive loop (a paged search waits for them). */
+void search(client_state &state, client_options &options, pending_requests &pending, const std::string &argument) {
+    if (options.PAGED_SEARCH) {
+        search_paged(state, options, argument);
+        return;
+    }
     uint64_t cmd_seq = send_simple_client_message(state.socket, state, "LIST", argument);
-    std::vector<message<SIMPL_CMD>> server_messages;
-    receive_timeouted_messages(state.socket, options, server_messages, SIZE_MAX);
+    auto files = std::make_shared<std::vector<message<SIMPL_CMD>>>();
+    pending.last_search = cmd_seq;
+    pending.requests.emplace(cmd_seq, pending_request{
+            reply_window(options, state.history, false),
+            take_as<SIMPL_CMD>([cmd_seq, files](const message<SIMPL_CMD> &info) {
+                if (!take_list(info, cmd_seq)) {
+                    return false;
+                }
+                files->push_back(info);
+                return true;
+            }),
+            [&state, &pending, cmd_seq, files] {
+                if (pending.last_search == cmd_seq) {
+                    state.previous_search = std::move(*files); /* replaces the list of files of a previous search */
+                }
+            }});
+}
 
-    for (auto &info : server_messages) {
-        if (check_data_not_empty(info.command, info.address) &&
-            check_cmd(info.command, "MY_LIST", info.address) &&
-            check_cmd_seq(info.command, cmd_seq, info.address)) {
-            std::string address(inet_ntoa(info.address.sin_addr));
-            auto t = tokenize(info);
-            for (auto it = t.begin(); it != t.end(); ++it) {
-                std::cout << *it << " (" << address << ")" << "\n";
-            }
+/**
+ * Hands the replies received by the interactive loop to their requests and finishes the requests
+ * whose windows are over.
+ */
+void serve_pending(client_state &state, pending_requests &pending, const receive_batch &batch, std::size_t count) {
+    chr::system_clock::time_point arrival = chr::system_clock::now();
+    for (std::size_t i = 0; i < count; ++i) {
+        simpl_view view;
+        if (!decode(batch.data(i), batch.length(i), view)) {
+            error_message(batch.address(i), "Message too short.");
+            continue;
+        }
+        auto request = pending.requests.find(view.cmd_seq);
+        if (request == pending.requests.end()) {
+            error_message(batch.address(i), "Wrong cmd_seq.");
+            continue;
+        }
+        if (request->second.take(batch.data(i), batch.length(i), batch.address(i))) {
+            request->second.window.reply(state.history, batch.address(i), arrival);
         }
     }
 
-    if (!state.previous_search.empty()) {
-        state.previous_search.clear(); /* clears a previous list of files */
-    }
-    for (message<SIMPL_CMD> &msg : server_messages) {
-        state.previous_search.emplace_back(message<SIMPL_CMD>(msg)); /* updates the list of files */
+    chr::system_clock::time_point current_time = chr::system_clock::now();
+    for (auto it = pending.requests.begin(); it != pending.requests.end();) {
+        if (it->second.window.deadline(state.history) <= current_time) {
+            it->second.window.finish(state.history);
+            it->second.finish();
+            it = pending.requests.erase(it);
+        }
+        else {
+            ++it;
+        }
     }
 }
 
-void create_tcp_socket(int &sock, struct sockaddr_in &server_tcp) {
+void create_tcp_socket(int &sock, const struct sockaddr_in &server_tcp) {
     sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
     if (sock < 0) {
         throw std::runtime_error("socket");
@@ -340,292 +867,1665 @@ void create_tcp_socket(int &sock, struct sockaddr_in &server_tcp) {
     }
 }
 
+/** Checksum of a transferred file: the one computed on the way and the one announced by the server. */
+struct file_checksum {
+    uint32_t computed = 0;
+    bool announced = false;
+    uint32_t expected = 0;
+
+    /** Reads the "crc32c" extension of the servers reply, if there is one. */
+    void read_announced(std::string_view data) {
+        std::string_view value;
+        if (find_extension(data, "crc32c", value)) {
+            announced = parse_crc32c(std::string(value), expected);
+        }
+    }
+
+    bool mismatch() const { return announced && computed != expected; }
+};
+
 /**
- * Receives the file @ref argument from the server identified by @ref info.
- * @param [in] state Client state.
- * @param [in] options Client options.
- * @param [in] info Message received from a sever, helps initialize a TCP connection.
- * @param [in] argument Received file.
+ * Asks @ref server for the size of the file @ref name (STAT), @ref checksum reads the checksum if it's announced.
+ * @return false if the server didn't answer (an old one doesn't know STAT).
  */
-void receive_file(client_state &state, client_options &options, const message<SIMPL_CMD> &info,
-                  const std::string &argument) {
-    int sock;
-    initialize_socket(sock);
-    char buffer[BSIZE];
-    uint64_t cmd_seq = send_simple_message(sock, info.address, "GET", argument, get_cmd_seq());
-    set_socket_receive_timeout(sock, {options.TIMEOUT, 0});
-
-    ssize_t rcv_len;
-    socklen_t addr_len = sizeof info.address;
-    rcv_len = recvfrom(sock, buffer, BSIZE, 0, (struct sockaddr *) &info.address, &addr_len);
-    if (rcv_len < 0) {
-        if (rcv_len != -1 ||
-            (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINPROGRESS)) {
-            /* not caused by timeout */
-            throw std::runtime_error("read");
-        }
-        else {
-            std::cout << "File " <<  argument << " downloading failed (:) server didn't answer\n";
-            return;
-        }
+bool stat_file(int sock, client_options &options, const struct sockaddr_in &server, const std::string &name,
+               uint64_t &size, file_checksum &checksum) {
+    uint64_t cmd_seq = send_simple_message(sock, server, "STAT", name, get_cmd_seq());
+    std::vector<message<CMPLX_CMD>> replies;
+    receive_timeouted_messages(sock, options, replies, 1);
+    if (replies.empty() ||
+        !check_cmd(replies[0].command, "FILE_SIZE", replies[0].address) ||
+        !check_cmd_seq(replies[0].command, cmd_seq, replies[0].address) ||
+        !check_data_equal(replies[0].command, replies[0].address, name)) {
+        return false;
     }
+    size = replies[0].command.param;
+    checksum.read_announced(replies[0].command.data);
+    return true;
+}
+
+/** How a single attempt of a transfer ended. */
+enum class attempt_result {
+    done,
+    broken, /** the connection broke, the transfer can be resumed */
+    refused, /** the server didn't answer */
+};
+
+/** Checks if the server's reply (CONNECT_ME, CAN_ADD) announces that the file moves deflated. */
+bool is_compressed(std::string_view data) {
+    std::string_view method;
+    return find_extension(data, "compress", method) && method == COMPRESSION_NAME;
+}
+
+/** Data of the GET of the whole file @ref argument, with the extensions @ref options ask for. */
+std::string get_data(const client_options &options, const std::string &argument) {
+    std::string data = options.CHECKSUMS ? ask_extension(argument, "crc32c") : argument;
+    return options.COMPRESSION ? add_extension(data, "compress", COMPRESSION_NAME) : data;
+}
 
-    CMPLX_CMD message(buffer, rcv_len); /* info about the TCP port */
-    if (!check_data_not_empty(message, info.address) ||
-        !check_cmd(message, "CONNECT_ME", info.address) ||
-        !check_cmd_seq(message, cmd_seq, info.address)) {
-        exit(0); /* invalid command */
+/**
+ * Asks @ref server for the file @ref argument from @ref offset on and appends it to @ref fd.
+ * The whole file is asked for with GET (see @ref get_data), the rest of it with GET_RANGE.
+ * A GET with the extensions that isn't answered is sent once more with the bare name,
+ * the servers without the extensions look for a file named with all of its data.
+ * @param [out] server_tcp Address the file was received from.
+ * @param [in/out] checksum Extended with the received bytes.
+ */
+attempt_result receive_stream(int sock, client_options &options, const struct sockaddr_in &server,
+                              const std::string &argument, uint64_t offset, int fd, struct sockaddr_in &server_tcp,
+                              file_checksum &checksum) {
+    std::string data = get_data(options, argument);
+    uint64_t cmd_seq = offset == 0 ?
+                       send_simple_message(sock, server, "GET", data, get_cmd_seq()) :
+                       send_complex_message(sock, server, "GET_RANGE", encode_range_data(0, argument),
+                                            get_cmd_seq(), offset);
+    std::vector<message<CMPLX_CMD>> replies; /* info about the TCP port */
+    receive_timeouted_messages(sock, options, replies, 1);
+    if (replies.empty() && offset == 0 && data != argument) {
+        cmd_seq = send_simple_message(sock, server, "GET", argument, get_cmd_seq());
+        receive_timeouted_messages(sock, options, replies, 1);
+    }
+    if (replies.empty() ||
+        !check_data_not_empty(replies[0].command, replies[0].address) ||
+        !check_cmd(replies[0].command, "CONNECT_ME", replies[0].address) ||
+        !check_cmd_seq(replies[0].command, cmd_seq, replies[0].address)) {
+        return attempt_result::refused;
     }
+    checksum.read_announced(replies[0].command.data);
 
     int tcp_socket;
-    struct sockaddr_in server_address{info.address};
-    server_address.sin_port = htons(message.param);
-    std::string server_address_string(inet_ntoa(info.address.sin_addr));
-
-    create_tcp_socket(tcp_socket, server_address);
+    server_tcp = server;
+    server_tcp.sin_port = htons(replies[0].command.param);
+    try {
+        create_tcp_socket(tcp_socket, server_tcp);
+    }
+    catch (const std::runtime_error &) {
+        return attempt_result::broken;
+    }
+    /* a stalled transfer is resumed */
+    set_socket_receive_timeout(tcp_socket, {options.TIMEOUT, 0});
+
+    if (is_compressed(replies[0].command.data)) {
+        /* what was inflated before the connection broke is kept, the rest comes uncompressed with GET_RANGE */
+        file_receiver receiver(fd, UINT64_MAX, true);
+        bool done;
+        try {
+            done = receiver.pump(tcp_socket);
+        }
+        catch (const std::runtime_error &) {
+            done = false;
+        }
+        checksum.computed = receiver.checksum();
+        close(tcp_socket);
+        return done ? attempt_result::done : attempt_result::broken;
+    }
 
-    rcv_len = 1;
-    std::string filename(options.OUT_FLDR + "/" + argument);
-    int fd = open(filename.c_str(), O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH); /* creates the file*/
-    state.open_files.insert(filename); /* marks the opening of the file */
-    while (rcv_len > 0) {
-        rcv_len = read(tcp_socket, buffer, BSIZE);
-        if (write(fd, buffer, rcv_len) < 0) {
+    char buffer[BSIZE];
+    ssize_t rcv_len;
+    while ((rcv_len = read(tcp_socket, buffer, BSIZE)) > 0) {
+        if (write(fd, buffer, rcv_len) != rcv_len) {
+            close(tcp_socket);
             throw std::runtime_error("write");
         }
+        checksum.computed = crc32c(checksum.computed, buffer, rcv_len);
     }
-    if (rcv_len < 0) {
-        throw std::runtime_error("read");
-    }
-    state.open_files.erase(filename); /* marks the closing of the file */
-    std::cout << "File " << argument << " downloaded (" << server_address_string << ":"
-              << ntohs(server_address.sin_port) << ")\n";
     close(tcp_socket);
-    exit(0);
+    return rcv_len == 0 ? attempt_result::done : attempt_result::broken;
 }
 
-/** Handles the "fetch" command. */
-void fetch(client_state &state, client_options &options, const std::string &argument) {
-    for (auto &info : state.previous_search) {
-        auto t = tokenize(info);
-        for (auto it = t.begin(); it != t.end(); ++it) {
-            if (*it == argument) {
-                switch (fork()) {
-                    case -1:
-                        throw std::runtime_error("fork");
-                    case 0:
-                        receive_file(state, options, info, argument); /* a child handles the transfer */
-                        return;
-                    default:
-                        break;
-                }
-                return;
-            }
-        }
+/** Drops the part of a file downloaded before (opened with O_APPEND), the download starts over. */
+void drop_partial(int fd, file_checksum &checksum) {
+    if (ftruncate(fd, 0) < 0) {
+        throw std::runtime_error("ftruncate");
     }
-
-    std::cout << "File " << argument << " wasn't found\n";
+    checksum = {};
 }
 
-/** Initializes a TCP connection and sends a file to the server. */
-void file_transfer(const message<CMPLX_CMD> &message, const server_info &server, const std::string &argument,
-                   fs::path &uploaded_file) {
-    bool success = true;
-    int tcp_socket;
-    struct sockaddr_in server_address{server.address};
-    server_address.sin_port = htons(message.command.param);
-    char buffer[BSIZE];
-    ssize_t read_len, write_len;
-
-    create_tcp_socket(tcp_socket, server_address);
+/**
+ * Receives the file @ref argument from the server identified by @ref info.
+ * The file is downloaded into @ref PARTIAL_SUFFIX file first, if it already exists (an earlier download broke),
+ * only the rest of the file is downloaded. A broken transfer is resumed up to @ref RESUME_ATTEMPTS times.
+ * If the server announced the checksum of the file, the received file is checked against it.
+ * The kept part may be of an older version of the file: it's dropped and the file is downloaded whole
+ * if it's longer than the file or the resumed file doesn't match the checksum.
+ * @param [in] state Client state.
+ * @param [in] options Client options.
+ * @param [in] info Message received from a sever, helps initialize a TCP connection.
+ * @param [in] argument Received file.
+ */
+void receive_file(client_state &, client_options &options, const message<SIMPL_CMD> &info,
+                  const std::string &argument) {
+    std::string filename(options.OUT_FLDR + "/" + argument);
+    std::string partial(filename + PARTIAL_SUFFIX);
+    int fd = open(partial.c_str(), O_RDWR | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (fd < 0) {
+        throw std::runtime_error("open");
+    }
 
-    std::string server_address_string(inet_ntoa(server_address.sin_addr));
-    read_len = 1;
-    const std::string &filename = uploaded_file.string();
-    int fd = open(filename.c_str(), O_RDONLY);
-    while (success && read_len > 0) {
-        read_len = read(fd, buffer, BSIZE);
-        if (read_len > 0) {
-            /* transfer bytes between the file descriptor and the socket */
-            if ((write_len = write(tcp_socket, buffer, read_len)) < 0 || write_len != read_len) {
-                success = false;
-            }
-        }
+    /* the part downloaded before is read once, to continue its checksum */
+    file_checksum checksum;
+    char buffer[BSIZE];
+    ssize_t read_len;
+    while ((read_len = read(fd, buffer, BSIZE)) > 0) {
+        checksum.computed = crc32c(checksum.computed, buffer, read_len);
     }
     if (read_len < 0) {
         throw std::runtime_error("read");
     }
 
-    if (!success) {
-        std::cout << "File " << argument << " uploading failed (" << server_address_string << ":"
-                  << ntohs(server_address.sin_port)
-                  << ") tcp connection error\n";
+    int sock;
+    initialize_socket(sock);
+    off_t kept = lseek(fd, 0, SEEK_END);
+    if (kept < 0) {
+        throw std::runtime_error("lseek");
     }
-    else {
-        std::cout << "File " << filename << " uploaded (" << server_address_string << ":"
-                  << ntohs(server_address.sin_port) << ")\n";
+    uint64_t size;
+    if (kept > 0 && stat_file(sock, options, info.address, argument, size, checksum) && size < (uint64_t) kept) {
+        drop_partial(fd, checksum);
+        kept = 0;
     }
-    exit(0);
-}
 
-/**
- * Sends a file to the server.
- * @param [in] options Client options.
- * @param [in] state Client state.
- * @param [in] argument Name of the file to send.
- * @param [in] uploaded_file File to send.
- */
-void send_file(client_options &options, client_state &state, const std::string &argument, fs::path &uploaded_file) {
+    struct sockaddr_in server_address{info.address};
+    auto download = [&]() {
+        attempt_result result = attempt_result::refused;
+        for (unsigned int attempt = 0; attempt <= RESUME_ATTEMPTS; ++attempt) {
+            off_t offset = lseek(fd, 0, SEEK_END);
+            if (offset < 0) {
+                throw std::runtime_error("lseek");
+            }
+            attempt_result last = receive_stream(sock, options, info.address, argument, offset, fd,
+                                                 server_address, checksum);
+            if (last == attempt_result::refused && result == attempt_result::broken) {
+                break; /* the server is gone for now, what came before it is kept for the next fetch */
+            }
+            result = last;
+            if (result != attempt_result::broken) {
+                break;
+            }
+        }
+        return result;
+    };
+    attempt_result result = download();
+    if (result == attempt_result::done && checksum.mismatch() && kept > 0) {
+        drop_partial(fd, checksum);
+        result = download();
+    }
+    close(sock);
+    off_t left = lseek(fd, 0, SEEK_END);
+    close(fd);
+
+    std::string server_address_string(inet_ntoa(server_address.sin_addr));
+    switch (result) {
+        case attempt_result::done:
+            if (checksum.mismatch()) {
+                unlink(partial.c_str());
+                std::cout << "File " << argument << " downloading failed (" << server_address_string << ":"
+                          << ntohs(server_address.sin_port) << ") checksum mismatch\n";
+                break;
+            }
+            if (rename(partial.c_str(), filename.c_str()) < 0) {
+                throw std::runtime_error("rename");
+            }
+            std::cout << "File " << argument << " downloaded (" << server_address_string << ":"
+                      << ntohs(server_address.sin_port) << ")\n";
+            break;
+        case attempt_result::broken:
+            std::cout << "File " << argument << " downloading failed (" << server_address_string << ":"
+                      << ntohs(server_address.sin_port) << ") connection broken, fetch again to resume\n";
+            break;
+        case attempt_result::refused:
+            if (left == 0) {
+                /* nothing to resume, an empty part would make the next fetch a resumed one */
+                unlink(partial.c_str());
+            }
+            std::cout << "File " << argument << " downloading failed (:) server didn't answer\n";
+            break;
+    }
+}
+
+/** A part of a file. */
+struct file_range {
+    uint64_t offset = 0;
+    uint64_t length = 0;
+};
+
+/**
+ * Parts of a file waiting to be downloaded, shared by the threads downloading them.
+ * A part given back by a failed thread is taken by the remaining ones.
+ */
+struct range_queue {
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<file_range> pending;
+    std::size_t in_flight = 0; /** parts being downloaded */
+
+    /**
+     * Takes the next part, waits if there is none but some may still be given back.
+     * @return false if the whole file is downloaded (or nobody is left to give a part back).
+     */
+    bool take(file_range &range) {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [this] { return !pending.empty() || in_flight == 0; });
+        if (pending.empty()) {
+            return false;
+        }
+        range = pending.front();
+        pending.pop_front();
+        ++in_flight;
+        return true;
+    }
+
+    /** Marks a part taken with @ref take as downloaded. */
+    void done() {
+        std::lock_guard<std::mutex> lock(mutex);
+        --in_flight;
+        changed.notify_all();
+    }
+
+    /** Returns a part that couldn't be downloaded. */
+    void give_back(const file_range &range) {
+        std::lock_guard<std::mutex> lock(mutex);
+        --in_flight;
+        pending.push_front(range);
+        changed.notify_all();
+    }
+};
+
+std::string address_string(const struct sockaddr_in &address) {
+    return std::string(inet_ntoa(address.sin_addr)) + ":" + std::to_string(ntohs(address.sin_port));
+}
+
+/**
+ * Downloads a part of the file @ref argument from @ref server and writes it in place.
+ * @param [in] sock UDP socket used to ask for the part.
+ * @param [in] fd Downloaded file.
+ * @return false if the server didn't answer or the transfer broke.
+ */
+bool receive_range(int sock, client_options &options, const struct sockaddr_in &server, const std::string &argument,
+                   const file_range &range, int fd) {
+    uint64_t cmd_seq = send_complex_message(sock, server, "GET_RANGE", encode_range_data(range.length, argument),
+                                            get_cmd_seq(), range.offset);
+    std::vector<message<CMPLX_CMD>> replies;
+    receive_timeouted_messages(sock, options, replies, 1);
+    if (replies.empty() ||
+        !check_cmd(replies[0].command, "CONNECT_ME", replies[0].address) ||
+        !check_cmd_seq(replies[0].command, cmd_seq, replies[0].address) ||
+        !check_data_equal(replies[0].command, replies[0].address, argument)) {
+        return false;
+    }
+
+    int tcp_socket;
+    struct sockaddr_in server_address{server};
+    server_address.sin_port = htons(replies[0].command.param);
+    create_tcp_socket(tcp_socket, server_address);
+    /* a stalled server gives its part to the others */
+    set_socket_receive_timeout(tcp_socket, {options.TIMEOUT, 0});
+
+    char buffer[BSIZE];
+    uint64_t received = 0;
+    while (received < range.length) {
+        ssize_t rcv_len = read(tcp_socket, buffer, std::min<uint64_t>(BSIZE, range.length - received));
+        if (rcv_len <= 0) {
+            break;
+        }
+        if (pwrite(fd, buffer, rcv_len, range.offset + received) != rcv_len) {
+            close(tcp_socket);
+            throw std::runtime_error("write");
+        }
+        received += rcv_len;
+    }
+    close(tcp_socket);
+    return received == range.length;
+}
+
+/** Downloads parts of a file from a single server until there are none left or the server fails. */
+void range_worker(client_options &options, range_queue &ranges, const struct sockaddr_in &server,
+                  const std::string &argument, int fd, bool &failed) {
     int sock;
     initialize_socket(sock);
-    hello(sock, state, options, false);
-    if (state.previous_servers.empty()) {
-        std::cout << "File " << argument << " uploading failed (:) no server available\n";
+    file_range range;
+    while (ranges.take(range)) {
+        bool success;
+        try {
+            success = receive_range(sock, options, server, argument, range, fd);
+        }
+        catch (const std::runtime_error &) {
+            success = false;
+        }
+        if (!success) {
+            failed = true;
+            ranges.give_back(range);
+            break;
+        }
+        ranges.done();
+    }
+    close(sock);
+}
+
+/** Checksum of the first @ref size bytes of the file @ref fd. */
+uint32_t file_crc32c(int fd, uint64_t size) {
+    char buffer[BSIZE];
+    uint32_t checksum = 0;
+    for (uint64_t offset = 0; offset < size;) {
+        ssize_t read_len = pread(fd, buffer, std::min<uint64_t>(size - offset, BSIZE), offset);
+        if (read_len <= 0) {
+            throw std::runtime_error("read");
+        }
+        checksum = crc32c(checksum, buffer, read_len);
+        offset += read_len;
+    }
+    return checksum;
+}
+
+/**
+ * Downloads the file @ref argument from all the @ref servers at once,
+ * every server sends some parts of the file.
+ * Only the servers with the same version of the file are used: the ones that announce the same checksum
+ * as the first one that does (and the same size), or the ones that agree on the size if none of them does.
+ * The file is received into its @ref PARTIAL_SUFFIX file and checked against the checksum as a whole.
+ * If none of them answers STAT (the servers without the extensions don't), the file is received
+ * from the @ref first one, like with a single server.
+ */
+void receive_file_parallel(client_state &state, client_options &options, const message<SIMPL_CMD> &first,
+                           const std::vector<struct sockaddr_in> &servers, const std::string &argument) {
+    int sock;
+    initialize_socket(sock);
+    uint64_t cmd_seq = get_cmd_seq();
+    for (const struct sockaddr_in &server : servers) {
+        send_simple_message(sock, server, "STAT", argument, cmd_seq);
+    }
+    std::vector<message<CMPLX_CMD>> replies;
+    receive_timeouted_messages(sock, options, replies, servers.size());
+    close(sock);
+
+    std::vector<const message<CMPLX_CMD> *> answers;
+    file_checksum checksum;
+    for (auto &info : replies) {
+        if (check_cmd(info.command, "FILE_SIZE", info.address) &&
+            check_cmd_seq(info.command, cmd_seq, info.address) &&
+            check_data_equal(info.command, info.address, argument)) {
+            answers.push_back(&info);
+            if (!checksum.announced) {
+                checksum.read_announced(info.command.data);
+            }
+        }
+    }
+    std::vector<struct sockaddr_in> sources;
+    uint64_t size = 0;
+    for (const message<CMPLX_CMD> *info : answers) {
+        file_checksum other;
+        other.read_announced(info->command.data);
+        if (other.announced != checksum.announced || other.expected != checksum.expected ||
+            (!sources.empty() && info->command.param != size)) {
+            continue;
+        }
+        size = info->command.param;
+        sources.push_back(info->address);
+    }
+    if (sources.empty()) {
+        receive_file(state, options, first, argument);
         return;
     }
 
-    /* sort the servers by available space */
-    std::sort(state.previous_servers.begin(), state.previous_servers.end(),
-              [](const server_info &lhs, const server_info &rhs) -> bool {
-                  return lhs.available_space > rhs.available_space;
-              });
+    /* an existing copy of the file is kept until the new one is complete */
+    std::string filename(options.OUT_FLDR + "/" + argument);
+    std::string partial(filename + PARTIAL_SUFFIX);
+    int fd = open(partial.c_str(), O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (fd < 0 || ftruncate(fd, size) < 0) {
+        throw std::runtime_error("open");
+    }
+    state.open_files->insert(partial); /* marks the opening of the file */
 
-    for (const auto &server : state.previous_servers) {
-        char buffer[BSIZE];
-        ssize_t rcv_len;
-        struct sockaddr_in server_address{};
-        socklen_t addr_len;
-        uint64_t cmd_seq = send_complex_message(sock, server.address, "ADD", uploaded_file.filename().string(),
-                                                get_cmd_seq(),
-                                                file_size(uploaded_file));
-        struct timeval wait_time{options.TIMEOUT, 0}; /* receive timeout */
-        set_socket_receive_timeout(sock, wait_time);
-        receive_message(sock, buffer, server_address, rcv_len, addr_len);
-        if (rcv_len > 0 && buffer[0] == 'C') {
-            /* CAN_ADD */
-            if (message_too_short<CMPLX_CMD>(server_address, rcv_len)) {
+    range_queue ranges;
+    uint64_t range_len = std::max(RANGE_MIN_LEN, size / (sources.size() * RANGES_PER_SOURCE));
+    for (uint64_t offset = 0; offset < size; offset += range_len) {
+        ranges.pending.push_back({offset, std::min(range_len, size - offset)});
+    }
+
+    std::vector<std::thread> workers;
+    std::unique_ptr<bool[]> failed(new bool[sources.size()]());
+    for (std::size_t i = 0; i < sources.size(); ++i) {
+        workers.emplace_back(range_worker, std::ref(options), std::ref(ranges), std::cref(sources[i]),
+                             std::cref(argument), fd, std::ref(failed[i]));
+    }
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+    bool complete = ranges.pending.empty();
+    if (complete && checksum.announced) {
+        checksum.computed = file_crc32c(fd, size);
+    }
+    close(fd);
+
+    std::string used, broken;
+    for (std::size_t i = 0; i < sources.size(); ++i) {
+        std::string &list = failed[i] ? broken : used;
+        list += (list.empty() ? "" : ", ") + address_string(sources[i]);
+    }
+    if (!complete || checksum.mismatch()) {
+        unlink(partial.c_str());
+        state.open_files->erase(partial);
+        if (!complete) {
+            std::cout << "File " << argument << " downloading failed (" << broken << ") all the servers failed\n";
+        }
+        else {
+            std::cout << "File " << argument << " downloading failed (" << used << ") checksum mismatch\n";
+        }
+        return;
+    }
+    if (rename(partial.c_str(), filename.c_str()) < 0) {
+        throw std::runtime_error("rename");
+    }
+    state.open_files->erase(partial); /* marks the closing of the file */
+    std::cout << "File " << argument << " downloaded (" << used << ")\n";
+}
+
+/** Writes the whole @ref data, false if the connection broke. */
+bool write_all(int sock, const char *data, std::size_t length) {
+    while (length > 0) {
+        ssize_t written = write(sock, data, length);
+        if (written <= 0) {
+            return false;
+        }
+        data += written;
+        length -= written;
+    }
+    return true;
+}
+
+/** Reads exactly @ref length bytes, false if the connection broke or timed out. */
+bool read_exactly(int sock, char *to, std::size_t length) {
+    while (length > 0) {
+        ssize_t read_len = read(sock, to, length);
+        if (read_len <= 0) {
+            return false;
+        }
+        to += read_len;
+        length -= read_len;
+    }
+    return true;
+}
+
+/**
+ * The session with @ref server, opened (SESSION / SESSION_OK) if there is none yet.
+ * @return nullptr if the server doesn't answer or doesn't know sessions.
+ */
+client_session *open_session(client_state &state, client_options &options, const struct sockaddr_in &server) {
+    auto it = state.sessions.find(discovery_history::key(server));
+    if (it != state.sessions.end()) {
+        return &it->second;
+    }
+
+    int sock;
+    initialize_socket(sock);
+    uint64_t cmd_seq = send_simple_message(sock, server, "SESSION", "", get_cmd_seq());
+    std::vector<message<CMPLX_CMD>> replies;
+    receive_timeouted_messages(sock, options, replies, 1);
+    close(sock);
+    if (replies.empty() || !check_cmd(replies[0].command, "SESSION_OK", replies[0].address) ||
+        !check_cmd_seq(replies[0].command, cmd_seq, replies[0].address)) {
+        return nullptr;
+    }
+
+    client_session session;
+    session.address = server;
+    session.address.sin_port = htons(replies[0].command.param);
+    try {
+        create_tcp_socket(session.socket, session.address);
+    }
+    catch (const std::runtime_error &) {
+        close(session.socket);
+        return nullptr;
+    }
+    set_socket_receive_timeout(session.socket, {options.TIMEOUT, 0});
+    return &(state.sessions[discovery_history::key(server)] = session);
+}
+
+/** Closes a broken session, the next transfer opens a new one. */
+void close_session(client_state &state, const struct sockaddr_in &server) {
+    auto it = state.sessions.find(discovery_history::key(server));
+    if (it != state.sessions.end()) {
+        close(it->second.socket);
+        state.sessions.erase(it);
+    }
+}
+
+/** Reads a reply frame of a session, false if the connection broke. */
+bool read_frame(client_session &session, frame_view &frame, std::string &data) {
+    if (!read_exactly(session.socket, session.header, FRAME_HEADER_LEN)) {
+        return false;
+    }
+    decode_frame_header(session.header, frame);
+    if (frame.data_len > MAX_FRAME_DATA_LEN) {
+        return false;
+    }
+    data.resize(frame.data_len);
+    return read_exactly(session.socket, &data[0], frame.data_len);
+}
+
+/** Writes a session frame, its header and data with one writev (without copying them together). */
+bool write_frame(int sock, std::string_view cmd, uint64_t id, uint64_t param, std::string_view data) {
+    char header[FRAME_HEADER_LEN];
+    encode_frame_header(header, cmd, id, param, (uint32_t) data.size());
+    struct iovec parts[2] = {{header, sizeof header}, {const_cast<char *>(data.data()), data.size()}};
+    for (std::size_t left = sizeof header + data.size(); left > 0;) {
+        ssize_t written = writev(sock, parts, 2);
+        if (written <= 0) {
+            return false;
+        }
+        left -= written;
+        for (struct iovec &part : parts) {
+            std::size_t step = std::min<std::size_t>(part.iov_len, written);
+            part.iov_base = static_cast<char *>(part.iov_base) + step;
+            part.iov_len -= step;
+            written -= step;
+        }
+    }
+    return true;
+}
+
+/**
+ * Receives a file of @ref size bytes from the session into OUT_FLDR/name (through its ".part" file).
+ * @return false if the connection broke (a checksum mismatch is only reported).
+ */
+bool receive_member(client_state &state, client_options &options, client_session &session, const std::string &name,
+                    uint64_t size, const file_checksum &announced) {
+    std::string filename(options.OUT_FLDR + "/" + name);
+    std::string partial = filename + PARTIAL_SUFFIX;
+    int fd = open(partial.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (fd < 0) {
+        throw std::runtime_error("open");
+    }
+    state.open_files->insert(partial); /* marks the opening of the file */
+    file_checksum checksum = announced;
+    char buffer[BSIZE];
+    bool received = true;
+    for (uint64_t remaining = size; received && remaining > 0;) {
+        std::size_t length = std::min<uint64_t>(remaining, BSIZE);
+        received = read_exactly(session.socket, buffer, length) && write_all(fd, buffer, length);
+        checksum.computed = crc32c(checksum.computed, buffer, length);
+        remaining -= length;
+    }
+    close(fd);
+    state.open_files->erase(partial);
+    if (!received) {
+        unlink(partial.c_str());
+        return false;
+    }
+    std::string address = address_string(session.address);
+    if (checksum.mismatch()) {
+        unlink(partial.c_str());
+        std::cout << "File " << name << " downloading failed (" << address << ") checksum mismatch\n";
+    }
+    else if (rename(partial.c_str(), filename.c_str()) < 0) {
+        throw std::runtime_error("rename");
+    }
+    else {
+        std::cout << "File " << name << " downloaded (" << address << ")\n";
+    }
+    return true;
+}
+
+/**
+ * Downloads the files @ref names from @ref server over its session: the names are split into GET_MANYs
+ * that fit into a frame and all of them are sent at once, then every MANIFEST is followed by its files
+ * back to back, each one received through its ".part" file.
+ * @param [out] done Which files were handled (downloaded or refused by the server).
+ * @return false if the session couldn't be opened or broke, the files not done are left to the caller.
+ */
+bool session_fetch(client_state &state, client_options &options, const struct sockaddr_in &server,
+                   const std::vector<std::string> &names, std::vector<bool> &done) {
+    done.assign(names.size(), false);
+    client_session *session = open_session(state, options, server);
+    if (session == nullptr) {
+        return false;
+    }
+    std::string requests;
+    uint64_t first_id = session->next_id;
+    std::vector<std::pair<std::size_t, std::size_t>> batches; /** [first, last) of names */
+    for (std::size_t first = 0; first < names.size();) {
+        std::string manifest;
+        std::size_t last = first;
+        for (; last < names.size() && last - first < MAX_BATCH_FILES; ++last) {
+            std::size_t length = manifest.size() + (last > first ? 1 : 0) + names[last].size();
+            if (names[last].find('\n') != std::string::npos || length > MAX_FRAME_DATA_LEN) {
+                break;
+            }
+            manifest += (last > first ? "\n" : "") + names[last];
+        }
+        if (last == first) {
+            ++first; /* the name doesn't fit into a frame at all, it's left to the caller */
+            continue;
+        }
+        encode_frame(requests, "GET_MANY", session->next_id++, 0, manifest);
+        batches.emplace_back(first, last);
+        first = last;
+    }
+    if (!write_all(session->socket, requests.data(), requests.size())) {
+        close_session(state, server);
+        return false;
+    }
+
+    std::string address = address_string(session->address);
+    for (std::size_t i = 0; i < batches.size(); ++i) {
+        auto [first, last] = batches[i];
+        frame_view frame;
+        std::string manifest;
+        if (!read_frame(*session, frame, manifest) || frame.id != first_id + i ||
+            !command_is(frame.cmd, "MANIFEST") || frame.param != last - first) {
+            close_session(state, server);
+            return false;
+        }
+        for (std::size_t member = first; member < last; ++member) {
+            uint64_t size;
+            uint8_t flags;
+            file_checksum announced;
+            if (!decode_manifest_entry(manifest, member - first, size, announced.expected, flags)) {
+                close_session(state, server);
+                return false;
+            }
+            done[member] = true;
+            if (!(flags & MANIFEST_FOUND)) {
+                std::cout << "File " << names[member] << " downloading failed (" << address << ") server refused\n";
                 continue;
             }
-            else {
-                CMPLX_CMD message(buffer, rcv_len);
-                if (check_cmd(message, "CAN_ADD", server_address) &&
-                    check_cmd_seq(message, cmd_seq, server_address) &&
-                    check_data_empty(message, server_address)) {
-                    file_transfer({server_address, message}, server, argument, uploaded_file);
-                }
+            announced.announced = flags & MANIFEST_CHECKSUMMED;
+            if (!receive_member(state, options, *session, names[member], size, announced)) {
+                done[member] = false;
+                close_session(state, server);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/** Downloads a single file, from many servers at once if it can. */
+void fetch_file(client_state &state, client_options &options, const std::string &argument) {
+    /* every server holding the file, each one once (its list may span many messages) */
+    const message<SIMPL_CMD> *first = nullptr;
+    std::vector<struct sockaddr_in> servers;
+    for (auto &info : state.previous_search) {
+        auto t = tokenize(info);
+        if (std::find(t.begin(), t.end(), argument) == t.end()) {
+            continue;
+        }
+        bool known = std::any_of(servers.begin(), servers.end(), [&info](const struct sockaddr_in &server) {
+            return server.sin_addr.s_addr == info.address.sin_addr.s_addr && server.sin_port == info.address.sin_port;
+        });
+        if (first == nullptr) {
+            first = &info;
+        }
+        if (!known && servers.size() < options.MAX_SOURCES) {
+            servers.push_back(info.address);
+        }
+    }
+
+    if (first == nullptr) {
+        std::cout << "File " << argument << " wasn't found\n";
+        return;
+    }
+    /* a broken download is resumed from the server it came from */
+    bool resumed = fs::exists(options.OUT_FLDR + "/" + argument + PARTIAL_SUFFIX);
+    std::vector<bool> done;
+    if (options.SESSION && !resumed && session_fetch(state, options, first->address, {argument}, done)) {
+        return;
+    }
+    /* the transfer runs in the background */
+    background_tasks.run([task = task_state(state), options, info = *first, servers, argument, resumed]() mutable {
+        if (servers.size() == 1 || resumed) {
+            receive_file(task, options, info, argument);
+        }
+        else {
+            receive_file_parallel(task, options, info, servers, argument);
+        }
+    });
+}
+
+bool has_pattern(const std::string &word) {
+    return word.find_first_of("*?[") != std::string::npos;
+}
+
+/**
+ * Files of the "fetch" command: a file name from the previous search, or many names and patterns
+ * (e.g. "fetch a.txt *.log") separated by spaces, the patterns are matched against the previous search.
+ */
+std::vector<std::string> fetch_names(const client_state &state, const std::string &argument) {
+    std::vector<std::string> known;
+    for (const auto &info : state.previous_search) {
+        for (const std::string &name : tokenize(info)) {
+            known.push_back(name);
+        }
+    }
+    if (std::find(known.begin(), known.end(), argument) != known.end()) {
+        return {argument};
+    }
+    std::vector<std::string> names;
+    boost::char_separator<char> separator(" ");
+    for (const std::string &word : boost::tokenizer<boost::char_separator<char>>(argument, separator)) {
+        if (!has_pattern(word)) {
+            names.push_back(word);
+            continue;
+        }
+        std::size_t matched = names.size();
+        for (const std::string &name : known) {
+            if (fnmatch(word.c_str(), name.c_str(), 0) == 0) {
+                names.push_back(name);
+            }
+        }
+        if (names.size() == matched) {
+            std::cout << "File " << word << " wasn't found\n";
+        }
+    }
+    std::vector<std::string> unique;
+    std::set<std::string> seen;
+    for (std::string &name : names) {
+        if (seen.insert(name).second) {
+            unique.push_back(std::move(name));
+        }
+    }
+    return unique;
+}
+
+/**
+ * Handles the "fetch" command. With the sessions on, many files are downloaded over a single session
+ * with each server, otherwise each one is downloaded in the background on its own.
+ */
+void fetch(client_state &state, client_options &options, const std::string &argument) {
+    std::vector<std::string> names = fetch_names(state, argument);
+    if (names.size() == 1 || !options.SESSION) {
+        for (const std::string &name : names) {
+            fetch_file(state, options, name);
+        }
+        return;
+    }
+
+    /* every file comes from the first server that listed it */
+    std::map<uint64_t, std::pair<struct sockaddr_in, std::vector<std::string>>> batches;
+    std::vector<std::string> rest;
+    for (const std::string &name : names) {
+        auto holder = std::find_if(state.previous_search.begin(), state.previous_search.end(),
+                                   [&name](const message<SIMPL_CMD> &info) {
+                                       auto t = tokenize(info);
+                                       return std::find(t.begin(), t.end(), name) != t.end();
+                                   });
+        if (holder == state.previous_search.end() || fs::exists(options.OUT_FLDR + "/" + name + PARTIAL_SUFFIX)) {
+            rest.push_back(name); /* not found or resumed, reported by fetch_file */
+            continue;
+        }
+        auto &batch = batches[discovery_history::key(holder->address)];
+        batch.first = holder->address;
+        batch.second.push_back(name);
+    }
+    for (auto &[key, batch] : batches) {
+        std::vector<bool> done;
+        session_fetch(state, options, batch.first, batch.second, done);
+        for (std::size_t i = 0; i < batch.second.size(); ++i) {
+            if (!done[i]) {
+                rest.push_back(batch.second[i]);
+            }
+        }
+    }
+    for (const std::string &name : rest) {
+        fetch_file(state, options, name);
+    }
+}
+
+/**
+ * Initializes a TCP connection and sends a file to the server,
+ * then waits (up to TIMEOUT) for the server to close the connection, that is to save the file.
+ * @param [in] offset First byte sent (the server already has the ones before).
+ * @param [in] compress Deflate the file on the way (the whole file only).
+ * @param [out] checksum Checksum of the sent bytes.
+ * @return false if the connection broke.
+ */
+bool file_transfer(client_options &options, const struct sockaddr_in &server_address, fs::path &uploaded_file,
+                   uint64_t offset, bool compress, uint32_t &checksum) {
+    bool success = true;
+    int tcp_socket;
+    char buffer[BSIZE];
+    ssize_t read_len, write_len;
+
+    try {
+        create_tcp_socket(tcp_socket, server_address);
+    }
+    catch (const std::runtime_error &) {
+        return false;
+    }
+
+    read_len = 1;
+    const std::string &filename = uploaded_file.string();
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0 || lseek(fd, offset, SEEK_SET) < 0) {
+        throw std::runtime_error("open");
+    }
+    if (compress) {
+        file_sender sender(fd, 0, fs::file_size(uploaded_file), transfer_mode::copy, true, nullptr, true);
+        try {
+            success = sender.pump(tcp_socket);
+        }
+        catch (const std::runtime_error &) {
+            success = false;
+        }
+        checksum = sender.checksum();
+        read_len = 0;
+    }
+    while (success && read_len > 0) {
+        read_len = read(fd, buffer, BSIZE);
+        if (read_len > 0) {
+            /* transfer bytes between the file descriptor and the socket */
+            if ((write_len = write(tcp_socket, buffer, read_len)) < 0 || write_len != read_len) {
+                success = false;
             }
+            checksum = crc32c(checksum, buffer, read_len);
         }
-        else if (rcv_len > 0 && buffer[0] == 'N') {
-            /* NO_WAY */
+    }
+    if (read_len < 0) {
+        throw std::runtime_error("read");
+    }
+    close(fd);
+
+    if (success && shutdown(tcp_socket, SHUT_WR) == 0) {
+        set_socket_receive_timeout(tcp_socket, {options.TIMEOUT, 0});
+        while (read(tcp_socket, buffer, BSIZE) > 0) {}
+    }
+    close(tcp_socket);
+    return success;
+}
+
+/**
+ * Asks the server for the checksum of the file it saved and compares it with @ref checksum.
+ * @return false only if the server announced a different checksum (an old server doesn't announce any).
+ */
+bool verify_upload(int sock, client_options &options, const struct sockaddr_in &server, const std::string &name,
+                   uint32_t checksum) {
+    uint64_t size;
+    file_checksum saved;
+    saved.computed = checksum;
+    return !stat_file(sock, options, server, name, size, saved) || !saved.mismatch();
+}
+
+/**
+ * Sends a file to a server that accepted it with @ref accepted.
+ * A broken transfer is resumed with ADD_RESUME up to @ref RESUME_ATTEMPTS times.
+ * A file sent at once is checked against the checksum computed by the server, a corrupted one is removed.
+ */
+void upload_to(int sock, client_options &options, const message<CMPLX_CMD> &accepted, const server_info &server,
+               const std::string &argument, fs::path &uploaded_file) {
+    struct sockaddr_in server_address{server.address};
+    server_address.sin_port = htons(accepted.command.param);
+    uint32_t checksum = 0;
+    bool success = file_transfer(options, server_address, uploaded_file, 0, is_compressed(accepted.command.data),
+                                 checksum);
+    bool resumed = false;
+
+    for (unsigned int attempt = 0; !success && attempt < RESUME_ATTEMPTS; ++attempt) {
+        /* gives the server a moment to notice the broken connection and keep the part it received */
+        std::this_thread::sleep_for(chr::seconds(1));
+        uint64_t cmd_seq = send_complex_message(sock, server.address, "ADD_RESUME",
+                                                uploaded_file.filename().string(), get_cmd_seq(),
+                                                file_size(uploaded_file));
+        std::vector<message<CMPLX_CMD>> replies;
+        receive_timeouted_messages(sock, options, replies, 1);
+        if (replies.empty() ||
+            !check_cmd(replies[0].command, "CAN_RESUME", replies[0].address) ||
+            !check_cmd_seq(replies[0].command, cmd_seq, replies[0].address) ||
+            replies[0].command.data.size() != sizeof(uint64_t)) {
+            break;
+        }
+        server_address.sin_port = htons(replies[0].command.param);
+        uint32_t ignored = 0; /* a part of the file doesn't say anything */
+        success = file_transfer(options, server_address, uploaded_file,
+                                read_be64(replies[0].command.data.data()), false, ignored);
+        resumed = true;
+    }
+
+    std::string server_address_string(inet_ntoa(server_address.sin_addr));
+    if (!success) {
+        std::cout << "File " << argument << " uploading failed (" << server_address_string << ":"
+                  << ntohs(server_address.sin_port)
+                  << ") tcp connection error\n";
+    }
+    else if (!resumed && !verify_upload(sock, options, server.address, uploaded_file.filename().string(), checksum)) {
+        send_simple_message(sock, server.address, "DEL", uploaded_file.filename().string(), get_cmd_seq());
+        std::cout << "File " << argument << " uploading failed (" << server_address_string << ":"
+                  << ntohs(server_address.sin_port) << ") checksum mismatch\n";
+    }
+    else {
+        std::cout << "File " << uploaded_file.string() << " uploaded (" << server_address_string << ":"
+                  << ntohs(server_address.sin_port) << ")\n";
+    }
+}
+
+/**
+ * Sends the file to all the @ref servers at once: every block is read once and written to every connection.
+ * A server whose connection breaks is dropped, the others go on. Then waits (up to TIMEOUT)
+ * for every server to close the connection, that is to save the file.
+ * @param [in] servers TCP addresses of the servers.
+ * @param [out] success Which of the servers got the whole file.
+ * @return Checksum of the file.
+ */
+uint32_t replicate_file(client_options &options, const std::vector<struct sockaddr_in> &servers,
+                        fs::path &uploaded_file, std::vector<bool> &success) {
+    std::vector<int> sockets(servers.size(), -1);
+    success.assign(servers.size(), false);
+    for (std::size_t i = 0; i < servers.size(); ++i) {
+        try {
+            create_tcp_socket(sockets[i], servers[i]);
+            success[i] = true;
+        }
+        catch (const std::runtime_error &) {}
+    }
+
+    int fd = open(uploaded_file.string().c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("open");
+    }
+    char buffer[BSIZE];
+    ssize_t read_len;
+    uint32_t checksum = 0;
+    while ((read_len = read(fd, buffer, BSIZE)) > 0) {
+        checksum = crc32c(checksum, buffer, read_len);
+        for (std::size_t i = 0; i < servers.size(); ++i) {
+            if (success[i] && write(sockets[i], buffer, read_len) != read_len) {
+                success[i] = false;
+            }
+        }
+    }
+    if (read_len < 0) {
+        throw std::runtime_error("read");
+    }
+    close(fd);
+
+    for (std::size_t i = 0; i < servers.size(); ++i) {
+        if (success[i] && shutdown(sockets[i], SHUT_WR) == 0) {
+            set_socket_receive_timeout(sockets[i], {options.TIMEOUT, 0});
+            while (read(sockets[i], buffer, BSIZE) > 0) {}
+        }
+        if (sockets[i] >= 0) {
+            close(sockets[i]);
+        }
+    }
+    return checksum;
+}
+
+/** Orders @ref servers for uploading @ref name, the best ones first, by @ref options.PLACEMENT. */
+void place(const client_options &options, server_infos &servers, const std::string &name) {
+    std::function<bool(const server_info &, const server_info &)> better;
+    switch (options.PLACEMENT) {
+        case placement_policy::most_free:
+            better = [](const server_info &lhs, const server_info &rhs) {
+                return lhs.available_space > rhs.available_space;
+            };
+            break;
+        case placement_policy::least_loaded:
+            better = [](const server_info &lhs, const server_info &rhs) {
+                return std::tie(lhs.queue, lhs.rtt) < std::tie(rhs.queue, rhs.rtt);
+            };
+            break;
+        case placement_policy::consistent_hash:
+            /* every client computes the same scores, adding or removing a server moves only its files */
+            better = [name_hash = crc32c(0, name.data(), name.size())](const server_info &lhs,
+                                                                       const server_info &rhs) {
+                auto score = [name_hash](const server_info &server) {
+                    uint64_t key = ((uint64_t) server.address.sin_addr.s_addr << 16) | server.address.sin_port;
+                    return crc32c(name_hash, &key, sizeof key);
+                };
+                return score(lhs) > score(rhs);
+            };
+            break;
+    }
+    std::stable_sort(servers.begin(), servers.end(), better);
+}
+
+/** A server that accepted the upload. */
+struct accepted_upload {
+    const server_info *server;
+    message<CMPLX_CMD> reply; /** CAN_ADD */
+};
+
+/**
+ * Asks @ref candidates to accept the upload at once and waits (up to TIMEOUT) until all of them answer.
+ * The first CAN_ADDs are kept in @ref accepted, up to @ref wanted of them, the later ones are cancelled.
+ */
+void request_uploads(int sock, client_options &options, const std::vector<const server_info *> &candidates,
+                     fs::path &uploaded_file, std::size_t wanted, std::vector<accepted_upload> &accepted) {
+    std::string name = uploaded_file.filename().string();
+    /* a replicated file is read once for all the servers, it isn't deflated for some of them */
+    std::string data = options.COMPRESSION && wanted == 1 && worth_compressing(uploaded_file.string())
+                       ? add_extension(name, "compress", COMPRESSION_NAME) : name;
+    std::map<uint64_t, const server_info *> asked; /** by cmd_seq, until they answer */
+    for (const server_info *server : candidates) {
+        asked[send_complex_message(sock, server->address, "ADD", data, get_cmd_seq(),
+                                   file_size(uploaded_file))] = server;
+    }
+
+    constexpr command_key CAN_ADD = make_command_key("CAN_ADD"), NO_WAY = make_command_key("NO_WAY");
+    receive_batch batch(std::min(candidates.size(), UDP_BATCH));
+    batch_stats stats;
+    chr::system_clock::time_point end_point = chr::system_clock::now() + chr::seconds(options.TIMEOUT);
+    while (!asked.empty() && chr::system_clock::now() < end_point) {
+        std::size_t count = batch.receive_within(sock, end_point - chr::system_clock::now(), stats);
+        for (std::size_t i = 0; i < count; ++i) {
+            const struct sockaddr_in &server_address = batch.address(i);
+            ssize_t rcv_len = batch.length(i);
             if (message_too_short<SIMPL_CMD>(server_address, rcv_len)) {
                 continue;
             }
+            command_key key = load_command_key(batch.data(i));
+            if (key == CAN_ADD) {
+                if (message_too_short<CMPLX_CMD>(server_address, rcv_len)) {
+                    continue;
+                }
+                CMPLX_CMD message(batch.data(i), rcv_len);
+                auto it = asked.find(message.cmd_seq);
+                /* only the extensions may come with a CAN_ADD */
+                if (it == asked.end() || !check_cmd(message, "CAN_ADD", server_address) ||
+                    (!base_data(message.data).empty() && !check_data_empty(message, server_address))) {
+                    continue;
+                }
+                if (accepted.size() < wanted) {
+                    accepted.push_back({it->second, {server_address, message}});
+                }
+                else {
+                    send_simple_message(sock, it->second->address, "CANCEL_ADD", name, message.cmd_seq);
+                }
+                asked.erase(it);
+            }
+            else if (key == NO_WAY) {
+                SIMPL_CMD message(batch.data(i), rcv_len);
+                if (check_cmd(message, "NO_WAY", server_address) &&
+                    check_data_equal(message, server_address, name)) {
+                    asked.erase(message.cmd_seq);
+                }
+            }
             else {
-                SIMPL_CMD message(buffer, rcv_len);
-                check_cmd(message, "NO_WAY", server_address) &&
-                check_cmd_seq(message, cmd_seq, server_address) &&
-                check_data_equal(message, server_address, uploaded_file.filename().string());
+                error_message(server_address, "Invalid cmd.");
             }
         }
+    }
+}
+
+/**
+ * Sends a file to the servers.
+ * The servers are asked in the @ref options.PLACEMENT order, @ref options.UPLOAD_FANOUT at once,
+ * until @ref options.REPLICAS of them accept the file. A single copy is uploaded by @ref upload_to
+ * (with resuming), many copies by @ref replicate_file.
+ * @param [in] options Client options.
+ * @param [in] state Client state.
+ * @param [in] argument Name of the file to send.
+ * @param [in] uploaded_file File to send.
+ */
+void send_file(client_options &options, client_state &state, const std::string &argument, fs::path &uploaded_file) {
+    int sock;
+    initialize_socket(sock);
+    hello(sock, state, options, false);
+    if (state.previous_servers.empty()) {
+        close(sock);
+        std::cout << "File " << argument << " uploading failed (:) no server available\n";
+        return;
+    }
+
+    /* the servers without enough space would refuse anyway */
+    std::string name = uploaded_file.filename().string();
+    uint64_t size = file_size(uploaded_file);
+    place(options, state.previous_servers, name);
+    std::vector<const server_info *> candidates;
+    for (const server_info &server : state.previous_servers) {
+        if (server.available_space >= size) {
+            candidates.push_back(&server);
+        }
+    }
+
+    std::vector<accepted_upload> accepted;
+    for (std::size_t next = 0; next < candidates.size() && accepted.size() < options.REPLICAS;) {
+        std::size_t wanted = options.REPLICAS - accepted.size();
+        std::size_t count = std::min(std::max(options.UPLOAD_FANOUT, wanted), candidates.size() - next);
+        std::vector<const server_info *> round(candidates.begin() + next, candidates.begin() + next + count);
+        request_uploads(sock, options, round, uploaded_file, options.REPLICAS, accepted);
+        next += count;
+    }
+    if (accepted.empty()) {
+        close(sock);
+        std::cout << "File " << argument << " too big\n";
+        return;
+    }
+    if (accepted.size() == 1 && options.REPLICAS == 1) {
+        upload_to(sock, options, accepted[0].reply, *accepted[0].server, argument, uploaded_file);
+        close(sock);
+        return;
+    }
+
+    std::vector<struct sockaddr_in> servers;
+    for (const accepted_upload &upload : accepted) {
+        servers.push_back(upload.server->address);
+        servers.back().sin_port = htons(upload.reply.command.param);
+    }
+    std::vector<bool> success;
+    uint32_t checksum = replicate_file(options, servers, uploaded_file, success);
+    for (std::size_t i = 0; i < servers.size(); ++i) {
+        std::string server_address_string(inet_ntoa(servers[i].sin_addr));
+        if (!success[i]) {
+            std::cout << "File " << argument << " uploading failed (" << server_address_string << ":"
+                      << ntohs(servers[i].sin_port) << ") tcp connection error\n";
+        }
+        else if (!verify_upload(sock, options, accepted[i].server->address, name, checksum)) {
+            send_simple_message(sock, accepted[i].server->address, "DEL", name, get_cmd_seq());
+            std::cout << "File " << argument << " uploading failed (" << server_address_string << ":"
+                      << ntohs(servers[i].sin_port) << ") checksum mismatch\n";
+        }
         else {
-            error_message(server_address, "Invalid cmd.");
+            std::cout << "File " << uploaded_file.string() << " uploaded (" << server_address_string << ":"
+                      << ntohs(servers[i].sin_port) << ")\n";
         }
     }
-    std::cout << "File " << argument << " too big\n";
-    exit(0);
+    if (accepted.size() < options.REPLICAS) {
+        std::cout << "File " << argument << " uploading failed (:) only " << accepted.size() << " of "
+                  << options.REPLICAS << " servers accepted it\n";
+    }
+    close(sock);
 }
 
-/** Handles the "upload" command. */
-void upload(client_state &state, client_options &options, const std::string &argument) {
+/**
+ * Uploads @ref uploaded_file over a session with the first of the servers (in the placement order)
+ * that accepts it, the file is sent right after the ADD frame.
+ * @return false if no session could be used, the upload is left to @ref send_file.
+ */
+bool session_upload(client_state &state, client_options &options, const std::string &argument,
+                    fs::path &uploaded_file) {
+    hello(state.socket, state, options, false);
+    std::string name = uploaded_file.filename().string();
+    uint64_t size = file_size(uploaded_file);
+    place(options, state.previous_servers, name);
+
+    bool refused = false;
+    char buffer[BSIZE];
+    for (const server_info &server : state.previous_servers) {
+        if (server.available_space < size) {
+            continue;
+        }
+        client_session *session = open_session(state, options, server.address);
+        if (session == nullptr) {
+            continue;
+        }
+        uint64_t id = session->next_id++;
+        bool sent = write_frame(session->socket, "ADD", id, size, name);
+
+        int fd = open(uploaded_file.string().c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("open");
+        }
+        uint32_t checksum = 0;
+        ssize_t read_len;
+        for (uint64_t remaining = size; sent && remaining > 0; remaining -= read_len) {
+            read_len = read(fd, buffer, std::min<uint64_t>(remaining, BSIZE));
+            if (read_len <= 0) {
+                throw std::runtime_error("read");
+            }
+            checksum = crc32c(checksum, buffer, read_len);
+            sent = write_all(session->socket, buffer, read_len);
+        }
+        close(fd);
+
+        frame_view frame;
+        std::string data;
+        if (!sent || !read_frame(*session, frame, data) || frame.id != id) {
+            std::cout << "File " << argument << " uploading failed (" << address_string(session->address)
+                      << ") tcp connection error\n";
+            close_session(state, server.address);
+            continue;
+        }
+        if (command_is(frame.cmd, "NO_WAY")) {
+            refused = true;
+            continue;
+        }
+        file_checksum saved;
+        saved.computed = checksum;
+        saved.read_announced(data);
+        if (!command_is(frame.cmd, "ADDED") || saved.mismatch()) {
+            send_simple_message(state.socket, server.address, "DEL", name, get_cmd_seq());
+            std::cout << "File " << argument << " uploading failed (" << address_string(session->address)
+                      << ") checksum mismatch\n";
+            return true;
+        }
+        std::cout << "File " << uploaded_file.string() << " uploaded (" << address_string(session->address) << ")\n";
+        return true;
+    }
+    if (refused) {
+        std::cout << "File " << argument << " too big\n";
+        return true;
+    }
+    return false;
+}
+
+/** Uploads a single file, to REPLICAS servers. */
+void upload_file(client_state &state, client_options &options, const std::string &argument) {
     fs::path uploaded_file(argument);
     if (!fs::exists(uploaded_file)) {
         std::cout << "File " << argument << " does not exist\n";
         return;
     }
+    /* the copies go to many servers at once, each over its own connection */
+    if (options.SESSION && options.REPLICAS == 1 && session_upload(state, options, argument, uploaded_file)) {
+        return;
+    }
 
-    switch (fork()) {
-        case -1:
-            throw std::runtime_error("fork");
-        case 0:
-            send_file(options, state, argument, uploaded_file); /* a child handles the upload */
-            return;
-        default:
-            break;
+    /* the upload runs in the background */
+    background_tasks.run([task = task_state(state), options, argument, uploaded_file]() mutable {
+        send_file(options, task, argument, uploaded_file);
+    });
+}
+
+/** Sends @ref size bytes of the file @ref fd with sendfile, false if the connection broke. */
+bool sendfile_all(int sock, int fd, uint64_t size) {
+    off_t offset = 0;
+    while ((uint64_t) offset < size) {
+        ssize_t sent = sendfile(sock, fd, &offset, std::min<uint64_t>(size - offset, SSIZE_MAX));
+        if (sent <= 0) {
+            return false;
+        }
     }
+    return true;
 }
 
-/** Handles the "remove" command. */
-void remove(client_state &state, const std::string &argument) {
-    send_simple_client_message(state.socket, state, "DEL", argument);
+/**
+ * Uploads the files @ref paths to @ref server over its session: every ADD_MANY (as many files
+ * as fit into its frame) is followed by the files back to back, each one sent with sendfile.
+ * @param [out] done Which files were handled (uploaded or failed the checksum).
+ * @return false if the session couldn't be opened or broke, the files not done are left to the caller.
+ */
+bool session_upload_many(client_state &state, client_options &options, const server_info &server,
+                         const std::vector<std::string> &paths, std::vector<bool> &done) {
+    done.assign(paths.size(), false);
+    client_session *session = open_session(state, options, server.address);
+    if (session == nullptr) {
+        return false;
+    }
+    std::string address = address_string(session->address);
+    for (std::size_t first = 0; first < paths.size();) {
+        std::string entries;
+        std::vector<uint64_t> sizes;
+        std::size_t last = first;
+        for (; last < paths.size() && last - first < MAX_BATCH_FILES; ++last) {
+            std::string name = fs::path(paths[last]).filename().string();
+            uint64_t size = fs::file_size(paths[last]);
+            std::size_t length = entries.size();
+            if (!encode_add_entry(entries, size, name) || entries.size() > MAX_FRAME_DATA_LEN) {
+                entries.resize(length);
+                break;
+            }
+            sizes.push_back(size);
+        }
+        if (last == first) {
+            ++first; /* the name doesn't fit into a frame at all, it's left to the caller */
+            continue;
+        }
+
+        uint64_t id = session->next_id++;
+        bool sent = write_frame(session->socket, "ADD_MANY", id, last - first, entries);
+        std::vector<uint32_t> checksums;
+        for (std::size_t member = first; member < last; ++member) {
+            int fd = open(paths[member].c_str(), O_RDONLY);
+            if (fd < 0) {
+                throw std::runtime_error("open");
+            }
+            checksums.push_back(file_crc32c(fd, sizes[member - first]));
+            sent = sent && sendfile_all(session->socket, fd, sizes[member - first]);
+            close(fd);
+        }
+
+        frame_view frame;
+        std::string saved;
+        if (!sent || !read_frame(*session, frame, saved) || frame.id != id ||
+            !command_is(frame.cmd, "ADDED_MANY") || frame.param != last - first) {
+            close_session(state, server.address);
+            return false;
+        }
+        for (std::size_t member = first; member < last; ++member) {
+            uint64_t size;
+            uint8_t flags;
+            file_checksum checksum;
+            checksum.computed = checksums[member - first];
+            if (!decode_manifest_entry(saved, member - first, size, checksum.expected, flags)) {
+                close_session(state, server.address);
+                return false;
+            }
+            if (!(flags & MANIFEST_FOUND)) {
+                continue; /* refused, another server may take it */
+            }
+            done[member] = true;
+            checksum.announced = flags & MANIFEST_CHECKSUMMED;
+            if (checksum.mismatch()) {
+                send_simple_message(state.socket, server.address, "DEL", fs::path(paths[member]).filename().string(),
+                                    get_cmd_seq());
+                std::cout << "File " << paths[member] << " uploading failed (" << address << ") checksum mismatch\n";
+            }
+            else {
+                std::cout << "File " << paths[member] << " uploaded (" << address << ")\n";
+            }
+        }
+        first = last;
+    }
+    return true;
 }
 
-/** Handles a client command. */
-void handle_client_command(const boost::smatch &match, client_state &state, client_options &options) {
-    std::string command, argument;
-    if (match.size() == 1) {
-        command = match[0];
-        std::transform(command.begin(), command.end(), command.begin(), ::tolower);
-        if (command == "discover") {
-            discover(state, options);
-        }
-        else if (command == "exit") {
-            clean_up(state);
-            exit(0);
+/**
+ * Files of the "upload" command: a path, or many paths and patterns (e.g. "upload a.txt *.log")
+ * separated by spaces, the patterns are expanded with glob.
+ */
+std::vector<std::string> upload_paths(const std::string &argument) {
+    if (fs::exists(argument)) {
+        return {argument};
+    }
+    std::vector<std::string> paths;
+    boost::char_separator<char> separator(" ");
+    for (const std::string &word : boost::tokenizer<boost::char_separator<char>>(argument, separator)) {
+        if (!has_pattern(word)) {
+            paths.push_back(word);
+            continue;
+        }
+        glob_t matches{};
+        if (glob(word.c_str(), 0, nullptr, &matches) == 0) {
+            for (std::size_t i = 0; i < matches.gl_pathc; ++i) {
+                if (fs::is_regular_file(matches.gl_pathv[i])) {
+                    paths.emplace_back(matches.gl_pathv[i]);
+                }
+            }
         }
         else {
-            assert(false);
+            std::cout << "File " << word << " does not exist\n";
         }
+        globfree(&matches);
     }
-    else {
-        command = match[1];
-        argument = match[2];
-        std::transform(command.begin(), command.end(), command.begin(), ::tolower);
-        if (command == "search") {
-            search(state, options, argument);
+    return paths;
+}
+
+/**
+ * Handles the "upload" command. With a single copy of every file and the sessions on, many files go over
+ * a single session with each server: every file goes to the best server (by the placement) with room for it.
+ */
+void upload(client_state &state, client_options &options, const std::string &argument) {
+    std::vector<std::string> paths = upload_paths(argument);
+    if (paths.size() == 1 || options.REPLICAS != 1 || !options.SESSION) {
+        for (const std::string &path : paths) {
+            upload_file(state, options, path);
         }
-        else if (command == "remove") {
-            remove(state, argument);
+        return;
+    }
+
+    hello(state.socket, state, options, false);
+    std::map<uint64_t, uint64_t> space; /** free space left on the servers by the files placed so far */
+    for (const server_info &server : state.previous_servers) {
+        space[discovery_history::key(server.address)] = server.available_space;
+    }
+    std::map<uint64_t, std::vector<std::string>> batches;
+    std::vector<std::string> rest;
+    for (const std::string &path : paths) {
+        if (!fs::is_regular_file(path)) {
+            rest.push_back(path); /* reported by upload_file */
+            continue;
         }
-        else if (command == "fetch") {
-            fetch(state, options, argument);
+        uint64_t size = fs::file_size(path);
+        place(options, state.previous_servers, fs::path(path).filename().string());
+        auto server = std::find_if(state.previous_servers.begin(), state.previous_servers.end(),
+                                   [&space, size](const server_info &server) {
+                                       return space[discovery_history::key(server.address)] >= size;
+                                   });
+        if (server == state.previous_servers.end()) {
+            rest.push_back(path);
+            continue;
         }
-        else if (command == "upload") {
-            upload(state, options, argument);
+        space[discovery_history::key(server->address)] -= size;
+        batches[discovery_history::key(server->address)].push_back(path);
+    }
+    server_infos servers = state.previous_servers;
+    for (auto &[key, batch] : batches) {
+        auto server = std::find_if(servers.begin(), servers.end(), [key = key](const server_info &server) {
+            return discovery_history::key(server.address) == key;
+        });
+        std::vector<bool> done;
+        session_upload_many(state, options, *server, batch, done);
+        for (std::size_t i = 0; i < batch.size(); ++i) {
+            if (!done[i]) {
+                rest.push_back(batch[i]);
+            }
         }
-        else {
-            assert(false);
+    }
+    for (const std::string &path : rest) {
+        upload_file(state, options, path);
+    }
+}
+
+/** Handles the "remove" command. */
+void remove(client_state &state, const std::string &argument) {
+    send_simple_client_message(state.socket, state, "DEL", argument);
+}
+
+/** Commands of the interactive loop. */
+enum class command_kind {
+    discover,
+    search,
+    fetch,
+    upload,
+    remove,
+    exit,
+};
+
+/** What follows the command word. */
+enum class argument_form {
+    none, /** nothing, the whole line is the command word */
+    optional, /** an optional space, then the rest of the line (possibly empty) */
+    required, /** a space, then the rest of the line (not empty) */
+};
+
+struct command_syntax {
+    std::string_view name;
+    command_kind kind;
+    argument_form form;
+};
+
+constexpr command_syntax COMMANDS[] = {
+        {"discover", command_kind::discover, argument_form::none},
+        {"search", command_kind::search, argument_form::optional},
+        {"fetch", command_kind::fetch, argument_form::required},
+        {"upload", command_kind::upload, argument_form::required},
+        {"remove", command_kind::remove, argument_form::required},
+        {"exit", command_kind::exit, argument_form::none},
+};
+
+struct client_command {
+    command_kind kind = command_kind::exit;
+    std::string argument;
+};
+
+/**
+ * Parses a line of the input, the command word is case insensitive.
+ * @return false if the line isn't a command (it's ignored then).
+ */
+bool parse_command(std::string_view line, client_command &command) {
+    for (const command_syntax &syntax : COMMANDS) {
+        if (line.size() < syntax.name.size() ||
+            strncasecmp(line.data(), syntax.name.data(), syntax.name.size()) != 0) {
+            continue;
+        }
+        std::string_view rest = line.substr(syntax.name.size());
+        switch (syntax.form) {
+            case argument_form::none:
+                if (!rest.empty()) {
+                    return false;
+                }
+                break;
+            case argument_form::optional:
+                if (!rest.empty() && rest[0] == ' ') {
+                    rest.remove_prefix(1);
+                }
+                break;
+            case argument_form::required:
+                if (rest.size() < 2 || rest[0] != ' ') {
+                    return false;
+                }
+                rest.remove_prefix(1);
+                break;
+        }
+        command.kind = syntax.kind;
+        command.argument = std::string(rest);
+        return true;
+    }
+    return false;
+}
+
+/** Reads the input lines as they come, without blocking the interactive loop on a partial line. */
+class line_reader {
+public:
+    explicit line_reader(int fd) : fd(fd) {}
+
+    /** Reads what's waiting, the descriptor has to be readable. */
+    void fill() {
+        char buffer[1 << 16];
+        ssize_t read_len = read(fd, buffer, sizeof buffer);
+        if (read_len < 0) {
+            if (errno == EINTR || errno == EAGAIN) {
+                return;
+            }
+            throw std::runtime_error("read");
+        }
+        if (read_len == 0) {
+            closed = true;
+        }
+        pending.append(buffer, read_len);
+    }
+
+    /** Takes the next whole line, the last one may end without '\n'. */
+    bool next(std::string &line) {
+        std::size_t end = pending.find('\n', start);
+        if (end == std::string::npos) {
+            if (!closed || start == pending.size()) {
+                pending.erase(0, start); /* the partial line waits for the rest */
+                start = 0;
+                return false;
+            }
+            end = pending.size();
         }
+        line.assign(pending, start, end - start);
+        start = std::min(end + 1, pending.size());
+        return true;
     }
+
+    /** The input ended and all the lines were taken. */
+    bool finished() const { return closed && start == pending.size(); }
+
+private:
+    int fd;
+    std::string pending;
+    std::size_t start = 0; /** of the first line not taken yet */
+    bool closed = false;
+};
+
+/** Checks if the command can go while the discover and search requests wait for their replies. */
+bool pipelined(const client_options &options, const client_command &command) {
+    return command.kind == command_kind::discover ||
+           (command.kind == command_kind::search && !options.PAGED_SEARCH);
 }
 
+/** Handles a client command. */
+void run_command(client_state &state, client_options &options, pending_requests &pending,
+                 const client_command &command) {
+    switch (command.kind) {
+        case command_kind::discover:
+            discover(state, options, pending);
+            break;
+        case command_kind::search:
+            search(state, options, pending, command.argument);
+            break;
+        case command_kind::fetch:
+            fetch(state, options, command.argument);
+            break;
+        case command_kind::upload:
+            upload(state, options, command.argument);
+            break;
+        case command_kind::remove:
+            remove(state, command.argument);
+            break;
+        case command_kind::exit:
+            background_tasks.wait(); /* the transfers are finished first */
+            clean_up(state);
+            exit(0);
+    }
+}
+
+/**
+ * The interactive loop. The commands are read as they come: the discover and search requests are sent
+ * at once and their replies collected together, told apart by the cmd_seq; the transfers run in the background.
+ * Any other command depends on the results of the previous ones, so it waits until the requests are over.
+ * The end of the input is an "exit".
+ */
 void client_loop(client_state &state, client_options &options) {
-    static const boost::regex discover_r("discover",
-                                         boost::regex_constants::ECMAScript | boost::regex_constants::icase);
-    static const boost::regex search_r("(search) ?(.*)",
-                                       boost::regex_constants::ECMAScript | boost::regex_constants::icase);
-    static const boost::regex fetch_r("(fetch) (.+)",
-                                      boost::regex_constants::ECMAScript | boost::regex_constants::icase);
-    static const boost::regex upload_r("(upload) (.+)",
-                                       boost::regex_constants::ECMAScript | boost::regex_constants::icase);
-    static const boost::regex remove_r("(remove) (.+)",
-                                       boost::regex_constants::ECMAScript | boost::regex_constants::icase);
-    static const boost::regex exit_r("exit", boost::regex_constants::ECMAScript | boost::regex_constants::icase);
-    static const boost::regex expressions[] = {discover_r, search_r, fetch_r,
-                                               upload_r, remove_r, exit_r};
+    line_reader input(STDIN_FILENO);
+    pending_requests pending;
+    receive_batch batch(UDP_BATCH);
+    batch_stats stats;
+    client_command command;
+    std::string line;
+    bool waiting = false; /* the command read last waits for the requests */
 
     for (;;) {
-        std::string line;
-        std::getline(std::cin, line);
-        boost::smatch match;
-
-        for (const boost::regex &r : expressions) {
-            if (boost::regex_match(line, match, r)) {
-                /* client command matches a pattern */
-                handle_client_command(match, state, options);
+        while (waiting || input.next(line)) {
+            if (!waiting && !parse_command(line, command)) {
+                continue;
+            }
+            waiting = !pending.requests.empty() && !pipelined(options, command);
+            if (waiting) {
                 break;
             }
+            run_command(state, options, pending, command);
+        }
+        if (input.finished() && pending.requests.empty()) {
+            command.kind = command_kind::exit;
+            run_command(state, options, pending, command);
+        }
+
+        int timeout = -1;
+        if (!pending.requests.empty()) {
+            chr::system_clock::time_point deadline = chr::system_clock::time_point::max();
+            for (const auto &request : pending.requests) {
+                deadline = std::min(deadline, request.second.window.deadline(state.history));
+            }
+            timeout = (int) std::max<chr::milliseconds::rep>(
+                    0, chr::ceil<chr::milliseconds>(deadline - chr::system_clock::now()).count());
+        }
+        struct pollfd ready[2] = {{waiting || input.finished() ? -1 : STDIN_FILENO, POLLIN, 0},
+                                  {pending.requests.empty() ? -1 : state.socket, POLLIN, 0}};
+        if (poll(ready, 2, timeout) < 0 && errno != EINTR) {
+            throw std::runtime_error("poll");
         }
-        /* if no pattern was matched, the command is ignored */
+        if (ready[0].revents) {
+            input.fill();
+        }
+        std::size_t count = 0;
+        if (ready[1].revents & POLLIN) {
+            count = batch.receive_within(state.socket, chr::nanoseconds::zero(), stats);
+        }
+        serve_pending(state, pending, batch, count);
     }
 }
 
@@ -643,13 +2543,13 @@ void add_signal_handlers() {
     /* handle CTRL+C */
     sigaction(SIGINT, &signal_handler, nullptr);
 
-    struct sigaction sigchld_handler{};
-    sigchld_handler.sa_handler = SIG_IGN;
-    sigemptyset(&sigchld_handler.sa_mask);
-    sigchld_handler.sa_flags = 0;
+    struct sigaction sigpipe_handler{};
+    sigpipe_handler.sa_handler = SIG_IGN;
+    sigemptyset(&sigpipe_handler.sa_mask);
+    sigpipe_handler.sa_flags = 0;
 
-    /* handle an exit of a child */
-    if (sigaction(SIGCHLD, &sigchld_handler, nullptr)) {
+    /* a broken upload is reported by write, not by a signal */
+    if (sigaction(SIGPIPE, &sigpipe_handler, nullptr)) {
         throw std::runtime_error("sigaction");
     }
 }
@@ -663,11 +2563,7 @@ int main(int argc, char const *argv[]) {
         clean_up(current_client_state);
     }
     catch (const std::exception &e) {
-        std::cerr << "error: " << e.what();
-        if (errno != 0) {
-            std::cerr << ": " << strerror(errno);
-        }
-        std::cerr << "\n";
+        print_error(e);
     }
 }
 
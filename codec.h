@@ -0,0 +1,488 @@
+#ifndef NETSTORE_CODEC_H
+#define NETSTORE_CODEC_H
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <endian.h>
+#include <sys/types.h>
+
+#define CMD_LEN 10 /** max length of a command */
+#define BSIZE 65507 /** UDP max data size */
+#define MIN_SIMPL_LEN (CMD_LEN + sizeof(uint64_t)) /** min length of @ref SIMPL_CMD */
+#define MIN_CMPLX_LEN (CMD_LEN + 2 * sizeof(uint64_t)) /** min length of @ref CMPLX_CMD */
+#define MAX_SIMPL_DATA_LEN (BSIZE - MIN_SIMPL_LEN) /** max length of data in @ref SIMPL_CMD */
+#define MAX_CMPLX_DATA_LEN (BSIZE - MIN_CMPLX_LEN) /** max length of data in @ref CMPLX_CMD */
+#define FRAME_HEADER_LEN (CMD_LEN + 2 * sizeof(uint64_t) + sizeof(uint32_t)) /** session frame without data */
+#define MAX_FRAME_DATA_LEN 4096 /** max length of data in a session frame */
+#define MAX_BATCH_FILES 256 /** max number of files in a single GET_MANY / ADD_MANY */
+#define MANIFEST_ENTRY_LEN (sizeof(uint64_t) + sizeof(uint32_t) + 1) /** size | checksum | flags */
+#define MANIFEST_FOUND 1 /** flag: the file is there / was saved */
+#define MANIFEST_CHECKSUMMED 2 /** flag: the checksum is known */
+
+/**
+ * Wire format of the UDP messages, without any allocations:
+ * the decoded messages are views into the receive buffer, the encoded ones
+ * are written straight into a buffer provided by the caller.
+ *
+ * SIMPL_CMD: cmd[CMD_LEN] | cmd_seq (be64) | data
+ * CMPLX_CMD: cmd[CMD_LEN] | cmd_seq (be64) | param (be64) | data
+ *
+ * Partial downloads: STAT (SIMPL_CMD, data = file name) is answered with FILE_SIZE
+ * (CMPLX_CMD, param = size, data = file name); GET_RANGE is a CMPLX_CMD with param = offset
+ * and data = length (be64) | file name, answered with CONNECT_ME like GET.
+ *
+ * Resumed uploads: ADD_RESUME is like ADD, answered with NO_WAY or CAN_RESUME
+ * (CMPLX_CMD, param = port, data = offset (be64) - bytes the server already has).
+ * CANCEL_ADD (SIMPL_CMD, cmd_seq of the ADD / ADD_RESUME, data = file name) releases a reservation
+ * the client won't use, it isn't answered.
+ *
+ * Data extensions: optional "key=value" fields appended to the data, each after a '\0'.
+ * The peers that don't know them take them as a part of the data (the baseline client prints GOOD_DAY's
+ * data as it is, a baseline server looks for a file named with all of GET's data), so a reply to a request
+ * of the baseline protocol carries an extension only if the request asked for it with the same key
+ * (see @ref ask_extension, or with the value it wants, like "compress=deflate"). The replies to the requests
+ * the baseline peers never send (STAT, GET_RANGE, LIST_PAGE, the session frames) carry them unasked.
+ * CONNECT_ME of GET (if asked) and of GET_RANGE up to the end of the file, and FILE_SIZE carry
+ * "crc32c=<8 hex digits>" (of the whole file) once the server knows the checksum of the file. GOOD_DAY (if asked) carries "queue=<n>", the transfers waiting for their turn.
+ *
+ * Sessions: SESSION (SIMPL_CMD, no data) is answered with SESSION_OK (CMPLX_CMD, param = port).
+ * The client keeps a TCP connection to that port open for many transfers and sends frames on it
+ * without waiting for the replies, the replies come in the order of the requests:
+ * frame: cmd[CMD_LEN] | id (be64) | param (be64) | data length (be32) | data
+ * GET (data = file name) is answered with FILE (param = size, data = name + extensions) followed by the file;
+ * ADD (param = size, data = file name) is followed by the file and answered with ADDED
+ * (param = size, data = name + extensions); a refused request is answered with NO_WAY (data = file name).
+ * Batches: GET_MANY (data = file names separated by '\n') is answered with MANIFEST (param = number of files,
+ * data = an entry for every file, in order) followed by the files that were found, back to back.
+ * ADD_MANY (param = number of files, data = size (be64) | name length (be16) | name for every file)
+ * is followed by all the files back to back and answered with ADDED_MANY (data = an entry for every file).
+ * manifest entry: size (be64) | checksum (be32) | flags (u8, MANIFEST_FOUND | MANIFEST_CHECKSUMMED)
+ *
+ * Paged search: LIST_PAGE (CMPLX_CMD, param = max number of names, 0 - as many as fit, data = query, with
+ * the "after=<name>" extension for the pages after the first one) is answered with MY_PAGE (CMPLX_CMD,
+ * param = number of all the matching files, data = the matching names sorted, the ones after the cursor,
+ * front coded). A server without any matching file doesn't answer the first page.
+ * page entry: length of the prefix shared with the previous name (varint) | length of the rest (varint) | the rest
+ * (the first name of a page shares nothing, varints are LEB128)
+ *
+ * Metrics: STATS (SIMPL_CMD, no data) is answered with MY_STATS (SIMPL_CMD, data = the server's metrics
+ * in the Prometheus text format), split between many replies at the line ends if it doesn't fit in one
+ * (a line longer than a reply is cut).
+ */
+
+/** Reads a big endian uint64_t from an unaligned buffer. */
+inline uint64_t read_be64(const char *from) {
+    uint64_t value;
+    memcpy(&value, from, sizeof value);
+    return be64toh(value);
+}
+
+/** Writes a big endian uint64_t into an unaligned buffer. */
+inline void write_be64(char *to, uint64_t value) {
+    value = htobe64(value);
+    memcpy(to, &value, sizeof value);
+}
+
+/** A SIMPL_CMD viewed in place, valid as long as the buffer it was decoded from. */
+struct simpl_view {
+    std::string_view cmd; /** all the CMD_LEN bytes, padded with '\0' */
+    uint64_t cmd_seq = 0;
+    std::string_view data;
+};
+
+/** A CMPLX_CMD viewed in place, valid as long as the buffer it was decoded from. */
+struct cmplx_view {
+    std::string_view cmd; /** all the CMD_LEN bytes, padded with '\0' */
+    uint64_t cmd_seq = 0;
+    uint64_t param = 0;
+    std::string_view data;
+};
+
+struct SIMPL_CMD;
+struct CMPLX_CMD;
+
+/** Layout of a message type, specialized for every type. */
+template<typename T>
+struct message_layout;
+
+template<>
+struct message_layout<simpl_view> {
+    static constexpr std::size_t header_len = MIN_SIMPL_LEN;
+    static constexpr bool has_param = false;
+};
+
+template<>
+struct message_layout<cmplx_view> {
+    static constexpr std::size_t header_len = MIN_CMPLX_LEN;
+    static constexpr bool has_param = true;
+};
+
+template<>
+struct message_layout<SIMPL_CMD> : message_layout<simpl_view> {};
+
+template<>
+struct message_layout<CMPLX_CMD> : message_layout<cmplx_view> {};
+
+/**
+ * Decodes a message without copying.
+ * @return false if @ref length is too short for the message type.
+ */
+inline bool decode(const char *buffer, std::size_t length, simpl_view &view) {
+    if (length < MIN_SIMPL_LEN) {
+        return false;
+    }
+    view.cmd = {buffer, CMD_LEN};
+    view.cmd_seq = read_be64(buffer + CMD_LEN);
+    view.data = {buffer + MIN_SIMPL_LEN, length - MIN_SIMPL_LEN};
+    return true;
+}
+
+/** See @ref decode(const char *, std::size_t, simpl_view &). */
+inline bool decode(const char *buffer, std::size_t length, cmplx_view &view) {
+    if (length < MIN_CMPLX_LEN) {
+        return false;
+    }
+    view.cmd = {buffer, CMD_LEN};
+    view.cmd_seq = read_be64(buffer + CMD_LEN);
+    view.param = read_be64(buffer + CMD_LEN + sizeof(uint64_t));
+    view.data = {buffer + MIN_CMPLX_LEN, length - MIN_CMPLX_LEN};
+    return true;
+}
+
+/**
+ * Writes the header of a message (everything but the data).
+ * @param [out] to Buffer of at least @ref message_layout<T>::header_len bytes.
+ * @return Length of the header.
+ */
+inline std::size_t encode_header(char *to, std::string_view cmd, uint64_t cmd_seq) {
+    memset(to, 0, CMD_LEN);
+    memcpy(to, cmd.data(), cmd.size() < CMD_LEN ? cmd.size() : CMD_LEN);
+    write_be64(to + CMD_LEN, cmd_seq);
+    return MIN_SIMPL_LEN;
+}
+
+/** See @ref encode_header(char *, std::string_view, uint64_t). */
+inline std::size_t encode_header(char *to, std::string_view cmd, uint64_t cmd_seq, uint64_t param) {
+    encode_header(to, cmd, cmd_seq);
+    write_be64(to + MIN_SIMPL_LEN, param);
+    return MIN_CMPLX_LEN;
+}
+
+/**
+ * Writes a whole SIMPL_CMD into @ref to.
+ * @return Length of the message, 0 if it doesn't fit in @ref capacity bytes.
+ */
+inline std::size_t encode_simpl(char *to, std::size_t capacity, std::string_view cmd, uint64_t cmd_seq,
+                                std::string_view data) {
+    if (capacity < MIN_SIMPL_LEN + data.size()) {
+        return 0;
+    }
+    std::size_t len = encode_header(to, cmd, cmd_seq);
+    memcpy(to + len, data.data(), data.size());
+    return len + data.size();
+}
+
+/** See @ref encode_simpl. */
+inline std::size_t encode_cmplx(char *to, std::size_t capacity, std::string_view cmd, uint64_t cmd_seq,
+                                uint64_t param, std::string_view data) {
+    if (capacity < MIN_CMPLX_LEN + data.size()) {
+        return 0;
+    }
+    std::size_t len = encode_header(to, cmd, cmd_seq, param);
+    memcpy(to + len, data.data(), data.size());
+    return len + data.size();
+}
+
+/** Header of a session frame, viewed in place. */
+struct frame_view {
+    std::string_view cmd; /** all the CMD_LEN bytes, padded with '\0' */
+    uint64_t id = 0;
+    uint64_t param = 0;
+    uint32_t data_len = 0;
+};
+
+/** Decodes the first @ref FRAME_HEADER_LEN bytes of a session frame. */
+inline void decode_frame_header(const char *buffer, frame_view &frame) {
+    frame.cmd = {buffer, CMD_LEN};
+    frame.id = read_be64(buffer + CMD_LEN);
+    frame.param = read_be64(buffer + CMD_LEN + sizeof(uint64_t));
+    uint32_t data_len;
+    memcpy(&data_len, buffer + CMD_LEN + 2 * sizeof(uint64_t), sizeof data_len);
+    frame.data_len = be32toh(data_len);
+}
+
+/** Writes the @ref FRAME_HEADER_LEN bytes of a session frame header, so the data can be sent from elsewhere. */
+inline void encode_frame_header(char *to, std::string_view cmd, uint64_t id, uint64_t param, uint32_t data_len) {
+    encode_header(to, cmd, id, param);
+    data_len = htobe32(data_len);
+    memcpy(to + MIN_CMPLX_LEN, &data_len, sizeof data_len);
+}
+
+/** Appends a whole session frame to @ref to. */
+inline void encode_frame(std::string &to, std::string_view cmd, uint64_t id, uint64_t param,
+                         std::string_view data) {
+    std::size_t begin = to.size();
+    to.resize(begin + FRAME_HEADER_LEN);
+    encode_frame_header(&to[begin], cmd, id, param, (uint32_t) data.size());
+    to += data;
+}
+
+/** Appends an entry of a MANIFEST / ADDED_MANY to @ref to. */
+inline void encode_manifest_entry(std::string &to, uint64_t size, uint32_t checksum, uint8_t flags) {
+    std::size_t begin = to.size();
+    to.resize(begin + MANIFEST_ENTRY_LEN);
+    write_be64(&to[begin], size);
+    uint32_t checksum_be = htobe32(checksum);
+    memcpy(&to[begin + sizeof(uint64_t)], &checksum_be, sizeof checksum_be);
+    to[begin + sizeof(uint64_t) + sizeof(uint32_t)] = (char) flags;
+}
+
+/** Reads the entry @ref i of a MANIFEST / ADDED_MANY, false if the data is too short. */
+inline bool decode_manifest_entry(std::string_view data, std::size_t i, uint64_t &size, uint32_t &checksum,
+                                  uint8_t &flags) {
+    if (data.size() < (i + 1) * MANIFEST_ENTRY_LEN) {
+        return false;
+    }
+    const char *entry = data.data() + i * MANIFEST_ENTRY_LEN;
+    size = read_be64(entry);
+    memcpy(&checksum, entry + sizeof(uint64_t), sizeof checksum);
+    checksum = be32toh(checksum);
+    flags = (uint8_t) entry[sizeof(uint64_t) + sizeof(uint32_t)];
+    return true;
+}
+
+/** Appends a file of an ADD_MANY to @ref to, false if its name is too long. */
+inline bool encode_add_entry(std::string &to, uint64_t size, std::string_view name) {
+    if (name.size() > UINT16_MAX) {
+        return false;
+    }
+    std::size_t begin = to.size();
+    to.resize(begin + sizeof(uint64_t) + sizeof(uint16_t));
+    write_be64(&to[begin], size);
+    uint16_t length = htobe16((uint16_t) name.size());
+    memcpy(&to[begin + sizeof(uint64_t)], &length, sizeof length);
+    to += name;
+    return true;
+}
+
+/**
+ * Reads the next file of an ADD_MANY from @ref data (and skips it).
+ * @return false if the data is too short.
+ */
+inline bool decode_add_entry(std::string_view &data, uint64_t &size, std::string_view &name) {
+    if (data.size() < sizeof(uint64_t) + sizeof(uint16_t)) {
+        return false;
+    }
+    size = read_be64(data.data());
+    uint16_t length;
+    memcpy(&length, data.data() + sizeof(uint64_t), sizeof length);
+    length = be16toh(length);
+    data.remove_prefix(sizeof(uint64_t) + sizeof(uint16_t));
+    if (data.size() < length) {
+        return false;
+    }
+    name = data.substr(0, length);
+    data.remove_prefix(length);
+    return true;
+}
+
+/**
+ * The CMD_LEN bytes of a command (padded with '\0') packed into two integers in their memory order,
+ * so a received command is told apart with two integer compares instead of a string compare.
+ */
+struct command_key {
+    uint64_t head; /** bytes 0-7 */
+    uint16_t tail; /** bytes 8-9 */
+
+    constexpr bool operator==(const command_key &other) const {
+        return head == other.head && tail == other.tail;
+    }
+
+    constexpr bool operator!=(const command_key &other) const {
+        return !(*this == other);
+    }
+};
+
+/** Key of @ref command (at most CMD_LEN bytes), computed at compile time for the literals. */
+constexpr command_key make_command_key(std::string_view command) {
+    uint64_t head = 0;
+    uint16_t tail = 0;
+    for (std::size_t i = 0; i < command.size() && i < CMD_LEN; ++i) {
+        uint64_t byte = (unsigned char) command[i];
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        std::size_t shift = 8 * (i < 8 ? i : i - 8);
+#else
+        std::size_t shift = 8 * (i < 8 ? 7 - i : 9 - i);
+#endif
+        if (i < 8) {
+            head |= byte << shift;
+        }
+        else {
+            tail |= (uint16_t) (byte << shift);
+        }
+    }
+    return {head, tail};
+}
+
+/** Key of the CMD_LEN bytes at @ref cmd, as they came in a message. */
+inline command_key load_command_key(const char *cmd) {
+    command_key key{};
+    memcpy(&key.head, cmd, sizeof key.head);
+    memcpy(&key.tail, cmd + sizeof key.head, sizeof key.tail);
+    return key;
+}
+
+/** Key of a command field: all the CMD_LEN bytes of a decoded message or a shorter, unpadded command. */
+inline command_key load_command_key(std::string_view field) {
+    return field.size() >= CMD_LEN ? load_command_key(field.data()) : make_command_key(field);
+}
+
+/** Checks if the CMD_LEN bytes of @ref field hold exactly @ref command (padded with '\0'). */
+inline bool command_is(std::string_view field, std::string_view command) {
+    return command.size() <= CMD_LEN && field.size() <= CMD_LEN &&
+           load_command_key(field) == make_command_key(command);
+}
+
+/** Appends @ref value as a LEB128 varint. */
+inline void write_varint(std::string &to, uint64_t value) {
+    while (value >= 0x80) {
+        to += (char) ((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    to += (char) value;
+}
+
+/** Length of @ref value written by @ref write_varint. */
+inline std::size_t varint_len(uint64_t value) {
+    std::size_t length = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        ++length;
+    }
+    return length;
+}
+
+/**
+ * Reads a varint written by @ref write_varint from the front of @ref from.
+ * @return false if it's cut off or too long.
+ */
+inline bool read_varint(std::string_view &from, uint64_t &value) {
+    value = 0;
+    for (std::size_t i = 0; i < from.size() && i < 10; ++i) {
+        value |= (uint64_t) (from[i] & 0x7f) << (7 * i);
+        if (!(from[i] & 0x80)) {
+            from.remove_prefix(i + 1);
+            return true;
+        }
+    }
+    return false;
+}
+
+/** Length of the common prefix of @ref a and @ref b. */
+inline std::size_t shared_prefix(std::string_view a, std::string_view b) {
+    std::size_t length = 0;
+    while (length < a.size() && length < b.size() && a[length] == b[length]) {
+        ++length;
+    }
+    return length;
+}
+
+/** Bytes @ref encode_page_entry appends for @ref name. */
+inline std::size_t page_entry_len(std::string_view previous, std::string_view name) {
+    std::size_t shared = shared_prefix(previous, name);
+    return varint_len(shared) + varint_len(name.size() - shared) + name.size() - shared;
+}
+
+/** Appends @ref name to a MY_PAGE payload, front coded against @ref previous (empty for the first one). */
+inline void encode_page_entry(std::string &page, std::string_view previous, std::string_view name) {
+    std::size_t shared = shared_prefix(previous, name);
+    write_varint(page, shared);
+    write_varint(page, name.size() - shared);
+    page.append(name.substr(shared));
+}
+
+/**
+ * Reads the next name of a MY_PAGE payload from the front of @ref page.
+ * @param [in/out] name The previous name (empty before the first one), replaced by the next one.
+ * @return false if the entry is corrupted.
+ */
+inline bool decode_page_entry(std::string_view &page, std::string &name) {
+    uint64_t shared, rest;
+    if (!read_varint(page, shared) || !read_varint(page, rest) || shared > name.size() || rest > page.size()) {
+        return false;
+    }
+    name.resize(shared);
+    name.append(page.substr(0, rest));
+    page.remove_prefix(rest);
+    return true;
+}
+
+/** Data of a GET_RANGE request. */
+inline std::string encode_range_data(uint64_t length, std::string_view name) {
+    std::string data(sizeof(uint64_t), '\0');
+    write_be64(&data[0], length);
+    data += name;
+    return data;
+}
+
+/**
+ * Reads the data of a GET_RANGE request.
+ * @return false if the data is too short.
+ */
+inline bool decode_range_data(std::string_view data, uint64_t &length, std::string_view &name) {
+    if (data.size() <= sizeof(uint64_t)) {
+        return false;
+    }
+    length = read_be64(data.data());
+    name = data.substr(sizeof(uint64_t));
+    return true;
+}
+
+/** The data without its extensions. */
+inline std::string_view base_data(std::string_view data) {
+    return data.substr(0, data.find('\0'));
+}
+
+/** Appends the extension @ref key = @ref value to @ref data. */
+inline std::string add_extension(std::string_view data, std::string_view key, std::string_view value) {
+    std::string extended(data);
+    extended += '\0';
+    extended += key;
+    extended += '=';
+    extended += value;
+    return extended;
+}
+
+/**
+ * Looks for the extension @ref key in @ref data.
+ * @return false if there is no such extension.
+ */
+inline bool find_extension(std::string_view data, std::string_view key, std::string_view &value) {
+    std::size_t begin = data.find('\0');
+    while (begin != std::string_view::npos) {
+        std::string_view field = data.substr(begin + 1);
+        std::size_t end = field.find('\0');
+        field = field.substr(0, end);
+        if (field.size() > key.size() && field.substr(0, key.size()) == key && field[key.size()] == '=') {
+            value = field.substr(key.size() + 1);
+            return true;
+        }
+        begin = end == std::string_view::npos ? end : begin + 1 + end;
+    }
+    return false;
+}
+
+/** Appends to the request's @ref data that its reply may carry the extension @ref key. */
+inline std::string ask_extension(std::string_view data, std::string_view key) {
+    return add_extension(data, key, "1");
+}
+
+/** Checks if the request's @ref data asks for the extension @ref key in the reply. */
+inline bool asks_extension(std::string_view data, std::string_view key) {
+    std::string_view value;
+    return find_extension(data, key, value);
+}
+
+#endif //NETSTORE_CODEC_H
@@ -1,151 +1,63 @@
-#include "connection.h"
-
-void serialize_string(char *to, const std::string &from, std::size_t &i, std::size_t n) {
-    for (std::size_t j = 0; j < n; ++i, ++j) {
-        to[i] = from[j];
-    }
-}
-
-void serialize_uint64(char *to, uint64_t from, std::size_t &i) {
-    uint64_t from_be = htobe64(from);
-    char *from_ptr = (char *) &from_be;
-    for (std::size_t j = 0; j < sizeof from; ++i, ++j) {
-        to[i] = from_ptr[j];
-    }
-}
-
-void deserialize_string(std::string &to, const char *from, std::size_t &i, std::size_t n) {
-    for (std::size_t j = 0; j < n; ++i, ++j) {
-        to.push_back(from[i]);
-    }
-}
+#include <sys/uio.h>
 
-void deserialize_uint64(uint64_t &to, const char *from, std::size_t &i) {
-    uint64_t to_be;
-    char *to_be_ptr = (char *) &to_be;
-    for (std::size_t j = 0; j < sizeof to; ++i, ++j) {
-        to_be_ptr[j] = from[i];
-    }
-    to = be64toh(to_be);
-}
+#include "connection.h"
 
 SIMPL_CMD::SIMPL_CMD(std::string _cmd, uint64_t _cmd_seq, std::string _data)
         : cmd(std::move(_cmd)), cmd_seq(_cmd_seq), data(std::move(_data)) {
-    if (_cmd.length() > CMD_LEN) {
+    if (cmd.length() > CMD_LEN) {
         throw std::invalid_argument("wrong command");
     }
-    serialize();
 }
 
 SIMPL_CMD::SIMPL_CMD(const char *input, ssize_t length) {
-    if (length < (ssize_t) MIN_SIMPL_LEN) {
+    simpl_view view;
+    if (length < 0 || !decode(input, length, view)) {
         throw std::runtime_error("wrong message format");
     }
-    serialized = new char[length];
-    memcpy(serialized, input, length);
-    serialized_length = length;
-
-    deserialize();
-}
-
-SIMPL_CMD::SIMPL_CMD(SIMPL_CMD &other) {
-    serialized_length = other.serialized_length;
-    serialized = new char[other.serialized_length];
-    memcpy(serialized, other.serialized, serialized_length);
-    deserialize();
-}
-
-SIMPL_CMD::SIMPL_CMD(SIMPL_CMD &&other) noexcept {
-    serialized_length = other.serialized_length;
-    serialized = other.serialized;
-    other.serialized = nullptr;
-    deserialize();
-}
-
-
-SIMPL_CMD::~SIMPL_CMD() {
-    delete[] serialized;
-}
-
-void SIMPL_CMD::deserialize() {
-    std::size_t i = 0;
-
-    deserialize_string(cmd, serialized, i, CMD_LEN);
-    i = CMD_LEN;
-    deserialize_uint64(cmd_seq, serialized, i);
-    deserialize_string(data, serialized, i, serialized_length - i);
+    *this = SIMPL_CMD(view);
 }
 
-void SIMPL_CMD::serialize() {
-    serialized_length = CMD_LEN + sizeof cmd_seq + data.length();
-    serialized = new char[serialized_length];
-    memset(serialized, 0, serialized_length);
+SIMPL_CMD::SIMPL_CMD(const simpl_view &view) : cmd(view.cmd), cmd_seq(view.cmd_seq), data(view.data) {}
 
-    std::size_t i = 0;
-    serialize_string(serialized, cmd, i, cmd.length());
-    i = CMD_LEN;
-    serialize_uint64(serialized, cmd_seq, i);
-    serialize_string(serialized, data, i, data.length());
+std::size_t SIMPL_CMD::serialize(char *to) const {
+    return encode_simpl(to, serialized_length(), cmd, cmd_seq, data);
 }
 
 CMPLX_CMD::CMPLX_CMD(std::string _cmd, uint64_t _cmd_seq, uint64_t _param, std::string _data)
         : cmd(std::move(_cmd)), cmd_seq(_cmd_seq), param(_param), data(std::move(_data)) {
-    if (_cmd.length() > CMD_LEN) {
+    if (cmd.length() > CMD_LEN) {
         throw std::invalid_argument("wrong command");
     }
-    serialize();
 }
 
 CMPLX_CMD::CMPLX_CMD(const char *input, ssize_t length) {
-    if (length < (ssize_t) MIN_CMPLX_LEN) {
+    cmplx_view view;
+    if (length < 0 || !decode(input, length, view)) {
         throw std::runtime_error("wrong message format");
     }
-    serialized = new char[length];
-    memcpy(serialized, input, length);
-    serialized_length = length;
-
-    deserialize();
+    *this = CMPLX_CMD(view);
 }
 
-CMPLX_CMD::CMPLX_CMD(CMPLX_CMD &other) {
-    serialized_length = other.serialized_length;
-    serialized = new char[other.serialized_length];
-    memcpy(serialized, other.serialized, serialized_length);
-    deserialize();
-}
+CMPLX_CMD::CMPLX_CMD(const cmplx_view &view)
+        : cmd(view.cmd), cmd_seq(view.cmd_seq), param(view.param), data(view.data) {}
 
-CMPLX_CMD::CMPLX_CMD(CMPLX_CMD &&other) noexcept {
-    serialized_length = other.serialized_length;
-    serialized = other.serialized;
-    other.serialized = nullptr;
-    deserialize();
+std::size_t CMPLX_CMD::serialize(char *to) const {
+    return encode_cmplx(to, serialized_length(), cmd, cmd_seq, param, data);
 }
 
-CMPLX_CMD::~CMPLX_CMD() {
-    delete[] serialized;
-}
-
-void CMPLX_CMD::deserialize() {
-    std::size_t i = 0;
-
-    deserialize_string(cmd, serialized, i, CMD_LEN);
-    i = CMD_LEN;
-    deserialize_uint64(cmd_seq, serialized, i);
-    deserialize_uint64(param, serialized, i);
-    deserialize_string(data, serialized, i, serialized_length - i);
-}
-
-void CMPLX_CMD::serialize() {
-    serialized_length = CMD_LEN + sizeof cmd_seq + sizeof param + data.length();
-    serialized = new char[serialized_length];
-    memset(serialized, 0, serialized_length);
-
-    std::size_t i = 0;
-    serialize_string(serialized, cmd, i, cmd.length());
-    i = CMD_LEN;
-    serialize_uint64(serialized, cmd_seq, i);
-    serialize_uint64(serialized, param, i);
-    serialize_string(serialized, data, i, data.length());
+/** Sends a header and the data as a single datagram. */
+static void send_message(int socket, const struct sockaddr_in &address, char *header, std::size_t header_len,
+                         std::string_view data) {
+    struct iovec parts[2] = {{header, header_len},
+                             {const_cast<char *>(data.data()), data.size()}};
+    struct msghdr msg{};
+    msg.msg_name = (void *) &address;
+    msg.msg_namelen = sizeof address;
+    msg.msg_iov = parts;
+    msg.msg_iovlen = 2;
+    if (sendmsg(socket, &msg, 0) != (ssize_t) (header_len + data.size())) {
+        throw std::runtime_error("write");
+    }
 }
 
 void set_socket_option(int socket, int optval, int level, int optname, const std::string &error_message) {
@@ -155,24 +67,24 @@ void set_socket_option(int socket, int optval, int level, int optname, const std
 }
 
 uint64_t
-send_simple_message(int socket, const struct sockaddr_in &address, const std::string &cmd, const std::string &data,
+send_simple_message(int socket, const struct sockaddr_in &address, std::string_view cmd, std::string_view data,
                     uint64_t cmd_seq) {
-    SIMPL_CMD command(cmd, cmd_seq, data);
-    if (sendto(socket, command.serialized, command.serialized_length, 0,
-               (struct sockaddr *) &address, sizeof address) != command.serialized_length) {
-        throw std::runtime_error("write");
+    if (cmd.length() > CMD_LEN) {
+        throw std::invalid_argument("wrong command");
     }
+    char header[MIN_SIMPL_LEN];
+    send_message(socket, address, header, encode_header(header, cmd, cmd_seq), data);
     return cmd_seq;
 }
 
 uint64_t
-send_complex_message(int socket, const struct sockaddr_in &address, const std::string &cmd, const std::string &data,
+send_complex_message(int socket, const struct sockaddr_in &address, std::string_view cmd, std::string_view data,
                      uint64_t cmd_seq, uint64_t param) {
-    CMPLX_CMD command(cmd, cmd_seq, param, data);
-    if (sendto(socket, command.serialized, command.serialized_length, 0,
-               (struct sockaddr *) &address, sizeof address) != command.serialized_length) {
-        throw std::runtime_error("write");
+    if (cmd.length() > CMD_LEN) {
+        throw std::invalid_argument("wrong command");
     }
+    char header[MIN_CMPLX_LEN];
+    send_message(socket, address, header, encode_header(header, cmd, cmd_seq, param), data);
     return cmd_seq;
 }
 
@@ -0,0 +1,123 @@
+#include <array>
+#include <cstdio>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+#include "crc32c.h"
+
+#define CRC32C_POLY 0x82F63B78 /** reversed Castagnoli polynomial */
+
+namespace {
+
+std::array<uint32_t, 256> make_table() {
+    std::array<uint32_t, 256> table{};
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; ++bit) {
+            crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+        }
+        table[i] = crc;
+    }
+    return table;
+}
+
+/** The state is the inverted checksum, as in all the implementations below. */
+uint32_t crc32c_table(uint32_t state, const unsigned char *data, std::size_t length) {
+    static const std::array<uint32_t, 256> table = make_table();
+    for (std::size_t i = 0; i < length; ++i) {
+        state = table[(state ^ data[i]) & 0xFF] ^ (state >> 8);
+    }
+    return state;
+}
+
+#if defined(__x86_64__)
+
+__attribute__((target("sse4.2")))
+uint32_t crc32c_hardware(uint32_t state, const unsigned char *data, std::size_t length) {
+    uint64_t state64 = state;
+    for (; length >= sizeof(uint64_t); length -= sizeof(uint64_t), data += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, data, sizeof word);
+        state64 = _mm_crc32_u64(state64, word);
+    }
+    state = (uint32_t) state64;
+    for (; length > 0; --length, ++data) {
+        state = _mm_crc32_u8(state, *data);
+    }
+    return state;
+}
+
+bool hardware_supported() {
+    /* runs during the static initialization, before the CPU info is known otherwise */
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.2");
+}
+
+const char *HARDWARE_NAME = "sse4.2";
+
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+
+uint32_t crc32c_hardware(uint32_t state, const unsigned char *data, std::size_t length) {
+    for (; length >= sizeof(uint64_t); length -= sizeof(uint64_t), data += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, data, sizeof word);
+        state = __crc32cd(state, word);
+    }
+    for (; length > 0; --length, ++data) {
+        state = __crc32cb(state, *data);
+    }
+    return state;
+}
+
+bool hardware_supported() {
+    return true; /* the compiler was told the CPU has the CRC extension */
+}
+
+const char *HARDWARE_NAME = "armv8";
+
+#else
+
+uint32_t crc32c_hardware(uint32_t state, const unsigned char *data, std::size_t length) {
+    return crc32c_table(state, data, length);
+}
+
+bool hardware_supported() {
+    return false;
+}
+
+const char *HARDWARE_NAME = "table";
+
+#endif
+
+using implementation = uint32_t (*)(uint32_t, const unsigned char *, std::size_t);
+
+const implementation selected = hardware_supported() ? crc32c_hardware : crc32c_table;
+
+}
+
+uint32_t crc32c(uint32_t crc, const void *data, std::size_t length) {
+    return ~selected(~crc, static_cast<const unsigned char *>(data), length);
+}
+
+const char *crc32c_implementation() {
+    return selected == crc32c_hardware ? HARDWARE_NAME : "table";
+}
+
+std::string crc32c_string(uint32_t crc) {
+    char text[9];
+    snprintf(text, sizeof text, "%08x", crc);
+    return text;
+}
+
+bool parse_crc32c(const std::string &text, uint32_t &crc) {
+    if (text.size() != 8 || text.find_first_not_of("0123456789abcdef") != std::string::npos) {
+        return false;
+    }
+    crc = (uint32_t) std::stoul(text, nullptr, 16);
+    return true;
+}
@@ -0,0 +1,27 @@
+#ifndef NETSTORE_CRC32C_H
+#define NETSTORE_CRC32C_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/**
+ * Extends the CRC32C (Castagnoli) checksum @ref crc with @ref length bytes of @ref data.
+ * The checksum of the empty string is 0, so a stream is checksummed by calling it on every block.
+ * Uses the SSE4.2 / ARMv8 CRC instructions if the CPU has them, a lookup table otherwise.
+ */
+uint32_t crc32c(uint32_t crc, const void *data, std::size_t length);
+
+/** Name of the implementation used by @ref crc32c ("sse4.2", "armv8" or "table"). */
+const char *crc32c_implementation();
+
+/** Checksum as 8 hex digits, the way it's sent in the data extensions. */
+std::string crc32c_string(uint32_t crc);
+
+/**
+ * Reads a checksum written by @ref crc32c_string.
+ * @return false if @ref text isn't a checksum.
+ */
+bool parse_crc32c(const std::string &text, uint32_t &crc);
+
+#endif //NETSTORE_CRC32C_H
@@ -0,0 +1,121 @@
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "file_cache.h"
+
+#define READAHEAD_MIN (1 << 20) /** smaller ranges are left to the kernel's own read ahead */
+
+cached_file::~cached_file() {
+    if (mapping != nullptr) {
+        munmap(const_cast<char *>(mapping), size);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+void cached_file::prefetch(uint64_t offset, uint64_t length) const {
+    if (length < READAHEAD_MIN || offset >= size) {
+        return;
+    }
+    length = std::min(length, size - offset);
+    if (mapping != nullptr) {
+        /* madvise needs a page aligned start */
+        uint64_t page = sysconf(_SC_PAGESIZE);
+        uint64_t begin = offset / page * page;
+        madvise(const_cast<char *>(mapping) + begin, offset + length - begin, MADV_WILLNEED);
+    }
+    else {
+        posix_fadvise(fd, offset, length, POSIX_FADV_WILLNEED);
+    }
+}
+
+file_cache::file_cache(uint64_t capacity, std::size_t max_files) : capacity(capacity), max_files(max_files) {}
+
+std::shared_ptr<const cached_file> file_cache::open(const std::string &path, uint64_t min_size) {
+    std::unique_lock<std::mutex> lock(mutex);
+    auto it = entries.find(path);
+    if (it != entries.end()) {
+        if (it->second.file->size >= min_size) {
+            ++hits;
+            order.splice(order.begin(), order, it->second.position);
+            return it->second.file;
+        }
+        evict(it); /* changed since it was opened */
+    }
+    ++misses;
+    bool keep = capacity > 0 && seen_before(path);
+    lock.unlock();
+
+    /* the file is opened without the lock, the other transfers don't wait for the disk */
+    auto file = std::make_shared<cached_file>();
+    struct stat info{};
+    file->fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (file->fd < 0 || fstat(file->fd, &info) < 0) {
+        return nullptr;
+    }
+    file->size = info.st_size;
+    if (!keep || file->size > capacity || file->size == 0) {
+        return file;
+    }
+    void *mapping = mmap(nullptr, file->size, PROT_READ, MAP_SHARED, file->fd, 0);
+    if (mapping != MAP_FAILED) {
+        madvise(mapping, file->size, MADV_SEQUENTIAL);
+        file->mapping = static_cast<const char *>(mapping);
+    }
+
+    lock.lock();
+    if (entries.count(path) > 0) {
+        return file; /* opened by another transfer meanwhile */
+    }
+    while (!order.empty() && (used + file->size > capacity || entries.size() >= max_files)) {
+        evict(entries.find(order.back()));
+    }
+    order.push_front(path);
+    entries[path] = {file, order.begin()};
+    used += file->size;
+    return file;
+}
+
+bool file_cache::seen_before(const std::string &path) {
+    auto it = seen_index.find(path);
+    if (it != seen_index.end()) {
+        seen.erase(it->second);
+        seen_index.erase(it);
+        return true;
+    }
+    seen.push_front(path);
+    seen_index[path] = seen.begin();
+    if (seen.size() > max_files) {
+        seen_index.erase(seen.back());
+        seen.pop_back();
+    }
+    return false;
+}
+
+void file_cache::evict(std::unordered_map<std::string, entry>::iterator it) {
+    used -= it->second.file->size;
+    order.erase(it->second.position);
+    entries.erase(it);
+    ++evictions;
+}
+
+void file_cache::forget(const std::string &path) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = entries.find(path);
+    if (it != entries.end()) {
+        used -= it->second.file->size;
+        order.erase(it->second.position);
+        entries.erase(it);
+    }
+}
+
+void file_cache::print(std::ostream &out) {
+    std::lock_guard<std::mutex> lock(mutex);
+    out << "hits " << hits << ", misses " << misses << ", evictions " << evictions << ", kept " << entries.size()
+        << " files (" << used << " bytes)";
+}
@@ -0,0 +1,83 @@
+#ifndef NETSTORE_FILE_CACHE_H
+#define NETSTORE_FILE_CACHE_H
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+
+/** A file opened for sending, shared by all the transfers sending it at once. */
+struct cached_file {
+    int fd = -1;
+    uint64_t size = 0;
+    const char *mapping = nullptr; /** the whole file (read only), nullptr if it isn't mapped */
+
+    cached_file() = default;
+    cached_file(const cached_file &) = delete;
+    cached_file &operator=(const cached_file &) = delete;
+    ~cached_file();
+
+    /** Asks the kernel to read ahead a large range about to be sent, does nothing for the small ones. */
+    void prefetch(uint64_t offset, uint64_t length) const;
+};
+
+/**
+ * Keeps the file descriptors and mappings of the popular files, so that sending them again
+ * skips the open and the mapping stays in memory. The least recently used files are dropped
+ * when they take more than the capacity; a file is only kept once asked for twice, so that
+ * the files fetched once don't push out the popular ones.
+ * The files are looked up by the path: the caller has to @ref forget the ones removed or replaced.
+ * Thread safe.
+ */
+class file_cache {
+public:
+    /**
+     * @param [in] capacity Bytes of the kept files, 0 - nothing is kept.
+     * @param [in] max_files Number of the kept files (file descriptors).
+     */
+    file_cache(uint64_t capacity, std::size_t max_files);
+    file_cache(const file_cache &) = delete;
+    file_cache &operator=(const file_cache &) = delete;
+
+    /**
+     * Opens @ref path, from the cache if it's there and has at least @ref min_size bytes.
+     * @return nullptr if it can't be opened.
+     */
+    std::shared_ptr<const cached_file> open(const std::string &path, uint64_t min_size);
+
+    /** Drops @ref path from the cache, the transfers sending it keep their copy. */
+    void forget(const std::string &path);
+
+    /** Writes the counters, e.g. "hits 10, misses 2, ...". */
+    void print(std::ostream &out);
+
+private:
+    using lru_list = std::list<std::string>; /** the most recently used first */
+
+    struct entry {
+        std::shared_ptr<const cached_file> file;
+        lru_list::iterator position;
+    };
+
+    std::mutex mutex;
+    uint64_t capacity;
+    std::size_t max_files;
+    uint64_t used = 0; /** bytes of the kept files */
+    lru_list order;
+    std::unordered_map<std::string, entry> entries;
+    lru_list seen; /** paths asked for once recently, not kept yet (the most recent first) */
+    std::unordered_map<std::string, lru_list::iterator> seen_index;
+
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+
+    /** Checks if the path was asked for before and remembers it, the lock is held. */
+    bool seen_before(const std::string &path);
+    void evict(std::unordered_map<std::string, entry>::iterator it);
+};
+
+#endif //NETSTORE_FILE_CACHE_H
@@ -0,0 +1,60 @@
+#include <algorithm>
+#include <cerrno>
+#include <stdexcept>
+
+#include <limits.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#include "folder_watcher.h"
+
+#define WATCHED_EVENTS (IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+                        IN_DELETE_SELF | IN_MOVE_SELF)
+#define EVENTS_BUFFER_SIZE (64 * (sizeof(struct inotify_event) + NAME_MAX + 1))
+
+folder_watcher::folder_watcher(const std::string &folder) : buffer(EVENTS_BUFFER_SIZE) {
+    fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0) {
+        throw std::runtime_error("inotify_init1");
+    }
+    if (inotify_add_watch(fd, folder.c_str(), WATCHED_EVENTS | IN_ONLYDIR) < 0) {
+        close(fd);
+        throw std::runtime_error("inotify_add_watch");
+    }
+}
+
+folder_watcher::~folder_watcher() {
+    close(fd);
+}
+
+watch_result folder_watcher::wait(std::vector<std::string> &names) {
+    names.clear();
+    ssize_t length;
+    do {
+        length = read(fd, buffer.data(), buffer.size());
+    } while (length < 0 && errno == EINTR);
+    if (length <= 0) {
+        throw std::runtime_error("read");
+    }
+
+    watch_result result = watch_result::changed;
+    for (ssize_t offset = 0; offset < length;) {
+        auto *event = reinterpret_cast<const struct inotify_event *>(buffer.data() + offset);
+        offset += sizeof(struct inotify_event) + event->len;
+
+        if (event->mask & IN_Q_OVERFLOW) {
+            result = watch_result::overflow;
+        }
+        else if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+            return watch_result::stopped;
+        }
+        else if (event->len > 0 && !(event->mask & IN_ISDIR)) {
+            std::string name(event->name); /* padded with '\0' up to len */
+            /* a file written in chunks gives an event per close, the batches are short */
+            if (std::find(names.begin(), names.end(), name) == names.end()) {
+                names.push_back(std::move(name));
+            }
+        }
+    }
+    return result;
+}
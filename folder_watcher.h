@@ -0,0 +1,39 @@
+#ifndef NETSTORE_FOLDER_WATCHER_H
+#define NETSTORE_FOLDER_WATCHER_H
+
+#include <string>
+#include <vector>
+
+/** What @ref folder_watcher::wait found. */
+enum class watch_result {
+    changed, /** some files changed */
+    overflow, /** the kernel dropped some events, the whole folder has to be checked */
+    stopped, /** the folder was removed or moved, nothing more will be reported */
+};
+
+/**
+ * Reports the files created, written, removed and renamed directly in a folder (inotify, not recursive).
+ * Only the names are reported, the caller checks what actually is on the disk,
+ * so the events don't have to be interpreted one by one.
+ */
+class folder_watcher {
+public:
+    /** Starts watching @ref folder, the changes made from now on are queued until @ref wait. */
+    explicit folder_watcher(const std::string &folder);
+    ~folder_watcher();
+
+    folder_watcher(const folder_watcher &) = delete;
+    folder_watcher &operator=(const folder_watcher &) = delete;
+
+    /**
+     * Blocks until there are some changes.
+     * @param [out] names Names of the changed files, every name once, in the order of the first change.
+     */
+    watch_result wait(std::vector<std::string> &names);
+
+private:
+    int fd = -1; /** the inotify instance */
+    std::vector<char> buffer; /** for the events read at once */
+};
+
+#endif //NETSTORE_FOLDER_WATCHER_H
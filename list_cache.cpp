@@ -0,0 +1,61 @@
+#include "codec.h"
+#include "list_cache.h"
+
+std::vector<std::string> pack_names(const std::vector<std::string_view> &names) {
+    std::vector<std::string> packets;
+    std::string data;
+
+    for (std::string_view name : names) {
+        if (!data.empty() && data.size() + 1 + name.size() > MAX_SIMPL_DATA_LEN) {
+            /* the name doesn't fit, the packet is ready */
+            packets.push_back(std::move(data));
+            data.clear();
+        }
+        if (!data.empty()) {
+            data += '\n';
+        }
+        data += name;
+    }
+    if (!data.empty()) {
+        packets.push_back(std::move(data));
+    }
+    return packets;
+}
+
+list_cache::list_cache(std::size_t capacity) : capacity(capacity) {}
+
+std::shared_ptr<const list_reply> list_cache::find(std::string_view query, uint64_t version) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = entries.find(query);
+    if (it == entries.end() || it->second.reply->version != version) {
+        ++miss_count;
+        return nullptr;
+    }
+    ++hit_count;
+    recency.splice(recency.begin(), recency, it->second.position);
+    return it->second.reply;
+}
+
+void list_cache::store(std::string_view query, std::shared_ptr<const list_reply> reply) {
+    if (capacity == 0) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = entries.find(query);
+    if (it != entries.end()) {
+        /* keep the newer reply only */
+        if (it->second.reply->version < reply->version) {
+            it->second.reply = std::move(reply);
+        }
+        recency.splice(recency.begin(), recency, it->second.position);
+        return;
+    }
+
+    if (entries.size() >= capacity) {
+        entries.erase(entries.find(recency.back()));
+        recency.pop_back();
+    }
+    it = entries.emplace(std::string(query), entry{std::move(reply), {}}).first;
+    recency.push_front(it->first);
+    it->second.position = recency.begin();
+}
@@ -0,0 +1,59 @@
+#ifndef NETSTORE_LIST_CACHE_H
+#define NETSTORE_LIST_CACHE_H
+
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/** MY_LIST payloads answering a single query, or the names the MY_PAGE replies are cut from. */
+struct list_reply {
+    uint64_t version = 0; /** version of the catalog the reply was built from */
+    std::vector<std::string> packets; /** data of the MY_LIST messages */
+    std::vector<std::string> sorted; /** the matching names sorted, for the pages (LIST_PAGE) */
+};
+
+/**
+ * Packs file names into MY_LIST payloads: names separated by '\n',
+ * every payload up to @ref MAX_SIMPL_DATA_LEN bytes.
+ */
+std::vector<std::string> pack_names(const std::vector<std::string_view> &names);
+
+/**
+ * Cache of the MY_LIST replies by the query string, LRU.
+ * A reply built from an older version of the catalog is never returned.
+ * Thread safe; the replies are immutable and shared, so they can be sent without holding any lock.
+ */
+class list_cache {
+public:
+    /** @param [in] capacity Max number of cached queries, 0 disables the cache. */
+    explicit list_cache(std::size_t capacity);
+
+    /** @return The reply for @ref query built from the catalog @ref version, nullptr if there is none. */
+    std::shared_ptr<const list_reply> find(std::string_view query, uint64_t version);
+
+    /** Caches @ref reply for @ref query, evicting the least recently used query if needed. */
+    void store(std::string_view query, std::shared_ptr<const list_reply> reply);
+
+    uint64_t hits() const { return hit_count; }
+    uint64_t misses() const { return miss_count; }
+
+private:
+    struct entry {
+        std::shared_ptr<const list_reply> reply;
+        std::list<std::string_view>::iterator position; /** in @ref recency */
+    };
+
+    std::size_t capacity;
+    std::mutex mutex;
+    std::map<std::string, entry, std::less<>> entries;
+    std::list<std::string_view> recency; /** keys of the entries, the most recently used first */
+    uint64_t hit_count = 0;
+    uint64_t miss_count = 0;
+};
+
+#endif //NETSTORE_LIST_CACHE_H
@@ -0,0 +1,193 @@
+#include <cstdio>
+
+#include "codec.h"
+#include "metrics.h"
+
+namespace chr = std::chrono;
+
+const char *REQUEST_NAMES[REQUEST_KINDS] = {"HELLO", "LIST", "LIST_PAGE", "GET", "GET_RANGE", "STAT", "DEL", "ADD",
+                                            "ADD_RESUME", "CANCEL_ADD", "SESSION", "STATS", "other"};
+
+/** Keys of the @ref REQUEST_NAMES (but "other"), for comparing with the received commands. */
+static const std::array<command_key, REQUEST_KINDS - 1> REQUEST_KEYS = [] {
+    std::array<command_key, REQUEST_KINDS - 1> keys{};
+    for (std::size_t i = 0; i < keys.size(); ++i) {
+        keys[i] = make_command_key(REQUEST_NAMES[i]);
+    }
+    return keys;
+}();
+
+/** Quantiles written for every histogram. */
+static const double QUANTILES[] = {0.5, 0.9, 0.99, 0.999};
+
+std::size_t histogram::bucket(uint64_t value) {
+    if (value < (1u << HISTOGRAM_SUB_BITS)) {
+        return value;
+    }
+    int exponent = 63 - __builtin_clzll(value);
+    return ((exponent - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS) +
+           ((value >> (exponent - HISTOGRAM_SUB_BITS)) & ((1u << HISTOGRAM_SUB_BITS) - 1));
+}
+
+uint64_t histogram::bucket_max(std::size_t bucket) {
+    if (bucket < (1u << HISTOGRAM_SUB_BITS)) {
+        return bucket;
+    }
+    int shift = (int) (bucket >> HISTOGRAM_SUB_BITS) - 1;
+    uint64_t lowest = (uint64_t) ((1u << HISTOGRAM_SUB_BITS) + (bucket & ((1u << HISTOGRAM_SUB_BITS) - 1))) << shift;
+    return lowest + ((uint64_t) 1 << shift) - 1;
+}
+
+void histogram::record(uint64_t value) {
+    bump(counts[bucket(value)]);
+    bump(sum, value);
+}
+
+metrics_shard &server_metrics::local() {
+    thread_local server_metrics *owner = nullptr;
+    thread_local metrics_shard *shard = nullptr;
+    if (owner != this) {
+        std::lock_guard<std::mutex> lock(mutex);
+        shards.push_back(std::make_unique<metrics_shard>());
+        shard = shards.back().get();
+        owner = this;
+    }
+    return *shard;
+}
+
+void server_metrics::request(std::string_view cmd, chr::steady_clock::duration handling) {
+    metrics_shard &shard = local();
+    command_key key = load_command_key(cmd);
+    std::size_t kind = 0;
+    while (kind < REQUEST_KINDS - 1 && key != REQUEST_KEYS[kind]) {
+        ++kind;
+    }
+    bump(shard.requests[kind]);
+    shard.request_latency.record(chr::duration_cast<chr::microseconds>(handling).count());
+}
+
+namespace {
+
+/** A histogram summed over the shards. */
+struct histogram_total {
+    std::array<uint64_t, HISTOGRAM_BUCKETS> counts{};
+    uint64_t count = 0;
+    uint64_t sum = 0;
+
+    void add(const histogram &part) {
+        for (std::size_t i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+            uint64_t bucket_count = part.counts[i].load(std::memory_order_relaxed);
+            counts[i] += bucket_count;
+            count += bucket_count;
+        }
+        sum += part.sum.load(std::memory_order_relaxed);
+    }
+
+    /** Upper bound of the @ref quantile, within the width of a bucket. */
+    uint64_t quantile(double quantile) const {
+        uint64_t rank = (uint64_t) (quantile * count);
+        uint64_t seen = 0;
+        for (std::size_t i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+            seen += counts[i];
+            if (seen > rank) {
+                return histogram::bucket_max(i);
+            }
+        }
+        return 0;
+    }
+};
+
+void write_header(std::string &out, std::string_view name, std::string_view help, std::string_view type) {
+    out += "# HELP ";
+    out += name;
+    out += ' ';
+    out += help;
+    out += "\n# TYPE ";
+    out += name;
+    out += ' ';
+    out += type;
+    out += '\n';
+}
+
+/** Writes one sample, @ref labels is empty or "key=\"value\"". */
+void write_sample(std::string &out, std::string_view name, std::string_view labels, double value) {
+    char number[32];
+    snprintf(number, sizeof number, "%.17g", value);
+    out += name;
+    if (!labels.empty()) {
+        out += '{';
+        out += labels;
+        out += '}';
+    }
+    out += ' ';
+    out += number;
+    out += '\n';
+}
+
+/** Histograms go out as summaries: the quantiles are computed on the server, from the buckets. */
+void write_summary(std::string &out, std::string_view name, std::string_view help, const histogram_total &total) {
+    write_header(out, name, help, "summary");
+    for (double quantile : QUANTILES) {
+        char label[32];
+        snprintf(label, sizeof label, "quantile=\"%g\"", quantile);
+        write_sample(out, name, label, (double) total.quantile(quantile));
+    }
+    write_sample(out, std::string(name) + "_sum", "", (double) total.sum);
+    write_sample(out, std::string(name) + "_count", "", (double) total.count);
+}
+
+}
+
+void write_gauge(std::string &out, std::string_view name, std::string_view help, double value) {
+    write_header(out, name, help, "gauge");
+    write_sample(out, name, "", value);
+}
+
+void server_metrics::prometheus(std::string &out) {
+    std::array<uint64_t, REQUEST_KINDS> requests{};
+    uint64_t bytes_sent = 0, bytes_received = 0, transfers_done = 0, transfers_failed = 0;
+    uint64_t uring_requests = 0, uring_enters = 0;
+    histogram_total request_latency, accept_wait, transfer_rate;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const std::unique_ptr<metrics_shard> &shard : shards) {
+            for (std::size_t i = 0; i < REQUEST_KINDS; ++i) {
+                requests[i] += shard->requests[i].load(std::memory_order_relaxed);
+            }
+            bytes_sent += shard->bytes_sent.load(std::memory_order_relaxed);
+            bytes_received += shard->bytes_received.load(std::memory_order_relaxed);
+            transfers_done += shard->transfers_done.load(std::memory_order_relaxed);
+            transfers_failed += shard->transfers_failed.load(std::memory_order_relaxed);
+            uring_requests += shard->uring_requests.load(std::memory_order_relaxed);
+            uring_enters += shard->uring_enters.load(std::memory_order_relaxed);
+            request_latency.add(shard->request_latency);
+            accept_wait.add(shard->accept_wait);
+            transfer_rate.add(shard->transfer_rate);
+        }
+    }
+
+    write_header(out, "netstore_requests_total", "UDP requests handled, by command.", "counter");
+    for (std::size_t i = 0; i < REQUEST_KINDS; ++i) {
+        write_sample(out, "netstore_requests_total", std::string("command=\"") + REQUEST_NAMES[i] + "\"",
+                     (double) requests[i]);
+    }
+    write_summary(out, "netstore_request_duration_microseconds", "Time a UDP request took to handle.",
+                  request_latency);
+    write_header(out, "netstore_sent_bytes_total", "Bytes sent over the TCP transfers and sessions.", "counter");
+    write_sample(out, "netstore_sent_bytes_total", "", (double) bytes_sent);
+    write_header(out, "netstore_received_bytes_total", "Bytes received over the TCP transfers and sessions.",
+                 "counter");
+    write_sample(out, "netstore_received_bytes_total", "", (double) bytes_received);
+    write_header(out, "netstore_transfers_total", "Finished file transfers, by the result.", "counter");
+    write_sample(out, "netstore_transfers_total", "result=\"success\"", (double) transfers_done);
+    write_sample(out, "netstore_transfers_total", "result=\"failure\"", (double) transfers_failed);
+    write_header(out, "netstore_uring_requests_total", "Requests submitted to the io_uring of the transfer workers.",
+                 "counter");
+    write_sample(out, "netstore_uring_requests_total", "", (double) uring_requests);
+    write_header(out, "netstore_uring_enters_total", "io_uring_enter calls of the transfer workers.", "counter");
+    write_sample(out, "netstore_uring_enters_total", "", (double) uring_enters);
+    write_summary(out, "netstore_accept_wait_microseconds",
+                  "Time between announcing a TCP port and the client connecting to it.", accept_wait);
+    write_summary(out, "netstore_transfer_rate_bytes_per_second", "Throughput of the successful file transfers.",
+                  transfer_rate);
+}
@@ -0,0 +1,84 @@
+#ifndef NETSTORE_METRICS_H
+#define NETSTORE_METRICS_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#define HISTOGRAM_SUB_BITS 3 /** every power of two is split into 2^HISTOGRAM_SUB_BITS buckets (12.5% wide) */
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS) /** cover all of uint64_t */
+#define REQUEST_KINDS 13 /** commands counted separately, including "other" */
+
+/** The requests counted by their command, the unknown ones are "other" (the last one). */
+extern const char *REQUEST_NAMES[REQUEST_KINDS];
+
+/** Adds to a counter written by one thread only: a plain load and store, no locked instruction. */
+inline void bump(std::atomic<uint64_t> &counter, uint64_t value = 1) {
+    counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+/**
+ * Histogram of non-negative values (latencies in microseconds, rates in bytes per second), HDR style:
+ * log-linear buckets with a bounded relative error and no configured range.
+ * Recorded by a single thread, read by any.
+ */
+struct histogram {
+    std::array<std::atomic<uint64_t>, HISTOGRAM_BUCKETS> counts{};
+    std::atomic<uint64_t> sum{0};
+
+    void record(uint64_t value);
+
+    static std::size_t bucket(uint64_t value);
+    /** The largest value that falls into @ref bucket. */
+    static uint64_t bucket_max(std::size_t bucket);
+};
+
+/** Counters of a single thread, only that thread writes them, without contention. */
+struct metrics_shard {
+    std::array<std::atomic<uint64_t>, REQUEST_KINDS> requests{}; /** by the index into @ref REQUEST_NAMES */
+    std::atomic<uint64_t> bytes_sent{0}; /** by the TCP transfers and sessions */
+    std::atomic<uint64_t> bytes_received{0};
+    std::atomic<uint64_t> transfers_done{0};
+    std::atomic<uint64_t> transfers_failed{0};
+    std::atomic<uint64_t> uring_requests{0}; /** submitted to the io_uring of a transfer worker, in total */
+    std::atomic<uint64_t> uring_enters{0}; /** io_uring_enter calls of a transfer worker, in total */
+    histogram request_latency; /** microseconds a UDP request was handled */
+    histogram accept_wait; /** microseconds between the announced port and the client's connection */
+    histogram transfer_rate; /** bytes per second of the finished file transfers */
+};
+
+/**
+ * Counters and histograms of the server's hot paths, every thread updates its own @ref metrics_shard
+ * and the shards are only summed when the metrics are read.
+ * Thread safe.
+ */
+class server_metrics {
+public:
+    server_metrics() = default;
+    server_metrics(const server_metrics &) = delete;
+    server_metrics &operator=(const server_metrics &) = delete;
+
+    /** The shard of the calling thread, created on its first use. */
+    metrics_shard &local();
+
+    /** Counts a UDP request, @ref cmd is the CMD_LEN bytes of its command. */
+    void request(std::string_view cmd, std::chrono::steady_clock::duration handling);
+
+    /** Writes all the metrics in the Prometheus text format (version 0.0.4). */
+    void prometheus(std::string &out);
+
+private:
+    std::mutex mutex;
+    std::vector<std::unique_ptr<metrics_shard>> shards; /** kept after their threads end */
+};
+
+/** Appends a gauge in the Prometheus text format. */
+void write_gauge(std::string &out, std::string_view name, std::string_view help, double value);
+
+#endif //NETSTORE_METRICS_H
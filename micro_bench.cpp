@@ -0,0 +1,252 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+#include <boost/filesystem.hpp>
+
+#include "catalog.h"
+#include "connection.h"
+#include "list_cache.h"
+
+/**
+ * Microbenchmarks of the hot paths of the UDP requests: the wire codec, the command checks,
+ * the catalog lookups (against the linear scan they replaced) and the packing of the MY_LIST replies.
+ * Every benchmark reports its time per operation and "allocs/op", counted by the operator new below.
+ */
+
+namespace fs = boost::filesystem;
+
+static std::atomic<uint64_t> allocations{0};
+
+/* the replaced operators pair malloc with free, gcc can't see that through the inlined new/delete */
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+
+void *operator new(std::size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *memory = std::malloc(size == 0 ? 1 : size)) {
+        return memory;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *memory) noexcept {
+    std::free(memory);
+}
+
+void operator delete(void *memory, std::size_t) noexcept {
+    std::free(memory);
+}
+
+/** Sets the "allocs/op" counter of the benchmark to the allocations made during its lifetime. */
+class allocation_counter {
+public:
+    explicit allocation_counter(benchmark::State &state) : state(state), start(allocations.load()) {}
+
+    ~allocation_counter() {
+        state.counters["allocs/op"] = benchmark::Counter((double) (allocations.load() - start),
+                                                         benchmark::Counter::kAvgIterations);
+    }
+
+private:
+    benchmark::State &state;
+    uint64_t start;
+};
+
+const std::string FILE_NAME = "holiday-photos-2019.tar";
+
+std::string file_name(std::size_t i) {
+    return "shared-document-" + std::to_string(i) + ".txt"; /* too long for the small string optimization */
+}
+
+static void BM_simpl_cmd_construct(benchmark::State &state) {
+    allocation_counter counter(state);
+    for (auto _ : state) {
+        SIMPL_CMD message("GET", 1, FILE_NAME);
+        benchmark::DoNotOptimize(message);
+    }
+}
+BENCHMARK(BM_simpl_cmd_construct);
+
+static void BM_simpl_cmd_serialize(benchmark::State &state) {
+    SIMPL_CMD message("GET", 1, FILE_NAME);
+    char buffer[BSIZE];
+    allocation_counter counter(state);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(message.serialize(buffer));
+        benchmark::ClobberMemory();
+    }
+}
+BENCHMARK(BM_simpl_cmd_serialize);
+
+static void BM_simpl_cmd_deserialize(benchmark::State &state) {
+    char buffer[BSIZE];
+    std::size_t length = SIMPL_CMD("GET", 1, FILE_NAME).serialize(buffer);
+    allocation_counter counter(state);
+    for (auto _ : state) {
+        SIMPL_CMD message(buffer, length);
+        benchmark::DoNotOptimize(message);
+    }
+}
+BENCHMARK(BM_simpl_cmd_deserialize);
+
+static void BM_simpl_view_encode(benchmark::State &state) {
+    char buffer[BSIZE];
+    allocation_counter counter(state);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(encode_simpl(buffer, sizeof buffer, "GET", 1, FILE_NAME));
+        benchmark::ClobberMemory();
+    }
+}
+BENCHMARK(BM_simpl_view_encode);
+
+static void BM_simpl_view_decode(benchmark::State &state) {
+    char buffer[BSIZE];
+    std::size_t length = encode_simpl(buffer, sizeof buffer, "GET", 1, FILE_NAME);
+    allocation_counter counter(state);
+    for (auto _ : state) {
+        simpl_view view;
+        benchmark::DoNotOptimize(decode(buffer, length, view));
+        benchmark::DoNotOptimize(view);
+    }
+}
+BENCHMARK(BM_simpl_view_decode);
+
+static void BM_cmplx_cmd_construct(benchmark::State &state) {
+    allocation_counter counter(state);
+    for (auto _ : state) {
+        CMPLX_CMD message("ADD", 1, 1 << 20, FILE_NAME);
+        benchmark::DoNotOptimize(message);
+    }
+}
+BENCHMARK(BM_cmplx_cmd_construct);
+
+static void BM_cmplx_cmd_serialize(benchmark::State &state) {
+    CMPLX_CMD message("ADD", 1, 1 << 20, FILE_NAME);
+    char buffer[BSIZE];
+    allocation_counter counter(state);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(message.serialize(buffer));
+        benchmark::ClobberMemory();
+    }
+}
+BENCHMARK(BM_cmplx_cmd_serialize);
+
+static void BM_cmplx_cmd_deserialize(benchmark::State &state) {
+    char buffer[BSIZE];
+    std::size_t length = CMPLX_CMD("ADD", 1, 1 << 20, FILE_NAME).serialize(buffer);
+    allocation_counter counter(state);
+    for (auto _ : state) {
+        CMPLX_CMD message(buffer, length);
+        benchmark::DoNotOptimize(message);
+    }
+}
+BENCHMARK(BM_cmplx_cmd_deserialize);
+
+static void BM_cmplx_view_encode(benchmark::State &state) {
+    char buffer[BSIZE];
+    allocation_counter counter(state);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(encode_cmplx(buffer, sizeof buffer, "ADD", 1, 1 << 20, FILE_NAME));
+        benchmark::ClobberMemory();
+    }
+}
+BENCHMARK(BM_cmplx_view_encode);
+
+static void BM_cmplx_view_decode(benchmark::State &state) {
+    char buffer[BSIZE];
+    std::size_t length = encode_cmplx(buffer, sizeof buffer, "ADD", 1, 1 << 20, FILE_NAME);
+    allocation_counter counter(state);
+    for (auto _ : state) {
+        cmplx_view view;
+        benchmark::DoNotOptimize(decode(buffer, length, view));
+        benchmark::DoNotOptimize(view);
+    }
+}
+BENCHMARK(BM_cmplx_view_decode);
+
+static void BM_check_cmd(benchmark::State &state) {
+    SIMPL_CMD message("MY_LIST", 1, FILE_NAME);
+    allocation_counter counter(state);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(check_cmd(message, "MY_LIST", {}));
+    }
+}
+BENCHMARK(BM_check_cmd);
+
+static void BM_command_is(benchmark::State &state) {
+    char buffer[BSIZE];
+    std::size_t length = encode_simpl(buffer, sizeof buffer, "MY_LIST", 1, FILE_NAME);
+    simpl_view view;
+    decode(buffer, length, view);
+    allocation_counter counter(state);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(command_is(view.cmd, "MY_LIST"));
+    }
+}
+BENCHMARK(BM_command_is);
+
+/** The lookup the catalog replaced: a scan of the paths, comparing the file names. */
+static void BM_lookup_linear(benchmark::State &state) {
+    std::vector<fs::path> files;
+    for (std::size_t i = 0; i < (std::size_t) state.range(0); ++i) {
+        files.emplace_back("/srv/shared/" + file_name(i));
+    }
+    std::string wanted = file_name(files.size() / 2);
+    allocation_counter counter(state);
+    for (auto _ : state) {
+        auto it = std::find_if(files.begin(), files.end(), [&](const fs::path &path) {
+            return path.filename().string() == wanted;
+        });
+        benchmark::DoNotOptimize(it);
+    }
+}
+BENCHMARK(BM_lookup_linear)->Range(64, 1 << 16);
+
+static void BM_lookup_catalog(benchmark::State &state) {
+    catalog files("/srv/shared");
+    for (std::size_t i = 0; i < (std::size_t) state.range(0); ++i) {
+        files.insert(file_name(i), i, 0);
+    }
+    std::string wanted = file_name(files.size() / 2);
+    allocation_counter counter(state);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(files.find(wanted));
+    }
+}
+BENCHMARK(BM_lookup_catalog)->Range(64, 1 << 16);
+
+/** LIST of a query matching 1 / 16 of the files, from the index and packed into the MY_LIST payloads. */
+static void BM_list_search_and_pack(benchmark::State &state) {
+    catalog files("/srv/shared");
+    for (std::size_t i = 0; i < (std::size_t) state.range(0); ++i) {
+        files.insert(i % 16 == 0 ? "report-" + file_name(i) : file_name(i), i, 0);
+    }
+    allocation_counter counter(state);
+    for (auto _ : state) {
+        std::vector<std::string_view> results;
+        files.search("report", [&](catalog::entry_id, const file_entry &file) {
+            results.push_back(file.name);
+        });
+        benchmark::DoNotOptimize(pack_names(results));
+    }
+}
+BENCHMARK(BM_list_search_and_pack)->Range(64, 1 << 16);
+
+static void BM_list_pack(benchmark::State &state) {
+    std::vector<std::string> names;
+    for (std::size_t i = 0; i < (std::size_t) state.range(0); ++i) {
+        names.push_back(file_name(i));
+    }
+    std::vector<std::string_view> views(names.begin(), names.end());
+    allocation_counter counter(state);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(pack_names(views));
+    }
+}
+BENCHMARK(BM_list_pack)->Range(64, 1 << 16);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,83 @@
+#include <algorithm>
+
+#include "search_index.h"
+
+search_index::gram search_index::make_gram(std::string_view text) {
+    gram result = text.size() << 24;
+    for (std::size_t i = 0; i < text.size(); ++i) {
+        result |= static_cast<gram>(static_cast<unsigned char>(text[i])) << (8 * i);
+    }
+    return result;
+}
+
+void search_index::add(id_type id, std::string_view name) {
+    std::vector<gram> grams;
+    for (std::size_t len = 1; len <= GRAM_MAX_LEN; ++len) {
+        for (std::size_t i = 0; i + len <= name.size(); ++i) {
+            grams.push_back(make_gram(name.substr(i, len)));
+        }
+    }
+    std::sort(grams.begin(), grams.end());
+    grams.erase(std::unique(grams.begin(), grams.end()), grams.end());
+
+    if (references.size() <= id) {
+        references.resize(id + 1);
+    }
+    std::vector<std::pair<gram, uint32_t>> &refs = references[id];
+    refs.clear();
+    refs.reserve(grams.size());
+    for (gram g : grams) {
+        std::vector<id_type> &list = postings[g];
+        refs.emplace_back(g, list.size());
+        list.push_back(id);
+    }
+}
+
+void search_index::remove(id_type id) {
+    if (id >= references.size()) {
+        return;
+    }
+    for (const auto &[g, position] : references[id]) {
+        auto it = postings.find(g);
+        std::vector<id_type> &list = it->second;
+        id_type moved = list.back();
+        list[position] = moved;
+        list.pop_back();
+
+        if (moved != id) {
+            /* the last id of the list took the place of the removed one */
+            for (auto &ref : references[moved]) {
+                if (ref.first == g) {
+                    ref.second = position;
+                    break;
+                }
+            }
+        }
+        if (list.empty()) {
+            postings.erase(it);
+        }
+    }
+    references[id].clear();
+    references[id].shrink_to_fit();
+}
+
+const std::vector<search_index::id_type> *search_index::candidates(std::string_view query, bool &exact) const {
+    exact = query.size() <= GRAM_MAX_LEN;
+    if (exact) {
+        auto it = postings.find(make_gram(query));
+        return it == postings.end() ? nullptr : &it->second;
+    }
+
+    /* the rarest trigram of the query gives the fewest candidates */
+    const std::vector<id_type> *best = nullptr;
+    for (std::size_t i = 0; i + GRAM_MAX_LEN <= query.size(); ++i) {
+        auto it = postings.find(make_gram(query.substr(i, GRAM_MAX_LEN)));
+        if (it == postings.end()) {
+            return nullptr; /* some trigram doesn't occur anywhere */
+        }
+        if (best == nullptr || it->second.size() < best->size()) {
+            best = &it->second;
+        }
+    }
+    return best;
+}
@@ -0,0 +1,48 @@
+#ifndef NETSTORE_SEARCH_INDEX_H
+#define NETSTORE_SEARCH_INDEX_H
+
+#include <cstdint>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#define GRAM_MAX_LEN 3 /** longest substring with its own posting list (trigrams) */
+
+/**
+ * Substring index over the file names.
+ * Every distinct substring of length 1..@ref GRAM_MAX_LEN (a gram) of a name has a posting list
+ * of the ids of the names containing it. A query of up to 3 characters is a single posting list,
+ * a longer query is answered by verifying the names from its rarest trigram's list.
+ * Names are added and removed one by one, in time proportional to their length.
+ */
+class search_index {
+public:
+    using id_type = uint32_t;
+
+    /** Indexes the name @ref name with the id @ref id. */
+    void add(id_type id, std::string_view name);
+
+    /** Removes the name with the id @ref id from the index. */
+    void remove(id_type id);
+
+    /**
+     * Finds candidates for the names containing @ref query.
+     * @param [in] query Searched substring, non-empty.
+     * @param [out] exact Set to true if every candidate is a match (the query is short),
+     *                    otherwise the candidates have to be verified.
+     * @return Posting list of the candidates, nullptr if there are none.
+     */
+    const std::vector<id_type> *candidates(std::string_view query, bool &exact) const;
+
+private:
+    using gram = uint32_t; /** up to 3 bytes and the length in the top byte */
+
+    std::unordered_map<gram, std::vector<id_type>> postings;
+    /** for every id: its grams and their positions in the posting lists */
+    std::vector<std::vector<std::pair<gram, uint32_t>>> references;
+
+    static gram make_gram(std::string_view text);
+};
+
+#endif //NETSTORE_SEARCH_INDEX_H
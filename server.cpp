@@ -1,8 +1,12 @@
 #include <iostream>
-#include <list>
 #include <regex>
 #include <cassert>
 #include <algorithm>
+#include <atomic>
+#include <map>
+#include <shared_mutex>
+#include <thread>
+#include <unordered_set>
 
 #include <boost/filesystem.hpp>
 #include <boost/program_options.hpp>
@@ -11,10 +15,24 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <csignal>
+#include <functional>
 #include <netdb.h>
 #include <fcntl.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
 
+#include "catalog.h"
+#include "catalog_snapshot.h"
 #include "connection.h"
+#include "crc32c.h"
+#include "file_cache.h"
+#include "folder_watcher.h"
+#include "list_cache.h"
+#include "metrics.h"
+#include "space_ledger.h"
+#include "transfer.h"
+#include "transfer_engine.h"
+#include "udp_batch.h"
 
 #define QUEUE_LENGTH 1
 
@@ -24,12 +42,26 @@ namespace fs = boost::filesystem;
 std::size_t MAX_SPACE_DEFAULT = 52428800;
 std::size_t TIMEOUT_DEFAULT = 5;
 std::size_t TIMEOUT_MAX = 300;
+std::size_t TRANSFER_THREADS_DEFAULT = 4;
+std::size_t UDP_BATCH_DEFAULT = 32;
+std::size_t UDP_BATCH_MAX = 1024; /** limit of recvmmsg/sendmmsg */
+std::size_t CONTROL_THREADS_DEFAULT = 1;
+std::size_t LIST_CACHE_DEFAULT = 64;
+unsigned int PARTIAL_EXPIRY_DEFAULT = 3600;
+unsigned int SESSION_IDLE_DEFAULT = 60;
+std::size_t MAX_TRANSFERS_DEFAULT = 32;
+uint64_t SMALL_FILE_DEFAULT = 65536;
+uint64_t HOT_CACHE_DEFAULT = 64 << 20;
+std::size_t HOT_FILES_DEFAULT = 256;
+std::size_t URING_BUFFERS_DEFAULT = 64;
+const char *PARTIAL_FOLDER = ".netstore-partial"; /** failed uploads kept for resuming, inside SHRD_FLDR */
+const char *INCOMING_FOLDER = ".netstore-incoming"; /** uploads in progress, inside SHRD_FLDR */
+const char *SNAPSHOT_FILE = ".netstore-catalog"; /** snapshot of the catalog, inside SHRD_FLDR */
+const char *RESERVED_PREFIX = ".netstore-"; /** names of the servers own files, never indexed nor uploaded */
 
 struct server_options;
 struct server_state;
 
-using file_infos = std::vector<fs::path>;
-
 /**
  * Flags provided by the user.
  */
@@ -39,63 +71,176 @@ struct server_options {
     std::size_t MAX_SPACE = 0;
     std::string SHRD_FLDR = "";
     unsigned int TIMEOUT = 0;
+    transfer_mode TRANSFER_MODE = transfer_mode::sendfile; /** how files are sent to the clients */
+    std::size_t TRANSFER_THREADS = 0; /** number of threads handling the TCP transfers */
+    std::size_t UDP_BATCH = 0; /** max number of datagrams received/sent with one system call */
+    std::size_t CONTROL_THREADS = 0; /** number of threads answering the UDP requests */
+    std::size_t LIST_CACHE = 0; /** number of cached LIST replies */
+    unsigned int PARTIAL_EXPIRY = 0; /** seconds a failed upload is kept for resuming, 0 - not kept */
+    bool CHECKSUMS = true; /** compute the CRC32C of the files during the transfers */
+    bool CATALOG_SNAPSHOT = true; /** start from the snapshot of the catalog instead of indexing the files */
+    bool WATCH_FOLDER = true; /** apply the changes made in SHRD_FLDR by others to the catalog */
+    unsigned int SESSION_IDLE = 0; /** seconds an idle session is kept open */
+    std::size_t MAX_TRANSFERS = 0; /** file transfers moving data at once, 0 - no limit */
+    uint64_t SEND_RATE = 0; /** bytes per second sent to the clients, 0 - no limit */
+    uint64_t RECEIVE_RATE = 0; /** bytes per second received from the clients, 0 - no limit */
+    uint64_t SMALL_FILE = 0; /** transfers of at most that many bytes skip the line */
+    uint64_t HOT_CACHE = 0; /** bytes of the popular files kept open and mapped, 0 - none */
+    std::size_t HOT_FILES = 0; /** number of the popular files kept open */
+    bool COMPRESSION = true; /** deflate the files on the way when the client asks and they shrink */
+    bool IO_URING = true; /** move the file transfers with io_uring, if the kernel has it */
+    std::size_t URING_BUFFERS = 0; /** registered buffers of every transfer thread */
+    bool PREALLOCATE = true; /** allocate the announced size of an upload before receiving it */
+    bool DIRECT_IO = false; /** write the uploads with O_DIRECT (the io_uring transfers) */
+    uint64_t WRITEBACK_CHUNK = 0; /** bytes of an upload written before their write-back is started, 0 - off */
+};
+
+/**
+ * A thread answering the UDP requests on its own SO_REUSEPORT socket.
+ * The kernel spreads the unicast requests between the sockets, every socket gets a copy
+ * of a multicast request, so those are split by the hash of the client's address.
+ */
+struct control_thread {
+    std::size_t index = 0; /** shard number */
+    int socket = -1; /** UDP socket, bound to CMD_PORT, member of the multicast group */
+    batch_stats udp_stats; /** how well the UDP I/O is batched */
+    uint64_t handled = 0; /** requests handled by this thread */
+    uint64_t skipped = 0; /** multicast requests left for the other threads */
+    std::thread thread;
+};
+
+/** An upload in progress, its name is reserved until it ends. */
+struct pending_upload {
+    struct sockaddr_in client{}; /** who sent the ADD / ADD_RESUME */
+    uint64_t cmd_seq = 0; /** of the ADD / ADD_RESUME */
+    bool submitted = false; /** if @ref job is known */
+    uint64_t job = 0; /** the transfer receiving the file */
+    bool cancelled = false; /** CANCEL_ADD came before the job was submitted */
+};
+
+/** Changes of the catalog made to match the shared folder. */
+struct catalog_changes {
+    uint64_t added = 0;
+    uint64_t changed = 0;
+    uint64_t removed = 0;
+    uint64_t rescans = 0; /** whole folder checks */
 };
 
 /**
  * Current server state.
  */
 struct server_state {
-    uint64_t available_space = 0; /** file storage available */
-    uint64_t negative_space = 0; /** if after indexing the files their size is too big, the surplus number
-                                  * of bytes is stored here */
-    int socket = 0; /** UDP multicast socket */
+    std::unique_ptr<space_ledger> space; /** file storage available, reserved by the uploads in progress */
     struct ip_mreq ip_mreq{}; /** info about the multicast group */
-    file_infos files; /** list of files */
-    std::set<std::string> open_files; /** created files that haven't yet been saved */
+    std::vector<std::unique_ptr<control_thread>> control;
+    std::atomic<bool> stopping{false}; /** the control threads leave their loops */
+    int sigint_fd = -1; /** signalfd of SIGINT, the main thread waits for it */
+    std::shared_mutex files_mutex; /** guards the files and the pending uploads */
+    catalog files; /** files in the shared folder */
+    std::map<std::string, pending_upload, std::less<>> pending_uploads; /** the files being uploaded, by name */
+    std::unique_ptr<list_cache> list_replies; /** serialized MY_LIST replies of the recent queries */
+    std::unique_ptr<list_cache> page_replies; /** sorted results of the recent paged queries */
+    std::unique_ptr<transfer_engine> transfers; /** handles all the TCP transfers */
+    std::shared_ptr<file_cache> hot_files; /** the popular files, forgotten when they change */
+    std::shared_ptr<server_metrics> metrics; /** counters of the requests and the transfers, for STATS */
+    std::time_t next_partial_sweep = 0; /** when the expired partial uploads are removed next, guarded by files_mutex */
+    std::string snapshot_path; /** snapshot of the catalog, empty if it isn't kept */
+    bool reconcile = false; /** if the catalog was loaded from the snapshot, it has to be checked against the folder */
+    bool folder_changed = false; /** if files were added or removed since the snapshot was written */
+    std::unique_ptr<folder_watcher> watcher; /** changes of the shared folder, nullptr if it isn't watched */
+    catalog_changes watched; /** applied by the watcher thread */
+    std::shared_ptr<const session_handler> sessions; /** serves the requests of all the sessions */
 };
 
 server_state current_server_state{};
-int parent_pid = getpid();
 
 void clean_up(server_state &state) {
-    kill(-getpid(), SIGINT);
+    uint64_t handled = 0;
+    for (auto &control : state.control) {
+        handled += control->handled;
+    }
 
-    if (getpid() == parent_pid) {
-        /* dropping multicast group membership (only once) */
-        if (setsockopt(state.socket, IPPROTO_IP, IP_DROP_MEMBERSHIP,
+    for (auto &control : state.control) {
+        /* dropping multicast group membership */
+        if (setsockopt(control->socket, IPPROTO_IP, IP_DROP_MEMBERSHIP,
                        (void *) &state.ip_mreq, sizeof state.ip_mreq) < 0) {
             throw std::runtime_error("setsockopt");
         }
+        close(control->socket);
+
+        std::cerr << "[STATS] control thread " << control->index << ": handled " << control->handled << " ("
+                  << (handled ? 100.0 * control->handled / handled : 0) << "%), skipped " << control->skipped
+                  << ", ";
+        control->udp_stats.print(std::cerr);
+        std::cerr << "\n";
+    }
+    if (state.space) {
+        std::cerr << "[STATS] space: ";
+        state.space->print(std::cerr);
+        std::cerr << "\n";
+    }
+    if (state.list_replies) {
+        std::cerr << "[STATS] list cache: hits " << state.list_replies->hits() << ", misses "
+                  << state.list_replies->misses() << "\n";
+        std::cerr << "[STATS] page cache: hits " << state.page_replies->hits() << ", misses "
+                  << state.page_replies->misses() << "\n";
+    }
+    if (state.transfers) {
+        schedule_stats scheduled = state.transfers->scheduling();
+        std::cerr << "[STATS] scheduler: started " << scheduled.started << ", queued " << scheduled.queued
+                  << " (max depth " << scheduled.max_depth << "), throttled " << scheduled.throttled << "\n";
+    }
+    if (state.hot_files) {
+        std::cerr << "[STATS] hot files: ";
+        state.hot_files->print(std::cerr);
+        std::cerr << "\n";
     }
-    close(state.socket);
-    for (const std::string &filename : state.open_files) {
-        unlink(filename.c_str());
+    if (state.watcher) {
+        std::cerr << "[STATS] folder watcher: added " << state.watched.added << ", changed "
+                  << state.watched.changed << ", removed " << state.watched.removed << ", rescans "
+                  << state.watched.rescans << "\n";
     }
+    /* the unfinished uploads are kept for resuming (or removed) as the workers abort them */
+    state.transfers.reset();
 }
 
-void catch_sigint(int) {
-    clean_up(current_server_state);
-    exit(-1);
+/**
+ * Saves the catalog snapshot when the server stops, once the control threads and the transfers
+ * don't change the catalog anymore (the catalog threads still may, the lock waits for them).
+ */
+void save_final_snapshot(server_state &state) {
+    if (state.snapshot_path.empty()) {
+        return;
+    }
+    std::shared_lock<std::shared_mutex> lock(state.files_mutex);
+    try {
+        save_snapshot(state.files, state.snapshot_path);
+    } catch (const std::exception &e) {
+        std::cerr << "error: catalog snapshot: " << e.what() << "\n";
+    }
 }
 
-void add_signal_handlers() {
-    struct sigaction sigint_handler{};
-    sigint_handler.sa_handler = catch_sigint;
-    sigemptyset(&sigint_handler.sa_mask);
-    sigint_handler.sa_flags = 0;
-
-    /* handle CTRL+C */
-    if (sigaction(SIGINT, &sigint_handler, nullptr) == -1) {
-        throw std::runtime_error("sigaction");
+void add_signal_handlers(server_state &state) {
+    /* handle CTRL+C: it's blocked before any thread starts (all of them inherit the mask)
+     * and taken by the main thread from a signalfd, the server stops outside of a signal handler */
+    sigset_t sigint;
+    sigemptyset(&sigint);
+    sigaddset(&sigint, SIGINT);
+    if (pthread_sigmask(SIG_BLOCK, &sigint, nullptr) != 0) {
+        throw std::runtime_error("pthread_sigmask");
+    }
+    state.sigint_fd = signalfd(-1, &sigint, SFD_CLOEXEC);
+    if (state.sigint_fd < 0) {
+        throw std::runtime_error("signalfd");
     }
 
-    struct sigaction sigchld_handler{};
-    sigchld_handler.sa_handler = SIG_IGN;
-    sigemptyset(&sigchld_handler.sa_mask);
-    sigchld_handler.sa_flags = 0;
+    struct sigaction sigpipe_handler{};
+    sigpipe_handler.sa_handler = SIG_IGN;
+    sigemptyset(&sigpipe_handler.sa_mask);
+    sigpipe_handler.sa_flags = 0;
 
-    /* handle an exit of a child */
-    if (sigaction(SIGCHLD, &sigchld_handler, nullptr)) {
+    /* a client closing a TCP connection mustn't kill the whole server */
+    if (sigaction(SIGPIPE, &sigpipe_handler, nullptr)) {
         throw std::runtime_error("sigaction");
     }
 }
@@ -109,6 +254,7 @@ void add_signal_handlers() {
 server_options read_options(int argc, char const *argv[]) {
     po::options_description description("Allowed options");
     server_options options;
+    std::string transfer_mode_option;
 
     description.add_options()
             ("help", "help message")
@@ -116,7 +262,60 @@ server_options read_options(int argc, char const *argv[]) {
             ("cmd-port,p", po::value<int>(&options.CMD_PORT))
             ("max-space,b", po::value<std::size_t>(&options.MAX_SPACE)->default_value(MAX_SPACE_DEFAULT))
             ("shrd-fldr,f", po::value<std::string>(&options.SHRD_FLDR))
-            ("timeout,t", po::value<unsigned int>(&options.TIMEOUT)->default_value(TIMEOUT_DEFAULT));
+            ("timeout,t", po::value<unsigned int>(&options.TIMEOUT)->default_value(TIMEOUT_DEFAULT))
+            ("transfer-mode,m", po::value<std::string>(&transfer_mode_option)->default_value("sendfile"),
+             "copy, sendfile or splice")
+            ("transfer-threads,w",
+             po::value<std::size_t>(&options.TRANSFER_THREADS)->default_value(TRANSFER_THREADS_DEFAULT))
+            ("udp-batch,u", po::value<std::size_t>(&options.UDP_BATCH)->default_value(UDP_BATCH_DEFAULT),
+             "max number of datagrams handled with one recvmmsg/sendmmsg call")
+            ("control-threads,c",
+             po::value<std::size_t>(&options.CONTROL_THREADS)->default_value(CONTROL_THREADS_DEFAULT),
+             "number of threads answering the UDP requests, each with its own SO_REUSEPORT socket")
+            ("list-cache,l", po::value<std::size_t>(&options.LIST_CACHE)->default_value(LIST_CACHE_DEFAULT),
+             "number of cached LIST replies, 0 disables the cache")
+            ("partial-expiry,e",
+             po::value<unsigned int>(&options.PARTIAL_EXPIRY)->default_value(PARTIAL_EXPIRY_DEFAULT),
+             "seconds a failed upload is kept so that the client can resume it, 0 removes it at once")
+            ("checksums,k", po::value<bool>(&options.CHECKSUMS)->default_value(true),
+             "compute the CRC32C of the files during the transfers and announce it to the clients")
+            ("catalog-snapshot,n", po::value<bool>(&options.CATALOG_SNAPSHOT)->default_value(true),
+             "keep a snapshot of the catalog in the shared folder, load it at startup and check the folder "
+             "in the background")
+            ("watch-folder,i", po::value<bool>(&options.WATCH_FOLDER)->default_value(true),
+             "watch the shared folder (inotify) and add, update and remove the files changed by others")
+            ("session-idle,s",
+             po::value<unsigned int>(&options.SESSION_IDLE)->default_value(SESSION_IDLE_DEFAULT),
+             "seconds an idle session (many transfers over one TCP connection) is kept open")
+            ("max-transfers,x",
+             po::value<std::size_t>(&options.MAX_TRANSFERS)->default_value(MAX_TRANSFERS_DEFAULT),
+             "file transfers moving data at once, the others wait in line (fair between the clients), 0 - no limit")
+            ("send-rate", po::value<uint64_t>(&options.SEND_RATE)->default_value(0),
+             "bytes per second sent to all the clients together, 0 - no limit")
+            ("receive-rate", po::value<uint64_t>(&options.RECEIVE_RATE)->default_value(0),
+             "bytes per second received from all the clients together, 0 - no limit")
+            ("small-file", po::value<uint64_t>(&options.SMALL_FILE)->default_value(SMALL_FILE_DEFAULT),
+             "transfers of at most that many bytes go ahead of the waiting ones")
+            ("hot-cache", po::value<uint64_t>(&options.HOT_CACHE)->default_value(HOT_CACHE_DEFAULT),
+             "bytes of the popular files kept open and mapped between the transfers, 0 - none")
+            ("hot-files", po::value<std::size_t>(&options.HOT_FILES)->default_value(HOT_FILES_DEFAULT),
+             "number of the popular files kept open between the transfers")
+            ("compression", po::value<bool>(&options.COMPRESSION)->default_value(true),
+             "deflate the whole file transfers on the way when the client asks for it and the file compresses well")
+            ("io-uring", po::value<bool>(&options.IO_URING)->default_value(true),
+             "move the file transfers with io_uring (chained requests, registered buffers), "
+             "the transfer mode picks splice or reading into the buffers; without it in the kernel - epoll")
+            ("uring-buffers",
+             po::value<std::size_t>(&options.URING_BUFFERS)->default_value(URING_BUFFERS_DEFAULT),
+             "registered buffers of every transfer thread, a transfer takes one while it moves a block")
+            ("preallocate", po::value<bool>(&options.PREALLOCATE)->default_value(true),
+             "allocate the announced size of an upload (fallocate) before receiving it, so the file isn't fragmented")
+            ("direct-io", po::value<bool>(&options.DIRECT_IO)->default_value(false),
+             "write the uploads received by io_uring with O_DIRECT, past the page cache "
+             "(the tail of a file goes through it)")
+            ("writeback-chunk", po::value<uint64_t>(&options.WRITEBACK_CHUNK)->default_value(0),
+             "start the write-back of an upload (sync_file_range) after every that many bytes "
+             "and wait for the previous ones, so big uploads don't flood the page cache, 0 - left to the kernel");
     std::string mandatory_variables[] = {"mcast-addr", "cmd-port", "shrd-fldr"};
 
     po::variables_map variables;
@@ -134,148 +333,454 @@ server_options read_options(int argc, char const *argv[]) {
     if (options.CMD_PORT < 0) {
         throw std::invalid_argument("port");
     }
+    options.TRANSFER_MODE = parse_transfer_mode(transfer_mode_option);
+    if (options.TRANSFER_THREADS == 0) {
+        throw std::invalid_argument("transfer-threads");
+    }
+    if (options.UDP_BATCH == 0 || options.UDP_BATCH > UDP_BATCH_MAX) {
+        throw std::invalid_argument("udp-batch");
+    }
+    if (options.CONTROL_THREADS == 0) {
+        throw std::invalid_argument("control-threads");
+    }
+    if (options.SESSION_IDLE == 0) {
+        throw std::invalid_argument("session-idle");
+    }
+    if (options.IO_URING && options.URING_BUFFERS == 0) {
+        throw std::invalid_argument("uring-buffers");
+    }
 
     return options;
 }
 
+/** Checks if both addresses are the same host and port. */
+bool same_address(const struct sockaddr_in &lhs, const struct sockaddr_in &rhs) {
+    return lhs.sin_addr.s_addr == rhs.sin_addr.s_addr && lhs.sin_port == rhs.sin_port;
+}
+
+/** Checks if @ref name is one of the servers own files in the shared folder. */
+bool reserved_name(std::string_view name) {
+    return name.substr(0, strlen(RESERVED_PREFIX)) == RESERVED_PREFIX;
+}
+
+/** Modification time of a file as stored in the catalog, @ref fallback if it can't be read. */
+std::time_t file_mtime(const std::string &path, std::time_t fallback) {
+    boost::system::error_code error;
+    std::time_t mtime = fs::last_write_time(path, error);
+    return error ? fallback : mtime;
+}
+
 /**
  * Index files in @ref options.SHRD_FLDR.
+ * With @ref options.CATALOG_SNAPSHOT the catalog is loaded from the snapshot if there is one,
+ * and checked against the folder later (@ref reconcile_files).
+ * With @ref options.WATCH_FOLDER the folder is watched from before it's read.
  * @param [in] options
  * @param [out] state
  */
 void index_files(const server_options &options, server_state &state) {
     fs::path dir_path(options.SHRD_FLDR);
-    state.available_space = options.MAX_SPACE;
-
-    if (fs::exists(dir_path) && fs::is_directory(dir_path)) {
-        std::vector<fs::path> files;
-
-        for (fs::directory_iterator it(dir_path); it != fs::directory_iterator(); ++it) {
-            if (fs::is_regular_file(it->path())) {
-                fs::path file_path = it->path();
-                std::size_t current_file_size = file_size(file_path);
-                state.files.push_back(file_path);
-                if (state.available_space < current_file_size) {
-                    current_file_size -= state.available_space;
-                    state.available_space = 0;
-                    state.negative_space += current_file_size;
-                }
-                else {
-                    state.available_space -= current_file_size;
-                }
-            }
+    state.space = std::make_unique<space_ledger>(options.MAX_SPACE);
+    state.files = catalog(options.SHRD_FLDR);
+
+    if (!fs::exists(dir_path) || !fs::is_directory(dir_path)) {
+        throw std::invalid_argument("wrong directory");
+    }
+    /* before the files are read, so that no change is missed */
+    if (options.WATCH_FOLDER) {
+        state.watcher = std::make_unique<folder_watcher>(options.SHRD_FLDR);
+    }
+
+    if (options.CATALOG_SNAPSHOT) {
+        state.snapshot_path = options.SHRD_FLDR + "/" + SNAPSHOT_FILE;
+        int64_t saved_mtime;
+        if (load_snapshot(state.snapshot_path, state.files, saved_mtime)) {
+            state.files.for_each([&state](catalog::entry_id, const file_entry &entry) {
+                state.space->take(entry.size);
+            });
+            state.reconcile = true;
+            state.folder_changed = saved_mtime != folder_mtime(options.SHRD_FLDR);
+            return;
         }
     }
+
+    for (fs::directory_iterator it(dir_path); it != fs::directory_iterator(); ++it) {
+        if (fs::is_regular_file(it->path()) && !reserved_name(it->path().filename().string())) {
+            fs::path file_path = it->path();
+            std::size_t current_file_size = file_size(file_path);
+            state.files.insert(file_path.filename().string(), current_file_size, fs::last_write_time(file_path));
+            /* if the files are too big, the surplus is given back first when they are removed */
+            state.space->take(current_file_size);
+        }
+    }
+}
+
+/**
+ * Makes the catalog entry of @ref name match the file in the shared folder, with its space.
+ * A changed file is replaced, losing its checksum. The servers own files and the uploads in progress
+ * are skipped, the uploads update the catalog themselves.
+ * @param [out] changes What was done is counted here.
+ */
+void sync_file(server_state &state, const std::string &name, catalog_changes &changes) {
+    if (reserved_name(name)) {
+        return;
+    }
+    fs::path path = fs::path(state.files.folder()) / name;
+    /* the file is checked under the lock, so that it can't be removed by DEL in the meantime */
+    std::unique_lock<std::shared_mutex> lock(state.files_mutex);
+    if (state.pending_uploads.count(name)) {
+        return;
+    }
+    boost::system::error_code error;
+    bool present = fs::is_regular_file(path, error);
+    uint64_t size = present ? fs::file_size(path, error) : 0;
+    std::time_t mtime = present ? fs::last_write_time(path, error) : 0;
+    present = present && !error;
+
+    catalog::entry_id id = state.files.find(name);
+    if (id != catalog::npos) {
+        if (present && state.files[id].size == size && state.files[id].mtime == mtime) {
+            return;
+        }
+        state.space->give_back(state.files[id].size);
+        state.hot_files->forget(state.files.path(id));
+        state.files.erase(id);
+        if (!present) {
+            ++changes.removed;
+            return;
+        }
+        ++changes.changed;
+    }
+    else if (!present) {
+        return;
+    }
     else {
-        throw std::invalid_argument("wrong directory");
+        ++changes.added;
     }
+    state.files.insert(name, size, mtime);
+    state.space->take(size);
 }
 
-/** Initialize the UDP socket used to connect with the clients. */
-void initialize_connection(const server_options &options, server_state &state) {
-    struct sockaddr_in local_address{};
+/** Checks every file in the folder and every file in the catalog with @ref sync_file. */
+void rescan_files(server_state &state, catalog_changes &changes) {
+    std::unordered_set<std::string> names;
+    for (fs::directory_iterator it(state.files.folder()); it != fs::directory_iterator(); ++it) {
+        names.insert(it->path().filename().string());
+    }
+    {
+        std::shared_lock<std::shared_mutex> lock(state.files_mutex);
+        state.files.for_each([&names](catalog::entry_id, const file_entry &entry) {
+            names.emplace(entry.name);
+        });
+    }
+    for (const std::string &name : names) {
+        sync_file(state, name, changes);
+    }
+    ++changes.rescans;
+}
 
-    /* opening socket */
-    state.socket = socket(AF_INET, SOCK_DGRAM, 0);
-    if (state.socket < 0) {
-        throw std::runtime_error("socket");
+/** Checks every file in the catalog with @ref sync_file, the folder isn't read. */
+void check_entries(server_state &state, catalog_changes &changes) {
+    std::vector<std::string> names;
+    {
+        std::shared_lock<std::shared_mutex> lock(state.files_mutex);
+        state.files.for_each([&names](catalog::entry_id, const file_entry &entry) {
+            names.emplace_back(entry.name);
+        });
+    }
+    for (const std::string &name : names) {
+        sync_file(state, name, changes);
+    }
+}
+
+/**
+ * Brings the catalog loaded from the snapshot up to date with the shared folder, runs in the background
+ * while the server already answers the clients. Then a fresh snapshot is saved.
+ * If the folder's mtime didn't change, no file was added or removed, but a file rewritten in place
+ * still has a stale size and checksum, so every entry is checked anyway.
+ */
+void reconcile_files(server_state &state) {
+    catalog_changes changes;
+    if (state.folder_changed) {
+        rescan_files(state, changes);
     }
+    else {
+        check_entries(state, changes);
+    }
+    std::cerr << "[CATALOG] reconciled with the folder: added " << changes.added << ", changed "
+              << changes.changed << ", removed " << changes.removed << "\n";
+    std::shared_lock<std::shared_mutex> lock(state.files_mutex);
+    save_snapshot(state.files, state.snapshot_path);
+}
 
-    /* joining the multicast group */
-    state.ip_mreq.imr_interface.s_addr = htonl(INADDR_ANY);
-    if (inet_aton(options.MCAST_ADDR.c_str(), &state.ip_mreq.imr_multiaddr) == 0) {
-        throw std::runtime_error("inet_aton");
+/** Applies the changes reported by @ref server_state.watcher until the folder is gone. */
+void watch_files(server_state &state) {
+    std::vector<std::string> names;
+    for (;;) {
+        watch_result result = state.watcher->wait(names);
+        if (result == watch_result::stopped) {
+            std::cerr << "error: the shared folder is no longer watched\n";
+            return;
+        }
+        for (const std::string &name : names) {
+            sync_file(state, name, state.watched);
+        }
+        if (result == watch_result::overflow) {
+            rescan_files(state, state.watched);
+        }
+    }
+}
+
+/** Runs @ref task on a detached thread, @ref what names it in the error message. */
+void run_in_background(const char *what, std::function<void()> task) {
+    std::thread([what, task = std::move(task)]() {
+        try {
+            task();
+        } catch (const std::exception &e) {
+            std::cerr << "error: " << what << ": " << e.what() << "\n";
+        }
+    }).detach();
+}
+
+/** Starts the background threads keeping the catalog in sync with the shared folder. */
+void start_catalog_threads(server_state &state) {
+    if (state.reconcile) {
+        run_in_background("catalog reconciliation", [&state]() { reconcile_files(state); });
     }
+    if (state.watcher) {
+        run_in_background("folder watcher", [&state]() { watch_files(state); });
+    }
+}
 
-    if (setsockopt(state.socket, IPPROTO_IP, IP_ADD_MEMBERSHIP,
-                   (void *) &state.ip_mreq, sizeof state.ip_mreq) < 0) {
-        throw std::runtime_error("setsockopt");
+/** Where a failed upload of @ref name is kept. */
+std::string partial_path(const server_options &options, std::string_view name) {
+    return options.SHRD_FLDR + "/" + PARTIAL_FOLDER + "/" + std::string(name);
+}
+
+/** Removes the partial uploads older than @ref options.PARTIAL_EXPIRY, at most once per the expiry period. */
+void sweep_partial_uploads(const server_options &options, server_state &state) {
+    std::time_t now = std::time(nullptr);
+    if (options.PARTIAL_EXPIRY == 0 || now < state.next_partial_sweep) {
+        return;
     }
+    state.next_partial_sweep = now + options.PARTIAL_EXPIRY;
 
-    /* local address and port */
-    local_address.sin_family = AF_INET;
-    local_address.sin_addr.s_addr = htonl(INADDR_ANY);
-    local_address.sin_port = htons(options.CMD_PORT);
-    if (bind(state.socket, (struct sockaddr *) &local_address, sizeof local_address) < 0) {
-        throw std::runtime_error("bind");
+    boost::system::error_code error;
+    for (fs::directory_iterator it(fs::path(options.SHRD_FLDR) / PARTIAL_FOLDER, error);
+         it != fs::directory_iterator(); it.increment(error)) {
+        if (error) {
+            break;
+        }
+        if (fs::last_write_time(it->path(), error) + options.PARTIAL_EXPIRY <= now) {
+            fs::remove(it->path(), error);
+        }
     }
 }
 
-/** Check if the request has a valid command. */
-bool command_equal(const SIMPL_CMD &request, const std::string &command) {
-    for (std::size_t i = command.length(); i < request.cmd.length(); ++i) {
-        if (request.cmd[i] != '\0') {
-            return false;
+/** Where an upload of @ref name is received, it's moved to SHRD_FLDR once it's complete. */
+std::string incoming_path(const server_options &options, std::string_view name) {
+    return options.SHRD_FLDR + "/" + INCOMING_FOLDER + "/" + std::string(name);
+}
+
+/**
+ * Creates the folders of the uploads in progress and of the partial ones (if they are kept).
+ * The uploads the server didn't finish last time (it crashed) are kept like the failed ones, the expired
+ * partial uploads are removed.
+ */
+void prepare_partial_uploads(const server_options &options, server_state &state) {
+    fs::path incoming = fs::path(options.SHRD_FLDR) / INCOMING_FOLDER;
+    fs::create_directory(incoming);
+    if (options.PARTIAL_EXPIRY > 0) {
+        fs::create_directory(fs::path(options.SHRD_FLDR) / PARTIAL_FOLDER);
+    }
+    boost::system::error_code error;
+    for (fs::directory_iterator it(incoming, error); it != fs::directory_iterator(); it.increment(error)) {
+        if (error) {
+            break;
+        }
+        std::string name = it->path().filename().string();
+        if (options.PARTIAL_EXPIRY == 0 || rename(it->path().c_str(), partial_path(options, name).c_str()) < 0) {
+            fs::remove(it->path(), error);
         }
     }
-    return request.cmd.substr(0, command.length()) == command;
+    sweep_partial_uploads(options, state);
+}
+
+/** Initialize the UDP sockets used to connect with the clients, one for every control thread. */
+void initialize_connection(const server_options &options, server_state &state) {
+    struct sockaddr_in local_address{};
+
+    /* the multicast group */
+    state.ip_mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+    if (inet_aton(options.MCAST_ADDR.c_str(), &state.ip_mreq.imr_multiaddr) == 0) {
+        throw std::runtime_error("inet_aton");
+    }
+
+    for (std::size_t i = 0; i < options.CONTROL_THREADS; ++i) {
+        auto control = std::make_unique<control_thread>();
+        control->index = i;
+
+        /* opening socket */
+        control->socket = socket(AF_INET, SOCK_DGRAM, 0);
+        if (control->socket < 0) {
+            throw std::runtime_error("socket");
+        }
+        if (options.CONTROL_THREADS > 1) {
+            set_socket_option(control->socket, 1, SOL_SOCKET, SO_REUSEPORT, "setsockopt reuseport");
+            /* tells apart the multicast requests (copied to every socket) from the unicast ones */
+            set_socket_option(control->socket, 1, IPPROTO_IP, IP_PKTINFO, "setsockopt pktinfo");
+        }
+
+        /* joining the multicast group */
+        if (setsockopt(control->socket, IPPROTO_IP, IP_ADD_MEMBERSHIP,
+                       (void *) &state.ip_mreq, sizeof state.ip_mreq) < 0) {
+            throw std::runtime_error("setsockopt");
+        }
+
+        /* local address and port */
+        local_address.sin_family = AF_INET;
+        local_address.sin_addr.s_addr = htonl(INADDR_ANY);
+        local_address.sin_port = htons(options.CMD_PORT);
+        if (bind(control->socket, (struct sockaddr *) &local_address, sizeof local_address) < 0) {
+            throw std::runtime_error("bind");
+        }
+        state.control.push_back(std::move(control));
+    }
 }
 
 /** Handle the clients "discover" message. */
 void
-discover(server_state &state, server_options &options, const struct sockaddr_in &client_address, SIMPL_CMD &request) {
-    if (check_data_empty(request, client_address)) {
-        send_complex_message(state.socket, client_address, "GOOD_DAY", options.MCAST_ADDR, request.cmd_seq,
-                             state.available_space);
+discover(server_state &state, server_options &options, send_batch &replies, const struct sockaddr_in &client_address,
+         const simpl_view &request) {
+    simpl_view hello = request;
+    hello.data = base_data(request.data);
+    if (check_data_empty(hello, client_address)) {
+        std::string_view data = options.MCAST_ADDR;
+        if (asks_extension(request.data, "queue")) {
+            /* the clients steer away from the servers with many transfers waiting */
+            data = replies.keep(add_extension(data, "queue", std::to_string(state.transfers->queued())));
+        }
+        replies.add_complex(client_address, "GOOD_DAY", request.cmd_seq, state.space->available(), data);
     }
 }
 
 /** Handle the clients "remove" message. */
-void remove(server_state &state, const struct sockaddr_in &client_address, SIMPL_CMD &request) {
+void remove(server_state &state, const struct sockaddr_in &client_address, const simpl_view &request) {
     if (check_data_not_empty(request, client_address)) {
-        const std::string &target_file_name = request.data;
-        auto it = state.files.begin();
-
-        for (; (it != state.files.end()) && (it->filename().string() != target_file_name); ++it) {}
-        if (it != state.files.end()) {
-            std::size_t size = file_size(*it);
-            if (state.negative_space > 0) {
-                if (state.negative_space > size) {
-                    state.negative_space -= size;
-                }
-                else {
-                    size -= state.negative_space;
-                    state.negative_space = 0;
-                    state.available_space += size;
-                }
-            }
-            else {
-                state.available_space += size;
-            }
-            fs::remove(*it);
-            state.files.erase(it);
+        std::unique_lock<std::shared_mutex> lock(state.files_mutex);
+        catalog::entry_id id = state.files.find(request.data);
+        if (id != catalog::npos) {
+            state.space->give_back(state.files[id].size);
+            state.hot_files->forget(state.files.path(id));
+            fs::remove(state.files.path(id));
+            state.files.erase(id);
         }
     }
 }
 
+/**
+ * Handle the "statistics" message: the metrics in the Prometheus text format,
+ * split between as many MY_STATS replies as needed (at the line ends).
+ */
+void report_stats(server_state &state, send_batch &replies, const struct sockaddr_in &client_address,
+                  const simpl_view &request) {
+    std::string text;
+    state.metrics->prometheus(text);
+    write_gauge(text, "netstore_active_transfers", "Transfers announced or in progress.",
+                (double) state.transfers->active());
+    write_gauge(text, "netstore_queued_transfers", "Connected transfers waiting for their slot.",
+                (double) state.transfers->queued());
+    write_gauge(text, "netstore_free_space_bytes", "Space left for the uploads.", (double) state.space->available());
+    {
+        std::shared_lock<std::shared_mutex> lock(state.files_mutex);
+        write_gauge(text, "netstore_files", "Files in the shared folder.", (double) state.files.size());
+    }
+
+    std::string_view rest = text;
+    while (!rest.empty()) {
+        std::size_t length = rest.size();
+        if (length > MAX_SIMPL_DATA_LEN) {
+            std::size_t line_end = rest.rfind('\n', MAX_SIMPL_DATA_LEN - 1);
+            /* a line longer than a datagram is cut where the datagram ends */
+            length = line_end == std::string_view::npos ? MAX_SIMPL_DATA_LEN : line_end + 1;
+        }
+        replies.add_simple(client_address, "MY_STATS", request.cmd_seq,
+                           replies.keep(std::string(rest.substr(0, length))));
+        rest.remove_prefix(length);
+    }
+}
+
 /** Handle the clients "search" message. */
-void list(server_state &state, const struct sockaddr_in &client_address, SIMPL_CMD &request) {
-    std::string &target_file_name = request.data;
-    std::list<std::string> results;
-    for (const fs::path &file : state.files) {
-        std::string file_name = file.filename().string();
-        if (file_name.find(target_file_name) != std::string::npos) {
-            results.push_back(file_name);
-        }
-    }
-
-    std::string data;
-
-    while (!results.empty()) {
-        if (!results.empty()) {
-            std::string current = results.front();
-            data = current;
-            results.pop_front();
-            /* prepare one UDP packet */
-            while (!results.empty() && data.size() + current.size() + 1 < MAX_SIMPL_DATA_LEN) {
-                current = results.front();
-                results.pop_front();
-                data += "\n" + current;
-            }
+void list(server_state &state, send_batch &replies, const struct sockaddr_in &client_address,
+               const simpl_view &request) {
+    std::string_view target_file_name = request.data;
+    std::shared_ptr<const list_reply> reply;
+    {
+        std::shared_lock<std::shared_mutex> lock(state.files_mutex);
+        uint64_t version = state.files.version();
+        reply = state.list_replies->find(target_file_name, version);
+        if (!reply) {
+            std::vector<std::string_view> results;
+            state.files.search(target_file_name, [&](catalog::entry_id, const file_entry &file) {
+                results.push_back(file.name);
+            });
+            auto new_reply = std::make_shared<list_reply>();
+            new_reply->version = version;
+            new_reply->packets = pack_names(results);
+            reply = new_reply;
+            state.list_replies->store(target_file_name, reply);
         }
-        send_simple_message(state.socket, client_address, "MY_LIST", data, request.cmd_seq);
-        data.clear();
     }
+
+    /* the cached payloads are sent as they are, only the headers are built */
+    for (const std::string &data : reply->packets) {
+        replies.add_simple(client_address, "MY_LIST", request.cmd_seq, data);
+    }
+    replies.hold(std::move(reply));
+}
+
+/**
+ * Handle the clients paged "search" message: the sorted matching names after the cursor,
+ * as many as fit in a datagram (or as asked for).
+ */
+void list_page(server_state &state, send_batch &replies, const struct sockaddr_in &client_address,
+               const cmplx_view &request) {
+    std::string_view query = base_data(request.data);
+    std::string_view after;
+    bool first = !find_extension(request.data, "after", after);
+    std::shared_ptr<const list_reply> reply;
+    {
+        std::shared_lock<std::shared_mutex> lock(state.files_mutex);
+        uint64_t version = state.files.version();
+        reply = state.page_replies->find(query, version);
+        if (!reply) {
+            auto new_reply = std::make_shared<list_reply>();
+            new_reply->version = version;
+            state.files.search(query, [&](catalog::entry_id, const file_entry &file) {
+                new_reply->sorted.emplace_back(file.name);
+            });
+            std::sort(new_reply->sorted.begin(), new_reply->sorted.end());
+            reply = new_reply;
+            state.page_replies->store(query, reply);
+        }
+    }
+
+    const std::vector<std::string> &names = reply->sorted;
+    if (first && names.empty()) {
+        return;
+    }
+    /* the names are looked up by the cursor, the files added or removed meanwhile don't shift the pages */
+    auto it = first ? names.begin() : std::upper_bound(names.begin(), names.end(), after);
+    std::string page;
+    std::string_view previous;
+    for (uint64_t count = 0; it != names.end() && (request.param == 0 || count < request.param); ++it, ++count) {
+        if (page.size() + page_entry_len(previous, *it) > MAX_CMPLX_DATA_LEN) {
+            break;
+        }
+        encode_page_entry(page, previous, *it);
+        previous = *it;
+    }
+    replies.add_complex(client_address, "MY_PAGE", request.cmd_seq, names.size(), replies.keep(std::move(page)));
 }
 
 /** Creates a TCP socket used to transfer files between the client and the server. */
@@ -306,227 +811,611 @@ create_tcp_socket(int &sock, struct sockaddr_in &server_tcp,
     }
 }
 
-/** Handles the transfer of a file to the client. */
-void send_file(server_options &options, server_state &state, const struct sockaddr_in &client_udp,
-               SIMPL_CMD &request, const fs::path &path) {
-    int sock, msg_sock;
+/**
+ * Creates a job for the transfer engine, the client has TIMEOUT seconds to connect,
+ * then the transfer is aborted if it stalls for TIMEOUT seconds.
+ */
+transfer_job create_transfer_job(server_options &options, transfer_kind kind, const struct sockaddr_in &client,
+                                 int sock, std::string path, uint64_t offset, uint64_t length) {
+    transfer_job job;
+    job.kind = kind;
+    job.client = client.sin_addr.s_addr;
+    job.listen_socket = sock;
+    job.path = std::move(path);
+    job.offset = offset;
+    job.length = length;
+    job.accept_deadline = std::chrono::steady_clock::now() + std::chrono::seconds(options.TIMEOUT);
+    job.idle_timeout = std::chrono::seconds(options.TIMEOUT);
+    return job;
+}
+
+/** Checks if the request asks for a compressed transfer (the "compress" extension) and the server allows it. */
+bool wants_compression(server_options &options, std::string_view data) {
+    std::string_view method;
+    return options.COMPRESSION && find_extension(data, "compress", method) && method == COMPRESSION_NAME;
+}
+
+/**
+ * Opens a TCP socket for the file transfer and hands the file over to the transfer engine.
+ * @param [in] data Data of the CONNECT_ME reply (the file name with the extensions).
+ * @param [in] offset, length Part of the file sent.
+ * @param [in] compress Deflate the file on the way, @ref data has to announce it.
+ * @param [in] on_done If set, the checksum of the sent bytes is computed and passed to it.
+ */
+void send_file(server_options &options, server_state &state, send_batch &replies,
+               const struct sockaddr_in &client_udp, uint64_t cmd_seq, std::string_view data, std::string path,
+               uint64_t offset, uint64_t length, bool compress,
+               std::function<void(const transfer_result &)> on_done = nullptr) {
+    int sock;
     struct sockaddr_in server_tcp{};
-    struct sockaddr_in client_tcp{};
-    socklen_t client_tcp_len = sizeof client_tcp;
     socklen_t server_tcp_len = sizeof server_tcp;
-    ssize_t snd_len;
 
     create_tcp_socket(sock, server_tcp, server_tcp_len);
-    struct timeval wait_time{options.TIMEOUT, 0};
-    fd_set fds;
-    FD_ZERO(&fds);
-    FD_SET(sock, &fds);
-    char buffer[BSIZE];
-
-    send_complex_message(state.socket, client_udp, "CONNECT_ME", request.data, request.cmd_seq,
-                         ntohs(server_tcp.sin_port));
-
-    /* wait TIMEOUT to connect */
-    if (select(sock + 1, &fds, nullptr, nullptr, &wait_time)) {
-        client_tcp_len = sizeof(client_tcp);
-        msg_sock = accept(sock, (struct sockaddr *) &client_tcp, &client_tcp_len);
-        if (msg_sock < 0) {
-            throw std::runtime_error("accept");
-        }
-
-        int fd, read_len;
-        if ((fd = open(path.string().c_str(), O_RDONLY)) < 0) {
-            throw std::runtime_error("open");
-        }
-        while ((read_len = read(fd, buffer, BSIZE)) > 0) {
-            snd_len = write(msg_sock, buffer, read_len);
-            if (snd_len != read_len) {
-                throw std::runtime_error("writing to client socket");
-            }
-        }
-        if (read_len < 0) {
-            throw std::runtime_error("read");
-        }
-        if (close(msg_sock) < 0)
-            throw std::runtime_error("close");
+    replies.add_complex(client_udp, "CONNECT_ME", cmd_seq, ntohs(server_tcp.sin_port), data);
+    transfer_job job = create_transfer_job(options, transfer_kind::send, client_udp, sock, std::move(path), offset, length);
+    job.checksum = on_done != nullptr;
+    job.compress = compress;
+    job.on_done = std::move(on_done);
+    state.transfers->submit(std::move(job));
+}
+
+/**
+ * Data of a reply about the file @ref id: its @ref name (from the request, it outlives the lock)
+ * and its checksum if known. The caller holds the files lock.
+ */
+std::string_view file_data(server_state &state, send_batch &replies, catalog::entry_id id, std::string_view name) {
+    const file_entry &entry = state.files[id];
+    if (!entry.checksummed) {
+        return name;
     }
+    return replies.keep(add_extension(name, "crc32c", crc32c_string(entry.checksum)));
+}
 
-    close(state.socket);
-    close(sock);
-    exit(0);
+/**
+ * Stores the checksum computed while the file @ref name was sent (if it was sent whole),
+ * unless the file was replaced in the meantime.
+ */
+std::function<void(const transfer_result &)> remember_checksum(server_state &state, std::string name, uint64_t size,
+                                                              std::time_t mtime) {
+    return [&state, name = std::move(name), size, mtime](const transfer_result &result) {
+        if (!result.success || !result.checksummed) {
+            return;
+        }
+        std::unique_lock<std::shared_mutex> lock(state.files_mutex);
+        catalog::entry_id id = state.files.find(name);
+        if (id != catalog::npos && state.files[id].size == size && state.files[id].mtime == mtime) {
+            state.files[id].checksummed = true;
+            state.files[id].checksum = result.checksum;
+        }
+    };
 }
 
 /** Handle the clients "fetch" message. */
 void
-fetch(server_options &options, server_state &state, const struct sockaddr_in &client_address, SIMPL_CMD &request) {
-    for (const fs::path &file : state.files) {
-        if (file.filename().string() == request.data) {
-            switch (fork()) {
-                case -1:
-                    throw std::runtime_error("fork");
-                case 0:
-                    send_file(options, state, client_address, request, file);
-                    break;
-                default:
-                    break;
-            }
-            return;
-        }
+fetch(server_options &options, server_state &state, send_batch &replies, const struct sockaddr_in &client_address,
+      const simpl_view &request) {
+    std::string_view name = base_data(request.data);
+    std::shared_lock<std::shared_mutex> lock(state.files_mutex);
+    catalog::entry_id id = state.files.find(name);
+    if (id == catalog::npos) {
+        error_message(client_address, "Invalid file name.");
+        return;
+    }
+    std::string path = state.files.path(id);
+    const file_entry &entry = state.files[id];
+    uint64_t size = entry.size;
+    std::time_t mtime = entry.mtime;
+    /* the baseline clients never ask for the checksum */
+    std::string_view data = asks_extension(request.data, "crc32c") ? file_data(state, replies, id, name) : name;
+    bool checksummed = entry.checksummed;
+    lock.unlock();
+
+    /* the sample is read without the lock, the file is picked by its first bytes */
+    bool compress = wants_compression(options, request.data) && worth_compressing(path);
+    if (compress) {
+        data = replies.keep(add_extension(data, "compress", COMPRESSION_NAME));
+    }
+    if (checksummed || !options.CHECKSUMS) {
+        send_file(options, state, replies, client_address, request.cmd_seq, data, std::move(path), 0, size, compress);
+        return;
+    }
+    /* the checksum isn't known yet, this transfer goes through the copy loop to compute it */
+    send_file(options, state, replies, client_address, request.cmd_seq, data, std::move(path), 0, size, compress,
+              remember_checksum(state, std::string(name), size, mtime));
+}
+
+/** Handle the clients "fetch a part of a file" message. */
+void fetch_range(server_options &options, server_state &state, send_batch &replies,
+                 const struct sockaddr_in &client_address, const cmplx_view &request) {
+    uint64_t length;
+    std::string_view name;
+    if (!decode_range_data(request.data, length, name)) {
+        error_message(client_address, "No data.");
+        return;
+    }
+
+    std::shared_lock<std::shared_mutex> lock(state.files_mutex);
+    catalog::entry_id id = state.files.find(name);
+    if (id == catalog::npos) {
+        error_message(client_address, "Invalid file name.");
+        return;
+    }
+    uint64_t size = state.files[id].size;
+    if (request.param > size) {
+        error_message(client_address, "Offset past the end of the file.");
+        return;
+    }
+    std::string path = state.files.path(id);
+    /* length 0 means up to the end of the file */
+    uint64_t rest = size - request.param;
+    bool to_end = length == 0 || length >= rest;
+    /* the client resuming a download checks the whole file */
+    std::string_view data = to_end ? file_data(state, replies, id, name) : name;
+    lock.unlock();
+
+    send_file(options, state, replies, client_address, request.cmd_seq, data, std::move(path), request.param,
+              to_end ? rest : length, false);
+}
+
+/** Handle the clients "file size" message. */
+void file_stat(server_state &state, send_batch &replies, const struct sockaddr_in &client_address,
+               const simpl_view &request) {
+    std::shared_lock<std::shared_mutex> lock(state.files_mutex);
+    catalog::entry_id id = state.files.find(request.data);
+    if (id != catalog::npos) {
+        replies.add_complex(client_address, "FILE_SIZE", request.cmd_seq, state.files[id].size,
+                            file_data(state, replies, id, request.data));
+        return;
     }
     error_message(client_address, "Invalid file name.");
 }
 
-/** Handles the transfer of a file from the client. */
-void receive_file(server_options &options, server_state &state, const struct sockaddr_in &client_udp,
-                  CMPLX_CMD &request) {
-    int sock, msg_sock;
+/**
+ * Ends an upload reserved by @ref reserve_upload: a saved file joins the catalog (replacing an entry
+ * of the same name) and its reservation is committed, otherwise the reservation is rolled back.
+ * @param [in] checksum Store the checksum of the received bytes (they are the whole file).
+ */
+std::function<void(const transfer_result &)> finish_upload(server_state &state, std::string name, uint64_t size,
+                                                          bool checksum) {
+    return [&state, name = std::move(name), size, checksum](const transfer_result &result) {
+        std::unique_lock<std::shared_mutex> lock(state.files_mutex);
+        state.pending_uploads.erase(name);
+        if (result.success) {
+            state.hot_files->forget(state.files.folder() + "/" + name);
+            /* the name may already be in the catalog (e.g. added by a rescan), the old entry is replaced */
+            catalog::entry_id old = state.files.find(name);
+            if (old != catalog::npos) {
+                state.space->give_back(state.files[old].size);
+                state.files.erase(old);
+            }
+            std::time_t now = std::time(nullptr);
+            catalog::entry_id id = state.files.insert(name, size, file_mtime(state.files.folder() + "/" + name, now));
+            if (checksum) {
+                state.files[id].checksummed = true;
+                state.files[id].checksum = result.checksum;
+            }
+            state.space->commit(size);
+        }
+        else {
+            state.space->rollback(size);
+        }
+    };
+}
+
+/**
+ * Opens a TCP socket for the file transfer and lets the transfer engine receive the file.
+ * The space of the file is already reserved: when the file is saved, the reservation is committed
+ * and the file joins the catalog, when the transfer fails or times out, the reservation is rolled back.
+ * @param [in] offset Bytes of the file already received (a resumed upload), answered with CAN_RESUME.
+ * @param [in] compress The file comes deflated, announced in the CAN_ADD.
+ */
+void receive_file(server_options &options, server_state &state, send_batch &replies,
+                  const struct sockaddr_in &client_udp, const cmplx_view &request, bool resume, uint64_t offset,
+                  bool compress) {
+    int sock;
     struct sockaddr_in server_tcp{};
-    struct sockaddr_in client_tcp{};
-    socklen_t client_tcp_len = sizeof client_tcp;
     socklen_t server_tcp_len = sizeof server_tcp;
-    ssize_t write_len;
-    ssize_t remaining_file_size = request.param;
 
     create_tcp_socket(sock, server_tcp, server_tcp_len);
-    struct timeval wait_time{options.TIMEOUT, 0};
-    fd_set fds;
-    bool error_occurred = false;
-    FD_ZERO(&fds);
-    FD_SET(sock, &fds);
-    char buffer[BSIZE];
-    std::string filename = options.SHRD_FLDR + "/" + request.data;
-
-    send_complex_message(state.socket, client_udp, "CAN_ADD", "", request.cmd_seq,
-                         ntohs(server_tcp.sin_port));
-
-    /* wait TIMEOUT to connect */
-    if (select(sock + 1, &fds, nullptr, nullptr, &wait_time)) {
-        client_tcp_len = sizeof(client_tcp);
-        msg_sock = accept(sock, (struct sockaddr *) &client_tcp, &client_tcp_len);
-        if (msg_sock < 0) {
-            throw std::runtime_error("accept");
-        }
-
-        int fd;
-        ssize_t read_len;
-        if ((fd = open(filename.c_str(), O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0) {
-            throw std::runtime_error("open");
-        }
-        state.open_files.insert(filename); /* marks the opening of the file */
-        read_len = read(msg_sock, buffer, BSIZE);
-        while (remaining_file_size > 0 && read_len > 0 && !error_occurred) {
-            ssize_t to_write_len = std::min(read_len, remaining_file_size);
-            write_len = write(fd, buffer, to_write_len);
-            if (write_len != to_write_len) {
-                error_occurred = true;
-            }
-            remaining_file_size -= write_len;
-            read_len = read(msg_sock, buffer, BSIZE);
-        }
-        if (read_len < 0 || remaining_file_size != 0) {
-            error_occurred = true;
-        }
-        if (close(msg_sock) < 0) {
-            throw std::runtime_error("close");
+    if (resume) {
+        std::string data(sizeof(uint64_t), '\0');
+        write_be64(&data[0], offset);
+        replies.add_complex(client_udp, "CAN_RESUME", request.cmd_seq, ntohs(server_tcp.sin_port),
+                            replies.keep(std::move(data)));
+    }
+    else {
+        replies.add_complex(client_udp, "CAN_ADD", request.cmd_seq, ntohs(server_tcp.sin_port),
+                            compress ? replies.keep(add_extension("", "compress", COMPRESSION_NAME)) : "");
+    }
+
+    /* the file is received aside, it's never seen in SHRD_FLDR before it's complete */
+    transfer_job job = create_transfer_job(options, transfer_kind::receive, client_udp, sock,
+                                           incoming_path(options, request.data), offset, request.param);
+    job.final_path = options.SHRD_FLDR + "/" + std::string(request.data);
+    job.compress = compress;
+    if (options.PARTIAL_EXPIRY > 0) {
+        job.partial_path = partial_path(options, request.data);
+    }
+    /* the checksum of a resumed upload covers only the resumed part */
+    job.on_done = finish_upload(state, std::string(request.data), request.param, options.CHECKSUMS && offset == 0);
+    uint64_t job_id = state.transfers->submit(std::move(job));
+
+    /* the transfer may have ended already, then the name is no longer pending (or pending for someone else) */
+    std::unique_lock<std::shared_mutex> lock(state.files_mutex);
+    auto pending = state.pending_uploads.find(request.data);
+    if (pending != state.pending_uploads.end() && pending->second.cmd_seq == request.cmd_seq &&
+        same_address(pending->second.client, client_udp)) {
+        pending->second.submitted = true;
+        pending->second.job = job_id;
+        if (pending->second.cancelled) {
+            state.transfers->cancel(job_id);
         }
     }
+}
 
-    if (error_occurred) {
-        unlink(filename.c_str());
+/**
+ * Checks if the file from the clients "upload" message can be added and reserves its space.
+ * The caller holds the files lock.
+ */
+bool reserve_upload(server_state &state, const struct sockaddr_in &client_address, const cmplx_view &request) {
+    bool exists = state.files.find(request.data) != catalog::npos ||
+                  state.pending_uploads.find(request.data) != state.pending_uploads.end();
+
+    /* checks if such a file already exists (or is being uploaded), if the file name
+     * contains a '/', if the file name is empty, then the available space */
+    if (exists || request.data.find('/') != std::string::npos || request.data.empty() || reserved_name(request.data) ||
+        !state.space->reserve(request.param)) {
+        return false;
     }
-    state.open_files.erase(filename); /* marks the closing of the file */
-    close(state.socket);
-    close(sock);
-    exit(0);
+    pending_upload pending;
+    pending.client = client_address;
+    pending.cmd_seq = request.cmd_seq;
+    state.pending_uploads.emplace(request.data, pending);
+    return true;
 }
 
 /** Handle the clients "upload" message. */
 void
-upload(server_options &options, server_state &state, const struct sockaddr_in &client_address, CMPLX_CMD &request) {
-    bool exists = false;
-    for (auto &file : state.files) {
-        if (file.filename().string() == request.data) {
-            exists = true;
-            break;
-        }
+upload(server_options &options, server_state &state, send_batch &replies, const struct sockaddr_in &client_address,
+       const cmplx_view &request) {
+    /* the extensions (compression) aren't a part of the name */
+    cmplx_view file = request;
+    file.data = base_data(request.data);
+    std::unique_lock<std::shared_mutex> lock(state.files_mutex);
+    sweep_partial_uploads(options, state);
+    if (!reserve_upload(state, client_address, file)) {
+        replies.add_simple(client_address, "NO_WAY", request.cmd_seq, file.data);
+    }
+    else {
+        lock.unlock();
+        /* a new upload replaces the old partial one */
+        unlink(partial_path(options, file.data).c_str());
+        receive_file(options, state, replies, client_address, file, false, 0,
+                     wants_compression(options, request.data));
+    }
+}
+
+/**
+ * Handle the clients "resume an upload" message: like "upload",
+ * but the part of the file kept after a failed upload isn't sent again.
+ */
+void upload_resume(server_options &options, server_state &state, send_batch &replies,
+                   const struct sockaddr_in &client_address, const cmplx_view &request) {
+    std::unique_lock<std::shared_mutex> lock(state.files_mutex);
+    sweep_partial_uploads(options, state);
+    if (options.PARTIAL_EXPIRY == 0 || !reserve_upload(state, client_address, request)) {
+        replies.add_simple(client_address, "NO_WAY", request.cmd_seq, request.data);
+        return;
     }
 
-    /* checks available space, if such a file already exists, if the file name
-     * contains a '/', if the file name is empty */
-    if (state.available_space < request.param || exists ||
-        request.data.find('/') != std::string::npos || request.data.empty()) {
-        send_simple_message(state.socket, client_address, "NO_WAY", request.data, request.cmd_seq);
+    /* the kept part is moved back in place, the upload starts over if it's missing, expired or too big */
+    std::string kept = partial_path(options, request.data);
+    std::string path = incoming_path(options, request.data);
+    uint64_t offset = 0;
+    struct stat info{};
+    if (stat(kept.c_str(), &info) == 0 && S_ISREG(info.st_mode) &&
+        info.st_mtime + options.PARTIAL_EXPIRY > std::time(nullptr) && (uint64_t) info.st_size <= request.param &&
+        rename(kept.c_str(), path.c_str()) == 0) {
+        offset = info.st_size;
+    }
+    lock.unlock();
+    receive_file(options, state, replies, client_address, request, true, offset, false);
+}
+
+/**
+ * The requests of the sessions, answered like GET and ADD
+ * (with a session the client doesn't have to cancel anything, there are no reservations waiting for it).
+ */
+std::shared_ptr<const session_handler> create_session_handler(server_options &options, server_state &state) {
+    auto handler = std::make_shared<session_handler>();
+    handler->open_get = [&options, &state](std::string_view name, session_file &file) {
+        std::shared_lock<std::shared_mutex> lock(state.files_mutex);
+        catalog::entry_id id = state.files.find(name);
+        if (id == catalog::npos) {
+            return false;
+        }
+        const file_entry &entry = state.files[id];
+        file.path = state.files.path(id);
+        file.size = entry.size;
+        file.data = entry.checksummed ? add_extension(name, "crc32c", crc32c_string(entry.checksum))
+                                      : std::string(name);
+        if (!entry.checksummed && options.CHECKSUMS) {
+            file.checksum = true;
+            file.on_done = remember_checksum(state, std::string(name), entry.size, entry.mtime);
+        }
+        return true;
+    };
+    handler->open_add = [&options, &state](std::string_view name, uint64_t size, session_file &file) {
+        cmplx_view request;
+        request.param = size;
+        request.data = name;
+        std::unique_lock<std::shared_mutex> lock(state.files_mutex);
+        sweep_partial_uploads(options, state);
+        if (!reserve_upload(state, {}, request)) {
+            return false;
+        }
+        lock.unlock();
+        unlink(partial_path(options, name).c_str());
+        file.path = incoming_path(options, name);
+        file.final_path = options.SHRD_FLDR + "/" + std::string(name);
+        file.preallocate = options.PREALLOCATE;
+        file.data = std::string(name);
+        file.on_done = finish_upload(state, std::string(name), size, options.CHECKSUMS);
+        return true;
+    };
+    return handler;
+}
+
+/** Handle the clients "open a session" message: the client connects to the announced port. */
+void open_session(server_options &options, server_state &state, send_batch &replies,
+                  const struct sockaddr_in &client_address, const simpl_view &request) {
+    int sock;
+    struct sockaddr_in server_tcp{};
+    socklen_t server_tcp_len = sizeof server_tcp;
+
+    create_tcp_socket(sock, server_tcp, server_tcp_len);
+    replies.add_complex(client_address, "SESSION_OK", request.cmd_seq, ntohs(server_tcp.sin_port), "");
+
+    transfer_job job = create_transfer_job(options, transfer_kind::session, client_address, sock,
+                                           std::string("session of ") + inet_ntoa(client_address.sin_addr), 0, 0);
+    job.idle_timeout = std::chrono::seconds(options.SESSION_IDLE);
+    job.session = state.sessions;
+    state.transfers->submit(std::move(job));
+}
+
+/**
+ * Handle the clients "cancel the upload" message: the client got more CAN_ADDs than it needs
+ * (it asked many servers at once) and won't connect. The reservation is rolled back at once
+ * instead of after the timeout. Only the client that sent the ADD can cancel it; there is no answer.
+ */
+void cancel_upload(server_state &state, const struct sockaddr_in &client_address, const simpl_view &request) {
+    std::unique_lock<std::shared_mutex> lock(state.files_mutex);
+    auto pending = state.pending_uploads.find(request.data);
+    if (pending == state.pending_uploads.end() || pending->second.cmd_seq != request.cmd_seq ||
+        !same_address(pending->second.client, client_address)) {
+        error_message(client_address, "No such upload.");
+        return;
+    }
+    if (pending->second.submitted) {
+        state.transfers->cancel(pending->second.job); /* ignored if the client already connected */
     }
     else {
-        state.available_space -= request.param;
-        fs::path new_file(options.SHRD_FLDR + "/" + request.data);
-        state.files.push_back(new_file);
-        switch (fork()) {
-            case -1:
-                throw std::runtime_error("fork");
-            case 0:
-                receive_file(options, state, client_address, request);
-                break;
-            default:
-                break;
+        pending->second.cancelled = true;
+    }
+}
+
+/** Handler of a request that is a SIMPL_CMD. */
+using simple_handler = void (*)(server_options &, server_state &, send_batch &, const struct sockaddr_in &,
+                                const simpl_view &);
+/** Handler of a request that is a CMPLX_CMD. */
+using complex_handler = void (*)(server_options &, server_state &, send_batch &, const struct sockaddr_in &,
+                                 const cmplx_view &);
+
+template<typename H>
+struct route {
+    command_key key;
+    H handler;
+};
+
+/** The SIMPL_CMD requests, by their packed command. */
+constexpr route<simple_handler> SIMPLE_ROUTES[] = {
+        {make_command_key("HELLO"),
+                [](server_options &options, server_state &state, send_batch &replies,
+                   const struct sockaddr_in &client_address, const simpl_view &request) {
+                    discover(state, options, replies, client_address, request);
+                }},
+        {make_command_key("LIST"),
+                [](server_options &, server_state &state, send_batch &replies,
+                   const struct sockaddr_in &client_address, const simpl_view &request) {
+                    list(state, replies, client_address, request);
+                }},
+        {make_command_key("GET"),
+                [](server_options &options, server_state &state, send_batch &replies,
+                   const struct sockaddr_in &client_address, const simpl_view &request) {
+                    fetch(options, state, replies, client_address, request);
+                }},
+        {make_command_key("DEL"),
+                [](server_options &, server_state &state, send_batch &,
+                   const struct sockaddr_in &client_address, const simpl_view &request) {
+                    remove(state, client_address, request);
+                }},
+        {make_command_key("STAT"),
+                [](server_options &, server_state &state, send_batch &replies,
+                   const struct sockaddr_in &client_address, const simpl_view &request) {
+                    file_stat(state, replies, client_address, request);
+                }},
+        {make_command_key("CANCEL_ADD"),
+                [](server_options &, server_state &state, send_batch &,
+                   const struct sockaddr_in &client_address, const simpl_view &request) {
+                    cancel_upload(state, client_address, request);
+                }},
+        {make_command_key("SESSION"),
+                [](server_options &options, server_state &state, send_batch &replies,
+                   const struct sockaddr_in &client_address, const simpl_view &request) {
+                    open_session(options, state, replies, client_address, request);
+                }},
+        {make_command_key("STATS"),
+                [](server_options &, server_state &state, send_batch &replies,
+                   const struct sockaddr_in &client_address, const simpl_view &request) {
+                    report_stats(state, replies, client_address, request);
+                }},
+};
+
+/** The CMPLX_CMD requests, by their packed command. */
+constexpr route<complex_handler> COMPLEX_ROUTES[] = {
+        {make_command_key("ADD"), upload},
+        {make_command_key("ADD_RESUME"), upload_resume},
+        {make_command_key("GET_RANGE"), fetch_range},
+        {make_command_key("LIST_PAGE"),
+                [](server_options &, server_state &state, send_batch &replies,
+                   const struct sockaddr_in &client_address, const cmplx_view &request) {
+                    list_page(state, replies, client_address, request);
+                }},
+};
+
+/**
+ * Handles a single datagram.
+ * The command is looked up by its packed key in the route tables, the unknown ones are rejected
+ * before anything else is read or allocated.
+ * @param [in] buffer The datagram, it has to stay valid until @ref replies are flushed.
+ */
+void handle_request(server_options &options, server_state &state, send_batch &replies,
+                    const struct sockaddr_in &client_address, const char *buffer, ssize_t rcv_len) {
+    if (message_too_short<simpl_view>(client_address, rcv_len)) {
+        return;
+    }
+
+    command_key key = load_command_key(buffer);
+    for (const route<simple_handler> &route : SIMPLE_ROUTES) {
+        if (route.key == key) {
+            simpl_view request;
+            decode(buffer, rcv_len, request);
+            route.handler(options, state, replies, client_address, request);
+            return;
         }
     }
+    for (const route<complex_handler> &route : COMPLEX_ROUTES) {
+        if (route.key == key) {
+            if (message_too_short<cmplx_view>(client_address, rcv_len)) {
+                return;
+            }
+            cmplx_view request;
+            decode(buffer, rcv_len, request);
+            route.handler(options, state, replies, client_address, request);
+            return;
+        }
+    }
+    error_message(client_address, "Invalid cmd.");
+}
+
+/** Picks the control thread responsible for a multicast request from @ref address. */
+std::size_t shard(const struct sockaddr_in &address, std::size_t shards) {
+    uint64_t key = ((uint64_t) address.sin_addr.s_addr << 16) | address.sin_port;
+    return (key * 0x9E3779B97F4A7C15ULL >> 32) % shards;
 }
 
-/** Server loop. */
-void read_requests(server_options &options, server_state &state) {
-    /* data received */
-    char buffer[BSIZE];
-    ssize_t rcv_len;
-    struct sockaddr_in client_address{};
-    socklen_t addrlen = sizeof client_address;
+/** Control thread loop, takes the waiting datagrams in batches and sends the replies in batches. */
+void read_requests(server_options &options, server_state &state, control_thread &control) {
+    receive_batch requests(options.UDP_BATCH);
+    send_batch replies(control.socket, options.UDP_BATCH, control.udp_stats);
+    std::size_t shards = state.control.size();
 
     for (;;) {
-        /* read */
-        rcv_len = recvfrom(state.socket, buffer, sizeof buffer, 0, (struct sockaddr *) &client_address, &addrlen);
-        if (rcv_len < 0) {
-            throw std::runtime_error("read");
+        std::size_t count = requests.receive(control.socket, control.udp_stats);
+        if (state.stopping) {
+            return;
         }
-        else {
-            if (message_too_short<SIMPL_CMD>(client_address, rcv_len)) {
+        for (std::size_t i = 0; i < count; ++i) {
+            if (shards > 1 && requests.multicast(i) && shard(requests.address(i), shards) != control.index) {
+                ++control.skipped;
                 continue;
             }
+            ++control.handled;
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            handle_request(options, state, replies, requests.address(i), requests.data(i), requests.length(i));
+            std::string_view cmd(requests.data(i), std::min<std::size_t>(requests.length(i), CMD_LEN));
+            state.metrics->request(cmd, std::chrono::steady_clock::now() - start);
+        }
+        replies.flush();
+    }
+}
 
-            SIMPL_CMD request(buffer, rcv_len);
-            if (command_equal(request, "HELLO")) {
-                discover(state, options, client_address, request);
-            }
-            else if (command_equal(request, "DEL")) {
-                remove(state, client_address, request);
-            }
-            else if (command_equal(request, "LIST")) {
-                list(state, client_address, request);
-            }
-            else if (command_equal(request, "GET")) {
-                fetch(options, state, client_address, request);
-            }
-            else if (command_equal(request, "ADD")) {
-                if (message_too_short<CMPLX_CMD>(client_address, rcv_len)) {
-                    continue;
-                }
-                CMPLX_CMD complex_request(buffer, rcv_len);
-                upload(options, state, client_address, complex_request);
-            }
-            else {
-                error_message(client_address, "Invalid cmd.");
+/** Starts the control threads. */
+void run_control_threads(server_options &options, server_state &state) {
+    for (auto &thread : state.control) {
+        control_thread &control = *thread;
+        control.thread = std::thread([&options, &state, &control]() {
+            try {
+                read_requests(options, state, control);
+            } catch (const std::exception &e) {
+                std::cerr << "error: control thread " << control.index << ": " << e.what() << ": "
+                          << strerror(errno) << "\n";
+                std::terminate();
             }
+        });
+    }
+}
+
+/** Waits for CTRL+C. */
+void wait_for_sigint(server_state &state) {
+    struct signalfd_siginfo info{};
+    while (read(state.sigint_fd, &info, sizeof info) < 0) {
+        if (errno != EINTR) {
+            throw std::runtime_error("signalfd read");
+        }
+    }
+}
+
+/** Stops the control threads, the requests still waiting aren't answered. */
+void stop_control_threads(server_state &state) {
+    state.stopping = true;
+    for (auto &control : state.control) {
+        /* wakes the thread up, from now on its receive returns at once
+         * (on a UDP socket that isn't connected it does so even though it fails with ENOTCONN) */
+        shutdown(control->socket, SHUT_RD);
+        if (control->thread.joinable()) {
+            control->thread.join();
         }
     }
 }
 
 int main(int argc, char const *argv[]) {
     try {
-        add_signal_handlers();
+        add_signal_handlers(current_server_state);
         server_options options = read_options(argc, argv);
         index_files(options, current_server_state);
+        prepare_partial_uploads(options, current_server_state);
+        current_server_state.list_replies = std::make_unique<list_cache>(options.LIST_CACHE);
+        current_server_state.page_replies = std::make_unique<list_cache>(options.LIST_CACHE);
+        schedule_limits limits;
+        limits.max_transfers = options.MAX_TRANSFERS;
+        limits.send_rate = options.SEND_RATE;
+        limits.receive_rate = options.RECEIVE_RATE;
+        limits.small_file = options.SMALL_FILE;
+        current_server_state.hot_files = std::make_shared<file_cache>(options.HOT_CACHE, options.HOT_FILES);
+        current_server_state.metrics = std::make_shared<server_metrics>();
+        uring_options uring;
+        uring.enabled = options.IO_URING;
+        uring.buffers = options.URING_BUFFERS;
+        write_options writes;
+        writes.preallocate = options.PREALLOCATE;
+        writes.direct = options.DIRECT_IO;
+        writes.writeback_chunk = options.WRITEBACK_CHUNK;
+        current_server_state.transfers = std::make_unique<transfer_engine>(options.TRANSFER_THREADS,
+                                                                           options.TRANSFER_MODE, limits,
+                                                                           current_server_state.hot_files,
+                                                                           current_server_state.metrics, uring,
+                                                                           writes);
+        current_server_state.sessions = create_session_handler(options, current_server_state);
         initialize_connection(options, current_server_state);
-        read_requests(options, current_server_state);
+        start_catalog_threads(current_server_state);
+        run_control_threads(options, current_server_state);
+        wait_for_sigint(current_server_state);
+        stop_control_threads(current_server_state);
         clean_up(current_server_state);
+        save_final_snapshot(current_server_state);
+        /* the catalog threads are still running, the state can't be destroyed under them */
+        _exit(-1);
     } catch (const std::exception &e) {
         std::cerr << "error: " << e.what();
         if (errno != 0) {
@@ -0,0 +1,339 @@
+#include <cerrno>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "crc32c.h"
+#include "session.h"
+
+session::session(std::shared_ptr<const session_handler> handler, transfer_mode mode,
+                 std::shared_ptr<file_cache> cache)
+        : handler(std::move(handler)), mode(mode), cache(std::move(cache)) {}
+
+session::~session() {
+    if (fd >= 0 || sender) {
+        close_file(false, {});
+    }
+    /* the reservations of the files that weren't received yet are released too */
+    for (member &file : members) {
+        if (file.present && !file.done && file.file.on_done) {
+            file.done = true;
+            file.file.on_done({});
+        }
+    }
+}
+
+ssize_t session::read_some(int sock, char *to, std::size_t length) {
+    ssize_t read_len = read(sock, to, length);
+    if (read_len < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return -1;
+        }
+        throw std::runtime_error("read");
+    }
+    return read_len;
+}
+
+bool session::pump(int sock) {
+    for (;;) {
+        switch (current) {
+            case phase::header: {
+                ssize_t read_len = read_some(sock, header + have, FRAME_HEADER_LEN - have);
+                if (read_len < 0) {
+                    return false;
+                }
+                if (read_len == 0) {
+                    if (have == 0) {
+                        return true; /* the client is done */
+                    }
+                    throw std::runtime_error("session closed inside a frame");
+                }
+                have += read_len;
+                bytes_in += read_len;
+                if (have == FRAME_HEADER_LEN) {
+                    decode_frame_header(header, frame);
+                    if (frame.data_len > MAX_FRAME_DATA_LEN) {
+                        throw std::runtime_error("session frame too long");
+                    }
+                    data.resize(frame.data_len);
+                    have = 0;
+                    current = phase::data;
+                }
+                break;
+            }
+            case phase::data: {
+                if (have < data.size()) {
+                    ssize_t read_len = read_some(sock, &data[have], data.size() - have);
+                    if (read_len < 0) {
+                        return false;
+                    }
+                    if (read_len == 0) {
+                        throw std::runtime_error("session closed inside a frame");
+                    }
+                    have += read_len;
+                    bytes_in += read_len;
+                }
+                if (have == data.size()) {
+                    have = 0;
+                    ++handled;
+                    dispatch();
+                }
+                break;
+            }
+            case phase::reply: {
+                /* the header and the data go out in one call, without copying them together */
+                struct iovec parts[2];
+                std::size_t count = 0;
+                if (out_sent < FRAME_HEADER_LEN) {
+                    parts[count++] = {out_header + out_sent, FRAME_HEADER_LEN - out_sent};
+                    parts[count++] = {&out[0], out.size()};
+                }
+                else {
+                    parts[count++] = {&out[out_sent - FRAME_HEADER_LEN], out.size() - (out_sent - FRAME_HEADER_LEN)};
+                }
+                ssize_t write_len = writev(sock, parts, (int) count);
+                if (write_len < 0) {
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                        return false;
+                    }
+                    throw std::runtime_error("writing to client socket");
+                }
+                out_sent += write_len;
+                bytes_out += write_len;
+                if (out_sent == FRAME_HEADER_LEN + out.size()) {
+                    if (adding) {
+                        members.clear();
+                        current = phase::header;
+                    }
+                    else {
+                        start_next();
+                    }
+                }
+                break;
+            }
+            case phase::send: {
+                if (!sender->pump(sock)) {
+                    return false;
+                }
+                transfer_result result;
+                result.success = true;
+                result.bytes = sender->sent();
+                result.checksummed = sender->checksummed();
+                result.checksum = sender->checksum();
+                close_file(true, result);
+                ++next;
+                start_next();
+                break;
+            }
+            case phase::receive: {
+                if (!receiver->pump(sock)) {
+                    return false;
+                }
+                transfer_result result;
+                result.success = true;
+                result.bytes = receiver->written();
+                result.checksummed = true;
+                result.checksum = receiver->checksum();
+                close_file(true, result);
+                ++next;
+                start_next();
+                break;
+            }
+            case phase::skip: {
+                char dropped[BSIZE];
+                ssize_t read_len = read_some(sock, dropped, std::min<uint64_t>(skipping, sizeof dropped));
+                if (read_len < 0) {
+                    return false;
+                }
+                if (read_len == 0) {
+                    throw std::runtime_error("session closed inside a file");
+                }
+                skipping -= read_len;
+                bytes_in += read_len;
+                if (skipping == 0) {
+                    ++next;
+                    start_next();
+                }
+                break;
+            }
+        }
+    }
+}
+
+void session::dispatch() {
+    members.clear();
+    next = 0;
+    adding = command_is(frame.cmd, "ADD") || command_is(frame.cmd, "ADD_MANY");
+    batch = command_is(frame.cmd, "GET_MANY") || command_is(frame.cmd, "ADD_MANY");
+    if (command_is(frame.cmd, "GET")) {
+        member &file = members.emplace_back();
+        if (!handler->open_get(data, file.file)) {
+            members.clear();
+            reply("NO_WAY", 0, data);
+            return;
+        }
+        file.present = true;
+        file.size = file.file.size;
+        reply("FILE", file.size, file.file.data);
+    }
+    else if (command_is(frame.cmd, "ADD")) {
+        member &file = members.emplace_back();
+        file.size = frame.param;
+        file.present = handler->open_add(data, frame.param, file.file);
+        start_next();
+    }
+    else if (command_is(frame.cmd, "GET_MANY")) {
+        dispatch_get_many();
+    }
+    else if (command_is(frame.cmd, "ADD_MANY")) {
+        dispatch_add_many();
+    }
+    else {
+        throw std::runtime_error("invalid session request");
+    }
+}
+
+void session::dispatch_get_many() {
+    std::string manifest;
+    std::string_view names = data;
+    while (!names.empty()) {
+        std::size_t end = names.find('\n');
+        std::string_view name = names.substr(0, end);
+        names.remove_prefix(end == std::string_view::npos ? names.size() : end + 1);
+        if (members.size() == MAX_BATCH_FILES) {
+            throw std::runtime_error("session batch too long");
+        }
+        member &file = members.emplace_back();
+        file.present = handler->open_get(name, file.file);
+        std::string_view checksum;
+        uint32_t crc = 0;
+        uint8_t flags = 0;
+        if (file.present) {
+            file.size = file.file.size;
+            flags |= MANIFEST_FOUND;
+            if (find_extension(file.file.data, "crc32c", checksum) && parse_crc32c(std::string(checksum), crc)) {
+                flags |= MANIFEST_CHECKSUMMED;
+            }
+        }
+        encode_manifest_entry(manifest, file.size, crc, flags);
+    }
+    reply("MANIFEST", members.size(), std::move(manifest));
+}
+
+void session::dispatch_add_many() {
+    std::string_view entries = data;
+    for (uint64_t i = 0; i < frame.param; ++i) {
+        uint64_t size;
+        std::string_view name;
+        if (members.size() == MAX_BATCH_FILES || !decode_add_entry(entries, size, name)) {
+            throw std::runtime_error("invalid session batch");
+        }
+        member &file = members.emplace_back();
+        file.size = size;
+        file.present = handler->open_add(name, size, file.file);
+    }
+    start_next();
+}
+
+void session::reply(std::string_view cmd, uint64_t param, std::string reply_data) {
+    out = std::move(reply_data);
+    out_sent = 0;
+    encode_frame_header(out_header, cmd, frame.id, param, (uint32_t) out.size());
+    current = phase::reply;
+}
+
+void session::start_next() {
+    for (; next < members.size(); ++next) {
+        member &file = members[next];
+        if (!adding) {
+            if (!file.present) {
+                continue;
+            }
+            /* the file was announced, if it's gone now the client can't be told in the stream */
+            if (!(sent_file = cache->open(file.file.path, file.size))) {
+                throw std::runtime_error("open");
+            }
+            sent_file->prefetch(0, file.size);
+            sender = std::make_unique<file_sender>(sent_file->fd, 0, file.size, mode, file.file.checksum,
+                                                   sent_file->size >= file.size ? sent_file->mapping : nullptr);
+            current = phase::send;
+            return;
+        }
+        if (file.present) {
+            fd = open(file.file.path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                      S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+            if (fd < 0) {
+                close_file(false, {});
+                throw std::runtime_error("open");
+            }
+            if (file.file.preallocate) {
+                preallocate(fd, 0, file.size);
+            }
+            receiver = std::make_unique<file_receiver>(fd, file.size);
+            current = phase::receive;
+            return;
+        }
+        if (file.size > 0) {
+            skipping = file.size;
+            current = phase::skip;
+            return;
+        }
+    }
+    if (adding) {
+        reply_added();
+    }
+    else {
+        members.clear();
+        current = phase::header;
+    }
+}
+
+void session::reply_added() {
+    if (!batch) {
+        const member &file = members.front();
+        if (file.result.success) {
+            reply("ADDED", file.result.bytes, add_extension(data, "crc32c", crc32c_string(file.result.checksum)));
+        }
+        else {
+            reply("NO_WAY", 0, data);
+        }
+        return;
+    }
+    std::string saved;
+    for (const member &file : members) {
+        encode_manifest_entry(saved, file.result.bytes, file.result.checksum,
+                              file.result.success ? MANIFEST_FOUND | MANIFEST_CHECKSUMMED : 0);
+    }
+    reply("ADDED_MANY", members.size(), std::move(saved));
+}
+
+void session::close_file(bool success, const transfer_result &outcome) {
+    member &file = members[next];
+    transfer_result result = outcome;
+    if (fd >= 0) {
+        close(fd);
+        fd = -1;
+    }
+    if (receiver) {
+        if (success && !file.file.final_path.empty() &&
+            rename(file.file.path.c_str(), file.file.final_path.c_str()) < 0) {
+            success = result.success = false;
+        }
+        if (!success) {
+            unlink(file.file.path.c_str());
+        }
+    }
+    bytes_out += sender ? sender->sent() : 0;
+    bytes_in += receiver ? receiver->received() : 0;
+    sender.reset();
+    receiver.reset();
+    sent_file.reset();
+    file.result = result;
+    file.done = true;
+    if (file.file.on_done) {
+        file.file.on_done(result);
+    }
+}
@@ -0,0 +1,135 @@
+#ifndef NETSTORE_SESSION_H
+#define NETSTORE_SESSION_H
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "codec.h"
+#include "file_cache.h"
+#include "transfer.h"
+
+/** A file of a session request, described by the @ref session_handler. */
+struct session_file {
+    std::string path;
+    uint64_t size = 0; /** GET: size of the file */
+    std::string data; /** data of the FILE / ADDED reply, at least the file name */
+    bool checksum = false; /** GET: compute the checksum of the sent bytes (forces the copy loop) */
+    /** ADD: the file is received into @ref path and renamed to that once it's complete, empty - in place */
+    std::string final_path;
+    bool preallocate = false; /** ADD: allocate the blocks of the file before receiving it */
+    /** called when the transfer of the file ends (successfully or not), may be empty for GET */
+    std::function<void(const transfer_result &result)> on_done;
+};
+
+/**
+ * What the sessions ask of the control plane, called on the transfer worker threads
+ * (once for every file of a GET_MANY / ADD_MANY).
+ */
+struct session_handler {
+    /** GET: describes the file to send, false if there is no such file. */
+    std::function<bool(std::string_view name, session_file &file)> open_get;
+    /** ADD: reserves the file to receive, false if it can't be added. */
+    std::function<bool(std::string_view name, uint64_t size, session_file &file)> open_add;
+};
+
+/**
+ * Server side of a session (see the frames in codec.h): a state machine over a non-blocking socket,
+ * the requests are handled one by one, in order, so the client can pipeline them.
+ * The data of an ADD follows its frame on the same connection, so only the frames are read ahead.
+ * A request has a list of members: one file for GET / ADD, the files of the manifest for GET_MANY / ADD_MANY,
+ * they are transferred one after another with no per-file round trip.
+ */
+class session {
+public:
+    /**
+     * @param [in] handler Looks up and reserves the files.
+     * @param [in] mode How the files are sent.
+     * @param [in] cache Opens the sent files.
+     */
+    session(std::shared_ptr<const session_handler> handler, transfer_mode mode, std::shared_ptr<file_cache> cache);
+    session(const session &) = delete;
+    session &operator=(const session &) = delete;
+    /** Aborts the request in progress: a partially received file is removed, the reserved ones are released. */
+    ~session();
+
+    /**
+     * Handles the requests as far as the socket allows.
+     * Throws if the connection breaks or the client sends an invalid frame.
+     * @return true if the client closed the session (between the requests).
+     */
+    bool pump(int sock);
+
+    /** If the session waits for the socket to be writable, otherwise it waits for it to be readable. */
+    bool wants_write() const { return current == phase::reply || current == phase::send; }
+
+    uint64_t requests() const { return handled; }
+
+    /** Bytes written to the socket so far (replies and files). */
+    uint64_t sent() const { return bytes_out + (sender ? sender->sent() : 0); }
+
+    /** Bytes read from the socket so far (requests and files). */
+    uint64_t received() const { return bytes_in + (receiver ? receiver->received() : 0); }
+
+private:
+    enum class phase {
+        header, /** reading a frame header */
+        data, /** reading the data of the frame */
+        reply, /** writing the reply */
+        send, /** sending the files after the FILE / MANIFEST reply */
+        receive, /** receiving a file of an ADD / ADD_MANY */
+        skip, /** dropping a refused file of an ADD / ADD_MANY */
+    };
+
+    struct member {
+        session_file file;
+        uint64_t size = 0; /** bytes of the file on the connection */
+        bool present = false; /** GET: the file is there, ADD: the file was accepted */
+        bool done = false; /** its on_done was called */
+        transfer_result result;
+    };
+
+    std::shared_ptr<const session_handler> handler;
+    transfer_mode mode;
+    std::shared_ptr<file_cache> cache;
+
+    phase current = phase::header;
+    char header[FRAME_HEADER_LEN];
+    frame_view frame;
+    std::string data;
+    std::size_t have = 0; /** bytes of the header / data read so far */
+    char out_header[FRAME_HEADER_LEN]; /** the reply header, written together with @ref out */
+    std::string out; /** the reply data */
+    std::size_t out_sent = 0; /** bytes of the header and the data written so far */
+    uint64_t skipping = 0; /** bytes left to drop */
+    uint64_t handled = 0;
+    uint64_t bytes_out = 0; /** not counting the file being sent */
+    uint64_t bytes_in = 0; /** not counting the file being received */
+
+    bool adding = false; /** the request is an ADD / ADD_MANY */
+    bool batch = false; /** the request is a GET_MANY / ADD_MANY */
+    std::vector<member> members;
+    std::size_t next = 0; /** the member being transferred */
+    int fd = -1; /** the received file */
+    std::shared_ptr<const cached_file> sent_file;
+    std::unique_ptr<file_sender> sender;
+    std::unique_ptr<file_receiver> receiver;
+
+    /** Reads up to @ref length bytes into @ref to, returns -1 if it would block, 0 at the end of the stream. */
+    static ssize_t read_some(int sock, char *to, std::size_t length);
+    void dispatch();
+    void dispatch_get_many();
+    void dispatch_add_many();
+    void reply(std::string_view cmd, uint64_t param, std::string reply_data);
+    /** Starts the transfer of the next present member, replies to an ADD / ADD_MANY when there are none left. */
+    void start_next();
+    /** Answers an ADD / ADD_MANY after all the files were received. */
+    void reply_added();
+    /** Ends the transfer of the member @ref next, calls its on_done. */
+    void close_file(bool success, const transfer_result &result);
+};
+
+#endif //NETSTORE_SESSION_H
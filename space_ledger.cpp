@@ -0,0 +1,50 @@
+#include <ostream>
+
+#include "space_ledger.h"
+
+space_ledger::space_ledger(uint64_t max_space) : free_space((int64_t) max_space) {}
+
+uint64_t space_ledger::available() const {
+    int64_t space = free_space.load(std::memory_order_relaxed);
+    return space > 0 ? space : 0;
+}
+
+uint64_t space_ledger::surplus() const {
+    int64_t space = free_space.load(std::memory_order_relaxed);
+    return space < 0 ? -space : 0;
+}
+
+void space_ledger::take(uint64_t size) {
+    free_space.fetch_sub((int64_t) size, std::memory_order_relaxed);
+}
+
+void space_ledger::give_back(uint64_t size) {
+    free_space.fetch_add((int64_t) size, std::memory_order_relaxed);
+}
+
+bool space_ledger::reserve(uint64_t size) {
+    int64_t space = free_space.load(std::memory_order_relaxed);
+    do {
+        if (space < 0 || (uint64_t) space < size) {
+            return false;
+        }
+    } while (!free_space.compare_exchange_weak(space, space - (int64_t) size, std::memory_order_relaxed));
+    reserved_bytes.fetch_add(size, std::memory_order_relaxed);
+    return true;
+}
+
+void space_ledger::commit(uint64_t size) {
+    reserved_bytes.fetch_sub(size, std::memory_order_relaxed);
+    commits.fetch_add(1, std::memory_order_relaxed);
+}
+
+void space_ledger::rollback(uint64_t size) {
+    reserved_bytes.fetch_sub(size, std::memory_order_relaxed);
+    free_space.fetch_add((int64_t) size, std::memory_order_relaxed);
+    rollbacks.fetch_add(1, std::memory_order_relaxed);
+}
+
+void space_ledger::print(std::ostream &out) const {
+    out << "available " << available() << ", surplus " << surplus() << ", reserved " << reserved()
+        << ", committed " << commits << ", rolled back " << rollbacks;
+}
@@ -0,0 +1,57 @@
+#ifndef NETSTORE_SPACE_LEDGER_H
+#define NETSTORE_SPACE_LEDGER_H
+
+#include <atomic>
+#include <cstdint>
+#include <iosfwd>
+
+/**
+ * Free space of the server, shared by the control threads and the transfer workers.
+ * An upload reserves its size up front, the reservation is committed when the file is saved
+ * and rolled back when the transfer fails or times out.
+ * All the counters are atomic, reading the free space (HELLO) takes no lock.
+ */
+class space_ledger {
+public:
+    /** @param [in] max_space Space for all the files (MAX_SPACE). */
+    explicit space_ledger(uint64_t max_space);
+
+    /** Space left for new files. */
+    uint64_t available() const;
+
+    /** Bytes the files take over the max space (if they were already there at startup). */
+    uint64_t surplus() const;
+
+    /** Accounts for a file that is already there, even if there is no space left for it. */
+    void take(uint64_t size);
+
+    /** Gives back the space of a removed file. */
+    void give_back(uint64_t size);
+
+    /**
+     * Reserves space for an upload. Every successful reservation has to be followed
+     * by exactly one @ref commit or @ref rollback of the same size.
+     * @return false if there isn't enough space.
+     */
+    bool reserve(uint64_t size);
+
+    /** The reserved file was saved, its space stays taken. */
+    void commit(uint64_t size);
+
+    /** The reserved file wasn't saved, its space is given back. */
+    void rollback(uint64_t size);
+
+    /** Bytes reserved by the uploads in progress. */
+    uint64_t reserved() const { return reserved_bytes; }
+
+    /** Prints the counters. */
+    void print(std::ostream &out) const;
+
+private:
+    std::atomic<int64_t> free_space; /** negative if the files take more than the max space */
+    std::atomic<uint64_t> reserved_bytes{0};
+    std::atomic<uint64_t> commits{0};
+    std::atomic<uint64_t> rollbacks{0};
+};
+
+#endif //NETSTORE_SPACE_LEDGER_H
@@ -0,0 +1,416 @@
+#include <stdexcept>
+#include <algorithm>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "crc32c.h"
+#include "transfer.h"
+#include "connection.h"
+
+/** Max number of bytes moved by a single sendfile/splice call. */
+static const std::size_t CHUNK_LEN = 1 << 20;
+
+#define COMPRESS_LEVEL Z_BEST_SPEED /** the transfers are limited by the network, the compression by the CPU */
+#define COMPRESS_SAMPLE 16384 /** bytes at the start of a file deflated to see if it's worth compressing */
+#define COMPRESS_RATIO 0.9 /** ...it is if they shrink at least that much */
+
+const char *COMPRESSION_NAME = "deflate";
+
+void preallocate(int fd, uint64_t offset, uint64_t length) {
+    if (length > 0) {
+        fallocate(fd, FALLOC_FL_KEEP_SIZE, (off_t) offset, (off_t) length);
+    }
+}
+
+void release_preallocation(int fd, uint64_t end) {
+    struct stat info{};
+    if (fstat(fd, &info) == 0 && (uint64_t) info.st_size < end) {
+        /* truncating to the same size frees them on ext4, punching a hole past the end on XFS */
+        if (ftruncate(fd, info.st_size) == 0) {
+            fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, info.st_size, (off_t) (end - info.st_size));
+        }
+    }
+}
+
+void writeback_pacer::advance(uint64_t end) {
+    for (; end - flushed >= chunk; flushed += chunk) {
+        /* the pacing is only a hint, its errors are ignored */
+        sync_file_range(fd, (off_t) flushed, (off_t) chunk, SYNC_FILE_RANGE_WRITE);
+        if (flushed - first >= chunk) {
+            sync_file_range(fd, (off_t) (flushed - chunk), (off_t) chunk,
+                            SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        }
+    }
+}
+
+/** A zlib stream, deflating or inflating. */
+struct zlib_stream {
+    z_stream stream{};
+    bool deflating;
+
+    explicit zlib_stream(bool deflating) : deflating(deflating) {
+        if ((deflating ? deflateInit(&stream, COMPRESS_LEVEL) : inflateInit(&stream)) != Z_OK) {
+            throw std::runtime_error(deflating ? "deflateInit" : "inflateInit");
+        }
+    }
+
+    ~zlib_stream() {
+        if (deflating) {
+            deflateEnd(&stream);
+        }
+        else {
+            inflateEnd(&stream);
+        }
+    }
+};
+
+transfer_mode parse_transfer_mode(const std::string &name) {
+    if (name == "copy") {
+        return transfer_mode::copy;
+    }
+    else if (name == "sendfile") {
+        return transfer_mode::sendfile;
+    }
+    else if (name == "splice") {
+        return transfer_mode::splice;
+    }
+    throw std::invalid_argument("transfer-mode");
+}
+
+const char *transfer_mode_name(transfer_mode mode) {
+    switch (mode) {
+        case transfer_mode::copy:
+            return "copy";
+        case transfer_mode::sendfile:
+            return "sendfile";
+        case transfer_mode::splice:
+            return "splice";
+    }
+    return "unknown";
+}
+
+bool worth_compressing(const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    std::vector<char> sample(COMPRESS_SAMPLE);
+    ssize_t length = pread(fd, sample.data(), sample.size(), 0);
+    close(fd);
+    if (length <= 0) {
+        return false;
+    }
+    uLongf compressed_length = compressBound(length);
+    std::vector<Bytef> compressed(compressed_length);
+    if (compress2(compressed.data(), &compressed_length, reinterpret_cast<const Bytef *>(sample.data()), length,
+                  COMPRESS_LEVEL) != Z_OK) {
+        return false;
+    }
+    return compressed_length < length * COMPRESS_RATIO;
+}
+
+/** Checks if the error means that the kernel can't do zero-copy for this pair of descriptors. */
+static bool zero_copy_unsupported(int error) {
+    return error == EINVAL || error == ENOSYS || error == EOPNOTSUPP;
+}
+
+file_sender::file_sender(int fd, uint64_t offset, uint64_t length, transfer_mode mode, bool checksum,
+                         const char *mapping, bool compress)
+        : fd(fd), mapping(mapping), offset(offset), remaining(length), current_mode(checksum ? transfer_mode::copy : mode),
+          checksum_enabled(checksum) {
+    if (compress) {
+        deflater = std::make_unique<zlib_stream>(true);
+    }
+}
+
+file_sender::~file_sender() {
+    if (pipe_fds[0] >= 0) {
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+    }
+}
+
+bool file_sender::pump(int sock) {
+    if (deflater) {
+        return pump_deflate(sock);
+    }
+    for (;;) {
+        switch (current_mode) {
+            case transfer_mode::sendfile:
+                if (pump_sendfile(sock)) {
+                    return true;
+                }
+                break;
+            case transfer_mode::splice:
+                if (pump_splice(sock)) {
+                    return true;
+                }
+                break;
+            case transfer_mode::copy:
+                return pump_copy(sock);
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return false;
+        }
+        /* otherwise the mode was downgraded, try again with the next one */
+    }
+}
+
+/**
+ * @return true if done; false with errno == EAGAIN if the socket is full,
+ *         false with any other errno if the mode was changed.
+ */
+bool file_sender::pump_sendfile(int sock) {
+    while (remaining > 0) {
+        ssize_t len = sendfile(sock, fd, &offset, std::min<uint64_t>(remaining, CHUNK_LEN));
+        if (len < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return false;
+            }
+            if (zero_copy_unsupported(errno) && sent_bytes == 0) {
+                current_mode = transfer_mode::splice;
+                errno = 0;
+                return false;
+            }
+            throw std::runtime_error("sendfile");
+        }
+        if (len == 0) {
+            throw std::runtime_error("file truncated during transfer");
+        }
+        remaining -= len;
+        sent_bytes += len;
+    }
+    return true;
+}
+
+/** See @ref pump_sendfile. */
+bool file_sender::pump_splice(int sock) {
+    if (pipe_fds[0] < 0 && pipe(pipe_fds) < 0) {
+        throw std::runtime_error("pipe");
+    }
+
+    while (remaining > 0 || in_pipe > 0) {
+        if (in_pipe == 0) {
+            ssize_t len = splice(fd, &offset, pipe_fds[1], nullptr, std::min<uint64_t>(remaining, CHUNK_LEN),
+                                 SPLICE_F_MOVE);
+            if (len < 0) {
+                if (zero_copy_unsupported(errno) && sent_bytes == 0) {
+                    current_mode = transfer_mode::copy;
+                    errno = 0;
+                    return false;
+                }
+                throw std::runtime_error("splice");
+            }
+            if (len == 0) {
+                throw std::runtime_error("file truncated during transfer");
+            }
+            remaining -= len;
+            in_pipe = len;
+        }
+
+        ssize_t len = splice(pipe_fds[0], nullptr, sock, nullptr, in_pipe,
+                             SPLICE_F_MOVE | SPLICE_F_NONBLOCK | (remaining > 0 ? SPLICE_F_MORE : 0));
+        if (len < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return false;
+            }
+            throw std::runtime_error("splice");
+        }
+        in_pipe -= len;
+        sent_bytes += len;
+    }
+    return true;
+}
+
+/** The plain loop: read into a buffer, write the buffer into the socket (or write straight from the mapping). */
+bool file_sender::pump_copy(int sock) {
+    while (mapping != nullptr && remaining > 0) {
+        ssize_t snd_len = write(sock, mapping + offset, std::min<uint64_t>(remaining, CHUNK_LEN));
+        if (snd_len < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return false;
+            }
+            throw std::runtime_error("writing to client socket");
+        }
+        if (checksum_enabled) {
+            crc = crc32c(crc, mapping + offset, snd_len);
+        }
+        offset += snd_len;
+        remaining -= snd_len;
+        sent_bytes += snd_len;
+    }
+    if (mapping != nullptr) {
+        return true;
+    }
+
+    if (buffer.empty()) {
+        buffer.resize(BSIZE);
+    }
+
+    while (remaining > 0 || buffer_begin < buffer_end) {
+        if (buffer_begin == buffer_end) {
+            ssize_t read_len = pread(fd, buffer.data(), std::min<uint64_t>(remaining, buffer.size()), offset);
+            if (read_len < 0) {
+                throw std::runtime_error("read");
+            }
+            if (read_len == 0) {
+                throw std::runtime_error("file truncated during transfer");
+            }
+            if (checksum_enabled) {
+                crc = crc32c(crc, buffer.data(), read_len);
+            }
+            offset += read_len;
+            remaining -= read_len;
+            buffer_begin = 0;
+            buffer_end = read_len;
+        }
+
+        ssize_t snd_len = write(sock, buffer.data() + buffer_begin, buffer_end - buffer_begin);
+        if (snd_len < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return false;
+            }
+            throw std::runtime_error("writing to client socket");
+        }
+        buffer_begin += snd_len;
+        sent_bytes += snd_len;
+    }
+    return true;
+}
+
+/** The copy loop through the deflater: the file is read into @ref input, the compressed bytes go to the buffer. */
+bool file_sender::pump_deflate(int sock) {
+    if (buffer.empty()) {
+        buffer.resize(BSIZE);
+        input.resize(BSIZE);
+    }
+    z_stream &stream = deflater->stream;
+
+    for (;;) {
+        if (buffer_begin == buffer_end) {
+            if (deflated) {
+                return true;
+            }
+            if (stream.avail_in == 0 && remaining > 0) {
+                ssize_t read_len = pread(fd, input.data(), std::min<uint64_t>(remaining, input.size()), offset);
+                if (read_len < 0) {
+                    throw std::runtime_error("read");
+                }
+                if (read_len == 0) {
+                    throw std::runtime_error("file truncated during transfer");
+                }
+                if (checksum_enabled) {
+                    crc = crc32c(crc, input.data(), read_len);
+                }
+                offset += read_len;
+                remaining -= read_len;
+                stream.next_in = reinterpret_cast<Bytef *>(input.data());
+                stream.avail_in = read_len;
+            }
+            stream.next_out = reinterpret_cast<Bytef *>(buffer.data());
+            stream.avail_out = buffer.size();
+            int result = deflate(&stream, remaining == 0 ? Z_FINISH : Z_NO_FLUSH);
+            if (result == Z_STREAM_ERROR) {
+                throw std::runtime_error("deflate");
+            }
+            deflated = result == Z_STREAM_END;
+            buffer_begin = 0;
+            buffer_end = buffer.size() - stream.avail_out;
+            continue;
+        }
+
+        ssize_t snd_len = write(sock, buffer.data() + buffer_begin, buffer_end - buffer_begin);
+        if (snd_len < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return false;
+            }
+            throw std::runtime_error("writing to client socket");
+        }
+        buffer_begin += snd_len;
+        sent_bytes += snd_len;
+    }
+}
+
+file_receiver::file_receiver(int fd, uint64_t length, bool inflate) : fd(fd), remaining(length), buffer(BSIZE) {
+    if (inflate) {
+        inflater = std::make_unique<zlib_stream>(false);
+        output.resize(BSIZE);
+    }
+}
+
+file_receiver::~file_receiver() = default;
+
+bool file_receiver::pump(int sock) {
+    if (inflater) {
+        return pump_inflate(sock);
+    }
+    while (remaining > 0) {
+        ssize_t read_len = read(sock, buffer.data(), std::min<uint64_t>(remaining, buffer.size()));
+        if (read_len < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return false;
+            }
+            throw std::runtime_error("read");
+        }
+        if (read_len == 0) {
+            throw std::runtime_error("connection closed before the end of the file");
+        }
+
+        ssize_t write_len = write(fd, buffer.data(), read_len);
+        if (write_len != read_len) {
+            throw std::runtime_error("write");
+        }
+        crc = crc32c(crc, buffer.data(), read_len);
+        remaining -= read_len;
+        received_bytes += read_len;
+        written_bytes += read_len;
+    }
+    return true;
+}
+
+/** Reads the compressed bytes into the buffer, writes the inflated ones to the file. */
+bool file_receiver::pump_inflate(int sock) {
+    z_stream &stream = inflater->stream;
+    for (;;) {
+        if (stream.avail_in == 0) {
+            ssize_t read_len = read(sock, buffer.data(), buffer.size());
+            if (read_len < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return false;
+                }
+                throw std::runtime_error("read");
+            }
+            if (read_len == 0) {
+                throw std::runtime_error("connection closed before the end of the file");
+            }
+            received_bytes += read_len;
+            stream.next_in = reinterpret_cast<Bytef *>(buffer.data());
+            stream.avail_in = read_len;
+        }
+
+        stream.next_out = reinterpret_cast<Bytef *>(output.data());
+        stream.avail_out = output.size();
+        int result = inflate(&stream, Z_NO_FLUSH);
+        if (result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR) {
+            throw std::runtime_error("corrupted compressed stream");
+        }
+        std::size_t produced = output.size() - stream.avail_out;
+        if (produced > remaining) {
+            throw std::runtime_error("file longer than announced");
+        }
+        if (produced > 0 && write(fd, output.data(), produced) != (ssize_t) produced) {
+            throw std::runtime_error("write");
+        }
+        crc = crc32c(crc, output.data(), produced);
+        remaining -= produced;
+        written_bytes += produced;
+        if (result == Z_STREAM_END) {
+            return true;
+        }
+    }
+}
@@ -0,0 +1,196 @@
+#ifndef NETSTORE_TRANSFER_H
+#define NETSTORE_TRANSFER_H
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <sys/types.h>
+
+/** How file contents are moved from the disk into a TCP socket. */
+enum class transfer_mode {
+    copy, /** read/write through a user space buffer */
+    sendfile, /** sendfile(2), no copying through user space */
+    splice, /** splice(2) through a pipe, no copying through user space */
+};
+
+/** How a transfer ended, passed to the callbacks of the transfer engine. */
+struct transfer_result {
+    bool success = false;
+    uint64_t bytes = 0; /** bytes sent / received */
+    bool checksummed = false; /** if @ref checksum is known */
+    uint32_t checksum = 0; /** CRC32C of the transferred bytes */
+};
+
+#define DIRECT_IO_ALIGN 4096 /** offsets and lengths of the O_DIRECT writes (covers the usual logical block sizes) */
+
+/** How the uploaded files are written. */
+struct write_options {
+    bool preallocate = true; /** fallocate the announced size before receiving, the file isn't fragmented */
+    /** O_DIRECT, only for the io_uring transfers: they write whole aligned buffers at aligned offsets */
+    bool direct = false;
+    /** start the write-back (sync_file_range) after every that many bytes, 0 - left to the kernel */
+    uint64_t writeback_chunk = 0;
+};
+
+/**
+ * Allocates the blocks of @ref length bytes of the file from @ref offset on, without changing its size.
+ * Does nothing where the file system can't (it's only an optimization).
+ */
+void preallocate(int fd, uint64_t offset, uint64_t length);
+
+/** Frees the blocks allocated by @ref preallocate past the end of the file, up to @ref end. */
+void release_preallocation(int fd, uint64_t end);
+
+/**
+ * Paces the write-back of a file being written: every @ref chunk bytes written start their write-back
+ * and wait for the ones before them, so a big upload doesn't fill the page cache with dirty pages
+ * for the kernel to flush all at once.
+ */
+class writeback_pacer {
+public:
+    /**
+     * @param [in] fd Descriptor of the written file (not owned).
+     * @param [in] start Position the writing starts at.
+     * @param [in] chunk Bytes of a write-back, more than 0.
+     */
+    writeback_pacer(int fd, uint64_t start, uint64_t chunk) : fd(fd), flushed(start), first(start), chunk(chunk) {}
+
+    /** The file is written up to @ref end. */
+    void advance(uint64_t end);
+
+private:
+    int fd;
+    uint64_t flushed; /** the write-back started up to there */
+    uint64_t first;
+    uint64_t chunk;
+};
+
+/** Parses a transfer mode name ("copy", "sendfile", "splice"). */
+transfer_mode parse_transfer_mode(const std::string &name);
+
+/** Name of the transfer mode (inverse of @ref parse_transfer_mode). */
+const char *transfer_mode_name(transfer_mode mode);
+
+/**
+ * The compression of the transfers ("compress" extension of GET / ADD and of their answers):
+ * the connection carries a deflate stream (zlib format) of the file instead of the file.
+ */
+extern const char *COMPRESSION_NAME;
+
+/** Checks if the file at @ref path shrinks enough with deflate to be worth compressing (by its first block). */
+bool worth_compressing(const std::string &path);
+
+struct zlib_stream;
+
+/**
+ * Streams a part of a file into a socket.
+ * If the selected mode isn't supported for the given file/socket pair,
+ * the sender falls back to splice and then to the copy loop.
+ * Works both with blocking and non-blocking sockets.
+ */
+class file_sender {
+public:
+    /**
+     * @param [in] fd Descriptor of the file (not owned).
+     * @param [in] offset Position of the first byte to send.
+     * @param [in] length Number of bytes to send.
+     * @param [in] mode Preferred transfer mode.
+     * @param [in] checksum Compute the CRC32C of the sent bytes, needs the copy loop (the mode is ignored).
+     * @param [in] mapping The whole file mapped (not owned), if set the copy loop writes straight from it.
+     * @param [in] compress Send a deflate stream of the file (the mode is ignored).
+     */
+    file_sender(int fd, uint64_t offset, uint64_t length, transfer_mode mode, bool checksum = false,
+                const char *mapping = nullptr, bool compress = false);
+    file_sender(const file_sender &) = delete;
+    file_sender &operator=(const file_sender &) = delete;
+    ~file_sender();
+
+    /**
+     * Sends as much as the socket accepts.
+     * @param [in] sock Destination socket.
+     * @return true if the whole range was sent, false if the socket would block.
+     */
+    bool pump(int sock);
+
+    /** Bytes written to the socket (compressed ones if compressing). */
+    uint64_t sent() const { return sent_bytes; }
+    transfer_mode mode() const { return current_mode; }
+    /** CRC32C of the bytes read so far, if asked for in the constructor. */
+    bool checksummed() const { return checksum_enabled; }
+    uint32_t checksum() const { return crc; }
+
+private:
+    int fd;
+    const char *mapping;
+    off_t offset; /** position of the next byte read from the file */
+    uint64_t remaining; /** bytes not yet read from the file */
+    uint64_t sent_bytes = 0;
+    transfer_mode current_mode;
+    bool checksum_enabled;
+    uint32_t crc = 0;
+
+    int pipe_fds[2] = {-1, -1}; /** used by splice */
+    std::size_t in_pipe = 0; /** bytes waiting in the pipe */
+
+    std::vector<char> buffer; /** used by the copy loop (and for the compressed bytes) */
+    std::size_t buffer_begin = 0;
+    std::size_t buffer_end = 0;
+
+    std::unique_ptr<zlib_stream> deflater; /** if compressing */
+    std::vector<char> input; /** bytes of the file waiting for the deflater */
+    bool deflated = false; /** the deflater wrote the end of the stream */
+
+    bool pump_sendfile(int sock);
+    bool pump_splice(int sock);
+    bool pump_copy(int sock);
+    bool pump_deflate(int sock);
+};
+
+/**
+ * Writes a file of a known size with the data read from a socket,
+ * computes the CRC32C of the received bytes on the way.
+ * Works both with blocking and non-blocking sockets.
+ */
+class file_receiver {
+public:
+    /**
+     * @param [in] fd Descriptor of the created file (not owned).
+     * @param [in] length Number of bytes expected from the socket, the most bytes of the file if inflating.
+     * @param [in] inflate The socket carries a deflate stream of the file, it ends with the stream.
+     */
+    file_receiver(int fd, uint64_t length, bool inflate = false);
+    file_receiver(const file_receiver &) = delete;
+    file_receiver &operator=(const file_receiver &) = delete;
+    ~file_receiver();
+
+    /**
+     * Receives as much as is available in the socket.
+     * Throws if the connection ends before @ref length bytes were received (before the end of the stream).
+     * @param [in] sock Source socket.
+     * @return true if the whole file was received, false if the socket would block.
+     */
+    bool pump(int sock);
+
+    /** Bytes read from the socket (compressed ones if inflating). */
+    uint64_t received() const { return received_bytes; }
+    /** Bytes written to the file. */
+    uint64_t written() const { return written_bytes; }
+    /** CRC32C of the bytes written to the file. */
+    uint32_t checksum() const { return crc; }
+
+private:
+    int fd;
+    uint64_t remaining;
+    uint64_t received_bytes = 0;
+    uint64_t written_bytes = 0;
+    uint32_t crc = 0;
+    std::vector<char> buffer;
+
+    std::unique_ptr<zlib_stream> inflater; /** if inflating */
+    std::vector<char> output; /** inflated bytes */
+
+    bool pump_inflate(int sock);
+};
+
+#endif //NETSTORE_TRANSFER_H
@@ -0,0 +1,792 @@
+#include <algorithm>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <thread>
+#include <unordered_map>
+#include <cstring>
+#include <csignal>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "transfer_engine.h"
+
+#define MAX_EVENTS 64 /** events taken from epoll at once */
+#define URING_ENTRIES 256 /** submission queue of a worker's ring, two requests a step */
+
+namespace chr = std::chrono;
+
+namespace {
+
+/** State of a single transfer inside a worker. */
+struct connection {
+    uint64_t id = 0;
+    transfer_job job;
+    int sock = -1; /** accepted socket, -1 while waiting for the client to connect */
+    int fd = -1; /** the received file */
+    std::shared_ptr<const cached_file> file; /** the sent file */
+    std::unique_ptr<file_sender> sender;
+    std::unique_ptr<file_receiver> receiver;
+    std::unique_ptr<::session> session;
+    std::unique_ptr<uring_transfer> ring_transfer; /** instead of the sender / receiver, with io_uring */
+    std::unique_ptr<writeback_pacer> pacer; /** of the received file, if its write-back is paced */
+    bool aborting = false; /** finished while its requests were in the kernel, it ends once they complete */
+    bool starved = false; /** an io_uring transfer waiting for a free buffer */
+    bool writing = false; /** a session waits for EPOLLOUT */
+    bool scheduled = false; /** entered the scheduler, has to leave it */
+    bool paused = false; /** out of epoll until @ref resume, by a rate limit */
+    chr::steady_clock::time_point listening; /** when the worker started waiting for the client */
+    chr::steady_clock::time_point connected;
+    std::multimap<chr::steady_clock::time_point, connection *>::iterator deadline;
+    std::multimap<chr::steady_clock::time_point, connection *>::iterator resume;
+};
+
+/** Bytes a transfer moved so far in both directions. */
+struct traffic {
+    uint64_t out = 0;
+    uint64_t in = 0;
+};
+
+traffic measure(const connection &conn) {
+    if (conn.session) {
+        return {conn.session->sent(), conn.session->received()};
+    }
+    if (conn.sender) {
+        return {conn.sender->sent(), 0};
+    }
+    if (conn.receiver) {
+        return {0, conn.receiver->received()};
+    }
+    if (conn.ring_transfer) {
+        return {conn.ring_transfer->sent(), conn.ring_transfer->received()};
+    }
+    return {};
+}
+
+void print_error(const connection &conn, const std::exception &e) {
+    std::cerr << "[TRANSFER ERROR] " << conn.job.path << ": " << e.what();
+    if (errno != 0) {
+        std::cerr << ": " << strerror(errno);
+    }
+    std::cerr << "\n";
+}
+
+/** The kernel waits for the socket of an io_uring transfer, without giving EAGAIN back. */
+void make_blocking(int sock) {
+    int flags = fcntl(sock, F_GETFL);
+    if (flags < 0 || fcntl(sock, F_SETFL, flags & ~O_NONBLOCK) < 0) {
+        throw std::runtime_error("fcntl");
+    }
+}
+
+}
+
+struct transfer_engine::worker {
+    transfer_engine &engine;
+    int epoll_fd = -1;
+    int wake_fd = -1; /** eventfd, signals new jobs or stopping */
+    std::thread thread;
+
+    std::mutex queue_mutex;
+    std::vector<std::pair<uint64_t, transfer_job>> queue; /** jobs submitted but not yet taken by the worker */
+    std::vector<uint64_t> cancelled; /** ids of the jobs to cancel, not yet handled by the worker */
+    std::vector<uint64_t> admitted; /** ids of the jobs given their slot, not yet handled by the worker */
+    bool stopping = false;
+
+    std::unordered_map<connection *, std::unique_ptr<connection>> connections;
+    std::unordered_map<uint64_t, connection *> by_id; /** the connections waiting for the client, by the job id */
+    /** connections waiting for the client (by the accept deadline) or for progress (by the idle deadline) */
+    std::multimap<chr::steady_clock::time_point, connection *> deadlines;
+    std::unordered_map<uint64_t, connection *> waiting; /** the connected jobs waiting for their slot, by the id */
+    std::multimap<chr::steady_clock::time_point, connection *> paused; /** by the time they may move data again */
+
+    std::unique_ptr<buffer_pool> buffers; /** registered with the @ref ring */
+    std::unique_ptr<uring> ring; /** nullptr - all the data is moved by the epoll loop */
+    std::deque<connection *> starved; /** io_uring transfers waiting for a free buffer, the first come first */
+
+    explicit worker(transfer_engine &engine);
+    ~worker();
+
+    void run();
+    void take_jobs();
+    void handle(connection &conn, uint32_t events);
+    void account(const traffic &before, const traffic &after);
+    void step(connection &conn);
+    void reap();
+    void feed_starved();
+    void accept_client(connection &conn);
+    void watch(connection &conn);
+    bool pause(connection &conn);
+    void resume_paused();
+    void finish(connection &conn, bool success);
+    void set_idle_deadline(connection &conn);
+    void expire_deadlines();
+    int next_timeout();
+};
+
+transfer_engine::worker::worker(transfer_engine &engine) : engine(engine) {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        throw std::runtime_error("epoll_create1");
+    }
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd < 0) {
+        throw std::runtime_error("eventfd");
+    }
+    struct epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.ptr = nullptr; /** marks the eventfd */
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &event) < 0) {
+        throw std::runtime_error("epoll_ctl");
+    }
+
+    if (engine.uring_settings.enabled) {
+        try {
+            buffers = std::make_unique<buffer_pool>(engine.uring_settings.buffers, URING_BUFFER_LEN);
+            ring = std::make_unique<uring>(URING_ENTRIES);
+            ring->register_buffers(buffers->all());
+        } catch (const std::exception &e) {
+            if (engine.workers.empty()) {
+                std::cerr << "[TRANSFER] io_uring isn't available (" << e.what() << ": " << strerror(errno)
+                          << "), the transfers go through epoll\n";
+            }
+            ring.reset();
+            buffers.reset();
+        }
+    }
+    if (ring) {
+        event.data.ptr = this; /** marks the ring, readable while there are completions */
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, ring->fd(), &event) < 0) {
+            throw std::runtime_error("epoll_ctl");
+        }
+    }
+}
+
+transfer_engine::worker::~worker() {
+    close(wake_fd);
+    close(epoll_fd);
+}
+
+void transfer_engine::worker::run() {
+    struct epoll_event events[MAX_EVENTS];
+
+    for (;;) {
+        int ready = epoll_wait(epoll_fd, events, MAX_EVENTS, next_timeout());
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error("epoll_wait");
+        }
+
+        /* the completions and the jobs (cancels too) may finish connections, they're taken after all the events
+         * of the connections: a finished one may still have an event further in the batch */
+        bool woken = false;
+        bool completed = false;
+        for (int i = 0; i < ready; ++i) {
+            if (events[i].data.ptr == nullptr) {
+                woken = true;
+            }
+            else if (events[i].data.ptr == this) {
+                completed = true;
+            }
+            else {
+                handle(*static_cast<connection *>(events[i].data.ptr), events[i].events);
+            }
+        }
+        if (completed) {
+            reap();
+        }
+        if (woken) {
+            uint64_t value;
+            if (read(wake_fd, &value, sizeof value) < 0 && errno != EAGAIN) {
+                throw std::runtime_error("read");
+            }
+            take_jobs();
+        }
+        expire_deadlines();
+        resume_paused();
+        if (ring) {
+            /* everything queued while handling the events goes to the kernel with a single call */
+            ring->submit();
+            metrics_shard &counters = engine.metrics->local();
+            counters.uring_requests.store(ring->submitted(), std::memory_order_relaxed);
+            counters.uring_enters.store(ring->enters(), std::memory_order_relaxed);
+        }
+
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        if (stopping) {
+            break;
+        }
+    }
+
+    /* abort unfinished transfers, the ones with requests in the kernel end once the requests complete */
+    while (!connections.empty()) {
+        std::vector<connection *> open;
+        for (const auto &entry : connections) {
+            if (!entry.first->aborting) {
+                open.push_back(entry.first);
+            }
+        }
+        for (connection *conn : open) {
+            finish(*conn, false);
+        }
+        if (!connections.empty()) {
+            ring->submit(1);
+            reap();
+        }
+    }
+}
+
+void transfer_engine::worker::take_jobs() {
+    std::vector<std::pair<uint64_t, transfer_job>> jobs;
+    std::vector<uint64_t> cancels;
+    std::vector<uint64_t> admits;
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        jobs.swap(queue);
+        cancels.swap(cancelled);
+        admits.swap(admitted);
+    }
+
+    for (auto &job : jobs) {
+        auto conn = std::make_unique<connection>();
+        conn->id = job.first;
+        conn->job = std::move(job.second);
+        int flags = fcntl(conn->job.listen_socket, F_GETFL);
+        if (flags < 0 || fcntl(conn->job.listen_socket, F_SETFL, flags | O_NONBLOCK) < 0) {
+            throw std::runtime_error("fcntl");
+        }
+
+        struct epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.ptr = conn.get();
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn->job.listen_socket, &event) < 0) {
+            throw std::runtime_error("epoll_ctl");
+        }
+        conn->deadline = deadlines.emplace(conn->job.accept_deadline, conn.get());
+        conn->listening = chr::steady_clock::now();
+        by_id.emplace(conn->id, conn.get());
+        connections.emplace(conn.get(), std::move(conn));
+    }
+
+    /* a job cancelled right after it was submitted is already known, the queue is taken first */
+    for (uint64_t id : cancels) {
+        auto it = by_id.find(id);
+        if (it != by_id.end()) {
+            finish(*it->second, false);
+        }
+    }
+
+    for (uint64_t id : admits) {
+        auto it = waiting.find(id);
+        if (it != waiting.end()) {
+            connection &conn = *it->second;
+            waiting.erase(it);
+            set_idle_deadline(conn);
+            watch(conn);
+        }
+    }
+}
+
+void transfer_engine::worker::handle(connection &conn, uint32_t events) {
+    try {
+        if (conn.sock < 0) {
+            accept_client(conn);
+            return;
+        }
+
+        if (pause(conn)) {
+            return;
+        }
+        traffic before = measure(conn);
+        bool done;
+        if (conn.session) {
+            done = conn.session->pump(conn.sock);
+            if (!done && conn.session->wants_write() != conn.writing) {
+                conn.writing = !conn.writing;
+                struct epoll_event event{};
+                event.events = conn.writing ? EPOLLOUT : EPOLLIN;
+                event.data.ptr = &conn;
+                if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn.sock, &event) < 0) {
+                    throw std::runtime_error("epoll_ctl");
+                }
+            }
+        }
+        else if (conn.job.kind == transfer_kind::send) {
+            if (events & (EPOLLERR | EPOLLHUP)) {
+                throw std::runtime_error("client disconnected");
+            }
+            done = conn.sender->pump(conn.sock);
+        }
+        else {
+            /* a hang up still leaves data to read, the receiver notices the end of the stream */
+            done = conn.receiver->pump(conn.sock);
+            if (conn.pacer) {
+                conn.pacer->advance(conn.job.offset + conn.receiver->written());
+            }
+            if (done && conn.job.compress && conn.receiver->written() != conn.job.length) {
+                throw std::runtime_error("file shorter than announced");
+            }
+        }
+        account(before, measure(conn));
+        if (done) {
+            finish(conn, true);
+        }
+        else {
+            set_idle_deadline(conn);
+        }
+    } catch (const std::exception &e) {
+        print_error(conn, e);
+        finish(conn, false);
+    }
+}
+
+/** Charges the bytes a transfer moved to the rate limits and the metrics. */
+void transfer_engine::worker::account(const traffic &before, const traffic &after) {
+    engine.scheduler.sending.charge(after.out - before.out);
+    engine.scheduler.receiving.charge(after.in - before.in);
+    metrics_shard &counters = engine.metrics->local();
+    bump(counters.bytes_sent, after.out - before.out);
+    bump(counters.bytes_received, after.in - before.in);
+}
+
+/** Queues the next step of an io_uring transfer (unless it's paused by a rate limit), or finishes it. */
+void transfer_engine::worker::step(connection &conn) {
+    if (conn.ring_transfer->done()) {
+        finish(conn, true);
+        return;
+    }
+    if (pause(conn)) {
+        return;
+    }
+    if (!conn.ring_transfer->start(*ring, *buffers, (uint64_t) &conn)) {
+        /* waiting for a buffer isn't stalling */
+        if (conn.deadline != deadlines.end()) {
+            deadlines.erase(conn.deadline);
+            conn.deadline = deadlines.end();
+        }
+        conn.starved = true;
+        starved.push_back(&conn);
+    }
+}
+
+/** Handles the completed requests of the io_uring transfers, the ones done with a step start the next one. */
+void transfer_engine::worker::reap() {
+    ring->reap([this](uint64_t user_data, int res, uint32_t flags) {
+        connection &conn = *reinterpret_cast<connection *>(user_data & ~uring_transfer::OPERATION_MASK);
+        traffic before = measure(conn);
+        try {
+            conn.ring_transfer->complete(user_data & uring_transfer::OPERATION_MASK, res, flags);
+        } catch (const std::exception &e) {
+            if (!conn.aborting) {
+                print_error(conn, e);
+            }
+            finish(conn, false);
+            return;
+        }
+        account(before, measure(conn));
+        if (conn.pacer) {
+            conn.pacer->advance(conn.job.offset + conn.ring_transfer->written());
+        }
+        if (!conn.ring_transfer->idle()) {
+            return;
+        }
+        if (conn.aborting) {
+            finish(conn, false);
+            return;
+        }
+        set_idle_deadline(conn);
+        step(conn);
+    });
+    feed_starved();
+}
+
+/** Gives the buffers returned to the pool to the transfers waiting for them. */
+void transfer_engine::worker::feed_starved() {
+    /* once around at most, the ones that still get nothing go to the back again */
+    for (std::size_t i = starved.size(); i > 0 && !starved.empty() && buffers->available() > 0; --i) {
+        connection &conn = *starved.front();
+        starved.pop_front();
+        conn.starved = false;
+        set_idle_deadline(conn);
+        step(conn);
+    }
+}
+
+void transfer_engine::worker::accept_client(connection &conn) {
+    int sock = accept4(conn.job.listen_socket, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (sock < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED) {
+            return;
+        }
+        throw std::runtime_error("accept");
+    }
+    conn.sock = sock;
+    conn.connected = chr::steady_clock::now();
+    engine.metrics->local().accept_wait.record(
+            chr::duration_cast<chr::microseconds>(conn.connected - conn.listening).count());
+
+    /* only one client per job, the listening socket isn't needed anymore */
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn.job.listen_socket, nullptr);
+    close(conn.job.listen_socket);
+    conn.job.listen_socket = -1;
+    by_id.erase(conn.id);
+    deadlines.erase(conn.deadline);
+    conn.deadline = deadlines.end();
+    set_idle_deadline(conn);
+
+    if (conn.job.kind == transfer_kind::session) {
+        conn.session = std::make_unique<::session>(conn.job.session, engine.mode, engine.cache);
+        watch(conn);
+        return;
+    }
+    else if (conn.job.kind == transfer_kind::send) {
+        uint64_t end = conn.job.offset + conn.job.length;
+        if (!(conn.file = engine.cache->open(conn.job.path, end))) {
+            throw std::runtime_error("open");
+        }
+        conn.file->prefetch(conn.job.offset, conn.job.length);
+        if (ring && !conn.job.compress) {
+            make_blocking(conn.sock);
+            conn.ring_transfer = std::make_unique<uring_transfer>(*ring, true, conn.file->fd, conn.sock,
+                                                                  conn.job.offset, conn.job.length, conn.job.checksum,
+                                                                  engine.mode != transfer_mode::copy);
+        }
+        else {
+            /* a file that shrank since it was announced fails on the way, it's never read past the mapping */
+            conn.sender = std::make_unique<file_sender>(conn.file->fd, conn.job.offset, conn.job.length, engine.mode,
+                                                        conn.job.checksum,
+                                                        conn.file->size >= end ? conn.file->mapping : nullptr,
+                                                        conn.job.compress);
+        }
+    }
+    else {
+        const write_options &writes = engine.write_settings;
+        bool through_ring = ring && !conn.job.compress;
+        /* only the io_uring transfers write aligned blocks, a resumed one has to start at an aligned offset */
+        bool direct = writes.direct && through_ring && conn.job.offset % DIRECT_IO_ALIGN == 0;
+        int flags = O_WRONLY | O_CREAT | O_CLOEXEC;
+        conn.fd = open(conn.job.path.c_str(), flags | (direct ? O_DIRECT : 0), S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+        if (conn.fd < 0 && direct && errno == EINVAL) {
+            /* the file system doesn't do O_DIRECT */
+            direct = false;
+            conn.fd = open(conn.job.path.c_str(), flags, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+        }
+        if (conn.fd < 0) {
+            throw std::runtime_error("open");
+        }
+        /* a resumed upload continues after the bytes already received, anything else is dropped */
+        if (ftruncate(conn.fd, conn.job.offset) < 0 || lseek(conn.fd, conn.job.offset, SEEK_SET) < 0) {
+            throw std::runtime_error("ftruncate");
+        }
+        if (writes.preallocate) {
+            preallocate(conn.fd, conn.job.offset, conn.job.length - conn.job.offset);
+        }
+        if (writes.writeback_chunk > 0 && !direct) {
+            conn.pacer = std::make_unique<writeback_pacer>(conn.fd, conn.job.offset, writes.writeback_chunk);
+        }
+        if (through_ring) {
+            make_blocking(conn.sock);
+            conn.ring_transfer = std::make_unique<uring_transfer>(*ring, false, conn.fd, conn.sock, conn.job.offset,
+                                                                  conn.job.length - conn.job.offset, true, false);
+        }
+        else {
+            conn.receiver = std::make_unique<file_receiver>(conn.fd, conn.job.length - conn.job.offset,
+                                                            conn.job.compress);
+        }
+    }
+
+    conn.scheduled = true;
+    uint64_t left = conn.job.kind == transfer_kind::send ? conn.job.length : conn.job.length - conn.job.offset;
+    if (!engine.scheduler.enter(conn.id, conn.job.client, left)) {
+        /* the client is connected and waits for its turn, it can't stall meanwhile */
+        deadlines.erase(conn.deadline);
+        conn.deadline = deadlines.end();
+        waiting.emplace(conn.id, &conn);
+        return;
+    }
+    watch(conn);
+}
+
+/** Lets epoll report the events the transfer waits for. */
+void transfer_engine::worker::watch(connection &conn) {
+    if (conn.ring_transfer) {
+        step(conn);
+        return;
+    }
+    struct epoll_event event{};
+    event.data.ptr = &conn;
+    if (conn.session) {
+        event.events = conn.writing ? EPOLLOUT : EPOLLIN;
+    }
+    else {
+        event.events = conn.job.kind == transfer_kind::send ? EPOLLOUT : EPOLLIN;
+    }
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn.sock, &event) < 0) {
+        throw std::runtime_error("epoll_ctl");
+    }
+}
+
+/**
+ * Takes the transfer out of epoll if the rate limit of the direction it's about to move data in is used up.
+ * @return true if it was paused.
+ */
+bool transfer_engine::worker::pause(connection &conn) {
+    bool sending = conn.session ? conn.session->wants_write() : conn.job.kind == transfer_kind::send;
+    chr::steady_clock::duration delay = (sending ? engine.scheduler.sending : engine.scheduler.receiving).delay();
+    if (delay == chr::steady_clock::duration::zero()) {
+        return false;
+    }
+    if (!conn.ring_transfer && epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn.sock, nullptr) < 0) {
+        throw std::runtime_error("epoll_ctl");
+    }
+    /* waiting for the rate limit isn't stalling */
+    if (conn.deadline != deadlines.end()) {
+        deadlines.erase(conn.deadline);
+        conn.deadline = deadlines.end();
+    }
+    conn.paused = true;
+    conn.resume = paused.emplace(chr::steady_clock::now() + delay, &conn);
+    engine.scheduler.throttled();
+    return true;
+}
+
+void transfer_engine::worker::resume_paused() {
+    chr::steady_clock::time_point now = chr::steady_clock::now();
+    while (!paused.empty() && paused.begin()->first <= now) {
+        connection &conn = *paused.begin()->second;
+        paused.erase(paused.begin());
+        conn.paused = false;
+        set_idle_deadline(conn);
+        watch(conn);
+    }
+}
+
+void transfer_engine::worker::finish(connection &conn, bool success) {
+    if (conn.ring_transfer && !conn.ring_transfer->idle()) {
+        /* the kernel still uses the buffer and the descriptors: the socket is shut down so that
+           the requests end quickly, the transfer is finished once they complete */
+        if (!conn.aborting) {
+            conn.aborting = true;
+            shutdown(conn.sock, SHUT_RDWR);
+        }
+        if (conn.deadline != deadlines.end()) {
+            deadlines.erase(conn.deadline);
+            conn.deadline = deadlines.end();
+        }
+        return;
+    }
+
+    transfer_result result;
+    result.success = success;
+    if (conn.sender) {
+        result.bytes = conn.sender->sent();
+        result.checksummed = conn.sender->checksummed();
+        result.checksum = conn.sender->checksum();
+    }
+    else if (conn.receiver) {
+        result.bytes = conn.receiver->written();
+        result.checksummed = true;
+        result.checksum = conn.receiver->checksum();
+    }
+    else if (conn.ring_transfer) {
+        result.bytes = conn.ring_transfer->is_sending() ? conn.ring_transfer->sent() : conn.ring_transfer->written();
+        result.checksummed = conn.ring_transfer->checksummed();
+        result.checksum = conn.ring_transfer->checksum();
+    }
+
+    if (conn.job.listen_socket >= 0) {
+        close(conn.job.listen_socket); /* also removes it from epoll */
+        by_id.erase(conn.id);
+    }
+    if (conn.deadline != deadlines.end()) {
+        deadlines.erase(conn.deadline);
+    }
+    if (conn.paused) {
+        paused.erase(conn.resume);
+    }
+    waiting.erase(conn.id);
+    if (conn.starved) {
+        starved.erase(std::find(starved.begin(), starved.end(), &conn));
+    }
+    if (conn.scheduled) {
+        engine.scheduler.leave(conn.id); /* the next transfer in line may start now */
+    }
+    if (conn.fd >= 0) {
+        if (!success && engine.write_settings.preallocate) {
+            release_preallocation(conn.fd, conn.job.length); /* a kept part takes only what it needs */
+        }
+        close(conn.fd);
+    }
+    if (conn.session) {
+        result.bytes = conn.session->requests();
+        conn.session.reset(); /* aborts the request in progress */
+    }
+    if (conn.receiver || (conn.ring_transfer && !conn.ring_transfer->is_sending())) {
+        if (success && !conn.job.final_path.empty() && rename(conn.job.path.c_str(), conn.job.final_path.c_str()) < 0) {
+            std::cerr << "[TRANSFER ERROR] " << conn.job.path << ": rename: " << strerror(errno) << "\n";
+            success = result.success = false;
+        }
+        if (!success && (conn.job.partial_path.empty() ||
+                         rename(conn.job.path.c_str(), conn.job.partial_path.c_str()) < 0)) {
+            unlink(conn.job.path.c_str());
+        }
+    }
+
+    if (!conn.session && conn.sock >= 0) {
+        /* the client connected, the unclaimed and cancelled ports aren't transfers */
+        metrics_shard &counters = engine.metrics->local();
+        bump(success ? counters.transfers_done : counters.transfers_failed);
+        double seconds = chr::duration<double>(chr::steady_clock::now() - conn.connected).count();
+        traffic moved = measure(conn);
+        if (success && seconds > 0) {
+            counters.transfer_rate.record((uint64_t) ((moved.out + moved.in) / seconds));
+        }
+    }
+    if (conn.job.on_done) {
+        conn.job.on_done(result);
+    }
+    /* closed last: once the client sees the end of the connection, the server state is up to date */
+    if (conn.sock >= 0) {
+        if (!success) {
+            /* reset, so that the client doesn't take the end of an aborted file for the end of the file */
+            struct linger reset{1, 0};
+            setsockopt(conn.sock, SOL_SOCKET, SO_LINGER, &reset, sizeof reset);
+        }
+        close(conn.sock);
+    }
+    --engine.active_jobs;
+    connections.erase(&conn);
+}
+
+/** Moves the idle deadline of a connected transfer, called whenever it makes progress. */
+void transfer_engine::worker::set_idle_deadline(connection &conn) {
+    if (conn.deadline != deadlines.end()) {
+        deadlines.erase(conn.deadline);
+        conn.deadline = deadlines.end();
+    }
+    if (conn.job.idle_timeout > chr::steady_clock::duration::zero()) {
+        conn.deadline = deadlines.emplace(chr::steady_clock::now() + conn.job.idle_timeout, &conn);
+    }
+}
+
+void transfer_engine::worker::expire_deadlines() {
+    chr::steady_clock::time_point now = chr::steady_clock::now();
+    while (!deadlines.empty() && deadlines.begin()->first <= now) {
+        /* the client didn't connect in time / the transfer stalled */
+        connection &conn = *deadlines.begin()->second;
+        if (conn.sock >= 0) {
+            std::cerr << "[TRANSFER ERROR] " << conn.job.path << ": no progress for too long\n";
+        }
+        finish(conn, false);
+    }
+}
+
+/** Time to the nearest deadline or the end of a pause in milliseconds, -1 if there is none. */
+int transfer_engine::worker::next_timeout() {
+    if (deadlines.empty() && paused.empty()) {
+        return -1;
+    }
+    chr::steady_clock::time_point nearest = chr::steady_clock::time_point::max();
+    if (!deadlines.empty()) {
+        nearest = deadlines.begin()->first;
+    }
+    if (!paused.empty()) {
+        nearest = std::min(nearest, paused.begin()->first);
+    }
+    chr::steady_clock::duration remaining = nearest - chr::steady_clock::now();
+    if (remaining <= chr::steady_clock::duration::zero()) {
+        return 0;
+    }
+    return chr::duration_cast<chr::milliseconds>(remaining).count() + 1;
+}
+
+transfer_engine::transfer_engine(std::size_t workers_count, transfer_mode mode, const schedule_limits &limits,
+                                 std::shared_ptr<file_cache> cache, std::shared_ptr<server_metrics> metrics,
+                                 const uring_options &uring_settings, const write_options &write_settings)
+        : mode(mode), cache(cache ? std::move(cache) : std::make_shared<file_cache>(0, 0)),
+          metrics(metrics ? std::move(metrics) : std::make_shared<server_metrics>()), uring_settings(uring_settings),
+          write_settings(write_settings), scheduler(limits, [this](uint64_t id) {
+            /* the worker of the job starts it */
+            worker &w = *workers[id % workers.size()];
+            {
+                std::lock_guard<std::mutex> lock(w.queue_mutex);
+                w.admitted.push_back(id);
+            }
+            uint64_t value = 1;
+            if (write(w.wake_fd, &value, sizeof value) < 0) {
+                throw std::runtime_error("eventfd write");
+            }
+        }) {
+    /* SIGINT has to be handled by the control plane thread */
+    sigset_t blocked, previous;
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &blocked, &previous);
+
+    for (std::size_t i = 0; i < std::max<std::size_t>(workers_count, 1); ++i) {
+        workers.push_back(std::make_unique<worker>(*this));
+        worker *w = workers.back().get();
+        w->thread = std::thread([w]() {
+            try {
+                w->run();
+            } catch (const std::exception &e) {
+                std::cerr << "error: transfer worker: " << e.what() << ": " << strerror(errno) << "\n";
+                std::terminate();
+            }
+        });
+    }
+
+    pthread_sigmask(SIG_SETMASK, &previous, nullptr);
+}
+
+transfer_engine::~transfer_engine() {
+    for (auto &w : workers) {
+        {
+            std::lock_guard<std::mutex> lock(w->queue_mutex);
+            w->stopping = true;
+        }
+        uint64_t value = 1;
+        if (write(w->wake_fd, &value, sizeof value) < 0) {
+            std::cerr << "error: eventfd write: " << strerror(errno) << "\n";
+        }
+    }
+    for (auto &w : workers) {
+        if (w->thread.joinable()) {
+            w->thread.join();
+        }
+    }
+}
+
+uint64_t transfer_engine::submit(transfer_job job) {
+    uint64_t id = next_id++;
+    worker &w = *workers[id % workers.size()];
+    ++active_jobs;
+    {
+        std::lock_guard<std::mutex> lock(w.queue_mutex);
+        w.queue.emplace_back(id, std::move(job));
+    }
+    uint64_t value = 1;
+    if (write(w.wake_fd, &value, sizeof value) < 0) {
+        throw std::runtime_error("eventfd write");
+    }
+    return id;
+}
+
+void transfer_engine::cancel(uint64_t id) {
+    worker &w = *workers[id % workers.size()];
+    {
+        std::lock_guard<std::mutex> lock(w.queue_mutex);
+        w.cancelled.push_back(id);
+    }
+    uint64_t value = 1;
+    if (write(w.wake_fd, &value, sizeof value) < 0) {
+        throw std::runtime_error("eventfd write");
+    }
+}
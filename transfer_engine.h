@@ -0,0 +1,129 @@
+#ifndef NETSTORE_TRANSFER_ENGINE_H
+#define NETSTORE_TRANSFER_ENGINE_H
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "file_cache.h"
+#include "metrics.h"
+#include "session.h"
+#include "transfer.h"
+#include "transfer_scheduler.h"
+#include "uring_transfer.h"
+
+/** Direction of a TCP transfer, seen from the server. */
+enum class transfer_kind {
+    send, /** client fetches a file */
+    receive, /** client uploads a file */
+    session, /** many transfers over a single connection, see @ref session */
+};
+
+/**
+ * A single TCP transfer handed over by the control plane.
+ * The control plane creates the listening socket (so that it knows the port to announce)
+ * and the engine takes the ownership of it.
+ */
+struct transfer_job {
+    transfer_kind kind = transfer_kind::send;
+    int listen_socket = -1; /** listening TCP socket, the client connects to it */
+    uint32_t client = 0; /** IPv4 address of the client (network byte order), for the fair queuing */
+    std::string path; /** file to send / file to create */
+    uint64_t offset = 0; /** first byte sent / first byte received (the ones before it are already in the file) */
+    uint64_t length = 0; /** number of bytes to send / expected size of the uploaded file */
+    /** an upload is received into @ref path and renamed to that once it's complete, empty - received in place */
+    std::string final_path;
+    /** a failed upload is moved there so that it can be resumed, if empty it's removed */
+    std::string partial_path;
+    std::chrono::steady_clock::time_point accept_deadline; /** the client has to connect before that */
+    /** the transfer is aborted if it makes no progress for that long, zero - never */
+    std::chrono::steady_clock::duration idle_timeout{};
+    /** compute the checksum of the sent bytes (the received ones always get it), forces the copy loop */
+    bool checksum = false;
+    /** the file moves deflated, both ways (see @ref worth_compressing), only for the whole file */
+    bool compress = false;
+    /**
+     * Called by the worker thread when the transfer ends (successfully or not),
+     * before the client's connection is closed.
+     */
+    std::function<void(const transfer_result &result)> on_done;
+    /** for @ref transfer_kind::session (path, offset, length and checksum aren't used then) */
+    std::shared_ptr<const session_handler> session;
+};
+
+/**
+ * Owns all the TCP transfer sockets of the server.
+ * A fixed number of worker threads, each one running an epoll loop over
+ * non-blocking sockets. The jobs are spread between the workers round robin.
+ * Once the client connects, a file transfer waits for its slot in the @ref transfer_scheduler,
+ * and every transfer (sessions too) pauses while the rate limit of its direction is used up.
+ * The sessions don't take a slot: they are long-lived and carry the small files anyway.
+ * The files are opened for sending through a @ref file_cache.
+ * With io_uring, every worker also has a ring with a pool of registered buffers: the file transfers
+ * (but the compressed ones) are moved by @ref uring_transfer instead of the epoll loop, and the worker
+ * only submits the next step when the previous one completes. The ring is watched by the same epoll.
+ * The uploaded files are written as the @ref write_options say.
+ */
+class transfer_engine {
+public:
+    /**
+     * Starts the worker threads.
+     * @param [in] workers Number of worker threads.
+     * @param [in] mode Transfer mode used to send files.
+     * @param [in] limits Limits of the @ref transfer_scheduler.
+     * @param [in] cache Opens the sent files, nullptr - they are opened every time.
+     * @param [in] metrics Counts the bytes and the transfers, nullptr - a private one.
+     * @param [in] uring The io_uring data path, if the kernel doesn't have it the workers say so and go without.
+     * @param [in] writes How the uploaded files are written.
+     */
+    transfer_engine(std::size_t workers, transfer_mode mode, const schedule_limits &limits = {},
+                    std::shared_ptr<file_cache> cache = nullptr, std::shared_ptr<server_metrics> metrics = nullptr,
+                    const uring_options &uring = {}, const write_options &writes = {});
+    transfer_engine(const transfer_engine &) = delete;
+    transfer_engine &operator=(const transfer_engine &) = delete;
+    /**
+     * Stops the workers, unfinished transfers are aborted: the files of the unfinished uploads are removed
+     * (or moved to their @ref transfer_job::partial_path).
+     */
+    ~transfer_engine();
+
+    /**
+     * Hands a job over to one of the workers. Thread safe.
+     * @return Id of the job, for @ref cancel.
+     */
+    uint64_t submit(transfer_job job);
+
+    /**
+     * Aborts the job @ref id if the client hasn't connected yet, as if its accept deadline passed
+     * (@ref transfer_job::on_done is called with a failure). Does nothing once it's connected or done.
+     * Thread safe, the job is aborted asynchronously by its worker.
+     */
+    void cancel(uint64_t id);
+
+    /** Number of jobs that haven't finished yet. */
+    std::size_t active() const { return active_jobs; }
+
+    /** Number of connected transfers waiting for their slot. Thread safe. */
+    std::size_t queued() { return scheduler.depth(); }
+
+    schedule_stats scheduling() { return scheduler.stats(); }
+
+    struct worker;
+
+private:
+    std::vector<std::unique_ptr<worker>> workers;
+    std::atomic<uint64_t> next_id{0}; /** the job id also picks its worker */
+    std::atomic<std::size_t> active_jobs{0};
+    transfer_mode mode;
+    std::shared_ptr<file_cache> cache;
+    std::shared_ptr<server_metrics> metrics;
+    uring_options uring_settings;
+    write_options write_settings;
+    transfer_scheduler scheduler;
+};
+
+#endif //NETSTORE_TRANSFER_ENGINE_H
@@ -0,0 +1,150 @@
+#include <algorithm>
+#include <vector>
+
+#include "transfer_scheduler.h"
+
+#define BURST_SECONDS 0.25 /** a bucket holds that many seconds of its rate */
+#define MIN_BURST 65536.0 /** ...but at least that many bytes */
+
+namespace chr = std::chrono;
+
+token_bucket::token_bucket(uint64_t rate)
+        : rate((double) rate), capacity(std::max(rate * BURST_SECONDS, MIN_BURST)), tokens(capacity),
+          refilled(chr::steady_clock::now()) {}
+
+void token_bucket::refill(chr::steady_clock::time_point now) {
+    double elapsed = chr::duration<double>(now - refilled).count();
+    tokens = std::min(capacity, tokens + elapsed * rate);
+    refilled = now;
+}
+
+chr::steady_clock::duration token_bucket::delay() {
+    if (rate == 0) {
+        return chr::steady_clock::duration::zero();
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    refill(chr::steady_clock::now());
+    if (tokens > 0) {
+        return chr::steady_clock::duration::zero();
+    }
+    return chr::duration_cast<chr::steady_clock::duration>(chr::duration<double>((1 - tokens) / rate));
+}
+
+void token_bucket::charge(uint64_t bytes) {
+    if (rate == 0 || bytes == 0) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    refill(chr::steady_clock::now());
+    tokens -= (double) bytes;
+}
+
+transfer_scheduler::transfer_scheduler(const schedule_limits &limits, std::function<void(uint64_t id)> admit)
+        : sending(limits.send_rate), receiving(limits.receive_rate), limits(limits), admit(std::move(admit)) {}
+
+bool transfer_scheduler::enter(uint64_t id, uint32_t client, uint64_t length) {
+    std::lock_guard<std::mutex> lock(mutex);
+    scheduled_job &job = jobs[id];
+    job.client = client;
+    job.small = length <= limits.small_file;
+    if (limits.max_transfers == 0 || running < limits.max_transfers) {
+        job.running = true;
+        ++running;
+        ++counters.started;
+        return true;
+    }
+
+    if (job.small) {
+        small_line.push_back(id);
+    }
+    else {
+        std::deque<uint64_t> &line = client_lines[client];
+        if (line.empty()) {
+            turns.push_back(client);
+        }
+        line.push_back(id);
+    }
+    ++waiting;
+    ++counters.queued;
+    counters.max_depth = std::max<uint64_t>(counters.max_depth, waiting);
+    return false;
+}
+
+uint64_t transfer_scheduler::pop_next() {
+    uint64_t id;
+    if (!small_line.empty()) {
+        id = small_line.front();
+        small_line.pop_front();
+    }
+    else {
+        uint32_t client = turns.front();
+        turns.pop_front();
+        std::deque<uint64_t> &line = client_lines[client];
+        id = line.front();
+        line.pop_front();
+        if (line.empty()) {
+            client_lines.erase(client);
+        }
+        else {
+            turns.push_back(client); /* the other clients go first */
+        }
+    }
+    --waiting;
+    return id;
+}
+
+void transfer_scheduler::leave(uint64_t id) {
+    std::vector<uint64_t> admitted;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = jobs.find(id);
+        if (it == jobs.end()) {
+            return;
+        }
+        scheduled_job job = it->second;
+        jobs.erase(it);
+
+        if (!job.running) {
+            /* gave up while waiting (cancelled, timed out, the server stops) */
+            if (job.small) {
+                small_line.erase(std::find(small_line.begin(), small_line.end(), id));
+            }
+            else {
+                std::deque<uint64_t> &line = client_lines[job.client];
+                line.erase(std::find(line.begin(), line.end(), id));
+                if (line.empty()) {
+                    client_lines.erase(job.client);
+                    turns.erase(std::find(turns.begin(), turns.end(), job.client));
+                }
+            }
+            --waiting;
+            return;
+        }
+
+        --running;
+        while (waiting > 0 && running < limits.max_transfers) {
+            uint64_t next = pop_next();
+            jobs[next].running = true;
+            ++running;
+            admitted.push_back(next);
+        }
+    }
+    for (uint64_t next : admitted) {
+        admit(next);
+    }
+}
+
+std::size_t transfer_scheduler::depth() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return waiting;
+}
+
+void transfer_scheduler::throttled() {
+    std::lock_guard<std::mutex> lock(mutex);
+    ++counters.throttled;
+}
+
+schedule_stats transfer_scheduler::stats() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return counters;
+}
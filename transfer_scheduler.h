@@ -0,0 +1,112 @@
+#ifndef NETSTORE_TRANSFER_SCHEDULER_H
+#define NETSTORE_TRANSFER_SCHEDULER_H
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+
+/** Limits of the @ref transfer_scheduler, zero - no limit. */
+struct schedule_limits {
+    std::size_t max_transfers = 0; /** transfers moving data at once */
+    uint64_t send_rate = 0; /** bytes per second sent to all the clients together */
+    uint64_t receive_rate = 0; /** bytes per second received from all the clients together */
+    uint64_t small_file = 0; /** transfers of at most that many bytes go ahead of the others */
+};
+
+/** How the transfers were scheduled, for the statistics. */
+struct schedule_stats {
+    uint64_t started = 0; /** transfers given a slot at once */
+    uint64_t queued = 0; /** transfers that had to wait for a slot */
+    uint64_t max_depth = 0; /** most transfers waiting at once */
+    uint64_t throttled = 0; /** times a transfer was paused by a rate limit */
+};
+
+/**
+ * Rate limit of a direction shared by all the transfers. A transfer moves as much as the socket allows
+ * and is charged afterwards, so the bucket may go into debt: nothing moves until it's paid off.
+ * Thread safe.
+ */
+class token_bucket {
+public:
+    /** @param [in] rate Bytes per second, 0 - no limit. */
+    explicit token_bucket(uint64_t rate);
+
+    /** Time until the data may move again, zero if it may move now. */
+    std::chrono::steady_clock::duration delay();
+
+    /** Takes @ref bytes moved by a transfer out of the bucket. */
+    void charge(uint64_t bytes);
+
+private:
+    std::mutex mutex;
+    double rate; /** bytes per second */
+    double capacity; /** the largest burst */
+    double tokens;
+    std::chrono::steady_clock::time_point refilled;
+
+    void refill(std::chrono::steady_clock::time_point now);
+};
+
+/**
+ * Decides which transfers move data: at most @ref schedule_limits::max_transfers at once,
+ * the others wait in line. The small files have their own line that goes first, the rest
+ * is served round robin between the clients, so that a burst of big files from one of them
+ * doesn't hold up everybody else. Thread safe.
+ */
+class transfer_scheduler {
+public:
+    /**
+     * @param [in] limits Limits of the transfers.
+     * @param [in] admit Called (on any thread, no lock held) when a waiting transfer gets its slot.
+     */
+    transfer_scheduler(const schedule_limits &limits, std::function<void(uint64_t id)> admit);
+
+    /**
+     * Asks for a slot for the transfer @ref id.
+     * @param [in] client Address of the client, for the fair queuing.
+     * @param [in] length Bytes left to transfer.
+     * @return true if it may start at once, otherwise it waits for @ref admit.
+     */
+    bool enter(uint64_t id, uint32_t client, uint64_t length);
+
+    /** The transfer @ref id ended (started or still waiting), its slot goes to the next one in line. */
+    void leave(uint64_t id);
+
+    /** Number of transfers waiting for a slot. */
+    std::size_t depth();
+
+    /** Counts a transfer paused by @ref sending or @ref receiving. */
+    void throttled();
+
+    schedule_stats stats();
+
+    token_bucket sending;
+    token_bucket receiving;
+
+private:
+    struct scheduled_job {
+        uint32_t client = 0;
+        bool small = false;
+        bool running = false;
+    };
+
+    std::mutex mutex;
+    schedule_limits limits;
+    std::function<void(uint64_t id)> admit;
+    std::size_t running = 0;
+    std::size_t waiting = 0;
+    std::unordered_map<uint64_t, scheduled_job> jobs; /** the running and the waiting transfers */
+    std::deque<uint64_t> small_line; /** small files, in order */
+    std::map<uint32_t, std::deque<uint64_t>> client_lines; /** the other files by the client, in order */
+    std::deque<uint32_t> turns; /** clients with waiting files, the first one is served next */
+    schedule_stats counters;
+
+    /** Takes the next transfer out of the lines, the lock is held. */
+    uint64_t pop_next();
+};
+
+#endif //NETSTORE_TRANSFER_SCHEDULER_H
@@ -0,0 +1,169 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+#include <netinet/ip.h>
+#include <poll.h>
+
+#include "udp_batch.h"
+
+#define CONTROL_LEN CMSG_SPACE(sizeof(struct in_pktinfo)) /** ancillary data space for one datagram */
+
+void batch_stats::print(std::ostream &out) const {
+    out << "received " << received << " datagrams in " << receive_calls << " recvmmsg calls (avg depth "
+        << (receive_calls ? (double) received / receive_calls : 0) << ", max " << max_received << "), "
+        << "sent " << sent << " datagrams in " << send_calls << " sendmmsg calls (avg depth "
+        << (send_calls ? (double) sent / send_calls : 0) << ", max " << max_sent << ")";
+}
+
+receive_batch::receive_batch(std::size_t size)
+        : size(size), buffers(new char[size * BSIZE]), parts(size), addresses(size), headers(size),
+          controls(size * CONTROL_LEN) {}
+
+void receive_batch::prepare() {
+    for (std::size_t i = 0; i < size; ++i) {
+        parts[i].iov_base = buffers.get() + i * BSIZE;
+        parts[i].iov_len = BSIZE;
+        headers[i].msg_hdr = {};
+        headers[i].msg_hdr.msg_name = &addresses[i];
+        headers[i].msg_hdr.msg_namelen = sizeof addresses[i];
+        headers[i].msg_hdr.msg_iov = &parts[i];
+        headers[i].msg_hdr.msg_iovlen = 1;
+        headers[i].msg_hdr.msg_control = controls.data() + i * CONTROL_LEN;
+        headers[i].msg_hdr.msg_controllen = CONTROL_LEN;
+        headers[i].msg_len = 0;
+    }
+}
+
+int receive_batch::receive_now(int socket, int flags, batch_stats &stats) {
+    prepare();
+    int count;
+    do {
+        count = recvmmsg(socket, headers.data(), size, flags, nullptr);
+    } while (count < 0 && errno == EINTR);
+    if (count < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return -1;
+        }
+        throw std::runtime_error("read");
+    }
+
+    ++stats.receive_calls;
+    stats.received += count;
+    stats.max_received = std::max<uint64_t>(stats.max_received, count);
+    return count;
+}
+
+std::size_t receive_batch::receive(int socket, batch_stats &stats) {
+    /* blocks until the first datagram, then takes the ones already waiting */
+    int count = receive_now(socket, MSG_WAITFORONE, stats);
+    if (count < 0) {
+        throw std::runtime_error("read");
+    }
+    return count;
+}
+
+std::size_t receive_batch::receive_within(int socket, std::chrono::nanoseconds timeout, batch_stats &stats) {
+    timeout = std::max(timeout, std::chrono::nanoseconds::zero());
+    std::chrono::seconds seconds = std::chrono::duration_cast<std::chrono::seconds>(timeout);
+    struct timespec wait_time{seconds.count(), (timeout - seconds).count()};
+    struct pollfd readable{socket, POLLIN, 0};
+    int ready = ppoll(&readable, 1, &wait_time, nullptr);
+    if (ready < 0 && errno != EINTR) {
+        throw std::runtime_error("poll");
+    }
+    if (ready <= 0) {
+        return 0;
+    }
+    /* another reader may have taken the datagram in the meantime */
+    int count = receive_now(socket, MSG_DONTWAIT, stats);
+    return count < 0 ? 0 : count;
+}
+
+bool receive_batch::multicast(std::size_t i) const {
+    auto *header = const_cast<struct msghdr *>(&headers[i].msg_hdr);
+    for (struct cmsghdr *control = CMSG_FIRSTHDR(header); control != nullptr; control = CMSG_NXTHDR(header, control)) {
+        if (control->cmsg_level == IPPROTO_IP && control->cmsg_type == IP_PKTINFO) {
+            struct in_pktinfo info{};
+            memcpy(&info, CMSG_DATA(control), sizeof info);
+            return IN_MULTICAST(ntohl(info.ipi_addr.s_addr));
+        }
+    }
+    return false;
+}
+
+send_batch::send_batch(int socket, std::size_t size, batch_stats &stats)
+        : socket(socket), size(size), stats(stats), slots(size), headers(size) {}
+
+send_batch::slot &
+send_batch::next_slot(const struct sockaddr_in &address, std::string_view cmd, std::string_view data) {
+    if (cmd.length() > CMD_LEN) {
+        throw std::invalid_argument("wrong command");
+    }
+    if (queued == size) {
+        send();
+    }
+    slot &s = slots[queued];
+    s.address = address;
+    s.parts[1].iov_base = const_cast<char *>(data.data());
+    s.parts[1].iov_len = data.size();
+
+    struct mmsghdr &header = headers[queued];
+    header.msg_hdr = {};
+    header.msg_hdr.msg_name = &s.address;
+    header.msg_hdr.msg_namelen = sizeof s.address;
+    header.msg_hdr.msg_iov = s.parts;
+    header.msg_hdr.msg_iovlen = 2;
+    ++queued;
+    return s;
+}
+
+void send_batch::add_simple(const struct sockaddr_in &address, std::string_view cmd, uint64_t cmd_seq,
+                            std::string_view data) {
+    slot &s = next_slot(address, cmd, data);
+    s.parts[0].iov_base = s.header;
+    s.parts[0].iov_len = encode_header(s.header, cmd, cmd_seq);
+}
+
+void send_batch::add_complex(const struct sockaddr_in &address, std::string_view cmd, uint64_t cmd_seq,
+                             uint64_t param, std::string_view data) {
+    slot &s = next_slot(address, cmd, data);
+    s.parts[0].iov_base = s.header;
+    s.parts[0].iov_len = encode_header(s.header, cmd, cmd_seq, param);
+}
+
+std::string_view send_batch::keep(std::string data) {
+    kept.push_back(std::move(data));
+    return kept.back();
+}
+
+void send_batch::hold(std::shared_ptr<const void> owner) {
+    held.push_back(std::move(owner));
+}
+
+void send_batch::send() {
+    std::size_t done = 0;
+    while (done < queued) {
+        int count = sendmmsg(socket, headers.data() + done, queued - done, 0);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            queued = 0;
+            throw std::runtime_error("write");
+        }
+        ++stats.send_calls;
+        stats.sent += count;
+        stats.max_sent = std::max<uint64_t>(stats.max_sent, count);
+        done += count;
+    }
+    queued = 0;
+}
+
+void send_batch::flush() {
+    send();
+    kept.clear();
+    held.clear();
+}
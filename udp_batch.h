@@ -0,0 +1,122 @@
+#ifndef NETSTORE_UDP_BATCH_H
+#define NETSTORE_UDP_BATCH_H
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <iosfwd>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "codec.h"
+
+/** Counters of the batched UDP I/O. */
+struct batch_stats {
+    uint64_t receive_calls = 0; /** recvmmsg calls that returned datagrams */
+    uint64_t received = 0; /** datagrams received */
+    uint64_t max_received = 0; /** biggest number of datagrams returned by a single recvmmsg */
+    uint64_t send_calls = 0; /** sendmmsg calls */
+    uint64_t sent = 0; /** datagrams sent */
+    uint64_t max_sent = 0; /** biggest number of datagrams sent by a single sendmmsg */
+
+    /** Prints the counters and the average batch depths. */
+    void print(std::ostream &out) const;
+};
+
+/**
+ * Receives many datagrams with a single recvmmsg call.
+ * If IP_PKTINFO is enabled on the socket, the destination address of every datagram is also known.
+ */
+class receive_batch {
+public:
+    /** @param [in] size Max number of datagrams received at once. */
+    explicit receive_batch(std::size_t size);
+
+    /**
+     * Waits for at least one datagram and takes all the waiting ones (up to the batch size).
+     * @return Number of datagrams received.
+     */
+    std::size_t receive(int socket, batch_stats &stats);
+
+    /**
+     * Waits (poll) up to @ref timeout for a datagram, then takes all the waiting ones without blocking,
+     * so a burst is drained with as few calls as possible. The socket doesn't need a receive timeout.
+     * @return Number of datagrams received, 0 if none arrived in time.
+     */
+    std::size_t receive_within(int socket, std::chrono::nanoseconds timeout, batch_stats &stats);
+
+    /** Datagram @ref i of the last @ref receive, valid until the next @ref receive. */
+    const char *data(std::size_t i) const { return buffers.get() + i * BSIZE; }
+    std::size_t length(std::size_t i) const { return headers[i].msg_len; }
+    const struct sockaddr_in &address(std::size_t i) const { return addresses[i]; }
+    /** Checks if the datagram @ref i was sent to a multicast group (false if IP_PKTINFO isn't enabled). */
+    bool multicast(std::size_t i) const;
+
+private:
+    std::size_t size;
+    std::unique_ptr<char[]> buffers;
+    std::vector<struct iovec> parts;
+    std::vector<struct sockaddr_in> addresses;
+    std::vector<struct mmsghdr> headers;
+    std::vector<char> controls; /** ancillary data (IP_PKTINFO) of every datagram */
+
+    /** Resets the headers before a recvmmsg. */
+    void prepare();
+    /** recvmmsg retried on EINTR, with the counters updated; -1 if it failed with EAGAIN. */
+    int receive_now(int socket, int flags, batch_stats &stats);
+};
+
+/**
+ * Queues outgoing messages and sends them with sendmmsg.
+ * The data of the messages isn't copied, it has to stay valid until the messages are sent
+ * (@ref keep or @ref hold can hold it until the next @ref flush).
+ */
+class send_batch {
+public:
+    /**
+     * @param [in] socket Socket used to send.
+     * @param [in] size Max number of datagrams sent at once, the queue is sent when it's full.
+     */
+    send_batch(int socket, std::size_t size, batch_stats &stats);
+
+    void add_simple(const struct sockaddr_in &address, std::string_view cmd, uint64_t cmd_seq,
+                    std::string_view data);
+    void add_complex(const struct sockaddr_in &address, std::string_view cmd, uint64_t cmd_seq, uint64_t param,
+                     std::string_view data);
+
+    /** Stores @ref data until the next @ref flush, returns a view of it. */
+    std::string_view keep(std::string data);
+
+    /** Keeps @ref owner (of some queued data) alive until the next @ref flush. */
+    void hold(std::shared_ptr<const void> owner);
+
+    /** Sends all the queued messages and releases the data stored by @ref keep and @ref hold. */
+    void flush();
+
+private:
+    struct slot {
+        struct sockaddr_in address;
+        char header[MIN_CMPLX_LEN];
+        struct iovec parts[2];
+    };
+
+    int socket;
+    std::size_t size;
+    batch_stats &stats;
+    std::vector<slot> slots;
+    std::vector<struct mmsghdr> headers;
+    std::size_t queued = 0;
+    std::deque<std::string> kept;
+    std::vector<std::shared_ptr<const void>> held;
+
+    slot &next_slot(const struct sockaddr_in &address, std::string_view cmd, std::string_view data);
+    /** Sends the queued messages, the kept data stays. */
+    void send();
+};
+
+#endif //NETSTORE_UDP_BATCH_H
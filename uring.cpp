@@ -0,0 +1,152 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *params) {
+    return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, const void *arg, unsigned nr_args) {
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/** Maps a part of the ring. */
+static void *map_ring(int fd, std::size_t length, off_t offset) {
+    void *memory = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+    if (memory == MAP_FAILED) {
+        throw std::runtime_error("mmap");
+    }
+    return memory;
+}
+
+uring::uring(unsigned entries) {
+    struct io_uring_params params{};
+    ring_fd = io_uring_setup(entries, &params);
+    if (ring_fd < 0) {
+        throw std::runtime_error("io_uring_setup");
+    }
+
+    try {
+        sq_ring_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_ring_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            sq_ring_len = cq_ring_len = std::max(sq_ring_len, cq_ring_len);
+        }
+        sq_ring = map_ring(ring_fd, sq_ring_len, IORING_OFF_SQ_RING);
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            cq_ring = sq_ring;
+        }
+        else {
+            cq_ring = map_ring(ring_fd, cq_ring_len, IORING_OFF_CQ_RING);
+        }
+        sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+        sqes = static_cast<struct io_uring_sqe *>(map_ring(ring_fd, sqes_len, IORING_OFF_SQES));
+    } catch (...) {
+        release();
+        throw;
+    }
+
+    char *sq = static_cast<char *>(sq_ring);
+    sq_head = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+    sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    sq_mask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+    sq_entries = params.sq_entries;
+    queued_tail = *sq_tail;
+
+    char *cq = static_cast<char *>(cq_ring);
+    cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    cq_mask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<struct io_uring_cqe *>(cq + params.cq_off.cqes);
+
+    probe();
+}
+
+uring::~uring() {
+    release();
+}
+
+void uring::release() {
+    if (sqes) {
+        munmap(sqes, sqes_len);
+    }
+    if (cq_ring && cq_ring != sq_ring) {
+        munmap(cq_ring, cq_ring_len);
+    }
+    if (sq_ring) {
+        munmap(sq_ring, sq_ring_len);
+    }
+    close(ring_fd);
+}
+
+/** Asks the kernel for the operations it has (IORING_REGISTER_PROBE, since 5.6). */
+void uring::probe() {
+    std::size_t length = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    std::vector<char> memory(length, 0);
+    auto *result = reinterpret_cast<struct io_uring_probe *>(memory.data());
+    ops.assign(IORING_OP_LAST, false);
+    if (io_uring_register(ring_fd, IORING_REGISTER_PROBE, result, IORING_OP_LAST) < 0) {
+        return; /* an old kernel, nothing beyond the basic reads and writes is used */
+    }
+    for (unsigned i = 0; i < result->ops_len && i < IORING_OP_LAST; ++i) {
+        ops[result->ops[i].op] = result->ops[i].flags & IO_URING_OP_SUPPORTED;
+    }
+}
+
+bool uring::reserve(unsigned count) {
+    if (sq_entries - (queued_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE)) >= count) {
+        return true;
+    }
+    submit();
+    return sq_entries - (queued_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE)) >= count;
+}
+
+struct io_uring_sqe *uring::get_sqe() {
+    unsigned index = queued_tail & *sq_mask;
+    struct io_uring_sqe *sqe = &sqes[index];
+    memset(sqe, 0, sizeof *sqe);
+    sq_array[index] = index;
+    ++queued_tail;
+    return sqe;
+}
+
+void uring::submit(unsigned wait) {
+    __atomic_store_n(sq_tail, queued_tail, __ATOMIC_RELEASE);
+    unsigned pending = queued_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    if (pending == 0 && wait == 0) {
+        return;
+    }
+    for (;;) {
+        ++enter_calls;
+        int count = io_uring_enter(ring_fd, pending, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0);
+        if (count >= 0) {
+            submitted_requests += count;
+            return;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EBUSY) {
+            return; /* the completions have to be reaped first, the requests stay queued */
+        }
+        throw std::runtime_error("io_uring_enter");
+    }
+}
+
+void uring::register_buffers(const std::vector<struct iovec> &buffers) {
+    if (io_uring_register(ring_fd, IORING_REGISTER_BUFFERS, buffers.data(), (unsigned) buffers.size()) < 0) {
+        throw std::runtime_error("io_uring_register");
+    }
+}
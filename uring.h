@@ -0,0 +1,107 @@
+#ifndef NETSTORE_URING_H
+#define NETSTORE_URING_H
+
+#include <cstdint>
+#include <vector>
+
+#include <linux/io_uring.h>
+#include <sys/uio.h>
+
+/**
+ * An io_uring instance, set up with the raw system calls (no liburing).
+ * The requests are queued with @ref get_sqe and go to the kernel together with @ref submit,
+ * the completions are taken with @ref reap. The ring descriptor is readable (for epoll)
+ * while there are completions waiting.
+ * Not thread safe.
+ */
+class uring {
+public:
+    /**
+     * Throws if the kernel has no io_uring (or it's disabled).
+     * @param [in] entries Size of the submission queue.
+     */
+    explicit uring(unsigned entries);
+    uring(const uring &) = delete;
+    uring &operator=(const uring &) = delete;
+    ~uring();
+
+    int fd() const { return ring_fd; }
+
+    /** Checks if the kernel has the operation (IORING_OP_*). */
+    bool supports(unsigned op) const { return op < ops.size() && ops[op]; }
+
+    /**
+     * Makes room for @ref count requests that have to be queued together (a linked chain),
+     * submitting the queued ones if needed.
+     * @return false if there is no room even then.
+     */
+    bool reserve(unsigned count);
+
+    /** The next request, zeroed. Has to be preceded by a successful @ref reserve. */
+    struct io_uring_sqe *get_sqe();
+
+    /**
+     * Hands the queued requests over to the kernel.
+     * @param [in] wait Number of the completions to wait for.
+     */
+    void submit(unsigned wait = 0);
+
+    /**
+     * Calls @ref handle(user_data, res, flags) for every waiting completion.
+     * @return Number of the completions.
+     */
+    template<typename F>
+    unsigned reap(F handle) {
+        unsigned head = *cq_head;
+        unsigned count = 0;
+        while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+            const struct io_uring_cqe &cqe = cqes[head & *cq_mask];
+            uint64_t user_data = cqe.user_data;
+            int res = cqe.res;
+            uint32_t flags = cqe.flags;
+            ++head;
+            ++count;
+            /* the entry is given back before it's handled, the handler may submit further requests */
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+            handle(user_data, res, flags);
+        }
+        return count;
+    }
+
+    /** Registers the buffers for IORING_OP_READ_FIXED / IORING_OP_WRITE_FIXED, by their index. */
+    void register_buffers(const std::vector<struct iovec> &buffers);
+
+    uint64_t submitted() const { return submitted_requests; }
+    /** io_uring_enter calls. */
+    uint64_t enters() const { return enter_calls; }
+
+private:
+    int ring_fd = -1;
+    void *sq_ring = nullptr;
+    std::size_t sq_ring_len = 0;
+    void *cq_ring = nullptr;
+    std::size_t cq_ring_len = 0;
+    struct io_uring_sqe *sqes = nullptr;
+    std::size_t sqes_len = 0;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    unsigned queued_tail; /** the tail with the requests queued but not yet published */
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    std::vector<bool> ops; /** by IORING_OP_* */
+    uint64_t submitted_requests = 0;
+    uint64_t enter_calls = 0;
+
+    void probe();
+    void release();
+};
+
+#endif //NETSTORE_URING_H
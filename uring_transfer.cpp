@@ -0,0 +1,194 @@
+#include <algorithm>
+#include <cerrno>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "crc32c.h"
+#include "uring_transfer.h"
+
+uring_transfer::uring_transfer(const uring &ring, bool sending, int fd, int sock, uint64_t offset, uint64_t length,
+                               bool checksum, bool splice)
+        : sender(sending), fd(fd), sock(sock), offset(offset), remaining(length), checksum_enabled(!sending || checksum) {
+    if (sending && splice && !checksum && ring.supports(IORING_OP_SPLICE)) {
+        if (pipe2(pipe_fds, O_CLOEXEC) < 0) {
+            throw std::runtime_error("pipe");
+        }
+        /* a bigger pipe moves more in a step, the default one (64 KiB) still works */
+        fcntl(pipe_fds[1], F_SETPIPE_SZ, URING_BUFFER_LEN);
+    }
+    zero_copy = sending && !splicing() && ring.supports(IORING_OP_SEND_ZC);
+    if (!sending) {
+        int flags = fcntl(fd, F_GETFL);
+        direct = flags >= 0 && (flags & O_DIRECT);
+    }
+}
+
+uring_transfer::~uring_transfer() {
+    release_buffer();
+    if (splicing()) {
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+    }
+}
+
+bool uring_transfer::start(uring &ring, buffer_pool &buffers, uint64_t user_data) {
+    if (filled == drained) {
+        /* the previous step is over, a whole chain */
+        if (!ring.reserve(2)) {
+            return false;
+        }
+        if (!splicing() && buffer < 0) {
+            if ((buffer = buffers.take()) < 0) {
+                return false;
+            }
+            pool = &buffers;
+            data = pool->data(buffer);
+        }
+        offset += filled;
+        filled = drained = 0;
+        uint64_t length = std::min<uint64_t>(remaining, URING_BUFFER_LEN);
+        check_direct(length);
+        struct io_uring_sqe *sqe = ring.get_sqe();
+        queue_fill(sqe, length);
+        sqe->flags |= IOSQE_IO_LINK;
+        sqe->user_data = user_data | fill;
+        sqe = ring.get_sqe();
+        queue_drain(sqe, length);
+        sqe->user_data = user_data | drain;
+        in_flight = 2;
+    }
+    else {
+        /* the rest of a short send / write, or of a chain broken by a short read */
+        if (!ring.reserve(1)) {
+            return false;
+        }
+        check_direct(filled - drained);
+        struct io_uring_sqe *sqe = ring.get_sqe();
+        queue_drain(sqe, filled - drained);
+        sqe->user_data = user_data | drain;
+        in_flight = 1;
+    }
+    return true;
+}
+
+/** Goes on without O_DIRECT if the next write of @ref length bytes isn't aligned. */
+void uring_transfer::check_direct(uint64_t length) {
+    if (direct && ((offset + drained) % DIRECT_IO_ALIGN != 0 || length % DIRECT_IO_ALIGN != 0)) {
+        /* the buffers are aligned, the tail of the file (or the rest of a short write) isn't */
+        int flags = fcntl(fd, F_GETFL);
+        if (flags >= 0) {
+            fcntl(fd, F_SETFL, flags & ~O_DIRECT); /* if it fails, so does the write and the transfer with it */
+        }
+        direct = false;
+    }
+}
+
+void uring_transfer::queue_fill(struct io_uring_sqe *sqe, uint64_t length) {
+    sqe->len = (uint32_t) length;
+    if (!sender) {
+        /* the whole buffer or the end of the stream, a short receive breaks the chain before the write */
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = sock;
+        sqe->addr = (uint64_t) data;
+        sqe->msg_flags = MSG_WAITALL;
+    }
+    else if (splicing()) {
+        sqe->opcode = IORING_OP_SPLICE;
+        sqe->splice_fd_in = fd;
+        sqe->splice_off_in = offset;
+        sqe->fd = pipe_fds[1];
+        sqe->off = (uint64_t) -1;
+        sqe->splice_flags = SPLICE_F_MOVE;
+    }
+    else {
+        sqe->opcode = IORING_OP_READ_FIXED;
+        sqe->fd = fd;
+        sqe->off = offset;
+        sqe->addr = (uint64_t) data;
+        sqe->buf_index = (uint16_t) buffer;
+    }
+}
+
+void uring_transfer::queue_drain(struct io_uring_sqe *sqe, uint64_t length) {
+    sqe->len = (uint32_t) length;
+    if (!sender) {
+        sqe->opcode = IORING_OP_WRITE_FIXED;
+        sqe->fd = fd;
+        sqe->off = offset + drained;
+        sqe->addr = (uint64_t) (data + drained);
+        sqe->buf_index = (uint16_t) buffer;
+    }
+    else if (splicing()) {
+        sqe->opcode = IORING_OP_SPLICE;
+        sqe->splice_fd_in = pipe_fds[0];
+        sqe->splice_off_in = (uint64_t) -1;
+        sqe->fd = sock;
+        sqe->off = (uint64_t) -1;
+        sqe->splice_flags = SPLICE_F_MOVE;
+    }
+    else {
+        sqe->opcode = zero_copy ? IORING_OP_SEND_ZC : IORING_OP_SEND;
+        sqe->fd = sock;
+        sqe->addr = (uint64_t) (data + drained);
+        sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+        if (zero_copy) {
+            sqe->ioprio = IORING_RECVSEND_FIXED_BUF;
+            sqe->buf_index = (uint16_t) buffer;
+        }
+    }
+}
+
+void uring_transfer::complete(uint64_t operation, int res, uint32_t flags) {
+    if (flags & IORING_CQE_F_NOTIF) {
+        /* the zero-copy send let go of the buffer */
+        --in_flight;
+    }
+    else {
+        if (!(flags & IORING_CQE_F_MORE)) {
+            --in_flight; /* otherwise the notification of a zero-copy send follows */
+        }
+        if (failed || (operation == drain && res == -ECANCELED)) {
+            /* the rest of an aborted step / a chain broken by a short read, its drain goes in the next step */
+        }
+        else if (res < 0) {
+            failed = true;
+            errno = -res;
+            if (operation == fill) {
+                throw std::runtime_error(sender && splicing() ? "splice" : "read");
+            }
+            throw std::runtime_error(sender ? splicing() ? "splice" : "writing to client socket" : "write");
+        }
+        else if (operation == fill) {
+            if (res == 0) {
+                failed = true;
+                errno = 0;
+                throw std::runtime_error(sender ? "file truncated during transfer"
+                                                : "connection closed before the end of the file");
+            }
+            if (checksum_enabled && !splicing()) {
+                crc = crc32c(crc, data, res);
+            }
+            filled = res;
+            remaining -= res;
+            fetched += res;
+        }
+        else {
+            drained += res;
+            moved += res;
+        }
+    }
+    if (idle() && (filled == drained || failed)) {
+        release_buffer();
+    }
+}
+
+void uring_transfer::release_buffer() {
+    if (buffer >= 0) {
+        pool->give_back(buffer);
+        buffer = -1;
+        data = nullptr;
+    }
+}
@@ -0,0 +1,112 @@
+#ifndef NETSTORE_URING_TRANSFER_H
+#define NETSTORE_URING_TRANSFER_H
+
+#include <cstdint>
+
+#include "buffer_pool.h"
+#include "transfer.h"
+#include "uring.h"
+
+#define URING_BUFFER_LEN (256 << 10) /** bytes moved by a single step of a transfer */
+
+/** The io_uring data path of the transfer engine. */
+struct uring_options {
+    bool enabled = false; /** falls back to the epoll loops if the kernel doesn't have io_uring */
+    std::size_t buffers = 64; /** registered buffers of every worker, a step of a transfer takes one */
+};
+
+/**
+ * A file transfer moved by io_uring, every step is a chain of two linked requests submitted at once:
+ * the file is read into a registered buffer and the buffer sent (IORING_OP_READ_FIXED -> IORING_OP_SEND_ZC
+ * or IORING_OP_SEND), or the file is spliced through a pipe (IORING_OP_SPLICE -> IORING_OP_SPLICE), or
+ * the socket is received into a buffer and the buffer written (IORING_OP_RECV -> IORING_OP_WRITE_FIXED).
+ * A chain broken by a short read or receive is finished by a single request in the next step.
+ * A file opened with O_DIRECT is written that way while the writes are aligned (see @ref DIRECT_IO_ALIGN),
+ * the tail of the file goes through the page cache.
+ * The socket has to be blocking: the kernel waits for it without giving EAGAIN back.
+ */
+class uring_transfer {
+public:
+    /** The requests of a step, in the low bits of their user_data. */
+    enum operation : uint64_t {
+        fill = 0, /** read from the file / receive from the socket */
+        drain = 1, /** send to the socket / write to the file */
+    };
+    static constexpr uint64_t OPERATION_MASK = 1;
+
+    /**
+     * @param [in] ring The ring the requests go to, for the operations the kernel has.
+     * @param [in] sending Send a part of the file, otherwise receive a file of a known size.
+     * @param [in] fd Descriptor of the file (not owned).
+     * @param [in] sock Connected socket (not owned), blocking.
+     * @param [in] offset Position in the file of the first byte sent / received.
+     * @param [in] length Number of bytes to send / receive.
+     * @param [in] checksum Compute the CRC32C of the sent bytes, they are read into a buffer then
+     *                      (the received ones always get it).
+     * @param [in] splice Send by splicing the file through a pipe (if the kernel has IORING_OP_SPLICE).
+     */
+    uring_transfer(const uring &ring, bool sending, int fd, int sock, uint64_t offset, uint64_t length,
+                   bool checksum, bool splice);
+    uring_transfer(const uring_transfer &) = delete;
+    uring_transfer &operator=(const uring_transfer &) = delete;
+    /** The requests have to be completed by then. */
+    ~uring_transfer();
+
+    /**
+     * Queues the next step, tagged with @ref user_data (its low bits are the @ref operation).
+     * Has to be @ref idle and not @ref done.
+     * @return false if no buffer was free, nothing was queued.
+     */
+    bool start(uring &ring, buffer_pool &pool, uint64_t user_data);
+
+    /**
+     * Handles the completion of one of its requests, the buffer goes back to its pool at the end of a step.
+     * Throws if the request failed (errno is its error), the transfer has to be aborted once it's @ref idle.
+     */
+    void complete(uint64_t operation, int res, uint32_t flags);
+
+    /** No requests of the transfer are in the kernel. */
+    bool idle() const { return in_flight == 0; }
+    bool done() const { return idle() && remaining == 0 && filled == drained; }
+
+    bool is_sending() const { return sender; }
+    /** Bytes written to the socket. */
+    uint64_t sent() const { return sender ? moved : 0; }
+    /** Bytes read from the socket. */
+    uint64_t received() const { return sender ? 0 : fetched; }
+    /** Bytes written to the file. */
+    uint64_t written() const { return sender ? 0 : moved; }
+    bool checksummed() const { return checksum_enabled; }
+    /** CRC32C of the bytes read from the file / the socket. */
+    uint32_t checksum() const { return crc; }
+
+private:
+    bool sender;
+    int fd;
+    int sock;
+    uint64_t offset; /** position in the file of the first byte of the step */
+    uint64_t remaining; /** bytes not yet read from the file / the socket */
+    uint64_t fetched = 0;
+    uint64_t moved = 0;
+    bool checksum_enabled;
+    uint32_t crc = 0;
+    bool zero_copy = false; /** IORING_OP_SEND_ZC */
+    bool direct = false; /** the received file is written with O_DIRECT, until an unaligned write */
+
+    int pipe_fds[2] = {-1, -1}; /** if splicing */
+    buffer_pool *pool = nullptr; /** of the @ref buffer */
+    int buffer = -1; /** index in the @ref pool, while the step holds one */
+    char *data = nullptr;
+    uint64_t filled = 0; /** bytes of the step in the buffer / the pipe */
+    uint64_t drained = 0; /** ...of them already sent / written */
+    unsigned in_flight = 0; /** completions still expected */
+    bool failed = false; /** the rest of the completions are only counted */
+
+    bool splicing() const { return pipe_fds[0] >= 0; }
+    void check_direct(uint64_t length);
+    void queue_fill(struct io_uring_sqe *sqe, uint64_t length);
+    void queue_drain(struct io_uring_sqe *sqe, uint64_t length);
+    void release_buffer();
+};
+
+#endif //NETSTORE_URING_TRANSFER_H